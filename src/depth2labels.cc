@@ -173,14 +173,9 @@ main(int argc, char **argv)
     for (int i = 0; i < n_trees; i++) {
         char *tree_path = argv[optind + 2 + i];
 
-        JSON_Value *js = json_parse_file(tree_path);
-        gm_assert(log, js != NULL, "Failed to parse %s as JSON", tree_path);
-
-        forest[i] = rdt_tree_load_from_json(log, js,
-                                            false, // don't load incomplete trees
-                                            NULL); // abort on error
-
-        json_value_free(js);
+        forest[i] = rdt_tree_load_from_json_file(log, tree_path,
+                                                 false, // don't load incomplete trees
+                                                 NULL); // abort on error
     }
 
     uint8_t n_labels = forest[0]->header.n_labels;
@@ -209,7 +204,7 @@ main(int argc, char **argv)
                  depth_image,
                  width, height,
                  output_pr.data(), // dest
-                 false, // single threaded
+                 NULL, // single threaded
                  false); // don't combine flipped results
 
     // Write out png of most likely labels
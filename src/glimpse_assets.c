@@ -127,6 +127,10 @@ gm_asset_open(struct gm_logger *log,
     gm_assert(log, asset_manager != NULL,
               "gm_android_set_asset_manager not called");
 
+    /* NB: AAsset_getBuffer() maps uncompressed assets */
+    if (mode == GM_ASSET_MODE_MAPPED)
+        mode = GM_ASSET_MODE_BUFFER;
+
     AAsset *native = AAssetManager_open(asset_manager, path, mode);
     if (native) {
         struct gm_asset *ret = xmalloc(sizeof(*ret));
@@ -150,6 +154,12 @@ gm_asset_get_length(struct gm_asset *asset)
     return AAsset_getLength(asset->native);
 }
 
+bool
+gm_asset_is_mapped(struct gm_asset *asset)
+{
+    return !AAsset_isAllocated(asset->native);
+}
+
 void
 gm_asset_close(struct gm_asset *asset)
 {
@@ -249,6 +259,31 @@ gm_asset_open(struct gm_logger *log,
             }
         }
         break;
+    case GM_ASSET_MODE_MAPPED:
+#if defined(__unix__) || defined(__APPLE__)
+        if (sb.st_size) {
+            buf = (uint8_t *)mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (buf == MAP_FAILED)
+                buf = NULL;
+        }
+#elif defined(_WIN32)
+        mapping = CreateFileMapping(_get_osfhandle(fd), NULL, PAGE_READONLY,
+                                    0, 0, NULL);
+        if (mapping) {
+            buf = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (!buf) {
+                CloseHandle(mapping);
+                mapping = NULL;
+            }
+        }
+#endif
+        if (!buf) {
+            close(fd);
+            gm_throw(log, err, "Failed to map %s", full_path);
+            return NULL;
+        }
+        buf_is_mmaped = true;
+        break;
     }
 
     asset = (struct gm_asset *)xcalloc(sizeof(*asset), 1);
@@ -277,11 +312,18 @@ gm_asset_get_length(struct gm_asset *asset)
     return asset->file_len;
 }
 
+bool
+gm_asset_is_mapped(struct gm_asset *asset)
+{
+    return asset->buf_is_mmaped;
+}
+
 void
 gm_asset_close(struct gm_asset *asset)
 {
     switch (asset->mode) {
     case GM_ASSET_MODE_BUFFER:
+    case GM_ASSET_MODE_MAPPED:
         if (asset->buf) {
 #if defined(__unix__) || defined(__APPLE__)
             if (asset->buf_is_mmaped) {
@@ -30,6 +30,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <sys/types.h> // off_t
 #include <glimpse_log.h>
 
@@ -40,7 +41,17 @@ enum {
     //GM_ASSET_MODE_UNKNOWN = 0,
     //GM_ASSET_MODE_RANDOM = 1,
     //GM_ASSET_MODE_STREAMING = 2,
-    GM_ASSET_MODE_BUFFER = 3
+    GM_ASSET_MODE_BUFFER = 3,
+
+    /* Like _BUFFER except the buffer is guaranteed to be a read-only, shared
+     * mapping of the file (so multiple processes share the same physical
+     * pages) which stays valid until the asset is closed. Opening fails if
+     * the file can't be mapped.
+     *
+     * On Android this is equivalent to _BUFFER, which maps uncompressed
+     * assets.
+     */
+    GM_ASSET_MODE_MAPPED = 4
 };
 
 struct gm_asset;
@@ -75,6 +86,10 @@ gm_asset_get_buffer(struct gm_asset *asset);
 off_t
 gm_asset_get_length(struct gm_asset *asset);
 
+/* Returns true if the buffer of the asset is a memory mapping of the file */
+bool
+gm_asset_is_mapped(struct gm_asset *asset);
+
 void
 gm_asset_close(struct gm_asset *asset);
 
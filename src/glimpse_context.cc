@@ -129,6 +129,11 @@
 #include <png.h>
 #include <setjmp.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_DEPTH_CONVERT 1
+#include <immintrin.h>
+#endif
+
 #include "half.hpp"
 #include "random.hpp"
 
@@ -146,6 +151,7 @@
 #include "glimpse_data.h"
 #include "glimpse_context.h"
 #include "glimpse_os.h"
+#include "glimpse_cpu.h"
 
 #undef GM_LOG_CONTEXT
 #ifdef __ANDROID__
@@ -230,6 +236,13 @@ using Random = effolkronium::random_thread_local;
 #define TRACK_FRAMES 4
 #define PERSON_HISTORY_SIZE 12
 
+/* Built when configured with -Dcompiled_forest=<trees> */
+#ifdef __APPLE__
+#define COMPILED_FOREST_PLUGIN "libglimpse-compiled-forest.dylib"
+#else
+#define COMPILED_FOREST_PLUGIN "libglimpse-compiled-forest.so"
+#endif
+
 enum debug_cloud_mode {
     DEBUG_CLOUD_MODE_NONE,
     DEBUG_CLOUD_MODE_VIDEO,
@@ -378,6 +391,40 @@ struct candidate_cluster {
     float max_z = -FLT_MAX;
 };
 
+/* The tree leaves reached by the foreground pixels of a cropped cluster,
+ * kept so that label inference for the next frame can skip pixels where
+ * nothing they could sample has changed.
+ *
+ * NB: crops are positioned within the downsampled cloud, which (as with the
+ * codebook) assumes the camera isn't moving.
+ */
+struct label_leaf_cache_entry {
+    // 2D bounds of the crop within the downsampled cloud
+    int x0;
+    int y0;
+    int width;
+    int height;
+    int cloud_width;
+
+    bool flip;
+    bool fixed_point;
+
+    std::vector<float> depth_image;
+    std::vector<uint32_t> leaves; // see INFER_LABELS_LEAF_CACHE_IDX
+    std::vector<uint8_t> reuse; // pixels whose leaves were copied from the previous frame
+};
+
+/* With li_batch_crops, the crops of all candidate clusters are kept so
+ * their labels can be inferred together
+ */
+struct label_inference_crop {
+    std::vector<float> depth_image;
+    std::vector<uint16_t> depth_image_mm;
+    std::vector<int> indices;
+    std::vector<float> label_probs;
+    std::vector<struct infer_labels_top_k> label_top_k;
+};
+
 struct joint_dist
 {
     float min;
@@ -685,7 +732,24 @@ struct gm_context
     dlib::shape_predictor face_feature_detector;
 
     RDTree **decision_trees;
+    struct gm_asset **decision_tree_assets; // mapped, for trees used in-place
     int n_decision_trees;
+    char *compiled_forest_path; // see update_compiled_forest()
+    struct infer_labels_compiled *compiled_forest;
+    bool compiled_forest_failed;
+
+    /* With gm_context_new_async() the decision trees and joint parameters
+     * are loaded by this thread and until assets_ready is set the tracking
+     * pipeline only runs as far as updating the codebook.
+     */
+    std::thread asset_loader_thread;
+    std::atomic<bool> assets_ready;
+    bool waiting_for_assets; // Only logged when it changes (tracking thread)
+
+    /* Measured from gm_context_new() for reporting start up latency */
+    uint64_t init_start_time;
+    std::atomic<uint64_t> assets_ready_latency;
+    std::atomic<uint64_t> first_skeleton_latency;
 
     // Incremented for each tracking iteration
     uint64_t frame_counter;
@@ -840,9 +904,39 @@ struct gm_context
     int debug_codebook_layer;
 
     std::vector<float> inference_cluster_depth_image;
+    std::vector<uint16_t> inference_cluster_depth_image_mm;
+    std::vector<int> inference_cluster_indices; // foreground pixels of crop
     std::vector<float> inference_cluster_weights;
+    struct infer_labels_pool *inference_pool;
+    struct infer_labels_pool *sync_inference_pool; // single worker, no threads
     bool use_threads;
     bool flip_labels;
+    bool fixed_point_inference;
+    bool use_compiled_forest;
+    bool top_k_labels;
+
+    bool batch_label_inference;
+    std::vector<struct label_inference_crop> inference_crops;
+
+    bool coarse_to_fine_inference;
+    int coarse_to_fine_check_interval; // frames between quality checks
+    float coarse_to_fine_refined; // read-only readout
+    float coarse_to_fine_agreement; // read-only readout
+    float label_inference_ms; // read-only readout
+
+    float cascade_threshold;
+    float cascade_avg_trees; // read-only readout for the current frame
+
+    bool temporal_label_reuse;
+    float label_reuse_tolerance;
+    float label_reuse_ratio; // read-only readout for the current frame
+    int n_label_reuse_pixels;
+    int n_label_inference_pixels;
+    float max_probe_offset;
+    uint64_t leaf_cache_frame_counter;
+    std::vector<struct label_leaf_cache_entry> leaf_cache_prev;
+    std::vector<struct label_leaf_cache_entry> leaf_cache_cur;
+    std::vector<int> leaf_cache_changed; // integral image of changed pixels
 
     bool fast_clustering;
     int max_people;
@@ -905,6 +999,8 @@ struct gm_context
     std::vector<struct gm_ui_enumerant> cloud_focus_enumerants;
     std::vector<struct gm_ui_enumerant> codebook_debug_view_enumerants;
     std::vector<struct gm_ui_enumerant> label_enumerants;
+    int debug_label_property;
+    bool added_label_enumerants;
     struct gm_ui_properties properties_state;
     std::vector<struct gm_ui_property> properties;
 
@@ -918,10 +1014,18 @@ struct gm_context
 
     void *callback_data;
 
+    /* Serializes setting the event callback with sending the asynchronous
+     * _ASSETS_READY event, which is held back until there is a callback
+     */
+    std::mutex event_callback_lock;
+    bool assets_ready_pending;
+    bool assets_ready_success;
+
     /* A re-usable allocation for label probabilities that might
      * get swapped into the latest tracking object
      */
     std::vector<float> label_probs_back;
+    std::vector<struct infer_labels_top_k> label_top_k_back;
 
     /* When paused we're careful to not preserve any results for tracking
      * frames so the future frames will be processed with the same initial
@@ -1019,7 +1123,11 @@ struct PointCmp {
 };
 
 struct InferredPerson {
+    /* Only one of these is populated, depending on whether top-k label
+     * inference is enabled.
+     */
     std::vector<float> label_probs;
+    std::vector<struct infer_labels_top_k> label_top_k;
     int label_probs_width;
     int label_probs_height;
     InferredJoints *joints;
@@ -2695,6 +2803,33 @@ tracking_state_alloc(struct gm_mem_pool *pool, void *user_data)
     return tracking;
 }
 
+static bool
+inferred_person_has_labels(InferredPerson &person,
+                           int width, int height, int n_labels)
+{
+    if (person.label_top_k.size())
+        return person.label_top_k.size() == (size_t)(width * height);
+    else
+        return person.label_probs.size() == (size_t)(width * height * n_labels);
+}
+
+/* Returns a pointer to a dense probability table for the given pixel,
+ * expanding top-k labels into tmp_pr_table if necessary.
+ */
+static float *
+inferred_person_get_label_probs(InferredPerson &person,
+                                int idx, int n_labels,
+                                float *tmp_pr_table)
+{
+    if (person.label_top_k.size()) {
+        infer_labels_top_k_to_pr_table(&person.label_top_k[idx], n_labels,
+                                       tmp_pr_table);
+        return tmp_pr_table;
+    } else {
+        return &person.label_probs[idx * n_labels];
+    }
+}
+
 static uint8_t
 label_from_pr_table(float *label_probs, int n_labels)
 {
@@ -2751,7 +2886,8 @@ tracking_create_rgb_label_map(struct gm_tracking *_tracking,
     int width = tracking->people.front().label_probs_width;
     int height = tracking->people.front().label_probs_height;
 
-    if (tracking->people.front().label_probs.size() != width * height * n_labels)
+    if (!inferred_person_has_labels(tracking->people.front(),
+                                    width, height, n_labels))
         return false;
 
     *width_out = width;
@@ -2765,8 +2901,11 @@ tracking_create_rgb_label_map(struct gm_tracking *_tracking,
               "Can't create RGB map of invalid label %u",
               ctx->debug_label);
 
+    float tmp_pr_table[n_labels];
     foreach_xy_off(width, height) {
-        float *label_probs = &tracking->people.front().label_probs[off * n_labels];
+        float *label_probs =
+            inferred_person_get_label_probs(tracking->people.front(),
+                                            off, n_labels, tmp_pr_table);
 
         uint8_t rgb[3];
         label_probs_to_rgb(ctx, label_probs, n_labels, rgb);
@@ -3583,6 +3722,94 @@ gm_prediction_get_skeleton(struct gm_prediction *_prediction)
     return &prediction->skeleton;
 }
 
+/* Converts a scanline of depth values into floats in meters. All variants
+ * give identical results (the conversions from u16 and half floats are exact
+ * and the division by 1000 is correctly rounded either way), except that NaN
+ * payloads may differ.
+ */
+typedef void (*depth_convert_func)(float *out, const void *in, int n);
+
+struct depth_convert_kernel {
+    depth_convert_func u16_mm;
+    depth_convert_func f16_m;
+};
+
+static void
+depth_convert_u16_mm_generic(float *out, const void *in, int n)
+{
+    const uint16_t *depth = (const uint16_t *)in;
+    for (int i = 0; i < n; i++)
+        out[i] = depth[i] / 1000.f;
+}
+
+static void
+depth_convert_f16_m_generic(float *out, const void *in, int n)
+{
+    const half *depth = (const half *)in;
+    for (int i = 0; i < n; i++)
+        out[i] = depth[i];
+}
+
+#ifdef HAVE_X86_DEPTH_CONVERT
+__attribute__((target("avx2"))) static void
+depth_convert_u16_mm_avx2(float *out, const void *in, int n)
+{
+    const uint16_t *depth = (const uint16_t *)in;
+    const __m256 mm_per_m = _mm256_set1_ps(1000.f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i depth_mm = _mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i *)(depth + i)));
+        _mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_cvtepi32_ps(depth_mm),
+                                                mm_per_m));
+    }
+    for (; i < n; i++)
+        out[i] = depth[i] / 1000.f;
+}
+
+__attribute__((target("avx2,f16c"))) static void
+depth_convert_f16_m_avx2(float *out, const void *in, int n)
+{
+    const uint16_t *depth = (const uint16_t *)in;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(
+                _mm_loadu_si128((const __m128i *)(depth + i))));
+    }
+    for (; i < n; i++)
+        out[i] = ((const half *)depth)[i];
+}
+#endif
+
+static struct depth_convert_kernel
+select_depth_convert_kernel(void)
+{
+    static const struct gm_cpu_variant variants[] = {
+#ifdef HAVE_X86_DEPTH_CONVERT
+        { "avx2", GM_CPU_FEATURE_AVX2 | GM_CPU_FEATURE_F16C },
+#endif
+        { "generic", 0 },
+    };
+    static const struct depth_convert_kernel kernels[] = {
+#ifdef HAVE_X86_DEPTH_CONVERT
+        { depth_convert_u16_mm_avx2, depth_convert_f16_m_avx2 },
+#endif
+        { depth_convert_u16_mm_generic, depth_convert_f16_m_generic },
+    };
+
+    return kernels[gm_cpu_select_variant("depth conversion",
+                                         variants, ARRAY_LEN(variants))];
+}
+
+static const struct depth_convert_kernel &
+get_depth_convert_kernel(void)
+{
+    /* NB: C++11 guarantees thread-safe initialization */
+    static const struct depth_convert_kernel kernel =
+        select_depth_convert_kernel();
+    return kernel;
+}
+
 static void
 copy_and_rotate_depth_buffer(struct gm_context *ctx,
                              struct gm_tracking_impl *tracking,
@@ -3599,38 +3826,57 @@ copy_and_rotate_depth_buffer(struct gm_context *ctx,
 
     int num_points;
 
-    // Not ideal how we use `with_rotated_rx_ry_roff` per-pixel, but it lets
-    // us easily combine our rotation with our copy...
-    //
-    // XXX: it could be worth reading multiple scanlines at a time so we could
-    // write out cache lines at a time instead of only 4 bytes (for rotated
-    // images).
-    //
     switch (format) {
     case GM_FORMAT_Z_U16_MM:
-        foreach_xy_off(width, height) {
-            float depth_m = ((uint16_t *)depth)[off] / 1000.f;
-            with_rotated_rx_ry_roff(x, y, width, height,
-                                    rotation, rot_width,
-                                    { depth_copy[roff] = depth_m; });
-        }
-        break;
-    case GM_FORMAT_Z_F32_M:
-        foreach_xy_off(width, height) {
-            float depth_m = ((float *)depth)[off];
-            with_rotated_rx_ry_roff(x, y, width, height,
-                                    rotation, rot_width,
-                                    { depth_copy[roff] = depth_m; });
-        }
-        break;
     case GM_FORMAT_Z_F16_M:
-        foreach_xy_off(width, height) {
-            float depth_m = ((half *)depth)[off];
-            with_rotated_rx_ry_roff(x, y, width, height,
-                                    rotation, rot_width,
-                                    { depth_copy[roff] = depth_m; });
+    case GM_FORMAT_Z_F32_M: {
+        const struct depth_convert_kernel &kernel = get_depth_convert_kernel();
+        depth_convert_func convert = NULL;
+        int bpp = 4;
+
+        if (format == GM_FORMAT_Z_U16_MM) {
+            convert = kernel.u16_mm;
+            bpp = 2;
+        } else if (format == GM_FORMAT_Z_F16_M) {
+            convert = kernel.f16_m;
+            bpp = 2;
+        }
+
+        /* Unrotated scanlines are converted straight into our copy, otherwise
+         * we convert into a temporary scanline first.
+         *
+         * Not ideal how we use `with_rotated_rx_ry_roff` per-pixel, but it
+         * lets us easily combine our rotation with our copy...
+         *
+         * XXX: it could be worth reading multiple scanlines at a time so we
+         * could write out cache lines at a time instead of only 4 bytes (for
+         * rotated images).
+         */
+        std::vector<float> scanline;
+        if (rotation != GM_ROTATION_0)
+            scanline.resize(width);
+
+        for (int y = 0; y < height; y++) {
+            const uint8_t *src = (const uint8_t *)depth + y * width * bpp;
+            float *dst = rotation == GM_ROTATION_0 ?
+                depth_copy + y * rot_width : scanline.data();
+
+            if (convert)
+                convert(dst, src, width);
+            else
+                memcpy(dst, src, width * sizeof(float));
+
+            if (rotation == GM_ROTATION_0)
+                continue;
+
+            for (int x = 0; x < width; x++) {
+                with_rotated_rx_ry_roff(x, y, width, height,
+                                        rotation, rot_width,
+                                        { depth_copy[roff] = scanline[x]; });
+            }
         }
         break;
+    }
     case GM_FORMAT_POINTS_XYZC_F32_M: {
 
         /* XXX: Tango doesn't give us a 2D depth buffer which we would prefer
@@ -4182,11 +4428,11 @@ colour_debug_cloud(struct gm_context *ctx,
                             int cluster_width_2d = cluster.max_x_2d - cluster.min_x_2d + 1;
                             int cluster_height_2d = cluster.max_y_2d - cluster.min_y_2d + 1;
 
-                            std::vector<float> &person_label_probs = person.label_probs;
-
                             gm_assert(ctx->log,
-                                      (cluster_width_2d * cluster_height_2d * n_labels ==
-                                       person_label_probs.size()),
+                                      inferred_person_has_labels(person,
+                                                                 cluster_width_2d,
+                                                                 cluster_height_2d,
+                                                                 n_labels),
                                       "Cluster bounds don't corresponds with size of label_probs array");
 
                             int x = idx % cloud_width_2d;
@@ -4199,7 +4445,12 @@ colour_debug_cloud(struct gm_context *ctx,
                                 cluster_y >= 0 && cluster_y < cluster_height_2d)
                             {
                                 int cluster_idx = cluster_width_2d * cluster_y + cluster_x;
-                                float *label_probs = &person_label_probs[cluster_idx * n_labels];
+                                float tmp_pr_table[n_labels];
+                                float *label_probs =
+                                    inferred_person_get_label_probs(person,
+                                                                    cluster_idx,
+                                                                    n_labels,
+                                                                    tmp_pr_table);
                                 alpha = label_from_pr_table(label_probs, n_labels);
                                 break;
                             }
@@ -4294,13 +4545,15 @@ colour_debug_cloud(struct gm_context *ctx,
                 int cluster_width_2d = cluster.max_x_2d - cluster.min_x_2d + 1;
                 int cluster_height_2d = cluster.max_y_2d - cluster.min_y_2d + 1;
 
-                std::vector<float> &person_label_probs = person.label_probs;
-
                 gm_assert(ctx->log,
-                          (cluster_width_2d * cluster_height_2d * n_labels ==
-                           person_label_probs.size()),
+                          inferred_person_has_labels(person,
+                                                     cluster_width_2d,
+                                                     cluster_height_2d,
+                                                     n_labels),
                           "Cluster bounds don't corresponds with size of label_probs array");
 
+                float tmp_pr_table[n_labels];
+
                 for (int i = 0; i < indices.size(); i++) {
                     int idx = indices[i];
                     int x = idx % cloud_width_2d;
@@ -4317,7 +4570,9 @@ colour_debug_cloud(struct gm_context *ctx,
 
                     int cluster_idx = cluster_width_2d * cluster_y + cluster_x;
 
-                    float *label_probs = &person_label_probs[cluster_idx * n_labels];
+                    float *label_probs =
+                        inferred_person_get_label_probs(person, cluster_idx,
+                                                        n_labels, tmp_pr_table);
                     uint8_t rgb[4];
                     uint8_t label;
                     switch (state->debug_cloud_mode) {
@@ -6567,6 +6822,10 @@ stage_crop_cluster_image_cb(struct gm_tracking_impl *tracking,
     depth_image.clear();
     depth_image.resize(img_size, bg_depth);
 
+    /* Label inference only needs to consider these foreground pixels */
+    std::vector<int> &crop_indices = ctx->inference_cluster_indices;
+    crop_indices.clear();
+
     std::vector<int> &indices = cluster_indices[cluster.label].indices;
     for (int i : indices) {
         pcl::PointXYZL &point = pcl_cloud->points[i];
@@ -6585,6 +6844,31 @@ stage_crop_cluster_image_cb(struct gm_tracking_impl *tracking,
 
         int doff = cluster_width_2d * cluster_y + cluster_x;
         depth_image[doff] = point.z;
+        crop_indices.push_back(doff);
+    }
+
+    /* Label inference can alternatively use a millimetre depth image, which
+     * is sampled in the same way as the training data (the float image is
+     * still needed for joint inference)
+     */
+    if (ctx->fixed_point_inference) {
+        std::vector<uint16_t> &depth_image_mm =
+            ctx->inference_cluster_depth_image_mm;
+
+        /* NB: zero is treated as background by infer_labels_u16_mm() */
+        depth_image_mm.clear();
+        depth_image_mm.resize(img_size, 0);
+
+        for (int i : indices) {
+            pcl::PointXYZL &point = pcl_cloud->points[i];
+
+            int x = i % cloud_width_2d;
+            int y = i / cloud_width_2d;
+            int doff = (cluster_width_2d * (y - cluster.min_y_2d) +
+                        (x - cluster.min_x_2d));
+            float depth_mm = roundf(point.z * 1000.f);
+            depth_image_mm[doff] = (uint16_t)clampf(depth_mm, 1.f, 65535.f);
+        }
     }
 }
 
@@ -6611,12 +6895,357 @@ stage_crop_cluster_image_debug_cb(struct gm_tracking_impl *tracking,
     tracking->debug_cloud_intrinsics = tracking->downsampled_intrinsics;
 }
 
+static inline float
+leaf_cache_sample_depth(const float *depth_image,
+                        int x0, int y0, int width, int height,
+                        int x, int y, float bg_depth)
+{
+    x -= x0;
+    y -= y0;
+    if (x < 0 || y < 0 || x >= width || y >= height)
+        return bg_depth;
+    return depth_image[y * width + x];
+}
+
+/* Adds a leaf cache entry for the cluster currently being labelled and,
+ * where possible, copies across the leaves for foreground pixels from the
+ * best matching cluster of the previous frame.
+ *
+ * A pixel's leaves may be reused if no depth value within the square that
+ * bounds its probes (given max_probe_offset / depth) has changed by more
+ * than the reuse tolerance. With a zero tolerance the results are exactly
+ * the same as a full traversal.
+ */
+static void
+prepare_label_leaf_cache(struct gm_tracking_impl *tracking,
+                         struct pipeline_scratch_state *state,
+                         int cluster_idx,
+                         std::vector<float> &depth_image,
+                         std::vector<int> &indices,
+                         struct infer_labels_leaf_cache *cache)
+{
+    struct gm_context *ctx = tracking->ctx;
+    struct candidate_cluster &cluster = state->person_clusters[cluster_idx];
+
+    int x0 = cluster.min_x_2d;
+    int y0 = cluster.min_y_2d;
+    int width = cluster.max_x_2d - cluster.min_x_2d + 1;
+    int height = cluster.max_y_2d - cluster.min_y_2d + 1;
+    int cloud_width = tracking->downsampled_cloud->width;
+    int n_leaves = ctx->n_decision_trees * 2;
+    float bg_depth = ctx->decision_trees[0]->header.bg_depth;
+    float tolerance = ctx->label_reuse_tolerance;
+
+    if (ctx->leaf_cache_frame_counter != state->frame_counter) {
+        std::swap(ctx->leaf_cache_prev, ctx->leaf_cache_cur);
+        ctx->leaf_cache_cur.clear();
+        ctx->leaf_cache_frame_counter = state->frame_counter;
+        ctx->n_label_reuse_pixels = 0;
+        ctx->n_label_inference_pixels = 0;
+    } else if (cluster_idx == 0) {
+        /* Re-processing the same frame (e.g. while paused) */
+        ctx->leaf_cache_cur.clear();
+        ctx->n_label_reuse_pixels = 0;
+        ctx->n_label_inference_pixels = 0;
+    }
+
+    struct label_leaf_cache_entry *prev = NULL;
+    int best_overlap = 0;
+    for (auto &entry : ctx->leaf_cache_prev) {
+        if (entry.cloud_width != cloud_width ||
+            entry.flip != ctx->flip_labels ||
+            entry.fixed_point != ctx->fixed_point_inference)
+        {
+            continue;
+        }
+        int overlap_x = (std::min(entry.x0 + entry.width, x0 + width) -
+                         std::max(entry.x0, x0));
+        int overlap_y = (std::min(entry.y0 + entry.height, y0 + height) -
+                         std::max(entry.y0, y0));
+        if (overlap_x > 0 && overlap_y > 0 &&
+            overlap_x * overlap_y > best_overlap)
+        {
+            best_overlap = overlap_x * overlap_y;
+            prev = &entry;
+        }
+    }
+
+    ctx->leaf_cache_cur.push_back(label_leaf_cache_entry());
+    struct label_leaf_cache_entry &entry = ctx->leaf_cache_cur.back();
+    entry.x0 = x0;
+    entry.y0 = y0;
+    entry.width = width;
+    entry.height = height;
+    entry.cloud_width = cloud_width;
+    entry.flip = ctx->flip_labels;
+    entry.fixed_point = ctx->fixed_point_inference;
+    entry.depth_image = depth_image;
+    entry.leaves.resize((size_t)width * height * n_leaves);
+
+    cache->leaves = entry.leaves.data();
+    cache->reuse = NULL;
+
+    ctx->n_label_inference_pixels += indices.size();
+
+    if (prev) {
+        /* Mark changed pixels over the union of both crops (beyond which
+         * everything samples as background in both frames)
+         */
+        int ux0 = std::min(x0, prev->x0);
+        int uy0 = std::min(y0, prev->y0);
+        int ux1 = std::max(x0 + width, prev->x0 + prev->width);
+        int uy1 = std::max(y0 + height, prev->y0 + prev->height);
+        int uw = ux1 - ux0;
+        int uh = uy1 - uy0;
+        int stride = uw + 1;
+
+        std::vector<int> &changed = ctx->leaf_cache_changed;
+        changed.clear();
+        changed.resize((size_t)stride * (uh + 1), 0);
+
+        for (int y = 0; y < uh; y++) {
+            int row_sum = 0;
+            for (int x = 0; x < uw; x++) {
+                float depth = leaf_cache_sample_depth(depth_image.data(),
+                                                      x0, y0, width, height,
+                                                      ux0 + x, uy0 + y,
+                                                      bg_depth);
+                float prev_depth = leaf_cache_sample_depth(prev->depth_image.data(),
+                                                           prev->x0, prev->y0,
+                                                           prev->width, prev->height,
+                                                           ux0 + x, uy0 + y,
+                                                           bg_depth);
+                row_sum += fabsf(depth - prev_depth) > tolerance ? 1 : 0;
+                changed[(y + 1) * stride + x + 1] =
+                    changed[y * stride + x + 1] + row_sum;
+            }
+        }
+
+        std::vector<uint8_t> &reuse = entry.reuse;
+        reuse.resize((size_t)width * height, 0);
+
+        /* NB: probes that land to the left of, or above a crop are truncated
+         * towards zero, and so if the crops aren't aligned they only map to
+         * the same cloud pixel in both frames if they stay within both crops.
+         */
+        int min_x = x0 == prev->x0 ? INT_MIN : std::max(x0, prev->x0);
+        int min_y = y0 == prev->y0 ? INT_MIN : std::max(y0, prev->y0);
+
+        int n_reused = 0;
+        for (int off : indices) {
+            int x = x0 + off % width;
+            int y = y0 + off / width;
+            int prev_x = x - prev->x0;
+            int prev_y = y - prev->y0;
+            if (prev_x < 0 || prev_y < 0 ||
+                prev_x >= prev->width || prev_y >= prev->height)
+            {
+                continue;
+            }
+
+            /* Only pixels in the foreground of the previous frame have
+             * cached leaves
+             */
+            int prev_off = prev_y * prev->width + prev_x;
+            if (prev->depth_image[prev_off] == bg_depth)
+                continue;
+
+            int r = (int)ceilf(ctx->max_probe_offset / depth_image[off]) + 1;
+            int sx0 = x - r;
+            int sy0 = y - r;
+            if (sx0 < min_x || sy0 < min_y)
+                continue;
+            sx0 = std::max(sx0, ux0) - ux0;
+            sy0 = std::max(sy0, uy0) - uy0;
+            int sx1 = std::min(x + r + 1, ux1) - ux0;
+            int sy1 = std::min(y + r + 1, uy1) - uy0;
+
+            int n_changed = (changed[sy1 * stride + sx1] -
+                             changed[sy0 * stride + sx1] -
+                             changed[sy1 * stride + sx0] +
+                             changed[sy0 * stride + sx0]);
+            if (n_changed)
+                continue;
+
+            memcpy(&entry.leaves[(size_t)off * n_leaves],
+                   &prev->leaves[(size_t)prev_off * n_leaves],
+                   sizeof(uint32_t) * n_leaves);
+            reuse[off] = 1;
+            n_reused++;
+        }
+
+        cache->reuse = reuse.data();
+        ctx->n_label_reuse_pixels += n_reused;
+    }
+
+    ctx->label_reuse_ratio = ctx->n_label_inference_pixels ?
+        (ctx->n_label_reuse_pixels / (float)ctx->n_label_inference_pixels) : 0;
+}
+
+/* NB: the single worker pool runs inference on the calling thread but we
+ * still want a pool for configuring cascaded inference and collecting stats
+ */
+static struct infer_labels_pool *
+get_inference_pool(struct gm_context *ctx)
+{
+    if (ctx->use_threads && ctx->inference_pool)
+        return ctx->inference_pool;
+    return ctx->sync_inference_pool;
+}
+
+static void
+infer_cluster_labels(struct gm_context *ctx,
+                     int width, int height,
+                     struct infer_labels_leaf_cache *leaf_cache,
+                     float *out_labels,
+                     struct infer_labels_top_k *out_top_k)
+{
+    /* NB: we only run inference for the foreground pixels of the cluster,
+     * and the remainder of the bounding box is output as background
+     */
+    std::vector<int> &indices = ctx->inference_cluster_indices;
+    struct infer_labels_pool *pool = get_inference_pool(ctx);
+
+    if (out_top_k) {
+        if (ctx->fixed_point_inference) {
+            infer_labels_top_k_sparse_u16_mm(ctx->log,
+                                             ctx->decision_trees,
+                                             ctx->n_decision_trees,
+                                             ctx->inference_cluster_depth_image_mm.data(),
+                                             width, height,
+                                             indices.data(), indices.size(),
+                                             leaf_cache,
+                                             out_top_k,
+                                             pool,
+                                             ctx->flip_labels);
+        } else {
+            infer_labels_top_k_sparse(ctx->log,
+                                      ctx->decision_trees,
+                                      ctx->n_decision_trees,
+                                      ctx->inference_cluster_depth_image.data(),
+                                      width, height,
+                                      indices.data(), indices.size(),
+                                      leaf_cache,
+                                      out_top_k,
+                                      pool,
+                                      ctx->flip_labels);
+        }
+    } else {
+        if (ctx->fixed_point_inference) {
+            infer_labels_sparse_u16_mm(ctx->log,
+                                       ctx->decision_trees,
+                                       ctx->n_decision_trees,
+                                       ctx->inference_cluster_depth_image_mm.data(),
+                                       width, height,
+                                       indices.data(), indices.size(),
+                                       leaf_cache,
+                                       out_labels,
+                                       pool,
+                                       ctx->flip_labels);
+        } else {
+            infer_labels_sparse(ctx->log,
+                                ctx->decision_trees,
+                                ctx->n_decision_trees,
+                                ctx->inference_cluster_depth_image.data(),
+                                width, height,
+                                indices.data(), indices.size(),
+                                leaf_cache,
+                                out_labels,
+                                pool,
+                                ctx->flip_labels);
+        }
+    }
+}
+
+static int
+label_probs_argmax(const float *pr_table, int n_labels)
+{
+    int best = 0;
+    for (int n = 1; n < n_labels; n++) {
+        if (pr_table[n] > pr_table[best])
+            best = n;
+    }
+    return best;
+}
+
+/* To give some indication of the quality of coarse-to-fine inference we
+ * periodically also run full resolution inference and compare the most
+ * probable label of each foreground pixel.
+ */
+static void
+check_coarse_to_fine_agreement(struct gm_context *ctx, int width, int height)
+{
+    std::vector<int> &indices = ctx->inference_cluster_indices;
+    int n_labels = ctx->n_labels;
+    int n_agree = 0;
+
+    if (ctx->top_k_labels) {
+        std::vector<struct infer_labels_top_k> full(width * height);
+        infer_cluster_labels(ctx, width, height, NULL, NULL, full.data());
+        for (int off : indices) {
+            if (full[off].labels[0] == ctx->label_top_k_back[off].labels[0])
+                n_agree++;
+        }
+    } else {
+        std::vector<float> full(width * height * n_labels);
+        infer_cluster_labels(ctx, width, height, NULL, full.data(), NULL);
+        for (int off : indices) {
+            int label = label_probs_argmax(&full[off * n_labels], n_labels);
+            int coarse_label =
+                label_probs_argmax(&ctx->label_probs_back[off * n_labels],
+                                   n_labels);
+            if (label == coarse_label)
+                n_agree++;
+        }
+    }
+
+    ctx->coarse_to_fine_agreement = indices.size() ?
+        (n_agree / (float)indices.size()) : 1.f;
+}
+
+/* The plugin is only opened or closed on the tracking thread, between
+ * inference runs, since it replaces how the trees are traversed
+ */
+static void
+update_compiled_forest(struct gm_context *ctx)
+{
+    if (!ctx->use_compiled_forest) {
+        if (ctx->compiled_forest) {
+            infer_labels_compiled_close(ctx->compiled_forest);
+            ctx->compiled_forest = NULL;
+        }
+        ctx->compiled_forest_failed = false;
+        return;
+    }
+
+    // Don't repeatedly try to open a missing or mismatched plugin
+    if (ctx->compiled_forest || ctx->compiled_forest_failed)
+        return;
+
+    char *err = NULL;
+    ctx->compiled_forest =
+        infer_labels_compiled_open(ctx->log,
+                                   ctx->compiled_forest_path,
+                                   ctx->decision_trees,
+                                   ctx->n_decision_trees,
+                                   &err);
+    if (ctx->compiled_forest) {
+        gm_info(ctx->log, "Opened compiled forest %s", ctx->compiled_forest_path);
+    } else {
+        gm_warn(ctx->log, "Failed to open compiled forest: %s", err);
+        free(err);
+        ctx->compiled_forest_failed = true;
+    }
+}
+
 static void
 stage_label_inference_cb(struct gm_tracking_impl *tracking,
                          struct pipeline_scratch_state *state)
 {
     struct gm_context *ctx = tracking->ctx;
 
+    update_compiled_forest(ctx);
+
     //std::vector<pcl::PointIndices> &cluster_indices = tracking->cluster_indices;
     std::vector<candidate_cluster> &person_clusters = state->person_clusters;
 
@@ -6627,22 +7256,188 @@ stage_label_inference_cb(struct gm_tracking_impl *tracking,
     int cluster_width_2d = cluster.max_x_2d - cluster.min_x_2d + 1;
     int cluster_height_2d = cluster.max_y_2d - cluster.min_y_2d + 1;
 
-    ctx->label_probs_back.resize(cluster_width_2d *
-                                 cluster_height_2d *
-                                 ctx->n_labels);
+    float *out_labels = NULL;
+    struct infer_labels_top_k *out_top_k = NULL;
+    if (ctx->top_k_labels) {
+        ctx->label_top_k_back.resize(cluster_width_2d * cluster_height_2d);
+        out_top_k = ctx->label_top_k_back.data();
+    } else {
+        ctx->label_probs_back.resize(cluster_width_2d *
+                                     cluster_height_2d *
+                                     ctx->n_labels);
+        out_labels = ctx->label_probs_back.data();
+    }
+
+    /* NB: coarse-to-fine inference is only supported for float depth */
+    bool coarse_to_fine = (ctx->coarse_to_fine_inference &&
+                           !ctx->fixed_point_inference);
+
+    struct infer_labels_leaf_cache cache;
+    struct infer_labels_leaf_cache *leaf_cache = NULL;
+    if (ctx->temporal_label_reuse && !coarse_to_fine) {
+        prepare_label_leaf_cache(tracking, state,
+                                 state->current_person_cluster,
+                                 ctx->inference_cluster_depth_image,
+                                 ctx->inference_cluster_indices,
+                                 &cache);
+        leaf_cache = &cache;
+    } else {
+        ctx->leaf_cache_prev.clear();
+        ctx->leaf_cache_cur.clear();
+        ctx->label_reuse_ratio = 0;
+    }
+
+    uint64_t start = gm_os_get_time();
+
+    if (coarse_to_fine) {
+        std::vector<int> &indices = ctx->inference_cluster_indices;
+        struct infer_labels_pool *pool = get_inference_pool(ctx);
+        struct infer_labels_coarse_stats stats;
+
+        if (out_top_k) {
+            infer_labels_top_k_coarse_to_fine(ctx->log,
+                                              ctx->decision_trees,
+                                              ctx->n_decision_trees,
+                                              ctx->inference_cluster_depth_image.data(),
+                                              cluster_width_2d, cluster_height_2d,
+                                              indices.data(), indices.size(),
+                                              out_top_k,
+                                              pool,
+                                              ctx->flip_labels,
+                                              &stats);
+        } else {
+            infer_labels_coarse_to_fine(ctx->log,
+                                        ctx->decision_trees,
+                                        ctx->n_decision_trees,
+                                        ctx->inference_cluster_depth_image.data(),
+                                        cluster_width_2d, cluster_height_2d,
+                                        indices.data(), indices.size(),
+                                        out_labels,
+                                        pool,
+                                        ctx->flip_labels,
+                                        &stats);
+        }
+
+        ctx->coarse_to_fine_refined = stats.n_pixels ?
+            (stats.n_refined / (float)stats.n_pixels) : 0.f;
+    } else {
+        infer_cluster_labels(ctx, cluster_width_2d, cluster_height_2d,
+                             leaf_cache, out_labels, out_top_k);
+    }
+
+    uint64_t end = gm_os_get_time();
+    ctx->label_inference_ms = (end - start) / 1e6f;
+
+    if (coarse_to_fine && ctx->coarse_to_fine_check_interval &&
+        (state->frame_counter % ctx->coarse_to_fine_check_interval) == 0)
+    {
+        check_coarse_to_fine_agreement(ctx, cluster_width_2d,
+                                       cluster_height_2d);
+    }
+
+    state->done_label_inference = true;
+}
+
+/* Infers the labels for the crops of all candidate clusters (see
+ * li_batch_crops) with a single dispatch to the inference pool
+ */
+static void
+stage_label_inference_batch_cb(struct gm_tracking_impl *tracking,
+                               struct pipeline_scratch_state *state)
+{
+    struct gm_context *ctx = tracking->ctx;
+
+    update_compiled_forest(ctx);
+
+    std::vector<candidate_cluster> &person_clusters = state->person_clusters;
+    int n_crops = person_clusters.size();
+
+    std::vector<struct infer_labels_crop> crops(n_crops);
+    std::vector<struct infer_labels_leaf_cache> caches(n_crops);
+
+    if (!ctx->temporal_label_reuse) {
+        ctx->leaf_cache_prev.clear();
+        ctx->leaf_cache_cur.clear();
+        ctx->label_reuse_ratio = 0;
+    }
+
+    for (int i = 0; i < n_crops; i++) {
+        auto &cluster = person_clusters[i];
+        int cluster_width_2d = cluster.max_x_2d - cluster.min_x_2d + 1;
+        int cluster_height_2d = cluster.max_y_2d - cluster.min_y_2d + 1;
+        struct label_inference_crop &crop = ctx->inference_crops[i];
+        struct infer_labels_crop &infer_crop = crops[i];
+
+        if (ctx->fixed_point_inference)
+            infer_crop.depth_image = crop.depth_image_mm.data();
+        else
+            infer_crop.depth_image = crop.depth_image.data();
+        infer_crop.width = cluster_width_2d;
+        infer_crop.height = cluster_height_2d;
+        infer_crop.indices = crop.indices.data();
+        infer_crop.n_indices = crop.indices.size();
+
+        if (ctx->top_k_labels) {
+            crop.label_top_k.resize(cluster_width_2d * cluster_height_2d);
+            infer_crop.out_labels = NULL;
+            infer_crop.out_top_k = crop.label_top_k.data();
+        } else {
+            crop.label_probs.resize(cluster_width_2d *
+                                    cluster_height_2d *
+                                    ctx->n_labels);
+            infer_crop.out_labels = crop.label_probs.data();
+            infer_crop.out_top_k = NULL;
+        }
+
+        if (ctx->temporal_label_reuse) {
+            prepare_label_leaf_cache(tracking, state, i,
+                                     crop.depth_image, crop.indices,
+                                     &caches[i]);
+            infer_crop.leaf_cache = &caches[i];
+        } else {
+            infer_crop.leaf_cache = NULL;
+        }
+    }
 
-    infer_labels(ctx->log,
-                 ctx->decision_trees,
-                 ctx->n_decision_trees,
-                 ctx->inference_cluster_depth_image.data(),
-                 cluster_width_2d, cluster_height_2d,
-                 ctx->label_probs_back.data(),
-                 ctx->use_threads,
-                 ctx->flip_labels);
+    struct infer_labels_pool *pool = get_inference_pool(ctx);
+
+    uint64_t start = gm_os_get_time();
+
+    if (ctx->fixed_point_inference) {
+        infer_labels_batch_u16_mm(ctx->log,
+                                  ctx->decision_trees,
+                                  ctx->n_decision_trees,
+                                  crops.data(), n_crops,
+                                  pool,
+                                  ctx->flip_labels);
+    } else {
+        infer_labels_batch(ctx->log,
+                           ctx->decision_trees,
+                           ctx->n_decision_trees,
+                           crops.data(), n_crops,
+                           pool,
+                           ctx->flip_labels);
+    }
+
+    uint64_t end = gm_os_get_time();
+    ctx->label_inference_ms = (end - start) / 1e6f;
 
     state->done_label_inference = true;
 }
 
+/* Moves the buffers of a batched crop into (or back out of) the scratch
+ * buffers used when processing one cluster at a time
+ */
+static void
+swap_inference_crop(struct gm_context *ctx, struct label_inference_crop &crop)
+{
+    std::swap(ctx->inference_cluster_depth_image, crop.depth_image);
+    std::swap(ctx->inference_cluster_depth_image_mm, crop.depth_image_mm);
+    std::swap(ctx->inference_cluster_indices, crop.indices);
+    std::swap(ctx->label_probs_back, crop.label_probs);
+    std::swap(ctx->label_top_k_back, crop.label_top_k);
+}
+
 static void
 add_debug_cloud_for_people(struct gm_tracking_impl *tracking,
                            struct pipeline_scratch_state *state)
@@ -6702,12 +7497,20 @@ stage_joint_weights_cb(struct gm_tracking_impl *tracking,
                                           cluster_height_2d *
                                           ctx->n_joints);
 
-    joints_inferrer_calc_pixel_weights(ctx->joints_inferrer,
-                                       ctx->inference_cluster_depth_image.data(),
-                                       ctx->label_probs_back.data(),
-                                       cluster_width_2d, cluster_height_2d,
-                                       ctx->n_labels,
-                                       ctx->inference_cluster_weights.data());
+    if (ctx->top_k_labels) {
+        joints_inferrer_calc_pixel_weights_top_k(ctx->joints_inferrer,
+                                                 ctx->inference_cluster_depth_image.data(),
+                                                 ctx->label_top_k_back.data(),
+                                                 cluster_width_2d, cluster_height_2d,
+                                                 ctx->inference_cluster_weights.data());
+    } else {
+        joints_inferrer_calc_pixel_weights(ctx->joints_inferrer,
+                                           ctx->inference_cluster_depth_image.data(),
+                                           ctx->label_probs_back.data(),
+                                           cluster_width_2d, cluster_height_2d,
+                                           ctx->n_labels,
+                                           ctx->inference_cluster_weights.data());
+    }
 }
 
 static void
@@ -6741,7 +7544,30 @@ stage_joint_inference_cb(struct gm_tracking_impl *tracking,
     downsampled_intrinsics.fx /= seg_res;
     downsampled_intrinsics.fy /= seg_res;
 
-    if (ctx->fast_clustering) {
+    if (ctx->top_k_labels) {
+        if (ctx->fast_clustering) {
+            state->joints_candidate =
+                joints_inferrer_infer_fast_top_k(ctx->joints_inferrer,
+                                                 &downsampled_intrinsics,
+                                                 cluster_width_2d, cluster_height_2d,
+                                                 cluster.min_x_2d, cluster.min_y_2d,
+                                                 ctx->inference_cluster_depth_image.data(),
+                                                 ctx->label_top_k_back.data(),
+                                                 ctx->inference_cluster_weights.data(),
+                                                 ctx->joint_params->joint_params);
+        } else {
+            state->joints_candidate =
+                joints_inferrer_infer_top_k(ctx->joints_inferrer,
+                                            &downsampled_intrinsics,
+                                            cluster_width_2d, cluster_height_2d,
+                                            cluster.min_x_2d, cluster.min_y_2d,
+                                            ctx->inference_cluster_depth_image.data(),
+                                            ctx->label_top_k_back.data(),
+                                            ctx->inference_cluster_weights.data(),
+                                            ctx->decision_trees[0]->header.bg_depth,
+                                            ctx->joint_params->joint_params);
+        }
+    } else if (ctx->fast_clustering) {
         state->joints_candidate =
                 joints_inferrer_infer_fast(ctx->joints_inferrer,
                                            &downsampled_intrinsics,
@@ -7837,28 +8663,92 @@ context_track_skeleton(struct gm_context *ctx,
         return false;
     }
 
-
-    std::vector<candidate_cluster> &person_clusters = state.person_clusters;
-    state.current_person_cluster = -1;
-
-    gm_assert(ctx->log, state.person_clusters.size() > 0,
+    /* While the decision trees and joint parameters are still being loaded
+     * (see gm_context_new_async()) we can at least keep learning the
+     * background...
+     */
+    if (!ctx->assets_ready) {
+        if (motion_detection) {
+            run_stage(tracking,
+                      TRACKING_STAGE_UPDATE_CODEBOOK,
+                      stage_update_codebook_cb,
+                      NULL,
+                      &state);
+        }
+        if (!ctx->waiting_for_assets) {
+            gm_info(ctx->log, "Give up tracking frames until assets are loaded");
+            ctx->waiting_for_assets = true;
+        }
+        return false;
+    }
+    if (ctx->waiting_for_assets) {
+        gm_info(ctx->log, "Assets loaded, starting skeletal tracking");
+        ctx->waiting_for_assets = false;
+    }
+
+
+    std::vector<candidate_cluster> &person_clusters = state.person_clusters;
+    state.current_person_cluster = -1;
+
+    gm_assert(ctx->log, state.person_clusters.size() > 0,
               "Spurious empty array of candidate person clusters");
 
-    for (state.current_person_cluster = 0;
-         state.current_person_cluster < state.person_clusters.size();
-         state.current_person_cluster++)
-    {
-        run_stage(tracking,
-                  TRACKING_STAGE_CROP_CLUSTER_IMAGE,
-                  stage_crop_cluster_image_cb,
-                  stage_crop_cluster_image_debug_cb,
-                  &state);
+    struct infer_labels_pool *inference_pool = get_inference_pool(ctx);
+    if (inference_pool) {
+        infer_labels_pool_set_cascade_threshold(inference_pool,
+                                                ctx->cascade_threshold);
+        infer_labels_pool_reset_cascade_stats(inference_pool);
+    }
+
+    /* Coarse-to-fine inference is only supported one cluster at a time */
+    bool batch_label_inference =
+        (ctx->batch_label_inference &&
+         !(ctx->coarse_to_fine_inference && !ctx->fixed_point_inference));
+
+    if (batch_label_inference) {
+        ctx->inference_crops.resize(person_clusters.size());
+
+        for (state.current_person_cluster = 0;
+             state.current_person_cluster < state.person_clusters.size();
+             state.current_person_cluster++)
+        {
+            run_stage(tracking,
+                      TRACKING_STAGE_CROP_CLUSTER_IMAGE,
+                      stage_crop_cluster_image_cb,
+                      stage_crop_cluster_image_debug_cb,
+                      &state);
+            swap_inference_crop(ctx,
+                                ctx->inference_crops[state.current_person_cluster]);
+        }
+        state.current_person_cluster = -1;
 
         run_stage(tracking,
                   TRACKING_STAGE_LABEL_INFERENCE,
-                  stage_label_inference_cb,
+                  stage_label_inference_batch_cb,
                   NULL,
                   &state);
+    }
+
+    for (state.current_person_cluster = 0;
+         state.current_person_cluster < state.person_clusters.size();
+         state.current_person_cluster++)
+    {
+        if (batch_label_inference) {
+            swap_inference_crop(ctx,
+                                ctx->inference_crops[state.current_person_cluster]);
+        } else {
+            run_stage(tracking,
+                      TRACKING_STAGE_CROP_CLUSTER_IMAGE,
+                      stage_crop_cluster_image_cb,
+                      stage_crop_cluster_image_debug_cb,
+                      &state);
+
+            run_stage(tracking,
+                      TRACKING_STAGE_LABEL_INFERENCE,
+                      stage_label_inference_cb,
+                      NULL,
+                      &state);
+        }
 
         run_stage(tracking,
                   TRACKING_STAGE_JOINT_WEIGHTS,
@@ -7880,7 +8770,10 @@ context_track_skeleton(struct gm_context *ctx,
         struct InferredPerson person;
         int n_cluster = state.current_person_cluster;
 
-        std::swap(ctx->label_probs_back, person.label_probs);
+        if (ctx->top_k_labels)
+            std::swap(ctx->label_top_k_back, person.label_top_k);
+        else
+            std::swap(ctx->label_probs_back, person.label_probs);
 
         auto &cluster = person_clusters[state.current_person_cluster];
         int cluster_width_2d = cluster.max_x_2d - cluster.min_x_2d + 1;
@@ -7906,6 +8799,13 @@ context_track_skeleton(struct gm_context *ctx,
 
     state.current_person_cluster = -1;
 
+    if (inference_pool) {
+        struct infer_labels_cascade_stats cascade_stats;
+        infer_labels_pool_get_cascade_stats(inference_pool, &cascade_stats);
+        ctx->cascade_avg_trees = cascade_stats.n_pixels ?
+            ((float)cascade_stats.n_trees_evaluated / cascade_stats.n_pixels) : 0.f;
+    }
+
     // Sort list of person clusters
     state.people.sort(compare_inferred_person_data);
 
@@ -8671,6 +9571,14 @@ detector_thread_cb(void *data)
 
         if (tracked) {
             gm_info(ctx->log, "Frame contains tracked people");
+
+            if (!ctx->first_skeleton_latency) {
+                uint64_t latency = end - ctx->init_start_time;
+                ctx->first_skeleton_latency = latency;
+                gm_info(ctx->log, "First skeleton tracked after %.3f%s",
+                        get_duration_ns_print_scale(latency),
+                        get_duration_ns_print_scale_suffix(latency));
+            }
         } else {
             gm_info(ctx->log, "Failed to track any people in frame");
         }
@@ -8906,6 +9814,18 @@ gm_context_destroy(struct gm_context *ctx)
 
     stop_tracking_thread(ctx);
 
+    /* Loading can't be interrupted so we have to wait for any asynchronous
+     * loading to finish before we can free the assets.
+     */
+    if (ctx->asset_loader_thread.joinable()) {
+        try {
+            ctx->asset_loader_thread.join();
+        } catch (const std::system_error &e) {
+            gm_error(ctx->log, "Failed waiting for asset loader thread to complete: %s",
+                     e.what());
+        }
+    }
+
     /* XXX: we don't need to hold the tracking_swap_mutex here because we've
      * stopped the tracking thread...
      */
@@ -8941,9 +9861,26 @@ gm_context_destroy(struct gm_context *ctx)
     free(ctx->depth_color_stops);
     free(ctx->heat_color_stops);
 
-    for (int i = 0; i < ctx->n_decision_trees; i++)
+    if (ctx->compiled_forest)
+        infer_labels_compiled_close(ctx->compiled_forest);
+    free(ctx->compiled_forest_path);
+
+    for (int i = 0; i < ctx->n_decision_trees; i++) {
         rdt_tree_destroy(ctx->decision_trees[i]);
+        if (ctx->decision_tree_assets[i])
+            gm_asset_close(ctx->decision_tree_assets[i]);
+    }
     xfree(ctx->decision_trees);
+    xfree(ctx->decision_tree_assets);
+
+    if (ctx->inference_pool) {
+        infer_labels_pool_destroy(ctx->inference_pool);
+        ctx->inference_pool = NULL;
+    }
+    if (ctx->sync_inference_pool) {
+        infer_labels_pool_destroy(ctx->sync_inference_pool);
+        ctx->sync_inference_pool = NULL;
+    }
 
     if (ctx->joints_inferrer) {
         joints_inferrer_destroy(ctx->joints_inferrer);
@@ -9170,36 +10107,82 @@ add_cluster_from_prev_props(struct gm_context *ctx,
     stage.properties.push_back(prop);
 }
 
-struct gm_context *
-gm_context_new(struct gm_logger *logger, char **err)
+static bool
+load_decision_trees(struct gm_context *ctx, char **err)
 {
-    /* NB: we can't just calloc this struct since it contains C++ class members
-     * that need to be constructed appropriately
-     */
-    struct gm_context *ctx = new gm_context();
+    struct gm_logger *logger = ctx->log;
 
-    ctx->log = logger;
+    int max_trees = 10;
+    ctx->n_decision_trees = 0;
 
-    ctx->tracking_pool = mem_pool_alloc(logger,
-                                        "tracking",
-                                        INT_MAX, // max size
-                                        tracking_state_alloc,
-                                        tracking_state_free,
-                                        ctx); // user data
+    /* A single forest container is preferred over separate tree files since
+     * it's loaded in-place with one mapping and the trees share their label
+     * probability tables.
+     */
+    char *forest_err = NULL;
+    struct gm_asset *forest_asset = gm_asset_open(logger,
+                                                  "forest.rdt",
+                                                  GM_ASSET_MODE_MAPPED,
+                                                  &forest_err);
+    if (forest_asset) {
+        const uint8_t *forest_buf = (const uint8_t *)gm_asset_get_buffer(forest_asset);
+        off_t forest_len = gm_asset_get_length(forest_asset);
+        int n_trees = 0;
+        RDTree **forest = rdt_forest_load_in_place(logger,
+                                                   forest_buf,
+                                                   forest_len,
+                                                   &n_trees,
+                                                   &forest_err);
+        bool in_place = forest != NULL;
+        if (!forest) {
+            /* Loading in-place can fail if the asset isn't suitably aligned
+             * (e.g. an Android asset that had to be buffered) so fall back
+             * to loading a copy of the forest...
+             */
+            gm_debug(logger, "Failed to load decision forest in-place: %s",
+                     forest_err);
+            free(forest_err);
+            forest_err = NULL;
+            forest = rdt_forest_load_from_buf(logger,
+                                              forest_buf,
+                                              forest_len,
+                                              &n_trees,
+                                              &forest_err);
+        }
+        if (forest) {
+            ctx->decision_trees = forest;
+            ctx->n_decision_trees = n_trees;
+
+            /* NB: every tree refers to the same asset but it only needs to
+             * be closed once
+             */
+            ctx->decision_tree_assets =
+                (struct gm_asset**)xcalloc(n_trees, sizeof(struct gm_asset*));
+            if (in_place)
+                ctx->decision_tree_assets[0] = forest_asset;
+            else
+                gm_asset_close(forest_asset);
 
-    ctx->prediction_pool = mem_pool_alloc(logger,
-                                          "prediction",
-                                          INT_MAX,
-                                          prediction_alloc,
-                                          prediction_free,
-                                          ctx);
+            gm_info(logger, "Opened decision forest 'forest.rdt' with %d trees",
+                    n_trees);
 
-    /* Load the decision trees immediately so we know how many labels we're
-     * dealing with asap.
-     */
-    int max_trees = 10;
-    ctx->n_decision_trees = 0;
-    ctx->decision_trees = (RDTree**)xcalloc(max_trees, sizeof(RDTree*));
+            /* Skip looking for separate tree files */
+            max_trees = 0;
+        } else {
+            gm_warn(ctx->log, "Failed to open decision forest 'forest.rdt': %s",
+                    forest_err);
+            free(forest_err);
+            gm_asset_close(forest_asset);
+        }
+    } else {
+        free(forest_err);
+    }
+
+    if (!ctx->n_decision_trees) {
+        ctx->decision_trees = (RDTree**)xcalloc(max_trees, sizeof(RDTree*));
+        ctx->decision_tree_assets =
+            (struct gm_asset**)xcalloc(max_trees, sizeof(struct gm_asset*));
+    }
 
     for (int i = 0; i < max_trees; i++) {
         char rdt_name[16];
@@ -9212,15 +10195,42 @@ gm_context_new(struct gm_logger *logger, char **err)
         char *catch_err = NULL;
         struct gm_asset *tree_asset = gm_asset_open(logger,
                                                     rdt_name,
-                                                    GM_ASSET_MODE_BUFFER,
+                                                    GM_ASSET_MODE_MAPPED,
                                                     &catch_err);
         if (tree_asset) {
             name = rdt_name;
-            ctx->decision_trees[i] =
-                rdt_tree_load_from_buf(logger,
-                                       (uint8_t *)gm_asset_get_buffer(tree_asset),
-                                       gm_asset_get_length(tree_asset),
-                                       &catch_err);
+
+            /* Trees in a mappable container are used in-place, directly
+             * from the mapping, so that multiple processes can share the
+             * same physical copy of the forest.
+             */
+            const uint8_t *tree_buf = (const uint8_t *)gm_asset_get_buffer(tree_asset);
+            off_t tree_len = gm_asset_get_length(tree_asset);
+            if (rdt_tree_is_mappable(tree_buf, tree_len)) {
+                ctx->decision_trees[i] =
+                    rdt_tree_load_in_place(logger, tree_buf, tree_len,
+                                           &catch_err);
+                if (ctx->decision_trees[i]) {
+                    ctx->decision_tree_assets[i] = tree_asset;
+                    tree_asset = NULL;
+                } else {
+                    /* Loading in-place can fail if the asset isn't suitably
+                     * aligned (e.g. an Android asset that had to be
+                     * buffered) so fall back to loading a copy...
+                     */
+                    gm_debug(logger, "Failed to load '%s' in-place: %s",
+                             name, catch_err);
+                    free(catch_err);
+                    catch_err = NULL;
+                    ctx->decision_trees[i] =
+                        rdt_tree_load_from_buf(logger, (uint8_t *)tree_buf,
+                                               tree_len, &catch_err);
+                }
+            } else {
+                ctx->decision_trees[i] =
+                    rdt_tree_load_from_buf(logger, (uint8_t *)tree_buf,
+                                           tree_len, &catch_err);
+            }
             if (!ctx->decision_trees[i]) {
                 gm_warn(ctx->log,
                         "Failed to open binary decision tree '%s': %s",
@@ -9279,7 +10289,8 @@ gm_context_new(struct gm_logger *logger, char **err)
             }
         }
 
-        gm_asset_close(tree_asset);
+        if (tree_asset)
+            gm_asset_close(tree_asset);
 
         if (!ctx->decision_trees[i]) {
             break;
@@ -9291,18 +10302,35 @@ gm_context_new(struct gm_logger *logger, char **err)
 
     if (!ctx->n_decision_trees) {
         gm_throw(logger, err, "Failed to open any decision tree assets");
-        gm_context_destroy(ctx);
-        return NULL;
+        return false;
     } else {
         gm_info(logger, "Loaded %d decision trees", ctx->n_decision_trees);
     }
 
     ctx->n_labels = ctx->decision_trees[0]->header.n_labels;
+    ctx->max_probe_offset =
+        infer_labels_get_max_probe_offset(ctx->decision_trees,
+                                          ctx->n_decision_trees);
+
+    /* The same trees may have been compiled to native code by rdt-compile
+     * and built into a plugin, which is used if the li_compiled_forest
+     * property is enabled. On Android the plugin is packaged as a native
+     * library, so the dynamic linker is left to find it.
+     */
+#ifdef __ANDROID__
+    ctx->compiled_forest_path = strdup(COMPILED_FOREST_PLUGIN);
+#else
+    xasprintf(&ctx->compiled_forest_path, "%s/%s",
+              gm_get_assets_root(), COMPILED_FOREST_PLUGIN);
+#endif
 
-    if (!start_tracking_thread(ctx, err)) {
-        gm_context_destroy(ctx);
-        return NULL;
-    }
+    return true;
+}
+
+static void
+load_label_map(struct gm_context *ctx)
+{
+    struct gm_logger *logger = ctx->log;
 
     /* We *optionally* open a label map so that we can describe an _ENUM
      * property with appropriate label names, but if the file is missing
@@ -9348,7 +10376,229 @@ gm_context_new(struct gm_logger *logger, char **err)
         /* It's not considered an error to be missing this */
         gm_info(logger, "No label map asset opened, so can't refer to names of labels in properties/debugging");
     }
+}
+
+static bool
+load_joint_params(struct gm_context *ctx, char **err)
+{
+    struct gm_logger *logger = ctx->log;
+    char *open_err = NULL;
+
+    ctx->joint_params = NULL;
+
+    struct gm_asset *joint_params_asset =
+        gm_asset_open(logger,
+                      "joint-params.json",
+                      GM_ASSET_MODE_BUFFER,
+                      &open_err);
+    if (joint_params_asset) {
+        const void *buf = gm_asset_get_buffer(joint_params_asset);
+        unsigned len = gm_asset_get_length(joint_params_asset);
+
+        /* unfortunately parson doesn't support parsing from a buffer with
+         * a given length...
+         */
+        char *js_string = (char *)xmalloc(len + 1);
+
+        memcpy(js_string, buf, len);
+        js_string[len] = '\0';
+
+        JSON_Value *root = json_parse_string(js_string);
+        if (root) {
+            ctx->joint_params = jip_load_from_json(logger, root, err);
+            json_value_free(root);
+        }
+
+        xfree(js_string);
+        gm_asset_close(joint_params_asset);
+
+        if (!ctx->joint_params)
+            return false;
+    } else {
+        gm_throw(logger, err, "Failed to open joint-params.json: %s", open_err);
+        free(open_err);
+        return false;
+    }
+
+    ctx->joints_inferrer = joints_inferrer_new(ctx->log,
+                                               ctx->joint_map, err);
+    if (!ctx->joints_inferrer)
+        return false;
 
+    return true;
+}
+
+/* The assets needed for label and joint inference, which may be loaded
+ * asynchronously (see gm_context_new_async())
+ */
+static bool
+load_assets(struct gm_context *ctx, char **err)
+{
+    if (!load_decision_trees(ctx, err))
+        return false;
+
+    load_label_map(ctx);
+
+    return load_joint_params(ctx, err);
+}
+
+/* Completes the debug_label property once we know how many labels there
+ * are...
+ */
+static void
+add_label_enumerants(struct gm_context *ctx)
+{
+    struct gm_ui_enumerant enumerant;
+
+    if (ctx->label_map) {
+        JSON_Array* label_map_array = json_array(ctx->label_map);
+
+        for (int i = 0; i < ctx->n_labels; i++) {
+            JSON_Object *mapping = json_array_get_object(label_map_array, i);
+
+            enumerant = gm_ui_enumerant();
+            enumerant.name = strdup(json_object_get_string(mapping, "name"));
+            enumerant.desc = strdup(enumerant.name);
+            enumerant.val = i;
+            ctx->label_enumerants.push_back(enumerant);
+        }
+    } else {
+        for (int i = 0; i < ctx->n_labels; i++) {
+            char tmp_name[256];
+            xsnprintf(tmp_name, sizeof(tmp_name), "Label %d", i);
+            enumerant = gm_ui_enumerant();
+            enumerant.name = strdup(tmp_name);
+            enumerant.desc = strdup(enumerant.name);
+            enumerant.val = i;
+            ctx->label_enumerants.push_back(enumerant);
+        }
+    }
+
+    struct gm_ui_property &prop = ctx->properties[ctx->debug_label_property];
+    prop.enum_state.n_enumerants = ctx->label_enumerants.size();
+
+    ctx->added_label_enumerants = true;
+}
+
+static void
+send_assets_ready_locked(struct gm_context *ctx, bool success)
+{
+    struct gm_event *event = event_alloc(GM_EVENT_ASSETS_READY);
+
+    event->assets_ready.success = success;
+
+    ctx->event_callback(ctx, event, ctx->callback_data);
+}
+
+static void
+notify_assets_ready(struct gm_context *ctx, bool success)
+{
+    std::lock_guard<std::mutex> scope_lock(ctx->event_callback_lock);
+
+    /* The assets may be loaded before the caller has had a chance to set an
+     * event callback, in which case the event is sent by
+     * gm_context_set_event_callback()
+     */
+    if (ctx->event_callback) {
+        send_assets_ready_locked(ctx, success);
+    } else {
+        ctx->assets_ready_pending = true;
+        ctx->assets_ready_success = success;
+    }
+}
+
+static void
+asset_loader_thread_cb(struct gm_context *ctx)
+{
+    char *err = NULL;
+
+    bool success = load_assets(ctx, &err);
+    if (success) {
+        /* NB: the debug_label enumerants are added on the thread that owns
+         * the context's properties (see gm_context_get_ui_properties())
+         */
+        ctx->assets_ready_latency = gm_os_get_time() - ctx->init_start_time;
+        ctx->assets_ready = true;
+
+        uint64_t latency = ctx->assets_ready_latency;
+        gm_info(ctx->log, "Assets ready after %.3f%s",
+                get_duration_ns_print_scale(latency),
+                get_duration_ns_print_scale_suffix(latency));
+    } else {
+        gm_error(ctx->log, "Failed to load assets, skeletal tracking disabled: %s",
+                 err);
+        free(err);
+    }
+
+    notify_assets_ready(ctx, success);
+}
+
+static bool
+start_asset_loader_thread(struct gm_context *ctx, char **err)
+{
+    try {
+        ctx->asset_loader_thread = std::thread(asset_loader_thread_cb, ctx);
+    } catch (const std::system_error &e) {
+        gm_throw(ctx->log, err, "Failed to start asset loader thread: %s", e.what());
+        return false;
+    }
+
+#ifdef __linux__
+    if (ctx->asset_loader_thread.joinable())
+        pthread_setname_np(ctx->asset_loader_thread.native_handle(), "Glimpse Assets");
+#endif
+
+    return true;
+}
+
+static struct gm_context *
+context_new(struct gm_logger *logger, bool async_load, char **err)
+{
+    /* NB: we can't just calloc this struct since it contains C++ class members
+     * that need to be constructed appropriately
+     */
+    struct gm_context *ctx = new gm_context();
+
+    ctx->log = logger;
+    ctx->init_start_time = gm_os_get_time();
+
+    ctx->tracking_pool = mem_pool_alloc(logger,
+                                        "tracking",
+                                        INT_MAX, // max size
+                                        tracking_state_alloc,
+                                        tracking_state_free,
+                                        ctx); // user data
+
+    ctx->prediction_pool = mem_pool_alloc(logger,
+                                          "prediction",
+                                          INT_MAX,
+                                          prediction_alloc,
+                                          prediction_free,
+                                          ctx);
+
+    /* The pool is only used while li_use_threads is enabled but we create it
+     * up-front so we never pay for spawning threads while tracking.
+     */
+    ctx->inference_pool = infer_labels_pool_new(logger, 0);
+    if (!ctx->inference_pool) {
+        gm_warn(logger, "Failed to create label inference thread pool, "
+                "inference will be single threaded");
+    }
+    ctx->sync_inference_pool = infer_labels_pool_new(logger, 1);
+
+    /* Make sure all the hot loop kernels have been selected before logging
+     * which variants we're using
+     */
+    infer_labels_get_kernel_name();
+    get_depth_convert_kernel();
+    gm_cpu_log_selected_variants(logger);
+
+    if (!start_tracking_thread(ctx, err)) {
+        gm_context_destroy(ctx);
+        return NULL;
+    }
+
+    char *open_err = NULL;
 
     ctx->joint_map = NULL;
     struct gm_asset *joint_map_asset = gm_asset_open(logger,
@@ -9517,50 +10767,17 @@ gm_context_new(struct gm_logger *logger, char **err)
         return NULL;
     }
 
-    ctx->joint_params = NULL;
-
-    struct gm_asset *joint_params_asset =
-        gm_asset_open(logger,
-                      "joint-params.json",
-                      GM_ASSET_MODE_BUFFER,
-                      &open_err);
-    if (joint_params_asset) {
-        const void *buf = gm_asset_get_buffer(joint_params_asset);
-        unsigned len = gm_asset_get_length(joint_params_asset);
-
-        /* unfortunately parson doesn't support parsing from a buffer with
-         * a given length...
-         */
-        char *js_string = (char *)xmalloc(len + 1);
-
-        memcpy(js_string, buf, len);
-        js_string[len] = '\0';
-
-        JSON_Value *root = json_parse_string(js_string);
-        if (root) {
-            ctx->joint_params = jip_load_from_json(logger, root, err);
-            json_value_free(root);
-        }
-
-        xfree(js_string);
-        gm_asset_close(joint_params_asset);
-
-        if (!ctx->joint_params) {
+    /* The decision trees and joint parameters account for almost all of our
+     * start up time...
+     */
+    if (!async_load) {
+        if (!load_assets(ctx, err)) {
             gm_context_destroy(ctx);
             return NULL;
         }
-    } else {
-        gm_throw(logger, err, "Failed to open joint-params.json: %s", open_err);
-        free(open_err);
-        gm_context_destroy(ctx);
-        return NULL;
-    }
 
-    ctx->joints_inferrer = joints_inferrer_new(ctx->log,
-                                               ctx->joint_map, err);
-    if (!ctx->joints_inferrer) {
-        gm_context_destroy(ctx);
-        return NULL;
+        ctx->assets_ready_latency = gm_os_get_time() - ctx->init_start_time;
+        ctx->assets_ready = true;
     }
 
     ctx->depth_color_stops_range = 5; // meters
@@ -9632,6 +10849,12 @@ gm_context_new(struct gm_logger *logger, char **err)
     prop.type = GM_PROPERTY_ENUM;
     prop.enum_state.ptr = &ctx->debug_label;
 
+    /* The label enumerants might only be added once the decision trees
+     * have been loaded asynchronously (see gm_context_get_ui_properties())
+     * so we reserve space up-front to be sure the array won't be moved.
+     */
+    ctx->label_enumerants.reserve(1 + 256); // n_labels is a uint8_t
+
     struct gm_ui_enumerant enumerant;
     enumerant = gm_ui_enumerant();
     enumerant.name = "most likely";
@@ -9639,34 +10862,14 @@ gm_context_new(struct gm_logger *logger, char **err)
     enumerant.val = -1;
     ctx->label_enumerants.push_back(enumerant);
 
-    if (ctx->label_map) {
-        JSON_Array* label_map_array = json_array(ctx->label_map);
-
-        for (int i = 0; i < ctx->n_labels; i++) {
-            JSON_Object *mapping = json_array_get_object(label_map_array, i);
-
-            enumerant = gm_ui_enumerant();
-            enumerant.name = strdup(json_object_get_string(mapping, "name"));
-            enumerant.desc = strdup(enumerant.name);
-            enumerant.val = i;
-            ctx->label_enumerants.push_back(enumerant);
-        }
-    } else {
-        for (int i = 0; i < ctx->n_labels; i++) {
-            char tmp_name[256];
-            xsnprintf(tmp_name, sizeof(tmp_name), "Label %d", i);
-            enumerant = gm_ui_enumerant();
-            enumerant.name = strdup(tmp_name);
-            enumerant.desc = strdup(enumerant.name);
-            enumerant.val = i;
-            ctx->label_enumerants.push_back(enumerant);
-        }
-    }
-
     prop.enum_state.n_enumerants = ctx->label_enumerants.size();
     prop.enum_state.enumerants = ctx->label_enumerants.data();
+    ctx->debug_label_property = ctx->properties.size();
     ctx->properties.push_back(prop);
 
+    if (ctx->assets_ready)
+        add_label_enumerants(ctx);
+
     ctx->debug_enable = true;
     prop = gm_ui_property();
     prop.object = ctx;
@@ -10604,6 +11807,153 @@ gm_context_new(struct gm_logger *logger, char **err)
         prop.bool_state.ptr = &ctx->flip_labels;
         stage.properties.push_back(prop);
 
+        ctx->batch_label_inference = false;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_batch_crops";
+        prop.desc = "Infer labels for all candidate clusters together, in a single dispatch to the inference threads";
+        prop.type = GM_PROPERTY_BOOL;
+        prop.bool_state.ptr = &ctx->batch_label_inference;
+        stage.properties.push_back(prop);
+
+        ctx->coarse_to_fine_inference = false;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_coarse_to_fine";
+        prop.desc = "Infer labels at half resolution and only refine label boundaries at full resolution (float depth only, approximate)";
+        prop.type = GM_PROPERTY_BOOL;
+        prop.bool_state.ptr = &ctx->coarse_to_fine_inference;
+        stage.properties.push_back(prop);
+
+        ctx->coarse_to_fine_check_interval = 30;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_coarse_check_interval";
+        prop.desc = "Frames between comparing coarse-to-fine labels with full resolution inference (0 = never)";
+        prop.type = GM_PROPERTY_INT;
+        prop.int_state.ptr = &ctx->coarse_to_fine_check_interval;
+        prop.int_state.min = 0;
+        prop.int_state.max = 300;
+        stage.properties.push_back(prop);
+
+        ctx->coarse_to_fine_refined = 0.f;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_coarse_refined";
+        prop.desc = "Fraction of foreground pixels refined at full resolution by coarse-to-fine inference";
+        prop.type = GM_PROPERTY_FLOAT;
+        prop.float_state.ptr = &ctx->coarse_to_fine_refined;
+        prop.float_state.min = 0.f;
+        prop.float_state.max = 1.f;
+        prop.read_only = true;
+        stage.properties.push_back(prop);
+
+        ctx->coarse_to_fine_agreement = 1.f;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_coarse_agreement";
+        prop.desc = "Fraction of foreground pixels where coarse-to-fine inference last agreed with full resolution inference on the most probable label";
+        prop.type = GM_PROPERTY_FLOAT;
+        prop.float_state.ptr = &ctx->coarse_to_fine_agreement;
+        prop.float_state.min = 0.f;
+        prop.float_state.max = 1.f;
+        prop.read_only = true;
+        stage.properties.push_back(prop);
+
+        ctx->label_inference_ms = 0.f;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_inference_ms";
+        prop.desc = "Time spent inferring labels for the last cluster (milliseconds)";
+        prop.type = GM_PROPERTY_FLOAT;
+        prop.float_state.ptr = &ctx->label_inference_ms;
+        prop.float_state.min = 0.f;
+        prop.float_state.max = 100.f;
+        prop.read_only = true;
+        stage.properties.push_back(prop);
+
+        ctx->cascade_threshold = 0.f;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_cascade_threshold";
+        prop.desc = "Stop evaluating trees for a pixel once its most probable label reaches this probability (0 = evaluate all trees)";
+        prop.type = GM_PROPERTY_FLOAT;
+        prop.float_state.ptr = &ctx->cascade_threshold;
+        prop.float_state.min = 0.f;
+        prop.float_state.max = 1.f;
+        stage.properties.push_back(prop);
+
+        ctx->cascade_avg_trees = 0.f;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_cascade_trees";
+        prop.desc = "Average number of trees evaluated per pixel for the last frame";
+        prop.type = GM_PROPERTY_FLOAT;
+        prop.float_state.ptr = &ctx->cascade_avg_trees;
+        prop.float_state.min = 0.f;
+        prop.float_state.max = 10.f;
+        prop.read_only = true;
+        stage.properties.push_back(prop);
+
+        ctx->fixed_point_inference = false;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_fixed_point";
+        prop.desc = "Infer labels from millimetre depth, sampled like the training data";
+        prop.type = GM_PROPERTY_BOOL;
+        prop.bool_state.ptr = &ctx->fixed_point_inference;
+        stage.properties.push_back(prop);
+
+        ctx->use_compiled_forest = false;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_compiled_forest";
+        prop.desc = "Traverse the trees with native code compiled by rdt-compile (needs the glimpse-compiled-forest plugin in the assets directory)";
+        prop.type = GM_PROPERTY_BOOL;
+        prop.bool_state.ptr = &ctx->use_compiled_forest;
+        stage.properties.push_back(prop);
+
+        ctx->top_k_labels = false;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_top_k_labels";
+        prop.desc = "Only keep the most probable few labels per pixel (less memory bandwidth)";
+        prop.type = GM_PROPERTY_BOOL;
+        prop.bool_state.ptr = &ctx->top_k_labels;
+        stage.properties.push_back(prop);
+
+        ctx->temporal_label_reuse = false;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_temporal_reuse";
+        prop.desc = "Reuse the tree leaves of static pixels from the previous frame";
+        prop.type = GM_PROPERTY_BOOL;
+        prop.bool_state.ptr = &ctx->temporal_label_reuse;
+        stage.properties.push_back(prop);
+
+        ctx->label_reuse_tolerance = 0.f;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_reuse_tolerance";
+        prop.desc = "Depth change (meters) below which a pixel is considered static (non-zero values approximate the labelling)";
+        prop.type = GM_PROPERTY_FLOAT;
+        prop.float_state.ptr = &ctx->label_reuse_tolerance;
+        prop.float_state.min = 0.f;
+        prop.float_state.max = 0.05f;
+        stage.properties.push_back(prop);
+
+        ctx->label_reuse_ratio = 0.f;
+        prop = gm_ui_property();
+        prop.object = ctx;
+        prop.name = "li_reuse_ratio";
+        prop.desc = "Fraction of foreground pixels whose leaves were reused for the last frame";
+        prop.type = GM_PROPERTY_FLOAT;
+        prop.float_state.ptr = &ctx->label_reuse_ratio;
+        prop.float_state.min = 0.f;
+        prop.float_state.max = 1.f;
+        prop.read_only = true;
+        stage.properties.push_back(prop);
+
         stage.properties_state.n_properties = stage.properties.size();
         stage.properties_state.properties = stage.properties.data();
     }
@@ -11124,9 +12474,26 @@ gm_context_new(struct gm_logger *logger, char **err)
     ctx->properties_state.n_properties = ctx->properties.size();
     ctx->properties_state.properties = &ctx->properties[0];
 
+    if (async_load && !start_asset_loader_thread(ctx, err)) {
+        gm_context_destroy(ctx);
+        return NULL;
+    }
+
     return ctx;
 }
 
+struct gm_context *
+gm_context_new(struct gm_logger *logger, char **err)
+{
+    return context_new(logger, false, err);
+}
+
+struct gm_context *
+gm_context_new_async(struct gm_logger *logger, char **err)
+{
+    return context_new(logger, true, err);
+}
+
 void
 gm_context_set_config(struct gm_context *ctx, JSON_Value *json_config)
 {
@@ -11382,6 +12749,18 @@ gm_context_get_average_frame_duration(struct gm_context *ctx)
     return ret;
 }
 
+uint64_t
+gm_context_get_assets_ready_latency(struct gm_context *ctx)
+{
+    return ctx->assets_ready_latency;
+}
+
+uint64_t
+gm_context_get_first_skeleton_latency(struct gm_context *ctx)
+{
+    return ctx->first_skeleton_latency;
+}
+
 int
 gm_context_get_n_joints(struct gm_context *ctx)
 {
@@ -12112,6 +13491,14 @@ gm_context_render_thread_hook(struct gm_context *ctx)
 struct gm_ui_properties *
 gm_context_get_ui_properties(struct gm_context *ctx)
 {
+    /* With gm_context_new_async() the number of labels isn't known until
+     * the decision trees are loaded, but rather than modify the properties
+     * on the asset loader thread the debug_label enumerants are completed
+     * here, by the thread that owns the properties.
+     */
+    if (ctx->assets_ready && !ctx->added_label_enumerants)
+        add_label_enumerants(ctx);
+
     return &ctx->properties_state;
 }
 
@@ -12122,8 +13509,15 @@ gm_context_set_event_callback(struct gm_context *ctx,
                                                      void *user_data),
                               void *user_data)
 {
+    std::lock_guard<std::mutex> scope_lock(ctx->event_callback_lock);
+
     ctx->event_callback = event_callback;
     ctx->callback_data = user_data;
+
+    if (ctx->event_callback && ctx->assets_ready_pending) {
+        ctx->assets_ready_pending = false;
+        send_assets_ready_locked(ctx, ctx->assets_ready_success);
+    }
 }
 
 void
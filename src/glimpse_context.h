@@ -103,7 +103,8 @@ struct gm_extrinsics {
 enum gm_event_type
 {
     GM_EVENT_REQUEST_FRAME,
-    GM_EVENT_TRACKING_READY
+    GM_EVENT_TRACKING_READY,
+    GM_EVENT_ASSETS_READY
 };
 
 #define GM_REQUEST_FRAME_DEPTH  1ULL<<0
@@ -117,6 +118,11 @@ struct gm_event
         struct {
             uint64_t flags;
         } request_frame;
+
+        /* Only sent for a context created with gm_context_new_async() */
+        struct {
+            bool success;
+        } assets_ready;
     };
 };
 
@@ -404,6 +410,24 @@ extern "C" {
 
 struct gm_context *gm_context_new(struct gm_logger *logger, char **err);
 
+/* Like gm_context_new() except the decision trees and joint inference
+ * parameters are loaded on a background thread so the context is returned
+ * before they are ready.
+ *
+ * Frames notified before then only update the motion segmentation codebook
+ * (so there's a background model as soon as skeletal tracking can start) and
+ * the resulting tracking objects won't contain any people.
+ *
+ * A GM_EVENT_ASSETS_READY event is sent once loading has finished, with
+ * assets_ready.success == false if any of the assets failed to load, in
+ * which case the context will never track skeletons. The event is deferred
+ * if no event callback has been set yet.
+ *
+ * The joint and bone maps are still loaded synchronously so the joint and
+ * bone queries below can be used immediately.
+ */
+struct gm_context *gm_context_new_async(struct gm_logger *logger, char **err);
+
 /* Before starting to feed a context frames from a new device then all buffered
  * state pertaining to the current/previous device can be flushed/cleared out
  * with this api.
@@ -563,6 +587,16 @@ gm_context_get_stage_toggle_property(struct gm_context *ctx, int stage);
 uint64_t
 gm_context_get_average_frame_duration(struct gm_context *ctx);
 
+/* Nanoseconds from the creation of the context until its assets were ready
+ * (synchronously loaded assets are ready before gm_context_new() returns)
+ * and until the first frame with a tracked skeleton. Zero until known.
+ */
+uint64_t
+gm_context_get_assets_ready_latency(struct gm_context *ctx);
+
+uint64_t
+gm_context_get_first_skeleton_latency(struct gm_context *ctx);
+
 struct gm_tracking *
 gm_context_get_latest_tracking(struct gm_context *ctx);
 
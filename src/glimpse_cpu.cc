@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2019 Glimp IP Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GM_CPU_X86 1
+#include <cpuid.h>
+#elif (defined(__linux__) || defined(__ANDROID__)) && \
+    (defined(__aarch64__) || defined(__arm__))
+#define GM_CPU_ARM_HWCAP 1
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "glimpse_cpu.h"
+
+
+static const struct {
+    const char *name;
+    uint32_t feature;
+} feature_names[] = {
+    { "sse4.1", GM_CPU_FEATURE_SSE4_1 },
+    { "avx2", GM_CPU_FEATURE_AVX2 },
+    { "f16c", GM_CPU_FEATURE_F16C },
+    { "avx512", GM_CPU_FEATURE_AVX512 },
+    { "neon", GM_CPU_FEATURE_NEON },
+};
+
+#define ARRAY_LEN(X) (sizeof(X)/sizeof(X[0]))
+
+#ifdef GM_CPU_X86
+static uint64_t
+read_xcr0(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Besides the CPU supporting AVX/AVX-512 we also need to check that the OS
+ * saves the wider registers across context switches (XCR0)
+ */
+static uint32_t
+detect_x86_features(void)
+{
+    uint32_t features = 0;
+    unsigned eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    if (ecx & bit_SSE4_1)
+        features |= GM_CPU_FEATURE_SSE4_1;
+
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return features;
+
+    uint64_t xcr0 = read_xcr0();
+    if ((xcr0 & 0x6) != 0x6) // SSE + AVX state
+        return features;
+
+    if (ecx & bit_F16C)
+        features |= GM_CPU_FEATURE_F16C;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return features;
+
+    if (ebx & bit_AVX2)
+        features |= GM_CPU_FEATURE_AVX2;
+
+    if ((xcr0 & 0xe0) == 0xe0 && // opmask + ZMM state
+        (ebx & bit_AVX512F) && (ebx & bit_AVX512BW))
+    {
+        features |= GM_CPU_FEATURE_AVX512;
+    }
+
+    return features;
+}
+#endif
+
+static uint32_t
+detect_features(void)
+{
+#if defined(GM_CPU_X86)
+    return detect_x86_features();
+#elif defined(GM_CPU_ARM_HWCAP)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+#if defined(__aarch64__)
+    return (hwcap & HWCAP_ASIMD) ? GM_CPU_FEATURE_NEON : 0;
+#else
+    return (hwcap & HWCAP_NEON) ? GM_CPU_FEATURE_NEON : 0;
+#endif
+#elif defined(__ARM_NEON)
+    /* E.g. iOS where there's no HWCAP but NEON is part of the ABI */
+    return GM_CPU_FEATURE_NEON;
+#else
+    return 0;
+#endif
+}
+
+/* Note: the override is only parsed once and any problems can only be
+ * reported later by gm_cpu_log_selected_variants()
+ */
+struct cpu_state {
+    uint32_t detected;
+    uint32_t enabled;
+    const char *override;
+    std::vector<std::string> unknown_names;
+
+    std::mutex selections_lock;
+    std::vector<std::pair<const char *, const char *>> selections;
+
+    cpu_state() {
+        detected = detect_features();
+        enabled = detected;
+
+        override = getenv("GLIMPSE_CPU_FEATURES");
+        if (!override)
+            return;
+
+        uint32_t allowed = 0;
+        const char *pos = override;
+        while (*pos) {
+            size_t len = strcspn(pos, ", ");
+            if (len) {
+                std::string name(pos, len);
+                bool found = name == "none";
+                for (unsigned i = 0; i < ARRAY_LEN(feature_names) && !found; i++) {
+                    if (name == feature_names[i].name) {
+                        allowed |= feature_names[i].feature;
+                        found = true;
+                    }
+                }
+                if (!found)
+                    unknown_names.push_back(name);
+            }
+            pos += len;
+            if (*pos)
+                pos++;
+        }
+
+        enabled &= allowed;
+    }
+};
+
+static struct cpu_state&
+get_cpu_state(void)
+{
+    /* NB: C++11 guarantees thread-safe initialization */
+    static struct cpu_state state;
+    return state;
+}
+
+uint32_t
+gm_cpu_get_detected_features(void)
+{
+    return get_cpu_state().detected;
+}
+
+uint32_t
+gm_cpu_get_features(void)
+{
+    return get_cpu_state().enabled;
+}
+
+int
+gm_cpu_select_variant(const char *kernel,
+                      const struct gm_cpu_variant *variants,
+                      int n_variants)
+{
+    struct cpu_state &state = get_cpu_state();
+
+    int i = 0;
+    for (; i < n_variants - 1; i++) {
+        if ((state.enabled & variants[i].features) == variants[i].features)
+            break;
+    }
+
+    std::lock_guard<std::mutex> scope_lock(state.selections_lock);
+    state.selections.push_back(std::make_pair(kernel, variants[i].name));
+
+    return i;
+}
+
+static std::string
+features_string(uint32_t features)
+{
+    std::string str;
+
+    for (unsigned i = 0; i < ARRAY_LEN(feature_names); i++) {
+        if (features & feature_names[i].feature) {
+            if (str.size())
+                str += " ";
+            str += feature_names[i].name;
+        }
+    }
+
+    return str.size() ? str : std::string("none");
+}
+
+void
+gm_cpu_log_selected_variants(struct gm_logger *log)
+{
+    struct cpu_state &state = get_cpu_state();
+
+    gm_info(log, "Detected CPU features: %s",
+            features_string(state.detected).c_str());
+    if (state.override) {
+        for (auto &name : state.unknown_names) {
+            gm_warn(log, "Unknown feature \"%s\" in GLIMPSE_CPU_FEATURES",
+                    name.c_str());
+        }
+        gm_info(log, "Enabled CPU features (GLIMPSE_CPU_FEATURES=\"%s\"): %s",
+                state.override,
+                features_string(state.enabled).c_str());
+    }
+
+    std::lock_guard<std::mutex> scope_lock(state.selections_lock);
+    for (auto &selection : state.selections) {
+        gm_info(log, "Using %s variant of %s kernel",
+                selection.second, selection.first);
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2019 Glimp IP Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Runtime selection of hot loop kernels according to the features of the
+ * CPU we're running on, so that one build can make the most of AVX-512
+ * servers, AVX2 laptops and ARM64 boards.
+ *
+ * Kernels declare a list of variants (best first, ending with a generic
+ * variant that requires no features) and gm_cpu_select_variant() picks the
+ * first one the CPU supports. Every variant must give identical results.
+ *
+ * The GLIMPSE_CPU_FEATURES environment variable can restrict which of the
+ * detected features may be used, as a comma separated list of feature names
+ * (e.g. "sse4.1,avx2") or "none" to force the generic kernels. Features
+ * that aren't detected can't be forced on.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "glimpse_log.h"
+
+enum gm_cpu_feature {
+    GM_CPU_FEATURE_SSE4_1   = 1<<0,
+    GM_CPU_FEATURE_AVX2     = 1<<1,
+    GM_CPU_FEATURE_F16C     = 1<<2,
+    GM_CPU_FEATURE_AVX512   = 1<<3, // F + BW
+    GM_CPU_FEATURE_NEON     = 1<<4,
+};
+
+struct gm_cpu_variant {
+    const char *name;
+    uint32_t features; // all required
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The features detected via CPUID (x86) or HWCAP (ARM) */
+uint32_t
+gm_cpu_get_detected_features(void);
+
+/* The detected features after applying any GLIMPSE_CPU_FEATURES override */
+uint32_t
+gm_cpu_get_features(void);
+
+static inline bool
+gm_cpu_has_features(uint32_t features)
+{
+    return (gm_cpu_get_features() & features) == features;
+}
+
+/* Returns the index of the first of @n_variants that the CPU supports and
+ * records the choice for gm_cpu_log_selected_variants(). The last variant
+ * must not require any features.
+ */
+int
+gm_cpu_select_variant(const char *kernel,
+                      const struct gm_cpu_variant *variants,
+                      int n_variants);
+
+/* Logs the detected/enabled features and each kernel variant selected so
+ * far
+ */
+void
+gm_cpu_log_selected_variants(struct gm_logger *log);
+
+#ifdef __cplusplus
+}
+#endif
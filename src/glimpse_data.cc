@@ -28,7 +28,12 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <string.h>
+#include <limits.h>
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <getline-compat.h>
@@ -204,6 +209,83 @@ gm_data_index_foreach(struct gm_data_index* data_index,
     return true;
 }
 
+bool
+gm_data_index_foreach_parallel(struct gm_data_index* data_index,
+                               int n_threads,
+                               bool (*callback)(struct gm_data_index* data_index,
+                                                int index,
+                                                const char* frame_path,
+                                                int thread_idx,
+                                                void* user_data,
+                                                char** err),
+                               void (*complete_callback)(struct gm_data_index* data_index,
+                                                         int index,
+                                                         void* user_data),
+                               void* user_data,
+                               char** err)
+{
+    int n_images = data_index->paths.size();
+
+    n_threads = std::max(1, std::min(n_threads, n_images));
+
+    std::atomic<int> next_index(0);
+    std::atomic<bool> failed(false);
+
+    std::mutex lock;
+    std::vector<bool> done(n_images);
+    int n_complete = 0;
+    int first_error_index = INT_MAX;
+    char* first_error = NULL;
+
+    auto worker = [&](int thread_idx) {
+        while (!failed) {
+            int i = next_index++;
+            if (i >= n_images)
+                break;
+
+            char* thread_err = NULL;
+            if (!callback(data_index, i, data_index->paths[i], thread_idx,
+                          user_data, err ? &thread_err : NULL))
+            {
+                std::lock_guard<std::mutex> scope_lock(lock);
+                if (i < first_error_index) {
+                    first_error_index = i;
+                    xfree(first_error);
+                    first_error = thread_err;
+                } else
+                    xfree(thread_err);
+                failed = true;
+                break;
+            }
+
+            std::lock_guard<std::mutex> scope_lock(lock);
+            done[i] = true;
+            while (n_complete < n_images && done[n_complete]) {
+                if (complete_callback)
+                    complete_callback(data_index, n_complete, user_data);
+                n_complete++;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < n_threads; i++)
+        threads.push_back(std::thread(worker, i));
+    worker(0);
+    for (auto &thread : threads)
+        thread.join();
+
+    if (failed) {
+        if (err)
+            *err = first_error;
+        else
+            xfree(first_error);
+        return false;
+    }
+
+    return true;
+}
+
 struct joint_mapping {
     char *name;
     const char *end; // "head" or "tail"
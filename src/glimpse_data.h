@@ -74,6 +74,32 @@ gm_data_index_foreach(struct gm_data_index* data_index,
                       void* user_data,
                       char** err);
 
+/* Like gm_data_index_foreach() except the callback is called for different
+ * images concurrently, from @n_threads threads (the callback is also passed
+ * the index of the calling thread so it can e.g. use per-thread buffers).
+ *
+ * Callbacks may run out of order, but the optional @complete_callback is
+ * called serially in the order of the index, once each image has been
+ * processed (e.g. for progress reporting).
+ *
+ * On failure no further images are processed and the error for the first
+ * (lowest index) image that failed is returned.
+ */
+bool
+gm_data_index_foreach_parallel(struct gm_data_index* data_index,
+                               int n_threads,
+                               bool (*callback)(struct gm_data_index* data_index,
+                                                int index,
+                                                const char* frame_path,
+                                                int thread_idx,
+                                                void* user_data,
+                                                char** err),
+                               void (*complete_callback)(struct gm_data_index* data_index,
+                                                         int index,
+                                                         void* user_data),
+                               void* user_data,
+                               char** err);
+
 bool
 gm_data_index_load_joints(struct gm_data_index* data_index,
                           const char* joint_map_file,
@@ -36,11 +36,22 @@
 #include <time.h>
 #include <signal.h>
 #include <inttypes.h>
-
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
 #include <atomic>
 #include <random>
+#include <string>
 #include <thread>
 #include <queue>
+#include <unordered_map>
 
 #include <png.h>
 
@@ -101,9 +112,11 @@ struct pixel {
 };
 
 struct node_data {
-    int id; // Unique id to place the node in a tree.
+    int id; // Index of the node in ctx->tree
+    int depth;
+    uint64_t path; // Breadth-first index in a complete tree, stable across runs
     int n_pixels; // Number of pixels that have reached this node.
-    struct pixel* pixels;   // An array of pixel pairs and image indices.
+    struct pixel* pixels;   // This node's range of ctx->pixels
 };
 
 /* Work submitted for the thread pool to process... */
@@ -126,10 +139,15 @@ struct node_shard_data {
     uint64_t duration;
 };
 
+/* Nodes are only allocated once they are reached while training, so
+ * ctx->tree isn't a complete tree. The children of a split node are allocated
+ * together, with the right child immediately after the left child.
+ */
 struct node {
     float uvs_m[4]; // U in [0:2] and V in [2:4]
     int32_t t_mm;
     uint32_t label_pr_idx;  // Index into label probability table (1-based)
+    int left_id;            // Index of the left child (if label_pr_idx == 0)
 };
 
 #if 0
@@ -209,12 +227,21 @@ struct thread_state {
 
     pthread_t thread;
 
-    /* We aim to use 16bit histograms when there are fewer than UINT16_MAX
+    /* For each uv combo we accumulate a label histogram for each of the
+     * n_thresholds + 1 buckets between the sorted thresholds, so each pixel
+     * only increments one bin per uv combo. The left/right histograms for
+     * each threshold are then recovered with a prefix sum when ranking.
+     *
+     * We aim to use 16bit histograms when there are fewer than UINT16_MAX
      * pixels for the current node, since the write bandwidth to these
      * histograms can be a performance bottleneck
      */
-    std::vector<uint32_t> uvt_lr_histograms_32;
-    std::vector<uint16_t> uvt_lr_histograms_16;
+    std::vector<uint32_t> uv_bucket_histograms_32;
+    std::vector<uint16_t> uv_bucket_histograms_16;
+
+    // Left branch histograms for each sorted threshold of one uv combo
+    std::vector<uint32_t> left_histograms;
+    std::vector<uint32_t> total_histogram;
 
     uint64_t current_work_start;
     uint64_t last_metrics_log;
@@ -255,8 +282,8 @@ struct gm_rdt_context_impl {
     int      n_rdt_labels;  // Number of labels classified by decision tree
 
     int      n_images;      // Number of training images
+    uint64_t data_hash;     // Identifies the frames and label mapping
 
-    uint64_t  last_load_update;
     int      n_uvs;         // Number of combinations of u,v pairs
     float    uv_range;      // Range of u,v combinations to generate
     float    uv_power;      // Power to raise generated u,v offset values to
@@ -272,11 +299,29 @@ struct gm_rdt_context_impl {
     int        n_pixels;      // Number of pixels to sample
 
     int16_t* depth_images;  // Depth images
+    struct pixel* pixels;   // All sampled pixels, partitioned between nodes
+    void*    cache_map;     // If depth_images points into an mmapped
+    size_t   cache_map_len; // training data cache
+
+    bool     training_cache; // Cache sampled pixels and cropped depth data
+    char*    cache_dir;      // Where to keep caches (data_dir by default)
+
+    char*    listen_address; // host:port to coordinate distributed training
+    int      n_workers;      // Number of workers to wait for when coordinating
+    char*    coordinator;    // host:port of coordinator to work for
+    int      coordinator_fd; // Connection to coordinator (for workers)
+
+    int      shard_index;   // Only images where index % n_shards ==
+    int      n_shards;      // shard_index are loaded (for workers)
     std::vector<float> uvs_m; // The uv pairs to test ordered like:
                               // [uv0.x, uv0.y, uv1.x, uv1.y]
                               // values are in pixel-millimeter units
 
     int16_t* thresholds_mm;    // A list of thresholds to test
+    std::vector<int> threshold_ranks; // Index of each threshold once sorted
+    std::vector<uint16_t> threshold_buckets; // Maps a gradient (as uint16_t)
+                                             // to the number of thresholds
+                                             // that are <= the gradient
 
     int      n_threads;     // How many threads to spawn for training
 
@@ -302,8 +347,8 @@ struct gm_rdt_context_impl {
     std::deque<work>    work_queue; //deque so we can iterate for debugging
     int                 n_idle; // number of threads currently waiting for work
 
+    pthread_mutex_t     tree_lock; // For growing tree and tree_histograms
     std::vector<node>   tree; // The decision tree being built
-    pthread_mutex_t     tree_histograms_lock;
     std::vector<float>  tree_histograms; // label histograms for leaf nodes
 
     std::vector<uint32_t>  root_pixel_histogram; // label histogram for initial pixels
@@ -544,7 +589,7 @@ maybe_log_thread_depth_metrics(struct thread_state* state,
 
         // Assume an even distribution of work across threads and shards
         // to estimate the current node progress...
-        int nodes_per_depth = 1<<depth;
+        uint64_t nodes_per_depth = 1ULL<<depth;
         int64_t progress = ((raw->n_pixels_accumulated/nodes_per_depth) * 100 /
                             ((int64_t)n_node_pixels * n_shards / ctx->n_threads));
 
@@ -569,37 +614,43 @@ maybe_log_thread_depth_metrics(struct thread_state* state,
     }
 }
 
-static int
-id_to_depth(int id)
+/* Distributed training workers only load a subset of the training images */
+static inline bool
+image_in_shard(struct gm_rdt_context_impl* ctx, int index)
 {
-    uint32_t id32 = id;
+    return index % ctx->n_shards == ctx->shard_index;
+}
 
-    /* clz() counts the number of leading zeros.
-     *
-     * 32-clz(value) essentially calculates an integer (rounded-down)
-     * log2(value) (for a 32bit integer)
-     *
-     * Our node IDs are base 0 (i.e. root node has ID = 0) but with base-1
-     * IDs then every depth level neatly starts with a power of two ID (thus
-     * the (id32 + 1))
-     *
-     * Finally subtract 1 to return a base-0 ID.
-     */
-    return 32 - __builtin_clz(id32 + 1) - 1;
+/* The sampled pixels of the images in a shard are stored contiguously, in
+ * order of image index (see shard_image_slot())
+ */
+static inline int
+get_n_shard_images(struct gm_rdt_context_impl* ctx)
+{
+    return (ctx->n_images - ctx->shard_index + ctx->n_shards - 1) / ctx->n_shards;
+}
+
+static inline int
+shard_image_slot(struct gm_rdt_context_impl* ctx, int index)
+{
+    return index / ctx->n_shards;
 }
 
+// Per-thread buffers for pre-processing label images
+struct labels_pre_processor_thread
+{
+    std::vector<uint8_t> image_buf;
+    std::vector<int> in_body_pixels;
+    std::vector<int> indices;
+};
+
 struct labels_pre_processor
 {
     struct gm_rdt_context_impl* ctx;
     uint64_t last_update;
-    std::mt19937 rng;
-    std::uniform_real_distribution<float> rand_0_1;
     int width;
     int height;
-    int n_image_pixels;
-    std::vector<uint8_t> image_buf;
-    std::vector<int> in_body_pixels;
-    std::vector<int> indices;
+    std::vector<labels_pre_processor_thread> threads;
     struct bounds* body_bounds;
     struct pixel* random_pixels;
 };
@@ -608,16 +659,25 @@ static bool
 pre_process_label_image_cb(struct gm_data_index* data_index,
                            int index,
                            const char* frame_path,
+                           int thread_idx,
                            void* user_data,
                            char** err)
 {
     struct labels_pre_processor* labels_pre_processor =
         (struct labels_pre_processor*)user_data;
+    struct labels_pre_processor_thread* thread =
+        &labels_pre_processor->threads[thread_idx];
     struct gm_rdt_context_impl* ctx = labels_pre_processor->ctx;
-    uint8_t* label_image = labels_pre_processor->image_buf.data();
+    uint8_t* label_image = thread->image_buf.data();
     int width = labels_pre_processor->width;
     int height = labels_pre_processor->height;
 
+    if (!image_in_shard(ctx, index)) {
+        struct bounds empty = { 0, -1, 0, -1 }; // 0x0 depth image
+        labels_pre_processor->body_bounds[index] = empty;
+        return true;
+    }
+
     const char* top_dir = gm_data_index_get_top_dir(data_index);
 
     char labels_filename[512];
@@ -639,7 +699,7 @@ pre_process_label_image_cb(struct gm_data_index* data_index,
      * of the body and so we're only interested in sampling points
      * inside the body...
      */
-    labels_pre_processor->in_body_pixels.clear();
+    thread->in_body_pixels.clear();
 
     struct bounds bounds;
     bounds.min_x = INT_MAX;
@@ -666,7 +726,7 @@ pre_process_label_image_cb(struct gm_data_index* data_index,
                 if (y > bounds.max_y)
                     bounds.max_y = y;
 
-                labels_pre_processor->in_body_pixels.push_back(off);
+                thread->in_body_pixels.push_back(off);
             }
         }
     }
@@ -674,7 +734,7 @@ pre_process_label_image_cb(struct gm_data_index* data_index,
     /* The image-pre-processor tool should already check this so just have
      * a *very* conservative sanity check here...
      */
-    gm_assert(ctx->log, labels_pre_processor->in_body_pixels.size() > 100,
+    gm_assert(ctx->log, thread->in_body_pixels.size() > 100,
               "Fewer than 100 non-background pixels found in frame %s",
               labels_filename);
 
@@ -696,26 +756,38 @@ pre_process_label_image_cb(struct gm_data_index* data_index,
      * approximately the same amount of energy training on each pose
      * regardless of body size or distance from the camera.
      */
-    int n_body_points = labels_pre_processor->in_body_pixels.size();
-    labels_pre_processor->indices.clear();
+    int n_body_points = thread->in_body_pixels.size();
+
+    /* Each image is sampled with its own RNG, seeded according to the
+     * training seed and the image index, so the sampled pixels don't
+     * depend on the order in which images are processed
+     */
+    std::seed_seq seed_seq = { ctx->seed, index };
+    std::mt19937 rng(seed_seq);
+    std::uniform_real_distribution<float> rand_0_1(0.0, 1.0);
+
+    thread->indices.clear();
     for (int j = 0; j < ctx->n_pixels; j++) {
 
-        int off = labels_pre_processor->rand_0_1(labels_pre_processor->rng) * n_body_points;
+        int off = rand_0_1(rng) * n_body_points;
 
         /* XXX: It's important we clamp here since the rounding can otherwise
          * result in off == n_body_points */
-        labels_pre_processor->indices.push_back(std::min(off, n_body_points - 1));
+        thread->indices.push_back(std::min(off, n_body_points - 1));
     }
 
     /* May slightly improve cache access patterns if we can process
      * our samples in memory order, even though the UV sampling
      * is somewhat randomized relative to these pixels...
      */
-    std::sort(labels_pre_processor->indices.begin(),
-              labels_pre_processor->indices.end());
+    std::sort(thread->indices.begin(),
+              thread->indices.end());
 
+    struct pixel* image_pixels =
+        &labels_pre_processor->random_pixels[(int64_t)shard_image_slot(ctx, index) *
+                                             ctx->n_pixels];
     for (int j = 0; j < ctx->n_pixels; j++) {
-        int off = labels_pre_processor->in_body_pixels[labels_pre_processor->indices[j]];
+        int off = thread->in_body_pixels[thread->indices[j]];
 
         struct pixel pixel;
         pixel.x = off % width;
@@ -754,17 +826,27 @@ pre_process_label_image_cb(struct gm_data_index* data_index,
                   bounds.min_x, bounds.min_y,
                   crop_width, crop_height);
 
-        labels_pre_processor->random_pixels[(int64_t)index * ctx->n_pixels + j] = pixel;
+        image_pixels[j] = pixel;
     }
 
+    return true;
+}
+
+static void
+pre_process_label_image_complete_cb(struct gm_data_index* data_index,
+                                    int index,
+                                    void* user_data)
+{
+    struct labels_pre_processor* labels_pre_processor =
+        (struct labels_pre_processor*)user_data;
+    struct gm_rdt_context_impl* ctx = labels_pre_processor->ctx;
+
     uint64_t current = get_time();
     if (current - labels_pre_processor->last_update > 2000000000) {
         int percent = index * 100 / ctx->n_images;
         gm_info(ctx->log, "%3d%%", percent);
         labels_pre_processor->last_update = current;
     }
-
-    return true;
 }
 
 /* For every image, pick N (ctx->n_pixels) random points within the silhoette
@@ -773,7 +855,7 @@ pre_process_label_image_cb(struct gm_data_index* data_index,
 static bool
 pre_process_label_images(struct gm_rdt_context_impl* ctx,
                          struct gm_data_index* data_index,
-                         struct pixel* random_pixels, /* len: n_images * n_pixels */
+                         struct pixel* random_pixels, /* len: n_shard_images * n_pixels */
                          struct bounds* body_bounds, /* len: n_images */
                          char** err)
 {
@@ -781,23 +863,26 @@ pre_process_label_images(struct gm_rdt_context_impl* ctx,
 
     labels_pre_processor.ctx = ctx;
     labels_pre_processor.last_update = get_time();
-    labels_pre_processor.rng = std::mt19937(ctx->seed);
-    labels_pre_processor.rand_0_1 = std::uniform_real_distribution<float>(0.0, 1.0);
     labels_pre_processor.width = gm_data_index_get_width(data_index);
     labels_pre_processor.height = gm_data_index_get_height(data_index);
     int n_image_pixels = labels_pre_processor.width * labels_pre_processor.height;
-    labels_pre_processor.image_buf = std::vector<uint8_t>(n_image_pixels);
-    labels_pre_processor.in_body_pixels = std::vector<int>(n_image_pixels);
-    labels_pre_processor.indices = std::vector<int>(n_image_pixels);
+    labels_pre_processor.threads.resize(ctx->n_threads);
+    for (auto &thread : labels_pre_processor.threads) {
+        thread.image_buf = std::vector<uint8_t>(n_image_pixels);
+        thread.in_body_pixels.reserve(n_image_pixels);
+        thread.indices.reserve(ctx->n_pixels);
+    }
     labels_pre_processor.random_pixels = random_pixels;
     labels_pre_processor.body_bounds = body_bounds;
 
     gm_info(ctx->log, "Randomly sampling training pixels (%d per-image) across %d images...",
-            ctx->n_pixels, ctx->n_images);
-    if (!gm_data_index_foreach(data_index,
-                               pre_process_label_image_cb,
-                               &labels_pre_processor,
-                               err))
+            ctx->n_pixels, get_n_shard_images(ctx));
+    if (!gm_data_index_foreach_parallel(data_index,
+                                        ctx->n_threads,
+                                        pre_process_label_image_cb,
+                                        pre_process_label_image_complete_cb,
+                                        &labels_pre_processor,
+                                        err))
     {
         return false;
     }
@@ -805,31 +890,53 @@ pre_process_label_images(struct gm_rdt_context_impl* ctx,
     return true;
 }
 
+/* Sums the threshold bucket histograms for one uv combo (in order of
+ * ascending thresholds) to find the left branch histogram for each sorted
+ * threshold, as well as the total histogram that the right branch histograms
+ * can be derived from.
+ */
 static void
-normalize_histogram_16(uint16_t* histogram,
-                       int n_labels,
-                       float* normalized,
-                       int* n_histogram_pixels_ret,
-                       int* n_histogram_labels_ret)
+sum_bucket_histograms_16(uint16_t* bucket_histograms,
+                         int n_thresholds,
+                         int n_labels,
+                         uint32_t* left_histograms,
+                         uint32_t* total_histogram)
 {
-    int n_histogram_pixels = 0;
-    int n_histogram_labels = 0;
+    memset(total_histogram, 0, n_labels * sizeof(uint32_t));
 
-    for (int i = 0; i < n_labels; i++) {
-        if (histogram[i] > 0) {
-            n_histogram_pixels += histogram[i];
-            n_histogram_labels++;
+    for (int b = 0; b <= n_thresholds; b++) {
+        uint16_t* histogram = &bucket_histograms[b * n_labels];
+        for (int i = 0; i < n_labels; i++)
+            total_histogram[i] += histogram[i];
+
+        // Pixels in bucket b are to the left of all thresholds >= b
+        if (b < n_thresholds) {
+            memcpy(&left_histograms[b * n_labels], total_histogram,
+                   n_labels * sizeof(uint32_t));
         }
     }
+}
 
-    if (n_histogram_pixels) {
+static void
+sum_bucket_histograms_32(uint32_t* bucket_histograms,
+                         int n_thresholds,
+                         int n_labels,
+                         uint32_t* left_histograms,
+                         uint32_t* total_histogram)
+{
+    memset(total_histogram, 0, n_labels * sizeof(uint32_t));
+
+    for (int b = 0; b <= n_thresholds; b++) {
+        uint32_t* histogram = &bucket_histograms[b * n_labels];
         for (int i = 0; i < n_labels; i++)
-            normalized[i] = histogram[i] / (float)n_histogram_pixels;
-    } else
-        memset(normalized, 0, n_labels * sizeof(float));
+            total_histogram[i] += histogram[i];
 
-    *n_histogram_pixels_ret = n_histogram_pixels;
-    *n_histogram_labels_ret = n_histogram_labels;
+        // Pixels in bucket b are to the left of all thresholds >= b
+        if (b < n_thresholds) {
+            memcpy(&left_histograms[b * n_labels], total_histogram,
+                   n_labels * sizeof(uint32_t));
+        }
+    }
 }
 
 static void
@@ -930,27 +1037,65 @@ sample_uv_gradient_mm(int16_t* depth_image,
     return upixel - vpixel;
 }
 
+/* The thresholds aren't generated in sorted order, so we keep track of where
+ * each threshold ranks once sorted, and build a look up table to map any
+ * int16_t gradient to its bucket (i.e. the number of sorted thresholds that
+ * are <= the gradient) so the gradient is to the left of all thresholds
+ * ranked >= the bucket index.
+ */
+static void
+prepare_threshold_buckets(struct gm_rdt_context_impl* ctx)
+{
+    int n_thresholds = ctx->n_thresholds;
+
+    gm_assert(ctx->log, n_thresholds < UINT16_MAX,
+              "Too many thresholds (%d)", n_thresholds);
+
+    std::vector<int> sorted(n_thresholds);
+    for (int n = 0; n < n_thresholds; n++)
+        sorted[n] = n;
+    std::stable_sort(sorted.begin(), sorted.end(), [&](int a, int b) {
+        return ctx->thresholds_mm[a] < ctx->thresholds_mm[b];
+    });
+
+    ctx->threshold_ranks.resize(n_thresholds);
+    for (int r = 0; r < n_thresholds; r++)
+        ctx->threshold_ranks[sorted[r]] = r;
+
+    ctx->threshold_buckets.resize(UINT16_MAX + 1);
+    int bucket = 0;
+    for (int gradient = INT16_MIN; gradient <= INT16_MAX; gradient++) {
+        while (bucket < n_thresholds &&
+               ctx->thresholds_mm[sorted[bucket]] <= gradient)
+        {
+            bucket++;
+        }
+        ctx->threshold_buckets[(uint16_t)gradient] = bucket;
+    }
+}
+
 static void
-accumulate_uvt_lr_histograms(struct gm_rdt_context_impl* ctx,
-                             struct thread_state *state,
-                             struct node_data* data,
-                             int uv_start, int uv_end,
-                             int n_shards)
+accumulate_uv_bucket_histograms(struct gm_rdt_context_impl* ctx,
+                                struct thread_state *state,
+                                struct node_data* data,
+                                int uv_start, int uv_end,
+                                int n_shards)
 {
     int p;
     int last_i = -1;
     int max_depth = ctx->max_depth;
-    int node_depth = id_to_depth(data->id);
+    int node_depth = data->depth;
     struct depth_meta* depth_index = ctx->depth_index.data();
     int n_pixels = data->n_pixels;
     int n_labels = ctx->n_rdt_labels;
-    int n_thresholds = ctx->n_thresholds;
+    int n_buckets = ctx->n_thresholds + 1;
+    uint16_t* threshold_buckets = ctx->threshold_buckets.data();
 
     struct thread_depth_metrics_raw *depth_metrics =
         &state->per_depth_metrics[node_depth];
 
-    uint16_t* uvt_lr_histograms_16 = state->uvt_lr_histograms_16.data();
-    uint32_t* uvt_lr_histograms_32 = state->uvt_lr_histograms_32.data();
+    uint16_t* uv_bucket_histograms_16 = state->uv_bucket_histograms_16.data();
+    uint32_t* uv_bucket_histograms_32 = state->uv_bucket_histograms_32.data();
 
     struct depth_meta depth_meta = {};
 
@@ -1013,44 +1158,84 @@ accumulate_uvt_lr_histograms(struct gm_rdt_context_impl* ctx,
          */
         if (n_pixels < UINT16_MAX) {
             for (int i = 0;  i < n_uv_combos; i++) {
-                int uv_offset = i * n_thresholds * n_labels * 2;
-                for (int n = 0; n < n_thresholds; n++) {
-                    int threshold_mm = ctx->thresholds_mm[n];
-
-                    int t_offset = n * n_labels * 2;
-                    int lr_histogram_idx = uv_offset + t_offset;
-
-                    //gm_info(ctx->log, "combo %d: %s", c,
-                    //        gradients[c] < threshold ? "left" : "right");
-                    // Accumulate histogram for this particular uvt combination
-                    // on both theoretical branches
-                    ++uvt_lr_histograms_16[(gradients_mm[i] < threshold_mm) ?
-                        lr_histogram_idx + label :
-                        lr_histogram_idx + n_labels + label];
-                }
+                int bucket = threshold_buckets[(uint16_t)gradients_mm[i]];
+                ++uv_bucket_histograms_16[(i * n_buckets + bucket) * n_labels +
+                                          label];
             }
         } else {
             for (int i = 0;  i < n_uv_combos; i++) {
-                int uv_offset = i * n_thresholds * n_labels * 2;
-                for (int n = 0; n < n_thresholds; n++) {
-                    int threshold_mm = ctx->thresholds_mm[n];
-
-                    int t_offset = n * n_labels * 2;
-                    int lr_histogram_idx = uv_offset + t_offset;
-
-                    //gm_info(ctx->log, "combo %d: %s", c,
-                    //        gradients[c] < threshold ? "left" : "right");
-                    // Accumulate histogram for this particular uvt combination
-                    // on both theoretical branches
-                    ++uvt_lr_histograms_32[(gradients_mm[i] < threshold_mm) ?
-                        lr_histogram_idx + label :
-                        lr_histogram_idx + n_labels + label];
-                }
+                int bucket = threshold_buckets[(uint16_t)gradients_mm[i]];
+                ++uv_bucket_histograms_32[(i * n_buckets + bucket) * n_labels +
+                                          label];
             }
         }
     }
 }
 
+/* Calculates the gain for each threshold of one uv combo, given the left
+ * branch histograms for each sorted threshold (see sum_bucket_histograms_*)
+ * and updates shard_data if there's a better split.
+ *
+ * NB: we still rank in the original order of thresholds, so that ties are
+ * resolved the same way
+ */
+static void
+rank_uv_thresholds(struct gm_rdt_context_impl* ctx,
+                   int uv,
+                   int n_pixels,
+                   float entropy,
+                   uint32_t* left_histograms,
+                   uint32_t* total_histogram,
+                   struct node_shard_data* shard_data)
+{
+    int n_labels = ctx->n_rdt_labels;
+
+    for (int j = 0; j < ctx->n_thresholds && !interrupted; j++) {
+        int rank = ctx->threshold_ranks[j];
+        uint32_t* l_histogram = &left_histograms[rank * n_labels];
+        uint32_t r_histogram[n_labels];
+        float nhistogram[n_labels];
+        float l_entropy, r_entropy, gain;
+
+        int l_n_pixels = 0;
+        int l_n_labels = 0;
+
+        normalize_histogram_32(l_histogram,
+                               n_labels, nhistogram,
+                               &l_n_pixels,
+                               &l_n_labels);
+        if (l_n_pixels == 0 || l_n_pixels == n_pixels)
+            continue;
+
+        l_entropy = calculate_shannon_entropy(nhistogram,
+                                              n_labels);
+
+        for (int l = 0; l < n_labels; l++)
+            r_histogram[l] = total_histogram[l] - l_histogram[l];
+
+        int r_n_pixels = 0;
+        int r_n_labels = 0;
+        normalize_histogram_32(r_histogram,
+                               n_labels, nhistogram,
+                               &r_n_pixels,
+                               &r_n_labels);
+        r_entropy = calculate_shannon_entropy(nhistogram,
+                                              n_labels);
+
+        gain = calculate_gain(entropy, n_pixels,
+                              l_entropy, l_n_pixels,
+                              r_entropy, r_n_pixels);
+
+        if (gain > shard_data->best_gain) {
+            shard_data->best_gain = gain;
+            shard_data->best_uv = uv;
+            shard_data->best_threshold = j;
+            shard_data->n_lr_pixels[0] = l_n_pixels;
+            shard_data->n_lr_pixels[1] = r_n_pixels;
+        }
+    }
+}
+
 static void
 node_shard_work_cb(struct thread_state* state,
                    void* user_data)
@@ -1065,22 +1250,28 @@ node_shard_work_cb(struct thread_state* state,
 
     struct node_data node_data = shard_work->node_data;
 
-    // Histograms for each uvt combination being tested
+    // Threshold bucket histograms for each uv combination being tested
     int n_uv_combos = shard_work->uv_end - shard_work->uv_start;
     int n_thresholds = ctx->n_thresholds;
+    int n_buckets = n_thresholds + 1;
     int n_uvt_combos = n_uv_combos * n_thresholds;
+    int uv_histograms_size = n_buckets * n_labels;
     if (node_data.n_pixels < UINT16_MAX) {
-        state->uvt_lr_histograms_16.clear();
-        state->uvt_lr_histograms_16.resize(n_labels * n_uvt_combos * 2);
+        state->uv_bucket_histograms_16.clear();
+        state->uv_bucket_histograms_16.resize(n_uv_combos * uv_histograms_size);
     } else {
-        state->uvt_lr_histograms_32.clear();
-        state->uvt_lr_histograms_32.resize(n_labels * n_uvt_combos * 2);
+        state->uv_bucket_histograms_32.clear();
+        state->uv_bucket_histograms_32.resize(n_uv_combos * uv_histograms_size);
     }
+    state->left_histograms.resize(n_thresholds * n_labels);
+    state->total_histogram.resize(n_labels);
 
-    uint16_t* uvt_lr_histograms_16 = state->uvt_lr_histograms_16.data();
-    uint32_t* uvt_lr_histograms_32 = state->uvt_lr_histograms_32.data();
+    uint16_t* uv_bucket_histograms_16 = state->uv_bucket_histograms_16.data();
+    uint32_t* uv_bucket_histograms_32 = state->uv_bucket_histograms_32.data();
+    uint32_t* left_histograms = state->left_histograms.data();
+    uint32_t* total_histogram = state->total_histogram.data();
 
-    int node_depth = id_to_depth(node_data.id);
+    int node_depth = node_data.depth;
     struct thread_depth_metrics_raw *depth_metrics =
         &state->per_depth_metrics[node_depth];
 
@@ -1096,11 +1287,12 @@ node_shard_work_cb(struct thread_state* state,
     if (results->n_node_labels > 1 && node_depth < ctx->max_depth - 1)
     {
         uint64_t accu_start = get_time();
-        accumulate_uvt_lr_histograms(ctx,
-                                     state,
-                                     &node_data,
-                                     shard_work->uv_start, shard_work->uv_end,
-                                     results->n_shards);
+        accumulate_uv_bucket_histograms(ctx,
+                                        state,
+                                        &node_data,
+                                        shard_work->uv_start,
+                                        shard_work->uv_end,
+                                        results->n_shards);
         uint64_t accu_end = get_time();
         depth_metrics->accumulation_time += accu_end - accu_start;
 
@@ -1113,65 +1305,28 @@ node_shard_work_cb(struct thread_state* state,
 
         int n_uv_combos = shard_work->uv_end - shard_work->uv_start;
         // Calculate the gain for each combination of u,v,t and store the best
-        for (int i = 0; i < n_uv_combos; i++) {
-            int uv_offset = i * n_thresholds * n_labels * 2;
-
-            for (int j = 0; j < ctx->n_thresholds && !interrupted; j++) {
-                int t_offset = j * n_labels * 2;
-                int lr_histo_base = uv_offset + t_offset;
-                float nhistogram[n_labels];
-                float l_entropy, r_entropy, gain;
-
-                int l_n_pixels = 0;
-                int l_n_labels = 0;
-
-                if (node_data.n_pixels < UINT16_MAX) {
-                    normalize_histogram_16(&uvt_lr_histograms_16[lr_histo_base],
-                                           n_labels, nhistogram,
-                                           &l_n_pixels,
-                                           &l_n_labels);
-                } else {
-                    normalize_histogram_32(&uvt_lr_histograms_32[lr_histo_base],
-                                           n_labels, nhistogram,
-                                           &l_n_pixels,
-                                           &l_n_labels);
-                }
-                if (l_n_pixels == 0 || l_n_pixels == node_data.n_pixels)
-                    continue;
-
-                l_entropy = calculate_shannon_entropy(nhistogram,
-                                                      n_labels);
-
-                int r_n_pixels = 0;
-                int r_n_labels = 0;
-                if (node_data.n_pixels < UINT16_MAX) {
-                    normalize_histogram_16(
-                        &uvt_lr_histograms_16[lr_histo_base + n_labels],
-                        n_labels, nhistogram,
-                        &r_n_pixels,
-                        &r_n_labels);
-                } else {
-                    normalize_histogram_32(
-                        &uvt_lr_histograms_32[lr_histo_base + n_labels],
-                        n_labels, nhistogram,
-                        &r_n_pixels,
-                        &r_n_labels);
-                }
-                r_entropy = calculate_shannon_entropy(nhistogram,
-                                                      n_labels);
-
-                gain = calculate_gain(entropy, node_data.n_pixels,
-                                      l_entropy, l_n_pixels,
-                                      r_entropy, r_n_pixels);
-
-                if (gain > shard_data->best_gain) {
-                    shard_data->best_gain = gain;
-                    shard_data->best_uv = shard_work->uv_start + i;
-                    shard_data->best_threshold = j;
-                    shard_data->n_lr_pixels[0] = l_n_pixels;
-                    shard_data->n_lr_pixels[1] = r_n_pixels;
-                }
+        for (int i = 0; i < n_uv_combos && !interrupted; i++) {
+            int uv_offset = i * uv_histograms_size;
+
+            if (node_data.n_pixels < UINT16_MAX) {
+                sum_bucket_histograms_16(&uv_bucket_histograms_16[uv_offset],
+                                         n_thresholds, n_labels,
+                                         left_histograms,
+                                         total_histogram);
+            } else {
+                sum_bucket_histograms_32(&uv_bucket_histograms_32[uv_offset],
+                                         n_thresholds, n_labels,
+                                         left_histograms,
+                                         total_histogram);
             }
+
+            rank_uv_thresholds(ctx,
+                               shard_work->uv_start + i,
+                               node_data.n_pixels,
+                               entropy,
+                               left_histograms,
+                               total_histogram,
+                               shard_data);
         }
         uint64_t rank_end = get_time();
         depth_metrics->gain_ranking_time += rank_end - rank_start;
@@ -1281,7 +1436,7 @@ schedule_node_work(struct thread_state* state)
      * aren't very large.
      */
 
-    int node_depth = id_to_depth(node_data.id);
+    int node_depth = node_data.depth;
 
     /*
      * TODO: It's probably worth implementing some simple caching allocator for
@@ -1300,9 +1455,9 @@ schedule_node_work(struct thread_state* state)
      */
 
     // We want the working set of uvt combos to be constrained enough that
-    // the uvt_lr_histrograms array can be cached
+    // the uv_bucket_histograms array can be cached
     int est_uvt_lr_hist_size =
-        ctx->n_uvs * ctx->n_thresholds * ctx->n_rdt_labels * 4 * 2;
+        ctx->n_uvs * (ctx->n_thresholds + 1) * ctx->n_rdt_labels * 4;
     int max_thread_uvt_lr_size =
         (std::min(ctx->uvt_histograms_mem, est_uvt_lr_hist_size) /
          ctx->n_threads);
@@ -1398,21 +1553,31 @@ schedule_node_work(struct thread_state* state)
     return true;
 }
 
-static void
-collect_pixels(struct gm_rdt_context_impl* ctx,
-               struct node_data* data,
-               float* uvs_m,
-               int16_t t_mm,
-               struct pixel** l_pixels,
-               struct pixel** r_pixels,
-               int* n_lr_pixels)
-{
-    *l_pixels = (struct pixel*)xmalloc((n_lr_pixels[0] ? n_lr_pixels[0] :
-                                        data->n_pixels) *
-                                       sizeof(struct pixel));
-    *r_pixels = (struct pixel*)xmalloc((n_lr_pixels[1] ? n_lr_pixels[1] :
-                                        data->n_pixels) *
-                                       sizeof(struct pixel));
+/* Pixels are partitioned in blocks of this size with a scratch buffer on the
+ * stack before the blocks are merged
+ */
+#define PIXEL_PARTITION_BLOCK 4096
+
+static int
+partition_pixel_range(struct gm_rdt_context_impl* ctx,
+                      struct pixel* pixels,
+                      int n_pixels,
+                      float* uvs_m,
+                      int16_t t_mm,
+                      struct pixel* scratch)
+{
+    if (n_pixels > PIXEL_PARTITION_BLOCK) {
+        int mid = n_pixels / 2;
+        int n_left0 = partition_pixel_range(ctx, pixels, mid,
+                                            uvs_m, t_mm, scratch);
+        int n_left1 = partition_pixel_range(ctx, pixels + mid, n_pixels - mid,
+                                            uvs_m, t_mm, scratch);
+
+        /* [left0 right0 left1 right1] -> [left0 left1 right0 right1] */
+        std::rotate(pixels + n_left0, pixels + mid, pixels + mid + n_left1);
+
+        return n_left0 + n_left1;
+    }
 
     int l_index = 0;
     int r_index = 0;
@@ -1420,8 +1585,8 @@ collect_pixels(struct gm_rdt_context_impl* ctx,
     struct depth_meta* depth_index = ctx->depth_index.data();
     int16_t* depth_images = ctx->depth_images;
 
-    for (int p = 0; p < data->n_pixels; p++) {
-        struct pixel px = data->pixels[p];
+    for (int p = 0; p < n_pixels; p++) {
+        struct pixel px = pixels[p];
 
         struct depth_meta depth_meta = depth_index[px.i];
         int16_t* depth_image = &depth_images[depth_meta.pixel_offset];
@@ -1435,22 +1600,35 @@ collect_pixels(struct gm_rdt_context_impl* ctx,
                                                  depth_mm / 2,
                                                  uvs_m);
         if (gradient < t_mm)
-            (*l_pixels)[l_index++] = px;
+            pixels[l_index++] = px;
         else
-            (*r_pixels)[r_index++] = px;
+            scratch[r_index++] = px;
     }
 
-    if (n_lr_pixels[0] != l_index) {
-        *l_pixels = (struct pixel*)xrealloc(*l_pixels,
-                                            l_index * sizeof(struct pixel));
-        n_lr_pixels[0] = l_index;
-    }
+    memcpy(pixels + l_index, scratch, r_index * sizeof(struct pixel));
 
-    if (n_lr_pixels[1] != r_index) {
-        *r_pixels = (struct pixel*)xrealloc(*r_pixels,
-                                            r_index * sizeof(struct pixel));
-        n_lr_pixels[1] = r_index;
-    }
+    return l_index;
+}
+
+/* Reorders a node's pixels in place so that the pixels for the left branch
+ * come first and returns how many there are. Child nodes refer to their
+ * half of the parent's pixels, so all nodes share ctx->pixels.
+ *
+ * The partition is stable, so pixels stay grouped by image for better
+ * locality when sampling depth images. Since the predicate is only evaluated
+ * once per pixel and there's no allocation this is still cheaper than
+ * copying into new arrays.
+ */
+static int
+partition_pixels(struct gm_rdt_context_impl* ctx,
+                 struct node_data* data,
+                 float* uvs_m,
+                 int16_t t_mm)
+{
+    struct pixel scratch[PIXEL_PARTITION_BLOCK];
+
+    return partition_pixel_range(ctx, data->pixels, data->n_pixels,
+                                 uvs_m, t_mm, scratch);
 }
 
 static void
@@ -1471,17 +1649,67 @@ static void
 training_queue_add_node(struct gm_rdt_context_impl* ctx,
                         struct node_data node)
 {
-    int node_depth = id_to_depth(node.id);
-    int nodes_per_depth = 1<<node_depth;
+    uint64_t nodes_per_depth = 1ULL<<node.depth;
 
-
-    if (nodes_per_depth < ctx->batch_divider ||
-        node.id % ctx->batch_divider == ctx->batch_number)
+    if (nodes_per_depth < (uint64_t)ctx->batch_divider ||
+        node.path % ctx->batch_divider == (uint64_t)ctx->batch_number)
     {
         ctx->train_queue.push_back(node);
     }
 }
 
+/* Adds a pair of untrained children to the tree for a node that's been split
+ * and updates node->left_id.
+ *
+ * NB: other threads may grow ctx->tree concurrently so we only access
+ * it with the tree_lock held
+ */
+static void
+add_split_node(struct gm_rdt_context_impl* ctx, int id, struct node* node)
+{
+    struct node untrained = {};
+    untrained.label_pr_idx = INT_MAX;
+
+    pthread_mutex_lock(&ctx->tree_lock);
+    node->left_id = ctx->tree.size();
+    ctx->tree.push_back(untrained);
+    ctx->tree.push_back(untrained);
+    ctx->tree[id] = *node;
+    pthread_mutex_unlock(&ctx->tree_lock);
+}
+
+static void
+add_leaf_node(struct gm_rdt_context_impl* ctx, int id, float* nhistogram)
+{
+    struct node node = {};
+
+    pthread_mutex_lock(&ctx->tree_lock);
+
+    // NB: 0 is reserved for non-leaf nodes
+    node.label_pr_idx = (ctx->tree_histograms.size() /
+                         ctx->n_rdt_labels) + 1;
+    int len = ctx->tree_histograms.size();
+    ctx->tree_histograms.resize(len + ctx->n_rdt_labels);
+    memcpy(&ctx->tree_histograms[len],
+           nhistogram,
+           ctx->n_rdt_labels * sizeof(float));
+    ctx->tree[id] = node;
+
+    pthread_mutex_unlock(&ctx->tree_lock);
+
+    if (ctx->verbose)
+    {
+        pthread_mutex_lock(&ctx->tidy_log_lock);
+        gm_info(ctx->log, "  Leaf node (%d)\n", id);
+        for (int i = 0; i < ctx->n_rdt_labels; i++) {
+            if (nhistogram[i] > 0.f) {
+                gm_info(ctx->log, "    %02d - %f\n", i, nhistogram[i]);
+            }
+        }
+        pthread_mutex_unlock(&ctx->tidy_log_lock);
+    }
+}
+
 static void
 process_node_shards_work_cb(struct thread_state* state,
                             void* user_data)
@@ -1494,7 +1722,7 @@ process_node_shards_work_cb(struct thread_state* state,
     int n_shards = results->n_shards;
 
     struct node_data node_data = process_work->node_data;
-    int node_depth = id_to_depth(node_data.id);
+    int node_depth = node_data.depth;
 
     /* Make sure only one worker can process the shard results for a node...
      */
@@ -1531,7 +1759,6 @@ process_node_shards_work_cb(struct thread_state* state,
 
     int best_uv = 0;
     int best_threshold = 0;
-    int *n_lr_pixels = NULL;
     float best_gain = 0.0;
 
     // See which shard got the best uvt combination
@@ -1542,7 +1769,6 @@ process_node_shards_work_cb(struct thread_state* state,
             best_gain = shard_data->best_gain;
             best_uv = shard_data->best_uv;
             best_threshold = shard_data->best_threshold;
-            n_lr_pixels = shard_data->n_lr_pixels;
         }
     }
 
@@ -1550,38 +1776,40 @@ process_node_shards_work_cb(struct thread_state* state,
         gm_info(ctx->log, "Failed to find a UV threshold combo with any gain");
     }
 
-    // Add this node to the tree and possibly add left/ride nodes to the
-    // training queue.
-    struct node* node = &ctx->tree[node_data.id];
+    /* Add this node to the tree and possibly add left/right nodes to the
+     * training queue.
+     */
+    struct node node = {};
     if (best_gain > 0.f && (node_depth + 1) < ctx->max_depth)
     {
-        struct pixel* l_pixels;
-        struct pixel* r_pixels;
+        memcpy(node.uvs_m, &ctx->uvs_m[4 * best_uv], sizeof(node.uvs_m));
+        node.t_mm = ctx->thresholds_mm[best_threshold];
+        int n_l_pixels = partition_pixels(ctx, &node_data,
+                                          node.uvs_m, node.t_mm);
 
-        memcpy(node->uvs_m, &ctx->uvs_m[4 * best_uv], sizeof(node->uvs_m));
-        node->t_mm = ctx->thresholds_mm[best_threshold];
-        collect_pixels(ctx, &node_data, node->uvs_m, node->t_mm,
-                       &l_pixels, &r_pixels, n_lr_pixels);
+        // Mark the node as a continuing node
+        node.label_pr_idx = 0;
+        add_split_node(ctx, node_data.id, &node);
 
-        int id = (2 * node_data.id) + 1;
         struct node_data ldata;
-        ldata.id = id;
-        ldata.n_pixels = n_lr_pixels[0];
-        ldata.pixels = l_pixels;
+        ldata.id = node.left_id;
+        ldata.depth = node_depth + 1;
+        ldata.path = 2 * node_data.path + 1;
+        ldata.n_pixels = n_l_pixels;
+        ldata.pixels = node_data.pixels;
 
         struct node_data rdata;
-        rdata.id = id + 1;
-        rdata.n_pixels = n_lr_pixels[1];
-        rdata.pixels = r_pixels;
+        rdata.id = node.left_id + 1;
+        rdata.depth = node_depth + 1;
+        rdata.path = 2 * node_data.path + 2;
+        rdata.n_pixels = node_data.n_pixels - n_l_pixels;
+        rdata.pixels = node_data.pixels + n_l_pixels;
 
         pthread_mutex_lock(&ctx->train_queue_lock);
         training_queue_add_node(ctx, ldata);
         training_queue_add_node(ctx, rdata);
         pthread_mutex_unlock(&ctx->train_queue_lock);
 
-        // Mark the node as a continuing node
-        node->label_pr_idx = 0;
-
         if (ctx->verbose)
         {
             gm_info(ctx->log,
@@ -1592,47 +1820,16 @@ process_node_shards_work_cb(struct thread_state* state,
                     "    T: %f\n"
                     "  Queued left id=%d, right id=%d\n",
                     node_data.id, best_gain,
-                    node->uvs_m[0], node->uvs_m[1],
-                    node->uvs_m[2], node->uvs_m[3],
-                    node->t_mm / 1000.0f,
+                    node.uvs_m[0], node.uvs_m[1],
+                    node.uvs_m[2], node.uvs_m[3],
+                    node.t_mm / 1000.0f,
                     ldata.id,
                     rdata.id);
         }
 
     }
     else
-    {
-        float *nhistogram = results->nhistogram;
-
-        pthread_mutex_lock(&ctx->tree_histograms_lock);
-
-        // NB: 0 is reserved for non-leaf nodes
-        node->label_pr_idx = (ctx->tree_histograms.size() /
-                              ctx->n_rdt_labels) + 1;
-        int len = ctx->tree_histograms.size();
-        ctx->tree_histograms.resize(len + ctx->n_rdt_labels);
-        memcpy(&ctx->tree_histograms[len],
-               nhistogram,
-               ctx->n_rdt_labels * sizeof(float));
-
-        pthread_mutex_unlock(&ctx->tree_histograms_lock);
-
-        if (ctx->verbose)
-        {
-            pthread_mutex_lock(&ctx->tidy_log_lock);
-            gm_info(ctx->log, "  Leaf node (%d)\n", node_data.id);
-            for (int i = 0; i < ctx->n_rdt_labels; i++) {
-                if (nhistogram[i] > 0.f) {
-                    gm_info(ctx->log, "    %02d - %f\n", i, nhistogram[i]);
-                }
-            }
-            pthread_mutex_unlock(&ctx->tidy_log_lock);
-        }
-    }
-
-    // We no longer need the node's pixel data
-    xfree(node_data.pixels);
-    node_data.pixels = NULL;
+        add_leaf_node(ctx, node_data.id, results->nhistogram);
 
     struct thread_depth_metrics_raw *depth_metrics =
         &state->per_depth_metrics[node_depth];
@@ -1662,14 +1859,12 @@ worker_thread_cb(void* userdata)
     // combos at a time so we can allocate the memory up front...
     int max_uv_combos_per_thread = (ctx->n_uvs + ctx->n_threads/2) / ctx->n_threads;
 
-    state->uvt_lr_histograms_16.reserve(ctx->n_rdt_labels *
-                                        max_uv_combos_per_thread *
-                                        ctx->n_thresholds *
-                                        2);
-    state->uvt_lr_histograms_32.reserve(ctx->n_rdt_labels *
-                                        max_uv_combos_per_thread *
-                                        ctx->n_thresholds *
-                                        2);
+    state->uv_bucket_histograms_16.reserve(ctx->n_rdt_labels *
+                                           max_uv_combos_per_thread *
+                                           (ctx->n_thresholds + 1));
+    state->uv_bucket_histograms_32.reserve(ctx->n_rdt_labels *
+                                           max_uv_combos_per_thread *
+                                           (ctx->n_thresholds + 1));
 
     while (1)
     {
@@ -1812,7 +2007,7 @@ gm_rdt_context_new(struct gm_logger *log)
     pthread_mutex_init(&ctx->work_queue_lock, NULL);
     pthread_cond_init(&ctx->work_queue_changed, NULL);
 
-    pthread_mutex_init(&ctx->tree_histograms_lock, NULL);
+    pthread_mutex_init(&ctx->tree_lock, NULL);
 
     ctx->data_dir = strdup(cwd);
     prop = gm_ui_property();
@@ -1944,7 +2139,7 @@ gm_rdt_context_new(struct gm_logger *log)
     // with the root node and calculating the histograms of labels without
     // any decisions, so set the minimum to 2...
     prop.int_state.min = 2;
-    prop.int_state.max = 30;
+    prop.int_state.max = 64;
     ctx->properties.push_back(prop);
 
     ctx->max_nodes = 0;
@@ -2049,6 +2244,57 @@ gm_rdt_context_new(struct gm_logger *log)
     prop.int_state.max = 64000000;
     ctx->properties.push_back(prop);
 
+    ctx->training_cache = true;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "training_cache";
+    prop.desc = "Cache sampled pixels and cropped depth images for later runs";
+    prop.type = GM_PROPERTY_BOOL;
+    prop.bool_state.ptr = &ctx->training_cache;
+    ctx->properties.push_back(prop);
+
+    ctx->cache_dir = NULL;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "cache_dir";
+    prop.desc = "Location of training data caches (data_dir by default)";
+    prop.type = GM_PROPERTY_STRING;
+    prop.string_state.ptr = &ctx->cache_dir;
+    ctx->properties.push_back(prop);
+
+    ctx->listen_address = NULL;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "listen";
+    prop.desc = "Address (host:port) to coordinate distributed training workers from";
+    prop.type = GM_PROPERTY_STRING;
+    prop.string_state.ptr = &ctx->listen_address;
+    ctx->properties.push_back(prop);
+
+    ctx->n_workers = 1;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "n_workers";
+    prop.desc = "Number of distributed training workers to wait for (see listen)";
+    prop.type = GM_PROPERTY_INT;
+    prop.int_state.ptr = &ctx->n_workers;
+    prop.int_state.min = 1;
+    prop.int_state.max = 1000;
+    ctx->properties.push_back(prop);
+
+    ctx->coordinator = NULL;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "coordinator";
+    prop.desc = "Address (host:port) of distributed training coordinator to work for";
+    prop.type = GM_PROPERTY_STRING;
+    prop.string_state.ptr = &ctx->coordinator;
+    ctx->properties.push_back(prop);
+
+    ctx->coordinator_fd = -1;
+    ctx->shard_index = 0;
+    ctx->n_shards = 1;
+
     ctx->properties_state.n_properties = ctx->properties.size();
     ctx->properties_state.properties = &ctx->properties[0];
 
@@ -2060,10 +2306,22 @@ destroy_training_state(struct gm_rdt_context_impl* ctx)
 {
     ctx->uvs_m.clear();
     ctx->uvs_m.shrink_to_fit();
-    xfree(ctx->depth_images);
+    if (ctx->cache_map) {
+        munmap(ctx->cache_map, ctx->cache_map_len);
+        ctx->cache_map = NULL;
+        ctx->cache_map_len = 0;
+    } else
+        xfree(ctx->depth_images);
     ctx->depth_images = NULL;
+    ctx->train_queue.clear();
+    xfree(ctx->pixels);
+    ctx->pixels = NULL;
     xfree(ctx->thresholds_mm);
     ctx->thresholds_mm = NULL;
+    ctx->threshold_ranks.clear();
+    ctx->threshold_ranks.shrink_to_fit();
+    ctx->threshold_buckets.clear();
+    ctx->threshold_buckets.shrink_to_fit();
     if (ctx->history) {
         json_value_free(ctx->history);
         ctx->history = NULL;
@@ -2084,6 +2342,10 @@ destroy_training_state(struct gm_rdt_context_impl* ctx)
         json_value_free(ctx->data_meta);
         ctx->data_meta = NULL;
     }
+    if (ctx->coordinator_fd != -1) {
+        close(ctx->coordinator_fd);
+        ctx->coordinator_fd = -1;
+    }
 }
 
 void
@@ -2096,78 +2358,110 @@ gm_rdt_context_destroy(struct gm_rdt_context *_ctx)
     delete ctx;
 }
 
-static JSON_Value*
-recursive_build_tree(struct gm_rdt_context_impl* ctx,
-                     struct node* node,
-                     int depth,
-                     int id)
+/* NB: The nodes are written directly, without building a DOM (which can
+ * take many gigabytes for a deep tree) but formatted the same as parson
+ * would serialize them.
+ */
+static void
+write_json_indent(FILE* fp, bool pretty, int level)
 {
-    JSON_Value* json_node_val = json_value_init_object();
-    JSON_Object* json_node = json_object(json_node_val);
+    if (pretty) {
+        for (int i = 0; i < level; i++)
+            fputs("    ", fp);
+    }
+}
+
+static void
+write_json_key(FILE* fp, bool pretty, int level, bool first, const char* key)
+{
+    if (!first)
+        fputc(',', fp);
+    if (pretty)
+        fputc('\n', fp);
+    write_json_indent(fp, pretty, level);
+    fprintf(fp, pretty ? "\"%s\": " : "\"%s\":", key);
+}
+
+static void
+write_json_numbers(FILE* fp, bool pretty, int level, const float* values, int n)
+{
+    fputc('[', fp);
+    for (int i = 0; i < n; i++) {
+        if (pretty)
+            fputc('\n', fp);
+        write_json_indent(fp, pretty, level + 1);
+        fprintf(fp, "%1.17g", (double)values[i]);
+        if (i < n - 1)
+            fputc(',', fp);
+    }
+    if (n && pretty) {
+        fputc('\n', fp);
+        write_json_indent(fp, pretty, level);
+    }
+    fputc(']', fp);
+}
+
+static void
+write_tree_json(struct gm_rdt_context_impl* ctx,
+                FILE* fp,
+                struct node* node,
+                int depth,
+                int id,
+                int level)
+{
+    bool pretty = ctx->pretty;
+    bool first = true;
+
+    fputc('{', fp);
 
     if (ctx->verbose) {
-        json_object_set_number(json_node, "id", id);
+        write_json_key(fp, pretty, level + 1, first, "id");
+        fprintf(fp, "%1.17g", (double)id);
+        first = false;
     }
 
     if (node->label_pr_idx == 0)
     {
-        json_object_set_number(json_node, "t", node->t_mm / 1000.0f);
+        write_json_key(fp, pretty, level + 1, first, "t");
+        fprintf(fp, "%1.17g", (double)(node->t_mm / 1000.0f));
 
-        JSON_Value* u_val = json_value_init_array();
-        JSON_Array* u = json_array(u_val);
-        json_array_append_number(u, node->uvs_m[0]);
-        json_array_append_number(u, node->uvs_m[1]);
-        json_object_set_value(json_node, "u", u_val);
-
-        JSON_Value* v_val = json_value_init_array();
-        JSON_Array* v = json_array(v_val);
-        json_array_append_number(v, node->uvs_m[2]);
-        json_array_append_number(v, node->uvs_m[3]);
-        json_object_set_value(json_node, "v", v_val);
+        write_json_key(fp, pretty, level + 1, false, "u");
+        write_json_numbers(fp, pretty, level + 1, &node->uvs_m[0], 2);
+        write_json_key(fp, pretty, level + 1, false, "v");
+        write_json_numbers(fp, pretty, level + 1, &node->uvs_m[2], 2);
+        first = false;
 
         if (depth < (ctx->max_depth - 1))
         {
-            /* NB: The nodes in .rdt files are in a packed array arranged in
-             * breadth-first, left then right child order with the root node at
-             * index zero.
-             *
-             * With this layout then given an index for any particular node
-             * ('id' here) then 2 * id + 1 is the index for the left child and
-             * 2 * id + 2 is the index for the right child...
-             */
-            int left_id = id * 2 + 1;
-            struct node* left_node = &ctx->tree[left_id];
-            int right_id = id * 2 + 2;
-            struct node* right_node = &ctx->tree[right_id];
-
-            JSON_Value* left_json = recursive_build_tree(ctx, left_node,
-                                                         depth + 1, left_id);
-            json_object_set_value(json_node, "l", left_json);
-            JSON_Value* right_json = recursive_build_tree(ctx, right_node,
-                                                          depth + 1, right_id);
-            json_object_set_value(json_node, "r", right_json);
+            int left_id = node->left_id;
+            int right_id = left_id + 1;
+
+            write_json_key(fp, pretty, level + 1, false, "l");
+            write_tree_json(ctx, fp, &ctx->tree[left_id], depth + 1, left_id,
+                            level + 1);
+            write_json_key(fp, pretty, level + 1, false, "r");
+            write_tree_json(ctx, fp, &ctx->tree[right_id], depth + 1, right_id,
+                            level + 1);
         }
     }
-    else if (node->label_pr_idx != INT_MAX) // Return empty obj for untrained nodes
+    else if (node->label_pr_idx != INT_MAX) // Write empty obj for untrained nodes
     {
-        JSON_Value* probs_val = json_value_init_array();
-        JSON_Array* probs = json_array(probs_val);
-
         /* NB: node->label_pr_idx is a base-one index since index zero is
          * reserved to indicate that the node is not a leaf node
          */
         float* pr_table = &ctx->tree_histograms[(node->label_pr_idx - 1) *
             ctx->n_rdt_labels];
 
-        for (int i = 0; i < ctx->n_rdt_labels; i++)
-        {
-            json_array_append_number(probs, pr_table[i]);
-        }
-
-        json_object_set_value(json_node, "p", probs_val);
+        write_json_key(fp, pretty, level + 1, first, "p");
+        write_json_numbers(fp, pretty, level + 1, pr_table, ctx->n_rdt_labels);
+        first = false;
     }
 
-    return json_node_val;
+    if (!first && pretty) {
+        fputc('\n', fp);
+        write_json_indent(fp, pretty, level);
+    }
+    fputc('}', fp);
 }
 
 /* TODO: include more information than the RDTree, such as a date timestamp,
@@ -2219,22 +2513,39 @@ save_tree_json(struct gm_rdt_context_impl *ctx,
     JSON_Value* labels = json_value_deep_copy(ctx->label_names_js);
     json_object_set_value(json_object(rdt), "labels", labels);
 
-    JSON_Value *nodes = recursive_build_tree(ctx, &tree[0], 0, 0);
-
-    json_object_set_value(json_object(rdt), "root", nodes);
-
-    JSON_Status status;
-    if (ctx->pretty)
-        status = json_serialize_to_file_pretty(rdt, filename);
-    else
-        status = json_serialize_to_file(rdt, filename);
+    /* The top-level properties are serialized by parson, followed by the
+     * "root" node which is streamed out by write_tree_json()
+     */
+    char *props = ctx->pretty ?
+        json_serialize_to_string_pretty(rdt) : json_serialize_to_string(rdt);
     json_value_free(rdt);
-    if (status != JSONSuccess)
-    {
+    if (!props) {
         gm_throw(ctx->log, err, "Failed to serialize output to JSON\n");
         return false;
     }
 
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        gm_throw(ctx->log, err, "Failed to open %s for writing\n", filename);
+        json_free_serialized_string(props);
+        return false;
+    }
+
+    /* Strip the closing brace (and newline, if pretty) */
+    size_t props_len = strlen(props) - (ctx->pretty ? 2 : 1);
+    fwrite(props, 1, props_len, fp);
+    json_free_serialized_string(props);
+
+    write_json_key(fp, ctx->pretty, 1, false, "root");
+    write_tree_json(ctx, fp, &tree[0], 0, 0, 1);
+    fputs(ctx->pretty ? "\n}" : "}", fp);
+
+    bool failed = ferror(fp);
+    if (fclose(fp) != 0 || failed) {
+        gm_throw(ctx->log, err, "Failed to write JSON output to %s\n", filename);
+        return false;
+    }
+
     return true;
 }
 
@@ -2249,16 +2560,22 @@ reload_tree(struct gm_rdt_context_impl* ctx,
     int len = strlen(filename);
     RDTree* checkpoint = NULL;
     if (len > 5 && strcmp(filename + len - 5, ".json") == 0) {
-        JSON_Value* js = json_parse_file(filename);
-        if (!js) {
-            gm_throw(ctx->log, err, "Failed to parse %s", filename);
+        FILE* fp = fopen(filename, "rb");
+        if (!fp) {
+            gm_throw(ctx->log, err, "Failed to open %s", filename);
             return false;
         }
 
-        checkpoint = rdt_tree_load_from_json(ctx->log,
-                                             js,
-                                             true, // allow loading incomplete trees
-                                             err);
+        /* NB: js only holds the top-level properties, not the nodes */
+        JSON_Value* js = NULL;
+        checkpoint = rdt_tree_load_from_json_stream(ctx->log,
+                                                    fp,
+                                                    true, // allow loading incomplete trees
+                                                    &js,
+                                                    err);
+        fclose(fp);
+        if (!checkpoint)
+            return false;
 
         JSON_Value* history = json_object_get_value(json_object(js), "history");
         if (history) {
@@ -2298,6 +2615,21 @@ reload_tree(struct gm_rdt_context_impl* ctx,
     if (!checkpoint)
         return false;
 
+    if (!checkpoint->nodes) {
+        gm_throw(ctx->log, err, "Can't reload training from %s which uses the cache-blocked (v%d) node layout\n",
+                 filename, RDT_CLUSTERED_VERSION);
+        rdt_tree_destroy(checkpoint);
+        return false;
+    }
+
+    if (!checkpoint->label_pr_tables) {
+        gm_throw(ctx->log, err, "Can't reload training from %s which has quantised (%s) label probability tables\n",
+                 filename,
+                 rdt_pr_format_get_name((enum rdt_pr_format)checkpoint->header.pr_format));
+        rdt_tree_destroy(checkpoint);
+        return false;
+    }
+
     // Do some basic validation
     if (checkpoint->header.n_labels != ctx->n_rdt_labels)
     {
@@ -2320,39 +2652,44 @@ reload_tree(struct gm_rdt_context_impl* ctx,
 
     int reload_depth = std::min((int)checkpoint->header.depth, ctx->max_depth);
     gm_info(ctx->log, "Reloading %d levels", reload_depth);
+    gm_info(ctx->log, "Reloading up to %u nodes", checkpoint->n_nodes);
 
-    // Restore nodes
-    int n_reload_nodes = (1<<reload_depth) - 1;
-    gm_info(ctx->log, "Reloading %d nodes", n_reload_nodes);
-
-    /* We track the UVT values as integers instead of float while training... */
-    for (int i = 0; i < n_reload_nodes; i++) {
-        Node reload_node = checkpoint->nodes[i];
-
-        struct node train_node = {};
-        if (reload_node.label_pr_idx == 0) {
-            train_node.uvs_m[0] = reload_node.uv[0];
-            train_node.uvs_m[1] = reload_node.uv[1];
-            train_node.uvs_m[2] = reload_node.uv[2];
-            train_node.uvs_m[3] = reload_node.uv[3];
-            train_node.t_mm = roundf(reload_node.t * 1000.0f);
-        }
-        train_node.label_pr_idx = reload_node.label_pr_idx;
-        ctx->tree[i] = train_node;
-    }
-
-    // Navigate the tree to determine any unfinished nodes and the last
-    // trained depth
-    std::queue<node_data> reload_queue;
+    /* Navigate the tree to restore nodes and determine any unfinished nodes
+     * and the last trained depth.
+     *
+     * The checkpoint's nodes are in depth-first pre-order, so alongside each
+     * node of our tree we track the index of the corresponding checkpoint
+     * node...
+     */
+    struct reload_node {
+        struct node_data node_data;
+        uint32_t checkpoint_id;
+    };
+    std::queue<reload_node> reload_queue;
 
-    reload_queue.push(root_node);
+    reload_queue.push({ root_node, 0 });
 
     while (reload_queue.size())
     {
-        struct node_data node_data = reload_queue.front();
-        int node_depth = id_to_depth(node_data.id);
+        struct reload_node reload = reload_queue.front();
         reload_queue.pop();
+
+        struct node_data node_data = reload.node_data;
+        Node reload_node = checkpoint->nodes[reload.checkpoint_id];
+        int node_depth = node_data.depth;
+
+        /* We track the UVT values as integers instead of float while
+         * training...
+         */
         struct node* node = &ctx->tree[node_data.id];
+        if (reload_node.label_pr_idx == 0) {
+            node->uvs_m[0] = reload_node.uv[0];
+            node->uvs_m[1] = reload_node.uv[1];
+            node->uvs_m[2] = reload_node.uv[2];
+            node->uvs_m[3] = reload_node.uv[3];
+            node->t_mm = roundf(reload_node.t * 1000.0f);
+        }
+        node->label_pr_idx = reload_node.label_pr_idx;
 
         if (node->label_pr_idx == INT_MAX)
         {
@@ -2403,34 +2740,32 @@ reload_tree(struct gm_rdt_context_impl* ctx,
                 // If the node isn't a leaf-node, calculate which pixels should
                 // go to the next two nodes and add them to the reload
                 // queue
-                struct pixel* l_pixels;
-                struct pixel* r_pixels;
-                int n_lr_pixels[] = { 0, 0 };
-                collect_pixels(ctx, &node_data,
-                               node->uvs_m,
-                               node->t_mm,
-                               &l_pixels, &r_pixels,
-                               n_lr_pixels);
+                int n_l_pixels = partition_pixels(ctx, &node_data,
+                                                  node->uvs_m,
+                                                  node->t_mm);
 
-                int id = (2 * node_data.id) + 1;
+                // NB: this may reallocate ctx->tree, invalidating 'node'
+                int id = ctx->tree.size();
+                ctx->tree[node_data.id].left_id = id;
+                ctx->tree.resize(id + 2);
 
                 struct node_data ldata;
                 ldata.id = id;
-                ldata.n_pixels = n_lr_pixels[0];
-                ldata.pixels = l_pixels;
+                ldata.depth = node_depth + 1;
+                ldata.path = 2 * node_data.path + 1;
+                ldata.n_pixels = n_l_pixels;
+                ldata.pixels = node_data.pixels;
 
                 struct node_data rdata;
                 rdata.id = id + 1;
-                rdata.n_pixels = n_lr_pixels[1];
-                rdata.pixels = r_pixels;
+                rdata.depth = node_depth + 1;
+                rdata.path = 2 * node_data.path + 2;
+                rdata.n_pixels = node_data.n_pixels - n_l_pixels;
+                rdata.pixels = node_data.pixels + n_l_pixels;
 
-                reload_queue.push(ldata);
-                reload_queue.push(rdata);
+                reload_queue.push({ ldata, reload.checkpoint_id + 1 });
+                reload_queue.push({ rdata, reload_node.right_idx });
             }
-
-            // Since we didn't add the node to the training queue we
-            // no longer need the associated pixel data for this node...
-            xfree(node_data.pixels);
         }
     }
 
@@ -2470,15 +2805,13 @@ create_training_record(struct gm_rdt_context_impl* ctx)
 /* A histogram of the labels for the root node pixels is useful to help double
  * check they roughly match the relative sizes of the different labels else
  * maybe there was a problem with generating our sample points.
+ *
+ * NB: ctx->root_pixel_histogram must have been accumulated already
  */
 static void
-check_root_pixels_histogram(struct gm_rdt_context_impl* ctx,
-                            struct node_data* root_node)
+report_root_pixels_histogram(struct gm_rdt_context_impl* ctx)
 {
-    gm_info(ctx->log, "Calculating root node pixel histogram");
-    ctx->root_pixel_histogram.resize(ctx->n_rdt_labels);
     ctx->root_pixel_nhistogram.resize(ctx->n_rdt_labels);
-    accumulate_pixels_histogram_32(ctx, root_node, ctx->root_pixel_histogram.data());
     int n_root_pixels = 0;
     int n_root_labels = 0;
     normalize_histogram_32(ctx->root_pixel_histogram.data(),
@@ -2501,13 +2834,24 @@ check_root_pixels_histogram(struct gm_rdt_context_impl* ctx,
                           hist_val);
 }
 
+static void
+check_root_pixels_histogram(struct gm_rdt_context_impl* ctx,
+                            struct node_data* root_node)
+{
+    gm_info(ctx->log, "Calculating root node pixel histogram");
+    ctx->root_pixel_histogram.resize(ctx->n_rdt_labels);
+    accumulate_pixels_histogram_32(ctx, root_node, ctx->root_pixel_histogram.data());
+
+    report_root_pixels_histogram(ctx);
+}
+
 struct depth_loader
 {
     struct gm_rdt_context_impl* ctx;
     uint64_t last_update;
     int full_width;
     int full_height;
-    std::vector<half> image_buf;
+    std::vector<std::vector<half>> image_bufs; // Per-thread
     struct bounds* body_bounds;
 };
 
@@ -2515,11 +2859,16 @@ static bool
 load_depth_buffers_cb(struct gm_data_index* data_index,
                       int index,
                       const char* frame_path,
+                      int thread_idx,
                       void* user_data,
                       char** err)
 {
     struct depth_loader* loader = (struct depth_loader*)user_data;
     struct gm_rdt_context_impl* ctx = loader->ctx;
+
+    if (!image_in_shard(ctx, index))
+        return true;
+
     int full_width = loader->full_width;
     int full_height = loader->full_height;
     struct bounds bounds = loader->body_bounds[index];
@@ -2535,7 +2884,8 @@ load_depth_buffers_cb(struct gm_data_index* data_index,
     xsnprintf(depth_filename, sizeof(depth_filename), "%s/depth/%s.exr",
               top_dir, frame_path);
 
-    void* tmp_buf = loader->image_buf.data();
+    std::vector<half> &image_buf = loader->image_bufs[thread_idx];
+    void* tmp_buf = image_buf.data();
     IUImageSpec depth_spec = { full_width, full_height, IU_FORMAT_HALF };
     if (iu_read_exr_from_file(depth_filename, &depth_spec,
                               &tmp_buf) != SUCCESS)
@@ -2544,7 +2894,7 @@ load_depth_buffers_cb(struct gm_data_index* data_index,
         return false;
     }
 
-    half* src = loader->image_buf.data();
+    half* src = image_buf.data();
     int src_width = loader->full_width;
     int16_t* dest = &ctx->depth_images[depth_meta.pixel_offset];
     for (int y = 0; y < cropped_height; y++) {
@@ -2574,13 +2924,355 @@ load_depth_buffers_cb(struct gm_data_index* data_index,
         }
     }
 
+    return true;
+}
+
+static void
+load_depth_buffers_complete_cb(struct gm_data_index* data_index,
+                               int index,
+                               void* user_data)
+{
+    struct depth_loader* loader = (struct depth_loader*)user_data;
+    struct gm_rdt_context_impl* ctx = loader->ctx;
+
     uint64_t current = get_time();
-    if (current - ctx->last_load_update > 2000000000) {
+    if (current - loader->last_update > 2000000000) {
         int percent = index * 100 / ctx->n_images;
         gm_info(ctx->log, "%3d%%", percent);
-        ctx->last_load_update = current;
+        loader->last_update = current;
+    }
+}
+
+/* Sampling pixels and loading/cropping all the depth images can take hours
+ * for large data sets, so the results are cached in a file that's mmapped
+ * by later runs with the same index, seed and n_pixels (allowing concurrent
+ * training runs to share the same page cache too).
+ *
+ * The file is laid out like:
+ *
+ *   struct training_cache_header
+ *   struct depth_meta depth_index[n_images]
+ *   struct pixel pixels[n_shard_images * n_pixels]
+ *   int16_t depth_images[n_depth_pixels]
+ *
+ * with each section aligned to TRAINING_CACHE_ALIGN bytes.
+ */
+#define TRAINING_CACHE_VERSION 3
+#define TRAINING_CACHE_ALIGN 4096
+
+struct training_cache_header {
+    char     tag[8];        // "RDTCACHE"
+    uint32_t version;
+    uint32_t header_size;
+
+    int32_t  seed;
+    int32_t  n_pixels;
+    int32_t  n_images;
+    int32_t  width;
+    int32_t  height;
+    int32_t  n_rdt_labels;
+    uint64_t data_hash;     // Hash of the frame paths and label map
+
+    uint64_t depth_index_offset;
+    uint64_t pixels_offset;
+    uint64_t depth_offset;
+    uint64_t n_depth_pixels;
+    uint64_t file_size;
+};
+
+static inline uint64_t
+fnv1a_64(uint64_t hash, const void* data, size_t len)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* NB: the cache must be invalidated if the frames of the index or the label
+ * mapping change, since these affect the sampled pixels
+ */
+static uint64_t
+training_cache_data_hash(struct gm_rdt_context_impl* ctx,
+                         struct gm_data_index* data_index)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < ctx->n_images; i++) {
+        const char* frame_path = gm_data_index_get_frame_path(data_index, i);
+        hash = fnv1a_64(hash, frame_path, strlen(frame_path) + 1);
+    }
+    hash = fnv1a_64(hash, ctx->label_map, sizeof(ctx->label_map));
+
+    return hash;
+}
+
+static void
+training_cache_init_header(struct gm_rdt_context_impl* ctx,
+                           struct gm_data_index* data_index,
+                           int64_t n_depth_pixels,
+                           struct training_cache_header* header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->tag, "RDTCACHE", 8);
+    header->version = TRAINING_CACHE_VERSION;
+    header->header_size = sizeof(*header);
+    header->seed = ctx->seed;
+    header->n_pixels = ctx->n_pixels;
+    header->n_images = ctx->n_images;
+    header->width = gm_data_index_get_width(data_index);
+    header->height = gm_data_index_get_height(data_index);
+    header->n_rdt_labels = ctx->n_rdt_labels;
+    header->data_hash = training_cache_data_hash(ctx, data_index);
+    if (ctx->n_shards > 1) {
+        header->data_hash = fnv1a_64(header->data_hash, &ctx->shard_index,
+                                     sizeof(ctx->shard_index));
+        header->data_hash = fnv1a_64(header->data_hash, &ctx->n_shards,
+                                     sizeof(ctx->n_shards));
+    }
+
+#define ALIGN_CACHE_OFFSET(X) \
+    (((X) + TRAINING_CACHE_ALIGN - 1) & ~(uint64_t)(TRAINING_CACHE_ALIGN - 1))
+
+    uint64_t offset = ALIGN_CACHE_OFFSET(sizeof(*header));
+    header->depth_index_offset = offset;
+    offset = ALIGN_CACHE_OFFSET(offset + (uint64_t)ctx->n_images *
+                                sizeof(struct depth_meta));
+    header->pixels_offset = offset;
+    offset = ALIGN_CACHE_OFFSET(offset + (uint64_t)get_n_shard_images(ctx) *
+                                ctx->n_pixels * sizeof(struct pixel));
+    header->depth_offset = offset;
+    header->n_depth_pixels = n_depth_pixels;
+    header->file_size = offset + n_depth_pixels * sizeof(int16_t);
+
+#undef ALIGN_CACHE_OFFSET
+}
+
+static std::string
+training_cache_filename(struct gm_rdt_context_impl* ctx,
+                        struct gm_data_index* data_index)
+{
+    const char* dir = ctx->cache_dir ? ctx->cache_dir :
+        gm_data_index_get_top_dir(data_index);
+    char filename[512];
+
+    if (ctx->n_shards > 1) {
+        xsnprintf(filename, sizeof(filename),
+                  "%s/%s-seed%d-pixels%d-shard%dof%d.rdt-cache",
+                  dir, ctx->index_name, ctx->seed, ctx->n_pixels,
+                  ctx->shard_index, ctx->n_shards);
+    } else {
+        xsnprintf(filename, sizeof(filename), "%s/%s-seed%d-pixels%d.rdt-cache",
+                  dir, ctx->index_name, ctx->seed, ctx->n_pixels);
+    }
+
+    return std::string(filename);
+}
+
+/* Returns false if there's no valid cache, otherwise the depth index and
+ * pixels are copied out (since the pixels get split up and freed as nodes are
+ * trained) while ctx->depth_images points directly into the mapping.
+ */
+static bool
+load_training_cache(struct gm_rdt_context_impl* ctx,
+                    struct gm_data_index* data_index,
+                    struct pixel* root_pixels)
+{
+    std::string filename = training_cache_filename(ctx, data_index);
+
+    int fd = open(filename.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 ||
+        sb.st_size < (off_t)sizeof(struct training_cache_header))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        gm_warn(ctx->log, "Failed to map training data cache %s: %s",
+                filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct training_cache_header* header =
+        (struct training_cache_header*)map;
+    struct training_cache_header expected;
+    training_cache_init_header(ctx, data_index, header->n_depth_pixels,
+                               &expected);
+
+    if (memcmp(header, &expected, sizeof(expected)) != 0 ||
+        header->file_size != (uint64_t)sb.st_size)
+    {
+        gm_info(ctx->log, "Ignoring stale or incompatible training data cache %s",
+                filename.c_str());
+        munmap(map, sb.st_size);
+        return false;
+    }
+
+    uint8_t* base = (uint8_t*)map;
+
+    ctx->depth_index.resize(ctx->n_images);
+    memcpy(ctx->depth_index.data(), base + header->depth_index_offset,
+           ctx->n_images * sizeof(struct depth_meta));
+    memcpy(root_pixels, base + header->pixels_offset,
+           (size_t)get_n_shard_images(ctx) * ctx->n_pixels * sizeof(struct pixel));
+
+    ctx->depth_images = (int16_t*)(base + header->depth_offset);
+    ctx->cache_map = map;
+    ctx->cache_map_len = sb.st_size;
+
+    gm_info(ctx->log, "Mapped training data cache %s (%" PRIu64 " depth pixels)",
+            filename.c_str(), header->n_depth_pixels);
+
+    return true;
+}
+
+/* A failure to write a cache isn't considered fatal. We write to a temporary
+ * file first so that concurrent training runs never see a partial cache.
+ */
+static void
+save_training_cache(struct gm_rdt_context_impl* ctx,
+                    struct gm_data_index* data_index,
+                    struct pixel* root_pixels,
+                    int64_t n_depth_pixels)
+{
+    std::string filename = training_cache_filename(ctx, data_index);
+    char tmp_filename[512];
+    xsnprintf(tmp_filename, sizeof(tmp_filename), "%s.%d.tmp",
+              filename.c_str(), (int)getpid());
+
+    struct training_cache_header header;
+    training_cache_init_header(ctx, data_index, n_depth_pixels, &header);
+
+    FILE* fp = fopen(tmp_filename, "wb");
+    if (!fp) {
+        gm_warn(ctx->log, "Failed to create training data cache %s: %s",
+                tmp_filename, strerror(errno));
+        return;
+    }
+
+    struct {
+        uint64_t offset;
+        const void* data;
+        size_t len;
+    } sections[] = {
+        { 0, &header, sizeof(header) },
+        { header.depth_index_offset, ctx->depth_index.data(),
+          ctx->n_images * sizeof(struct depth_meta) },
+        { header.pixels_offset, root_pixels,
+          (size_t)get_n_shard_images(ctx) * ctx->n_pixels * sizeof(struct pixel) },
+        { header.depth_offset, ctx->depth_images,
+          (size_t)n_depth_pixels * sizeof(int16_t) },
+    };
+
+    bool ok = true;
+    for (int i = 0; i < (int)ARRAY_LEN(sections) && ok; i++) {
+        ok = (fseeko(fp, sections[i].offset, SEEK_SET) == 0 &&
+              fwrite(sections[i].data, 1, sections[i].len, fp) ==
+              sections[i].len);
+    }
+    if (fclose(fp) != 0)
+        ok = false;
+
+    if (!ok || rename(tmp_filename, filename.c_str()) != 0) {
+        gm_warn(ctx->log, "Failed to write training data cache %s: %s",
+                filename.c_str(), strerror(errno));
+        unlink(tmp_filename);
+        return;
+    }
+
+    gm_info(ctx->log, "Wrote training data cache %s", filename.c_str());
+}
+
+/* Samples pixels from the label images and loads the cropped depth images */
+static bool
+sample_training_data(struct gm_rdt_context_impl* ctx,
+                     struct gm_data_index* data_index,
+                     struct pixel* root_pixels,
+                     int64_t* n_depth_pixels_ret,
+                     char** err)
+{
+    struct bounds *body_bounds = (struct bounds*)xmalloc(ctx->n_images *
+                                                         sizeof(struct bounds));
+    if (!pre_process_label_images(ctx,
+                                  data_index,
+                                  root_pixels,
+                                  body_bounds,
+                                  err))
+    {
+        xfree(body_bounds);
+        return false;
+    }
+
+    ctx->depth_index.resize(ctx->n_images);
+
+    int max_width = gm_data_index_get_width(data_index);
+    int max_height = gm_data_index_get_height(data_index);
+    int64_t n_depth_pixels = 0;
+
+    for (int i = 0; i < ctx->n_images; i++) {
+        struct bounds bounds = body_bounds[i];
+
+        int width = bounds.max_x - bounds.min_x + 1;
+        int height = bounds.max_y - bounds.min_y + 1;
+
+        gm_assert(ctx->log, width <= max_width,
+                  "Bounded width (%d) > full width (%d)", width, max_width);
+        gm_assert(ctx->log, height <= max_height,
+                  "Bounded height (%d) > full height (%d)", height, max_height);
+
+        struct depth_meta meta;
+        meta.width = width;
+        meta.height = height;
+        meta.pixel_offset = n_depth_pixels;
+        ctx->depth_index[i] = meta;
+
+        n_depth_pixels += (width * height);
+    }
+
+    int64_t depth_size = n_depth_pixels * 2;
+    int64_t max_depth_size = (int64_t)max_width * max_height * ctx->n_images * 2;
+    gm_info(ctx->log, "Size of cropped depth data = %" PRIu64 " bytes, reduced from %" PRIu64 " (%d%% of original size)",
+            (int64_t)depth_size,
+            (int64_t)max_depth_size,
+            (int)((depth_size * 100 / max_depth_size)));
+
+    ctx->depth_images = (int16_t*)xmalloc(depth_size);
+
+    struct depth_loader loader;
+    loader.ctx = ctx;
+    loader.last_update = get_time();
+    loader.full_width = max_width;
+    loader.full_height = max_height;
+    loader.image_bufs.resize(ctx->n_threads);
+    for (auto &image_buf : loader.image_bufs)
+        image_buf = std::vector<half>(max_width * max_height);
+    loader.body_bounds = body_bounds;
+
+    gm_info(ctx->log, "Loading all depth buffers...");
+    if (!gm_data_index_foreach_parallel(data_index,
+                                        ctx->n_threads,
+                                        load_depth_buffers_cb,
+                                        load_depth_buffers_complete_cb,
+                                        &loader,
+                                        err))
+    {
+        xfree(body_bounds);
+        return false;
     }
 
+    xfree(body_bounds);
+
+    *n_depth_pixels_ret = n_depth_pixels;
+
     return true;
 }
 
@@ -2648,6 +3340,16 @@ load_training_data(struct gm_rdt_context_impl* ctx,
               "Can't handle training with more than %d pixels, but n_pixels * n_images = %" PRIu64,
               INT_MAX, (uint64_t)ctx->n_pixels * ctx->n_images);
 
+    ctx->data_hash = training_cache_data_hash(ctx, data_index);
+
+    /* The tree only grows as nodes are split, starting with an untrained
+     * root node (so we don't need to allocate a complete tree up front)
+     */
+    struct node root = {};
+    root.label_pr_idx = INT_MAX;
+    ctx->tree.clear();
+    ctx->tree.push_back(root);
+
     // Create the randomized sample points across all images that the decision
     // tree is going to learn to classify, and associate with a root node...
     //
@@ -2657,102 +3359,56 @@ load_training_data(struct gm_rdt_context_impl* ctx,
     //
     struct node_data root_node;
     root_node.id = 0;
-    root_node.pixels = (struct pixel*)xmalloc((size_t)ctx->n_images *
-                                              ctx->n_pixels *
-                                              sizeof(struct pixel));
+    root_node.depth = 0;
+    root_node.path = 0;
     root_node.n_pixels = ctx->n_images * ctx->n_pixels;
 
-    struct bounds *body_bounds = (struct bounds*)xmalloc(ctx->n_images *
-                                                         sizeof(struct bounds));
-    if (!pre_process_label_images(ctx,
-                                  data_index,
-                                  root_node.pixels,
-                                  body_bounds,
-                                  err))
-    {
-        xfree(root_node.pixels);
-        xfree(body_bounds);
-        return false;
-    }
-
-    ctx->depth_index.resize(ctx->n_images);
-
-    int max_width = gm_data_index_get_width(data_index);
-    int max_height = gm_data_index_get_height(data_index);
-    int64_t n_depth_pixels = 0;
-
-    for (int i = 0; i < ctx->n_images; i++) {
-        struct bounds bounds = body_bounds[i];
-
-        int width = bounds.max_x - bounds.min_x + 1;
-        int height = bounds.max_y - bounds.min_y + 1;
-
-        gm_assert(ctx->log, width <= max_width,
-                  "Bounded width (%d) > full width (%d)", width, max_width);
-        gm_assert(ctx->log, height <= max_height,
-                  "Bounded height (%d) > full height (%d)", height, max_height);
-
-        struct depth_meta meta;
-        meta.width = width;
-        meta.height = height;
-        meta.pixel_offset = n_depth_pixels;
-        ctx->depth_index[i] = meta;
-
-        n_depth_pixels += (width * height);
+    // A distributed training coordinator leaves loading images to workers
+    if (ctx->listen_address) {
+        gm_data_index_destroy(data_index);
+        root_node.pixels = NULL;
+        training_queue_add_node(ctx, root_node);
+        return true;
     }
 
-    int64_t depth_size = n_depth_pixels * 2;
-    int64_t max_depth_size = (int64_t)max_width * max_height * ctx->n_images * 2;
-    gm_info(ctx->log, "Size of cropped depth data = %" PRIu64 " bytes, reduced from %" PRIu64 " (%d%% of original size)",
-            (int64_t)depth_size,
-            (int64_t)max_depth_size,
-            (int)((depth_size * 100 / max_depth_size)));
-
-    ctx->depth_images = (int16_t*)xmalloc(depth_size);
-
-    struct depth_loader loader;
-    loader.ctx = ctx;
-    loader.last_update = get_time();
-    loader.full_width = max_width;
-    loader.full_height = max_height;
-    loader.image_buf = std::vector<half>(max_width * max_height);
-    loader.body_bounds = body_bounds;
+    /* Distributed training workers only sample the images in their shard */
+    root_node.n_pixels = get_n_shard_images(ctx) * ctx->n_pixels;
+    root_node.pixels = (struct pixel*)xmalloc((size_t)root_node.n_pixels *
+                                              sizeof(struct pixel));
 
-    gm_info(ctx->log, "Loading all depth buffers...");
-    if (!gm_data_index_foreach(data_index,
-                               load_depth_buffers_cb,
-                               &loader,
-                               err))
+    if (!ctx->training_cache ||
+        !load_training_cache(ctx, data_index, root_node.pixels))
     {
-        xfree(root_node.pixels);
-        xfree(body_bounds);
-        return false;
+        int64_t n_depth_pixels = 0;
+        if (!sample_training_data(ctx, data_index, root_node.pixels,
+                                  &n_depth_pixels, err))
+        {
+            xfree(root_node.pixels);
+            return false;
+        }
+
+        if (ctx->training_cache) {
+            save_training_cache(ctx, data_index, root_node.pixels,
+                                n_depth_pixels);
+        }
     }
 
     gm_data_index_destroy(data_index);
     data_index = NULL;
 
-    xfree(body_bounds);
-    body_bounds = NULL;
-
-    check_root_pixels_histogram(ctx, &root_node);
+    if (ctx->n_shards > 1) {
+        gm_info(ctx->log, "Training with shard %d of %d (%d pixels)",
+                ctx->shard_index, ctx->n_shards, root_node.n_pixels);
+    }
 
-    // Allocate memory to store the decision tree.
-    int n_tree_nodes = (1<<ctx->max_depth) - 1;
-    ctx->tree.resize(n_tree_nodes);
+    // Owned by ctx since nodes refer to ranges of the root pixels
+    ctx->pixels = root_node.pixels;
 
-    // Mark nodes in tree as unfinished, for checkpoint restoration
-    // Note: we still do this if we are reloading a tree, since it may
-    // be shallower than the total tree size.
-    for (int i = 0; i < (int)ctx->tree.size(); i++) {
-        ctx->tree[i].label_pr_idx = INT_MAX;
-    }
+    check_root_pixels_histogram(ctx, &root_node);
 
     if (ctx->reload) {
-        if (!reload_tree(ctx, ctx->reload, root_node, err)) {
-            xfree(root_node.pixels);
+        if (!reload_tree(ctx, ctx->reload, root_node, err))
             return false;
-        }
     } else {
         training_queue_add_node(ctx, root_node);
     }
@@ -2784,14 +3440,8 @@ debug_infer_pixel_label(struct gm_rdt_context_impl* ctx,
                                                  depth_mm,
                                                  half_depth_mm,
                                                  node.uvs_m);
-        /* NB: The nodes are arranged in breadth-first, left then
-         * right child order with the root node at index zero.
-         *
-         * In this case if you have an index for any particular node
-         * ('id' here) then 2 * id + 1 is the index for the left
-         * child and 2 * id + 2 is the index for the right child...
-         */
-        id = (gradient < node.t_mm) ? 2 * id + 1 : 2 * id + 2;
+        // NB: the right child is allocated immediately after the left child
+        id = (gradient < node.t_mm) ? node.left_id : node.left_id + 1;
         node = ctx->tree[id];
     }
 
@@ -2826,6 +3476,8 @@ debug_check_inference(struct gm_rdt_context_impl* ctx,
      */
     struct node_data root_node;
     root_node.id = 0;
+    root_node.depth = 0;
+    root_node.path = 0;
     root_node.pixels = (struct pixel*)xmalloc((size_t)ctx->n_images *
                                               ctx->n_pixels *
                                               sizeof(struct pixel));
@@ -2943,18 +3595,1216 @@ debug_check_inference(struct gm_rdt_context_impl* ctx,
     return true;
 }
 
-static float
-meter_range_to_pixelmeters(float fov_rad, int res_px, float meter_range)
-{
-    float field_size_at_1m = 2.0f * tanf(fov_rad / 2.0f);
-    float px_per_meter = (float)res_px / field_size_at_1m;
+/*
+ * Distributed training
+ *
+ * A coordinator (see the "listen" property) owns the training queue and the
+ * tree, while each worker (see the "coordinator" property) only loads a
+ * shard of the training images (every n_shards'th image, starting from
+ * shard_index) so that a data set doesn't need to fit in the memory of a
+ * single machine.
+ *
+ * For each node, the coordinator asks all the workers for the uv threshold
+ * bucket histograms of their share of the node's pixels, sums them to rank
+ * the possible splits and then tells the workers how to split their pixels.
+ * Since the histograms are summed exactly the tree is the same as one
+ * trained by a single process.
+ *
+ * Workers handle requests in order and the coordinator keeps a few nodes in
+ * flight so that workers can accumulate histograms for the next nodes while
+ * the coordinator is ranking.
+ *
+ * NB: messages are sent in host byte order so all processes must have the
+ * same endianness.
+ */
 
-    return meter_range * px_per_meter;
-}
+#define DIST_PROTOCOL_VERSION 1
+#define DIST_MAX_NODES_IN_FLIGHT 4
+#define DIST_CONNECT_RETRY_SECS 60
+
+// Only use multiple threads to accumulate histograms for larger nodes
+#define DIST_MIN_PARALLEL_SAMPLES (1<<18)
+
+enum dist_message_type {
+    DIST_MSG_HELLO = 1,     // worker -> coordinator: struct dist_hello
+    DIST_MSG_SETUP,         // coordinator -> worker: struct dist_setup
+    DIST_MSG_READY,         // worker -> coordinator: struct dist_ready
+    DIST_MSG_NODE,          // coordinator -> worker: struct dist_node
+    DIST_MSG_HISTOGRAMS,    // worker -> coordinator: struct dist_histograms
+    DIST_MSG_SPLIT,         // coordinator -> worker: struct dist_split
+    DIST_MSG_DROP,          // coordinator -> worker: struct dist_node
+    DIST_MSG_DONE,          // coordinator -> worker: (no payload)
+};
 
-bool
-gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
-{
+struct dist_message_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t len; // Length of the payload following the header
+};
+
+struct dist_hello {
+    char     tag[8]; // "RDTDIST\0"
+    uint32_t version;
+};
+
+/* The coordinator decides the hyperparameters that affect which pixels are
+ * sampled and which uvs and thresholds are tested
+ */
+struct dist_setup {
+    int32_t shard_index;
+    int32_t n_shards;
+    int32_t seed;
+    int32_t n_pixels;
+    int32_t n_uvs;
+    int32_t n_thresholds;
+    int32_t max_depth;
+    float   uv_range;
+    float   uv_power;
+    float   threshold_range;
+    float   threshold_power;
+};
+
+struct dist_ready {
+    int32_t  n_images;
+    int32_t  n_rdt_labels;
+    int32_t  n_thresholds;
+    int32_t  n_pixels;      // Number of root node pixels in this shard
+    uint64_t data_hash;     // See training_cache_data_hash()
+    uint64_t params_hash;   // See dist_params_hash()
+    uint32_t root_histogram[MAX_LABELS];
+};
+
+struct dist_node {
+    int32_t id;
+    int32_t depth;
+};
+
+enum {
+    DIST_HISTOGRAMS_NONE,   // No pixels in this shard reached the node
+    DIST_HISTOGRAMS_DENSE,  // uint32_t [n_uvs][n_thresholds + 1][n_labels]
+    DIST_HISTOGRAMS_PIXELS, // uint16_t bucket[n_uvs][n_pixels] followed by
+                            // uint8_t label[n_pixels], if that's smaller
+};
+
+// Followed by histograms, according to the encoding
+struct dist_histograms {
+    int32_t  id;
+    int32_t  n_pixels;
+    int32_t  encoding;
+    int32_t  reserved;
+    uint32_t histogram[MAX_LABELS]; // Label histogram for the node
+};
+
+struct dist_split {
+    int32_t id;
+    int32_t uv;
+    int32_t threshold;
+    int32_t left_id;    // The right child is left_id + 1
+    int32_t keep[2];    // Whether the left/right child will be trained
+};
+
+struct dist_coordinator {
+    std::vector<int> worker_fds;
+
+    // Label histograms for nodes in the training queue
+    std::unordered_map<int, std::vector<uint32_t>> node_histograms;
+
+    std::vector<std::vector<uint8_t>> replies; // Per-worker histograms
+    std::vector<uint32_t> uv_bucket_histograms; // Sum of all replies
+};
+
+static bool
+dist_write(int fd, const void* data, size_t len)
+{
+    const uint8_t* pos = (const uint8_t*)data;
+
+    while (len) {
+        ssize_t ret = send(fd, pos, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        pos += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+static bool
+dist_read(int fd, void* data, size_t len)
+{
+    uint8_t* pos = (uint8_t*)data;
+
+    while (len) {
+        ssize_t ret = recv(fd, pos, len, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        pos += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+static bool
+dist_send(struct gm_rdt_context_impl* ctx,
+          int fd,
+          uint32_t type,
+          const void* payload,
+          uint64_t len,
+          char** err)
+{
+    struct dist_message_header header = {};
+    header.type = type;
+    header.len = len;
+
+    if (!dist_write(fd, &header, sizeof(header)) ||
+        !dist_write(fd, payload, len))
+    {
+        gm_throw(ctx->log, err, "Failed to send distributed training message: %s",
+                 strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/* The largest payload either side can legitimately send: dense histograms
+ * (which are only sent when smaller than the per-pixel encoding) or one of
+ * the fixed size structs
+ */
+static uint64_t
+dist_max_message_size(struct gm_rdt_context_impl* ctx)
+{
+    uint64_t dense_size = (uint64_t)std::max(ctx->n_uvs, 0) *
+        (std::max(ctx->n_thresholds, 0) + 1) *
+        std::max(ctx->n_rdt_labels, 0) * sizeof(uint32_t);
+    uint64_t max_size = sizeof(struct dist_histograms) + dense_size;
+
+    max_size = std::max<uint64_t>(max_size, sizeof(struct dist_hello));
+    max_size = std::max<uint64_t>(max_size, sizeof(struct dist_setup));
+    max_size = std::max<uint64_t>(max_size, sizeof(struct dist_ready));
+    max_size = std::max<uint64_t>(max_size, sizeof(struct dist_node));
+    max_size = std::max<uint64_t>(max_size, sizeof(struct dist_split));
+
+    return max_size;
+}
+
+/* Returns the type of the next message, or 0 on failure */
+static uint32_t
+dist_recv(struct gm_rdt_context_impl* ctx,
+          int fd,
+          std::vector<uint8_t>& payload,
+          char** err)
+{
+    struct dist_message_header header;
+
+    if (!dist_read(fd, &header, sizeof(header))) {
+        gm_throw(ctx->log, err, "Lost distributed training connection");
+        return 0;
+    }
+
+    if (header.type == 0) {
+        gm_throw(ctx->log, err, "Spurious distributed training message type 0");
+        return 0;
+    }
+    if (header.len > dist_max_message_size(ctx)) {
+        gm_throw(ctx->log, err, "Spurious distributed training message length %" PRIu64,
+                 header.len);
+        return 0;
+    }
+
+    payload.resize(header.len);
+    if (!dist_read(fd, payload.data(), header.len)) {
+        gm_throw(ctx->log, err, "Lost distributed training connection");
+        return 0;
+    }
+
+    return header.type;
+}
+
+static bool
+dist_unpack(struct gm_rdt_context_impl* ctx,
+            std::vector<uint8_t>& payload,
+            void* data,
+            size_t size,
+            char** err)
+{
+    if (payload.size() != size) {
+        gm_throw(ctx->log, err, "Spurious distributed training message size %d (expected %d)",
+                 (int)payload.size(), (int)size);
+        return false;
+    }
+
+    memcpy(data, payload.data(), size);
+    return true;
+}
+
+static bool
+dist_recv_struct(struct gm_rdt_context_impl* ctx,
+                 int fd,
+                 uint32_t type,
+                 void* data,
+                 size_t size,
+                 char** err)
+{
+    std::vector<uint8_t> payload;
+
+    uint32_t recv_type = dist_recv(ctx, fd, payload, err);
+    if (!recv_type)
+        return false;
+    if (recv_type != type) {
+        gm_throw(ctx->log, err, "Unexpected distributed training message %u (expected %u)",
+                 recv_type, type);
+        return false;
+    }
+
+    return dist_unpack(ctx, payload, data, size, err);
+}
+
+static struct addrinfo*
+dist_resolve_address(struct gm_rdt_context_impl* ctx,
+                     const char* address,
+                     bool passive,
+                     char** err)
+{
+    const char* colon = strrchr(address, ':');
+    if (!colon || !colon[1]) {
+        gm_throw(ctx->log, err, "Expected a host:port address, not \"%s\"",
+                 address);
+        return NULL;
+    }
+    std::string host(address, colon - address);
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive)
+        hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo* res = NULL;
+    int ret = getaddrinfo(host.size() ? host.c_str() : NULL, colon + 1,
+                          &hints, &res);
+    if (ret != 0) {
+        gm_throw(ctx->log, err, "Failed to resolve \"%s\": %s",
+                 address, gai_strerror(ret));
+        return NULL;
+    }
+
+    return res;
+}
+
+// Requests are small so we don't want them delayed by Nagle's algorithm
+static void
+dist_set_nodelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Identifies the uvs and thresholds, which also depend on the camera
+ * intrinsics of the training data
+ */
+static uint64_t
+dist_params_hash(struct gm_rdt_context_impl* ctx)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = fnv1a_64(hash, ctx->uvs_m.data(),
+                    ctx->uvs_m.size() * sizeof(float));
+    hash = fnv1a_64(hash, ctx->thresholds_mm,
+                    ctx->n_thresholds * sizeof(int16_t));
+
+    return hash;
+}
+
+/* Calls part_cb(part, uv_start, uv_end) for n_parts ranges of uvs in
+ * parallel (with part 0 run by the calling thread)
+ */
+template<typename PartCallback>
+static void
+dist_foreach_uv_range(struct gm_rdt_context_impl* ctx,
+                      int n_parts,
+                      PartCallback part_cb)
+{
+    std::vector<std::thread> threads;
+
+    for (int i = 1; i < n_parts; i++) {
+        threads.push_back(std::thread(part_cb, i,
+                                      (int)((int64_t)i * ctx->n_uvs / n_parts),
+                                      (int)((int64_t)(i + 1) * ctx->n_uvs / n_parts)));
+    }
+    part_cb(0, 0, ctx->n_uvs / n_parts);
+
+    for (auto &thread : threads)
+        thread.join();
+}
+
+static bool
+dist_worker_connect(struct gm_rdt_context_impl* ctx, char** err)
+{
+    struct addrinfo* res = dist_resolve_address(ctx, ctx->coordinator,
+                                                false, // connect
+                                                err);
+    if (!res)
+        return false;
+
+    /* Allow workers to be started before the coordinator */
+    int fd = -1;
+    for (int i = 0; fd == -1 && i < DIST_CONNECT_RETRY_SECS; i++) {
+        if (i) {
+            if (i == 1) {
+                gm_info(ctx->log, "Waiting for coordinator at %s...",
+                        ctx->coordinator);
+            }
+            sleep(1);
+        }
+        for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd == -1)
+                continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        gm_throw(ctx->log, err, "Failed to connect to coordinator at %s: %s",
+                 ctx->coordinator, strerror(errno));
+        return false;
+    }
+    dist_set_nodelay(fd);
+    ctx->coordinator_fd = fd;
+
+    struct dist_hello hello = {};
+    memcpy(hello.tag, "RDTDIST", 8);
+    hello.version = DIST_PROTOCOL_VERSION;
+    if (!dist_send(ctx, fd, DIST_MSG_HELLO, &hello, sizeof(hello), err))
+        return false;
+
+    struct dist_setup setup;
+    if (!dist_recv_struct(ctx, fd, DIST_MSG_SETUP, &setup, sizeof(setup), err))
+        return false;
+
+    ctx->shard_index = setup.shard_index;
+    ctx->n_shards = setup.n_shards;
+    ctx->seed = setup.seed;
+    ctx->n_pixels = setup.n_pixels;
+    ctx->n_uvs = setup.n_uvs;
+    ctx->n_thresholds = setup.n_thresholds;
+    ctx->max_depth = setup.max_depth;
+    ctx->uv_range = setup.uv_range;
+    ctx->uv_power = setup.uv_power;
+    ctx->threshold_range = setup.threshold_range;
+    ctx->threshold_power = setup.threshold_power;
+
+    gm_info(ctx->log, "Connected to coordinator at %s as worker %d of %d",
+            ctx->coordinator, ctx->shard_index, ctx->n_shards);
+
+    return true;
+}
+
+/* Writes the histograms for a node's pixels, according to the encoding */
+static void
+dist_worker_accumulate(struct gm_rdt_context_impl* ctx,
+                       struct node_data* node_data,
+                       int encoding,
+                       uint8_t* data)
+{
+    int n_pixels = node_data->n_pixels;
+    size_t uv_histograms_size = (ctx->n_thresholds + 1) * ctx->n_rdt_labels;
+
+    int n_parts = std::min(ctx->n_threads, ctx->n_uvs);
+    if ((int64_t)n_pixels * ctx->n_uvs < DIST_MIN_PARALLEL_SAMPLES)
+        n_parts = 1;
+
+    if (encoding == DIST_HISTOGRAMS_PIXELS) {
+        uint8_t* labels = data + (size_t)ctx->n_uvs * n_pixels * sizeof(uint16_t);
+        for (int p = 0; p < n_pixels; p++)
+            labels[p] = node_data->pixels[p].label;
+    }
+
+    dist_foreach_uv_range(ctx, n_parts, [&](int part, int uv_start, int uv_end) {
+        struct thread_state* state = &ctx->thread_pool[part];
+
+        if (encoding == DIST_HISTOGRAMS_DENSE) {
+            uint32_t* histograms = (uint32_t*)data + uv_start * uv_histograms_size;
+            size_t len = (uv_end - uv_start) * uv_histograms_size;
+
+            if (n_pixels < UINT16_MAX) {
+                state->uv_bucket_histograms_16.clear();
+                state->uv_bucket_histograms_16.resize(len);
+            } else {
+                state->uv_bucket_histograms_32.clear();
+                state->uv_bucket_histograms_32.resize(len);
+            }
+            accumulate_uv_bucket_histograms(ctx, state, node_data,
+                                            uv_start, uv_end, n_parts);
+            if (n_pixels < UINT16_MAX) {
+                for (size_t i = 0; i < len; i++)
+                    histograms[i] = state->uv_bucket_histograms_16[i];
+            } else {
+                memcpy(histograms, state->uv_bucket_histograms_32.data(),
+                       len * sizeof(uint32_t));
+            }
+        } else {
+            uint16_t* buckets = (uint16_t*)data;
+            struct depth_meta* depth_index = ctx->depth_index.data();
+            uint16_t* threshold_buckets = ctx->threshold_buckets.data();
+
+            for (int p = 0; p < n_pixels; p++) {
+                struct pixel px = node_data->pixels[p];
+                struct depth_meta depth_meta = depth_index[px.i];
+                int16_t* depth_image = &ctx->depth_images[depth_meta.pixel_offset];
+                int16_t depth_mm = depth_image[px.y * depth_meta.width + px.x];
+
+                for (int c = uv_start; c < uv_end; c++) {
+                    int16_t gradient = sample_uv_gradient_mm(depth_image,
+                                                             depth_meta.width,
+                                                             depth_meta.height,
+                                                             px.x, px.y,
+                                                             depth_mm,
+                                                             depth_mm / 2,
+                                                             &ctx->uvs_m[4 * c]);
+                    buckets[(size_t)c * n_pixels + p] =
+                        threshold_buckets[(uint16_t)gradient];
+                }
+            }
+        }
+    });
+}
+
+static bool
+dist_worker_send_histograms(struct gm_rdt_context_impl* ctx,
+                            struct node_data* node_data,
+                            std::vector<uint8_t>& reply,
+                            char** err)
+{
+    int n_pixels = node_data->n_pixels;
+
+    struct dist_histograms header = {};
+    header.id = node_data->id;
+    header.n_pixels = n_pixels;
+    accumulate_pixels_histogram_32(ctx, node_data, header.histogram);
+
+    /* Histograms for small nodes are mostly empty, so in that case it's
+     * cheaper to send the bucket for each pixel
+     */
+    uint64_t dense_size = (uint64_t)ctx->n_uvs * (ctx->n_thresholds + 1) *
+        ctx->n_rdt_labels * sizeof(uint32_t);
+    uint64_t pixels_size = (uint64_t)n_pixels *
+        (ctx->n_uvs * sizeof(uint16_t) + sizeof(uint8_t));
+    uint64_t size = 0;
+    if (n_pixels == 0) {
+        header.encoding = DIST_HISTOGRAMS_NONE;
+    } else if (pixels_size < dense_size) {
+        header.encoding = DIST_HISTOGRAMS_PIXELS;
+        size = pixels_size;
+    } else {
+        header.encoding = DIST_HISTOGRAMS_DENSE;
+        size = dense_size;
+    }
+
+    reply.resize(sizeof(header) + size);
+    memcpy(reply.data(), &header, sizeof(header));
+    if (size) {
+        dist_worker_accumulate(ctx, node_data, header.encoding,
+                               reply.data() + sizeof(header));
+    }
+
+    if (interrupted) {
+        gm_throw(ctx->log, err, "Interrupted");
+        return false;
+    }
+
+    return dist_send(ctx, ctx->coordinator_fd, DIST_MSG_HISTOGRAMS,
+                     reply.data(), reply.size(), err);
+}
+
+static bool
+dist_worker_train(struct gm_rdt_context_impl* ctx, char** err)
+{
+    int fd = ctx->coordinator_fd;
+
+    // The pixels of each node we've been asked to train (in this shard)
+    std::unordered_map<int, struct node_data> nodes;
+
+    struct node_data root_node = ctx->train_queue.front();
+    ctx->train_queue.pop_front();
+    nodes[root_node.id] = root_node;
+
+    struct dist_ready ready = {};
+    ready.n_images = ctx->n_images;
+    ready.n_rdt_labels = ctx->n_rdt_labels;
+    ready.n_thresholds = ctx->n_thresholds;
+    ready.n_pixels = root_node.n_pixels;
+    ready.data_hash = ctx->data_hash;
+    ready.params_hash = dist_params_hash(ctx);
+    memcpy(ready.root_histogram, ctx->root_pixel_histogram.data(),
+           ctx->n_rdt_labels * sizeof(uint32_t));
+
+    bool ok = dist_send(ctx, fd, DIST_MSG_READY, &ready, sizeof(ready), err);
+    if (ok)
+        gm_info(ctx->log, "Waiting for work from coordinator...");
+
+    std::vector<uint8_t> payload;
+    std::vector<uint8_t> reply;
+    bool done = false;
+
+    while (ok && !done) {
+        struct dist_node request;
+        struct dist_split split;
+        uint32_t type = dist_recv(ctx, fd, payload, err);
+        std::unordered_map<int, struct node_data>::iterator iter;
+
+        switch (type) {
+        case 0:
+            ok = false;
+            break;
+        case DIST_MSG_NODE:
+            ok = dist_unpack(ctx, payload, &request, sizeof(request), err);
+            if (!ok)
+                break;
+            iter = nodes.find(request.id);
+            if (iter == nodes.end()) {
+                gm_throw(ctx->log, err, "Coordinator requested unknown node %d",
+                         request.id);
+                ok = false;
+                break;
+            }
+            ok = dist_worker_send_histograms(ctx, &iter->second, reply, err);
+            break;
+        case DIST_MSG_SPLIT:
+            ok = dist_unpack(ctx, payload, &split, sizeof(split), err);
+            if (!ok)
+                break;
+            iter = nodes.find(split.id);
+            if (iter == nodes.end() ||
+                split.uv < 0 || split.uv >= ctx->n_uvs ||
+                split.threshold < 0 || split.threshold >= ctx->n_thresholds)
+            {
+                gm_throw(ctx->log, err, "Spurious split of node %d", split.id);
+                ok = false;
+                break;
+            } else {
+                struct node_data node_data = iter->second;
+                int n_l_pixels = partition_pixels(ctx, &node_data,
+                                                  &ctx->uvs_m[4 * split.uv],
+                                                  ctx->thresholds_mm[split.threshold]);
+                nodes.erase(iter);
+
+                for (int i = 0; i < 2; i++) {
+                    if (!split.keep[i])
+                        continue;
+                    struct node_data child;
+                    child.id = split.left_id + i;
+                    child.depth = node_data.depth + 1;
+                    child.path = 2 * node_data.path + 1 + i;
+                    child.n_pixels = i ? node_data.n_pixels - n_l_pixels : n_l_pixels;
+                    child.pixels = node_data.pixels + (i ? n_l_pixels : 0);
+                    nodes[child.id] = child;
+                }
+            }
+            break;
+        case DIST_MSG_DROP:
+            ok = dist_unpack(ctx, payload, &request, sizeof(request), err);
+            if (!ok)
+                break;
+            iter = nodes.find(request.id);
+            if (iter == nodes.end()) {
+                gm_throw(ctx->log, err, "Coordinator dropped unknown node %d",
+                         request.id);
+                ok = false;
+                break;
+            }
+            nodes.erase(iter);
+            break;
+        case DIST_MSG_DONE:
+            done = true;
+            break;
+        default:
+            gm_throw(ctx->log, err, "Unexpected distributed training message %u",
+                     type);
+            ok = false;
+            break;
+        }
+    }
+
+    if (done)
+        gm_info(ctx->log, "Coordinator finished training");
+
+    return ok;
+}
+
+static bool
+dist_coordinator_send_all(struct gm_rdt_context_impl* ctx,
+                          struct dist_coordinator* coordinator,
+                          uint32_t type,
+                          const void* payload,
+                          uint64_t len,
+                          char** err)
+{
+    for (int fd : coordinator->worker_fds) {
+        if (!dist_send(ctx, fd, type, payload, len, err))
+            return false;
+    }
+
+    return true;
+}
+
+/* Tells any workers that are still connected to stop and then waits for them
+ * to hang up, so that a worker isn't left blocked sending histograms for a
+ * node that the coordinator is no longer going to read
+ */
+static void
+dist_coordinator_shutdown_workers(struct gm_rdt_context_impl* ctx,
+                                  struct dist_coordinator* coordinator)
+{
+    struct dist_message_header done = {};
+    done.type = DIST_MSG_DONE;
+
+    for (int fd : coordinator->worker_fds) {
+        if (dist_write(fd, &done, sizeof(done)))
+            shutdown(fd, SHUT_WR);
+    }
+
+    for (int fd : coordinator->worker_fds) {
+        uint8_t discard[4096];
+        ssize_t ret;
+        do {
+            ret = recv(fd, discard, sizeof(discard), 0);
+        } while (ret > 0 || (ret < 0 && errno == EINTR));
+        close(fd);
+    }
+    coordinator->worker_fds.clear();
+}
+
+static bool
+dist_coordinator_accept_workers(struct gm_rdt_context_impl* ctx,
+                                struct dist_coordinator* coordinator,
+                                char** err)
+{
+    struct addrinfo* res = dist_resolve_address(ctx, ctx->listen_address,
+                                                true, // passive
+                                                err);
+    if (!res)
+        return false;
+
+    int listen_fd = -1;
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (listen_fd == -1)
+            continue;
+        int one = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(listen_fd, ctx->n_workers) == 0)
+        {
+            break;
+        }
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (listen_fd == -1) {
+        gm_throw(ctx->log, err, "Failed to listen on %s: %s",
+                 ctx->listen_address, strerror(errno));
+        return false;
+    }
+
+    gm_info(ctx->log, "Waiting for %d workers to connect to %s...",
+            ctx->n_workers, ctx->listen_address);
+
+    struct dist_setup setup = {};
+    setup.n_shards = ctx->n_workers;
+    setup.seed = ctx->seed;
+    setup.n_pixels = ctx->n_pixels;
+    setup.n_uvs = ctx->n_uvs;
+    setup.n_thresholds = ctx->n_thresholds;
+    setup.max_depth = ctx->max_depth;
+    setup.uv_range = ctx->uv_range;
+    setup.uv_power = ctx->uv_power;
+    setup.threshold_range = ctx->threshold_range;
+    setup.threshold_power = ctx->threshold_power;
+
+    for (int i = 0; i < ctx->n_workers; i++) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            gm_throw(ctx->log, err, "Failed to accept worker connection: %s",
+                     strerror(errno));
+            close(listen_fd);
+            return false;
+        }
+        dist_set_nodelay(fd);
+        coordinator->worker_fds.push_back(fd);
+
+        struct dist_hello hello;
+        if (!dist_recv_struct(ctx, fd, DIST_MSG_HELLO,
+                              &hello, sizeof(hello), err))
+        {
+            close(listen_fd);
+            return false;
+        }
+        if (memcmp(hello.tag, "RDTDIST", 8) != 0 ||
+            hello.version != DIST_PROTOCOL_VERSION)
+        {
+            gm_throw(ctx->log, err, "Worker %d isn't compatible (protocol version %u, not %u)",
+                     i, hello.version, DIST_PROTOCOL_VERSION);
+            close(listen_fd);
+            return false;
+        }
+
+        setup.shard_index = i;
+        if (!dist_send(ctx, fd, DIST_MSG_SETUP, &setup, sizeof(setup), err)) {
+            close(listen_fd);
+            return false;
+        }
+        gm_info(ctx->log, "Worker %d connected", i);
+    }
+    close(listen_fd);
+
+    /* Double check that all the workers are training with the same data
+     * and are testing the same uvs and thresholds
+     */
+    uint64_t params_hash = dist_params_hash(ctx);
+    int64_t n_root_pixels = 0;
+    ctx->root_pixel_histogram.assign(ctx->n_rdt_labels, 0);
+    for (int i = 0; i < ctx->n_workers; i++) {
+        struct dist_ready ready;
+        if (!dist_recv_struct(ctx, coordinator->worker_fds[i], DIST_MSG_READY,
+                              &ready, sizeof(ready), err))
+        {
+            return false;
+        }
+        if (ready.n_images != ctx->n_images ||
+            ready.n_rdt_labels != ctx->n_rdt_labels ||
+            ready.data_hash != ctx->data_hash)
+        {
+            gm_throw(ctx->log, err, "Worker %d has inconsistent training data", i);
+            return false;
+        }
+        if (ready.n_thresholds != ctx->n_thresholds ||
+            ready.params_hash != params_hash)
+        {
+            gm_throw(ctx->log, err, "Worker %d has inconsistent uvs or thresholds", i);
+            return false;
+        }
+
+        n_root_pixels += ready.n_pixels;
+        for (int l = 0; l < ctx->n_rdt_labels; l++)
+            ctx->root_pixel_histogram[l] += ready.root_histogram[l];
+
+        gm_info(ctx->log, "Worker %d ready with %d pixels", i, ready.n_pixels);
+    }
+
+    if (n_root_pixels != (int64_t)ctx->n_images * ctx->n_pixels) {
+        gm_throw(ctx->log, err, "Workers have %" PRIi64 " pixels in total, not %d",
+                 n_root_pixels, ctx->n_images * ctx->n_pixels);
+        return false;
+    }
+
+    report_root_pixels_histogram(ctx);
+    coordinator->node_histograms[0] = ctx->root_pixel_histogram;
+    coordinator->replies.resize(ctx->n_workers);
+
+    return true;
+}
+
+static void
+dist_reduce_histograms(struct gm_rdt_context_impl* ctx,
+                       const uint8_t* reply,
+                       int uv_start,
+                       int uv_end,
+                       uint32_t* uv_bucket_histograms)
+{
+    const struct dist_histograms* header = (const struct dist_histograms*)reply;
+    const uint8_t* data = reply + sizeof(*header);
+    int n_labels = ctx->n_rdt_labels;
+    size_t uv_histograms_size = (ctx->n_thresholds + 1) * n_labels;
+
+    if (header->encoding == DIST_HISTOGRAMS_DENSE) {
+        const uint32_t* histograms = (const uint32_t*)data;
+        for (size_t i = uv_start * uv_histograms_size;
+             i < uv_end * uv_histograms_size;
+             i++)
+        {
+            uv_bucket_histograms[i] += histograms[i];
+        }
+    } else if (header->encoding == DIST_HISTOGRAMS_PIXELS) {
+        int n_pixels = header->n_pixels;
+        const uint16_t* buckets = (const uint16_t*)data;
+        const uint8_t* labels = data + (size_t)ctx->n_uvs * n_pixels * sizeof(uint16_t);
+
+        for (int c = uv_start; c < uv_end; c++) {
+            uint32_t* histograms = &uv_bucket_histograms[c * uv_histograms_size];
+            const uint16_t* uv_buckets = &buckets[(size_t)c * n_pixels];
+
+            for (int p = 0; p < n_pixels; p++)
+                histograms[uv_buckets[p] * n_labels + labels[p]]++;
+        }
+    }
+}
+
+static void
+dist_coordinator_count_node(struct gm_rdt_context_impl* ctx)
+{
+    ctx->n_nodes_trained++;
+    if (ctx->max_nodes && ctx->n_nodes_trained > ctx->max_nodes) {
+        if (ctx->verbose) {
+            gm_warn(ctx->log, "Interrupting - Maximum number of nodes (%d) reached",
+                    ctx->max_nodes);
+        }
+        interrupt_reason = "Max nodes trained";
+        interrupted = true;
+    }
+}
+
+/* For nodes with a single label, or at the maximum depth, we don't need any
+ * histograms from the workers
+ */
+static bool
+dist_coordinator_add_leaf(struct gm_rdt_context_impl* ctx,
+                          struct dist_coordinator* coordinator,
+                          struct node_data* node_data,
+                          char** err)
+{
+    std::vector<uint32_t>& histogram = coordinator->node_histograms[node_data->id];
+    float nhistogram[ctx->n_rdt_labels];
+    int n_pixels = 0;
+    int n_labels = 0;
+
+    normalize_histogram_32(histogram.data(), ctx->n_rdt_labels, nhistogram,
+                           &n_pixels, &n_labels);
+    add_leaf_node(ctx, node_data->id, nhistogram);
+    coordinator->node_histograms.erase(node_data->id);
+
+    struct dist_node drop = { node_data->id, node_data->depth };
+    if (!dist_coordinator_send_all(ctx, coordinator, DIST_MSG_DROP,
+                                   &drop, sizeof(drop), err))
+    {
+        return false;
+    }
+
+    dist_coordinator_count_node(ctx);
+
+    return true;
+}
+
+static bool
+dist_coordinator_process_node(struct gm_rdt_context_impl* ctx,
+                              struct dist_coordinator* coordinator,
+                              struct node_data* node_data,
+                              char** err)
+{
+    int n_workers = ctx->n_workers;
+    int n_labels = ctx->n_rdt_labels;
+    int n_thresholds = ctx->n_thresholds;
+    size_t uv_histograms_size = (n_thresholds + 1) * n_labels;
+    uint64_t dense_size = ctx->n_uvs * uv_histograms_size * sizeof(uint32_t);
+
+    uint32_t histogram[n_labels];
+    memset(histogram, 0, sizeof(histogram));
+    int n_pixels = 0;
+
+    for (int i = 0; i < n_workers; i++) {
+        std::vector<uint8_t>& reply = coordinator->replies[i];
+        uint32_t type = dist_recv(ctx, coordinator->worker_fds[i], reply, err);
+        if (!type)
+            return false;
+
+        struct dist_histograms* header = (struct dist_histograms*)reply.data();
+        uint64_t size = 0;
+        if (type == DIST_MSG_HISTOGRAMS && reply.size() >= sizeof(*header)) {
+            if (header->encoding == DIST_HISTOGRAMS_DENSE)
+                size = dense_size;
+            else if (header->encoding == DIST_HISTOGRAMS_PIXELS) {
+                size = (uint64_t)header->n_pixels *
+                    (ctx->n_uvs * sizeof(uint16_t) + sizeof(uint8_t));
+            }
+        }
+        if (type != DIST_MSG_HISTOGRAMS ||
+            reply.size() != sizeof(*header) + size ||
+            header->n_pixels < 0 ||
+            header->id != node_data->id)
+        {
+            gm_throw(ctx->log, err, "Spurious histograms for node %d from worker %d",
+                     node_data->id, i);
+            return false;
+        }
+
+        /* dist_reduce_histograms() indexes the histograms with the per-pixel
+         * buckets and labels so they have to be in range
+         */
+        if (header->encoding == DIST_HISTOGRAMS_PIXELS) {
+            const uint8_t* data = reply.data() + sizeof(*header);
+            size_t n_buckets = (size_t)ctx->n_uvs * header->n_pixels;
+            const uint16_t* buckets = (const uint16_t*)data;
+            const uint8_t* labels = data + n_buckets * sizeof(uint16_t);
+            bool valid = true;
+
+            for (size_t b = 0; b < n_buckets; b++)
+                valid &= buckets[b] <= n_thresholds;
+            for (int p = 0; p < header->n_pixels; p++)
+                valid &= labels[p] < n_labels;
+            if (!valid) {
+                gm_throw(ctx->log, err, "Spurious histograms for node %d from worker %d",
+                         node_data->id, i);
+                return false;
+            }
+        }
+
+        n_pixels += header->n_pixels;
+        for (int l = 0; l < n_labels; l++)
+            histogram[l] += header->histogram[l];
+    }
+
+    std::vector<uint32_t>& node_histogram =
+        coordinator->node_histograms[node_data->id];
+    if (n_pixels != node_data->n_pixels ||
+        memcmp(histogram, node_histogram.data(), sizeof(histogram)) != 0)
+    {
+        gm_throw(ctx->log, err, "Workers have inconsistent pixels for node %d",
+                 node_data->id);
+        return false;
+    }
+    coordinator->node_histograms.erase(node_data->id);
+
+    // Leave the node untrained if we've been interrupted
+    if (interrupted)
+        return true;
+
+    float nhistogram[n_labels];
+    int n_node_pixels = 0;
+    int n_node_labels = 0;
+    normalize_histogram_32(histogram, n_labels, nhistogram,
+                           &n_node_pixels, &n_node_labels);
+    float entropy = calculate_shannon_entropy(nhistogram, n_labels);
+
+    if (ctx->verbose) {
+        gm_info(ctx->log, "Processing node %d with %d pixels, depth=%d",
+                node_data->id, n_pixels, node_data->depth);
+    }
+
+    /* Sum and rank the histograms for ranges of uvs in parallel and then
+     * find the best split in the same way as process_node_shards_work_cb()
+     */
+    int n_parts = std::min(ctx->n_threads, ctx->n_uvs);
+    std::vector<struct node_shard_data> results(n_parts);
+    coordinator->uv_bucket_histograms.resize(ctx->n_uvs * uv_histograms_size);
+    uint32_t* uv_bucket_histograms = coordinator->uv_bucket_histograms.data();
+
+    dist_foreach_uv_range(ctx, n_parts, [&](int part, int uv_start, int uv_end) {
+        memset(&uv_bucket_histograms[uv_start * uv_histograms_size], 0,
+               (uv_end - uv_start) * uv_histograms_size * sizeof(uint32_t));
+        for (int i = 0; i < n_workers; i++) {
+            dist_reduce_histograms(ctx, coordinator->replies[i].data(),
+                                   uv_start, uv_end, uv_bucket_histograms);
+        }
+
+        std::vector<uint32_t> left_histograms(n_thresholds * n_labels);
+        std::vector<uint32_t> total_histogram(n_labels);
+        struct node_shard_data* shard_data = &results[part];
+        shard_data->best_gain = 0.f;
+
+        for (int c = uv_start; c < uv_end; c++) {
+            sum_bucket_histograms_32(&uv_bucket_histograms[c * uv_histograms_size],
+                                     n_thresholds, n_labels,
+                                     left_histograms.data(),
+                                     total_histogram.data());
+            rank_uv_thresholds(ctx, c, n_pixels, entropy,
+                               left_histograms.data(),
+                               total_histogram.data(),
+                               shard_data);
+        }
+    });
+
+    if (interrupted)
+        return true;
+
+    int best_uv = 0;
+    int best_threshold = 0;
+    int *n_lr_pixels = NULL;
+    float best_gain = 0.0;
+
+    for (int i = 0; i < n_parts; i++) {
+        struct node_shard_data* shard_data = &results[i];
+
+        if (shard_data->best_gain > best_gain) {
+            best_gain = shard_data->best_gain;
+            best_uv = shard_data->best_uv;
+            best_threshold = shard_data->best_threshold;
+            n_lr_pixels = shard_data->n_lr_pixels;
+        }
+    }
+
+    if (!best_gain) {
+        gm_info(ctx->log, "Failed to find a UV threshold combo with any gain");
+    }
+
+    if (best_gain > 0.f && (node_data->depth + 1) < ctx->max_depth)
+    {
+        // Recover the label histograms of the children for the best split
+        std::vector<uint32_t> left_histograms(n_thresholds * n_labels);
+        std::vector<uint32_t> lr_histograms[2];
+        lr_histograms[1].resize(n_labels);
+        sum_bucket_histograms_32(&uv_bucket_histograms[best_uv * uv_histograms_size],
+                                 n_thresholds, n_labels,
+                                 left_histograms.data(),
+                                 lr_histograms[1].data());
+        uint32_t* l_histogram =
+            &left_histograms[ctx->threshold_ranks[best_threshold] * n_labels];
+        lr_histograms[0].assign(l_histogram, l_histogram + n_labels);
+        for (int l = 0; l < n_labels; l++)
+            lr_histograms[1][l] -= lr_histograms[0][l];
+
+        struct node node = {};
+        memcpy(node.uvs_m, &ctx->uvs_m[4 * best_uv], sizeof(node.uvs_m));
+        node.t_mm = ctx->thresholds_mm[best_threshold];
+        node.label_pr_idx = 0;
+        add_split_node(ctx, node_data->id, &node);
+
+        struct dist_split split = {};
+        split.id = node_data->id;
+        split.uv = best_uv;
+        split.threshold = best_threshold;
+        split.left_id = node.left_id;
+
+        for (int i = 0; i < 2; i++) {
+            struct node_data child;
+            child.id = node.left_id + i;
+            child.depth = node_data->depth + 1;
+            child.path = 2 * node_data->path + 1 + i;
+            child.n_pixels = n_lr_pixels[i];
+            child.pixels = NULL;
+
+            size_t queue_len = ctx->train_queue.size();
+            training_queue_add_node(ctx, child);
+            split.keep[i] = ctx->train_queue.size() > queue_len;
+            if (split.keep[i])
+                coordinator->node_histograms[child.id] = lr_histograms[i];
+        }
+
+        if (!dist_coordinator_send_all(ctx, coordinator, DIST_MSG_SPLIT,
+                                       &split, sizeof(split), err))
+        {
+            return false;
+        }
+
+        if (ctx->verbose)
+        {
+            gm_info(ctx->log,
+                    "  Node (%u)\n"
+                    "    Gain: %f\n"
+                    "    U: (%f, %f)\n"
+                    "    V: (%f, %f)\n"
+                    "    T: %f\n"
+                    "  Queued left id=%d, right id=%d\n",
+                    node_data->id, best_gain,
+                    node.uvs_m[0], node.uvs_m[1],
+                    node.uvs_m[2], node.uvs_m[3],
+                    node.t_mm / 1000.0f,
+                    node.left_id,
+                    node.left_id + 1);
+        }
+    }
+    else
+    {
+        add_leaf_node(ctx, node_data->id, nhistogram);
+
+        struct dist_node drop = { node_data->id, node_data->depth };
+        if (!dist_coordinator_send_all(ctx, coordinator, DIST_MSG_DROP,
+                                       &drop, sizeof(drop), err))
+        {
+            return false;
+        }
+    }
+
+    dist_coordinator_count_node(ctx);
+
+    return true;
+}
+
+static bool
+dist_coordinator_train(struct gm_rdt_context_impl* ctx, char** err)
+{
+    struct dist_coordinator coordinator;
+
+    if (!dist_coordinator_accept_workers(ctx, &coordinator, err)) {
+        for (int fd : coordinator.worker_fds)
+            close(fd);
+        return false;
+    }
+
+    gm_info(ctx->log, "Beginning distributed training...\n");
+
+    bool ok = true;
+
+    std::deque<struct node_data> in_flight;
+    while (ok) {
+        while (ok && !interrupted &&
+               in_flight.size() < DIST_MAX_NODES_IN_FLIGHT &&
+               !ctx->train_queue.empty())
+        {
+            struct node_data node_data = ctx->train_queue.front();
+            ctx->train_queue.pop_front();
+
+            std::vector<uint32_t>& histogram =
+                coordinator.node_histograms[node_data.id];
+            int n_node_labels = 0;
+            for (uint32_t count : histogram)
+                n_node_labels += count ? 1 : 0;
+
+            if (n_node_labels > 1 && node_data.depth < ctx->max_depth - 1) {
+                struct dist_node request = { node_data.id, node_data.depth };
+                ok = dist_coordinator_send_all(ctx, &coordinator, DIST_MSG_NODE,
+                                               &request, sizeof(request), err);
+                in_flight.push_back(node_data);
+            } else {
+                ok = dist_coordinator_add_leaf(ctx, &coordinator, &node_data, err);
+            }
+        }
+
+        if (!ok || in_flight.empty())
+            break;
+
+        struct node_data node_data = in_flight.front();
+        in_flight.pop_front();
+        ok = dist_coordinator_process_node(ctx, &coordinator, &node_data, err);
+    }
+
+    /* Losing a worker is treated like an interruption, so the caller still
+     * saves the partially trained tree
+     */
+    if (!ok) {
+        interrupt_reason = "Lost distributed training worker";
+        interrupted = true;
+    }
+
+    dist_coordinator_shutdown_workers(ctx, &coordinator);
+
+    return ok;
+}
+
+static float
+meter_range_to_pixelmeters(float fov_rad, int res_px, float meter_range)
+{
+    float field_size_at_1m = 2.0f * tanf(fov_rad / 2.0f);
+    float px_per_meter = (float)res_px / field_size_at_1m;
+
+    return meter_range * px_per_meter;
+}
+
+bool
+gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
+{
     struct gm_rdt_context_impl* ctx = (struct gm_rdt_context_impl*)_ctx;
     int n_threads = ctx->n_threads;
 
@@ -2972,8 +4822,18 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
         gm_throw(ctx->log, err, "Index name not specified");
         return false;
     }
+    if (ctx->listen_address && ctx->coordinator) {
+        gm_throw(ctx->log, err, "Can't both listen for workers and connect to a coordinator");
+        return false;
+    }
+    if ((ctx->listen_address || ctx->coordinator) && ctx->reload) {
+        gm_throw(ctx->log, err, "Reloading a tree isn't supported with distributed training");
+        return false;
+    }
+
+    // Workers don't write the tree themselves
     const char* out_filename = ctx->out_filename;
-    if (!out_filename) {
+    if (!out_filename && !ctx->coordinator) {
         gm_throw(ctx->log, err, "Output filename not specified");
         return false;
     }
@@ -2986,6 +4846,14 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
 
     ctx->record = create_training_record(ctx);
 
+    /* A worker gets its shard and the hyperparameters that affect the
+     * training data from the coordinator
+     */
+    if (ctx->coordinator && !dist_worker_connect(ctx, err)) {
+        destroy_training_state(ctx);
+        return false;
+    }
+
     /* Loads label data, depth data and potentially loads a pre-existing
      * decision tree...
      */
@@ -3000,6 +4868,12 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
     JSON_Object* camera = json_object_get_object(json_object(ctx->data_meta), "camera");
     int camera_height = json_object_get_number(camera, "height");
 
+    if (ctx->n_thresholds % 2 == 0) {
+        gm_info(ctx->log, "Increasing N thresholds from %d to %d for symmetry around zero",
+                ctx->n_thresholds, ctx->n_thresholds + 1);
+        ctx->n_thresholds++;
+    }
+
     ctx->thresholds_mm = (int16_t*)xmalloc(ctx->n_thresholds * sizeof(int16_t));
 
     float range = powf(ctx->threshold_range, 1.f/ctx->threshold_power);
@@ -3010,6 +4884,7 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
             roundf(spowf(nth_threshold, ctx->threshold_power) * 1000.f);
         gm_info(ctx->log, "threshold: %f", ctx->thresholds_mm[n] / 1000.f);
     }
+    prepare_threshold_buckets(ctx);
 
     float uv_range_pm = meter_range_to_pixelmeters(ctx->fov,
                                                    camera_height,
@@ -3043,12 +4918,6 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
                 uvs[0]);
     }
 
-    if (ctx->n_thresholds % 2 == 0) {
-        gm_info(ctx->log, "Increasing N thresholds from %d to %d for symmetry around zero",
-                ctx->n_thresholds, ctx->n_thresholds + 1);
-        ctx->n_thresholds++;
-    }
-
     gm_info(ctx->log, "Initialising %u threads...\n", n_threads);
     ctx->thread_pool.resize(n_threads);
 
@@ -3060,34 +4929,62 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
         state->per_depth_metrics.resize(ctx->max_depth);
     }
 
-    /* This thread will effectively become thread 0 ... */
-    ctx->thread_pool[0].thread = pthread_self();
-    for (int i = 1; i < n_threads; i++) {
-        struct thread_state *state = &ctx->thread_pool[i];
+    if (ctx->coordinator) {
+        signal(SIGINT, sigint_handler);
+        bool ok = dist_worker_train(ctx, err);
+        destroy_training_state(ctx);
+        return ok;
+    }
 
-        if (pthread_create(&state->thread, NULL,
-                           worker_thread_cb, (void*)state) != 0)
-        {
-            gm_throw(ctx->log, err, "Error creating thread\n");
-            destroy_training_state(ctx);
-            return false;
+    /* If distributed training fails after it has started then the partially
+     * trained tree is still saved (like an interrupted training run) so
+     * that training can be resumed by reloading the tree
+     */
+    char* dist_err = NULL;
+
+    if (ctx->listen_address) {
+        signal(SIGINT, sigint_handler);
+        ctx->start = get_time();
+
+        if (!dist_coordinator_train(ctx, &dist_err)) {
+            if (!interrupted) {
+                gm_throw(ctx->log, err, "%s", dist_err);
+                xfree(dist_err);
+                destroy_training_state(ctx);
+                return false;
+            }
+            gm_error(ctx->log, "Distributed training failed: %s", dist_err);
         }
-    }
+    } else {
+        /* This thread will effectively become thread 0 ... */
+        ctx->thread_pool[0].thread = pthread_self();
+        for (int i = 1; i < n_threads; i++) {
+            struct thread_state *state = &ctx->thread_pool[i];
 
-    gm_info(ctx->log, "Beginning training...\n");
-    signal(SIGINT, sigint_handler);
-    ctx->start = get_time();
+            if (pthread_create(&state->thread, NULL,
+                               worker_thread_cb, (void*)state) != 0)
+            {
+                gm_throw(ctx->log, err, "Error creating thread\n");
+                destroy_training_state(ctx);
+                return false;
+            }
+        }
 
-    while (schedule_node_work(&ctx->thread_pool[0]))
-        ;
-    worker_thread_cb(&ctx->thread_pool[0]);
+        gm_info(ctx->log, "Beginning training...\n");
+        signal(SIGINT, sigint_handler);
+        ctx->start = get_time();
 
-    // NB: thread 0 is this thread...
-    for (int i = 1; i < n_threads; i++) {
-        struct thread_state *state = &ctx->thread_pool[i];
+        while (schedule_node_work(&ctx->thread_pool[0]))
+            ;
+        worker_thread_cb(&ctx->thread_pool[0]);
+
+        // NB: thread 0 is this thread...
+        for (int i = 1; i < n_threads; i++) {
+            struct thread_state *state = &ctx->thread_pool[i];
 
-        if (pthread_join(state->thread, NULL) != 0) {
-            gm_error(ctx->log, "Error joining thread, trying to continue...\n");
+            if (pthread_join(state->thread, NULL) != 0) {
+                gm_error(ctx->log, "Error joining thread, trying to continue...\n");
+            }
         }
     }
 
@@ -3138,6 +5035,7 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
                         out_filename,
                         err))
     {
+        xfree(dist_err);
         destroy_training_state(ctx);
         return false;
     }
@@ -3147,7 +5045,16 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
             format_duration_s16(duration, buf),
             interrupt_reason ?: "Done!");
 
-    if (ctx->debug_post_inference) {
+    if (dist_err) {
+        gm_throw(ctx->log, err, "%s", dist_err);
+        xfree(dist_err);
+        destroy_training_state(ctx);
+        return false;
+    }
+
+    if (ctx->debug_post_inference && ctx->listen_address) {
+        gm_warn(ctx->log, "Can't check inference after distributed training since the training data is sharded between workers");
+    } else if (ctx->debug_post_inference) {
         char* catch_err = NULL;
         if (!debug_check_inference(ctx, data_dir, index_name, &catch_err)) {
             gm_warn(ctx->log, "Failed to check inference after training: %s",
@@ -572,6 +572,9 @@ handle_context_event(struct glimpse_data *data, struct gm_event *event)
         gm_debug(data->log, "GM_EVENT_TRACKING_READY\n");
         data->tracking_ready = true;
         break;
+    case GM_EVENT_ASSETS_READY:
+        gm_debug(data->log, "GM_EVENT_ASSETS_READY\n");
+        break;
     }
 
     gm_context_event_free(event);
@@ -2630,6 +2630,16 @@ handle_context_event(Data *data, struct gm_event *event)
          */
         data->tracking_ready = true;
         break;
+    case GM_EVENT_ASSETS_READY:
+        if (event->assets_ready.success) {
+            char latency_s16[16];
+            format_duration_s16(gm_context_get_assets_ready_latency(data->ctx),
+                                latency_s16);
+            gm_info(data->log, "Skeletal tracking ready after %s", latency_s16);
+        } else {
+            gm_error(data->log, "Failed to load assets for skeletal tracking");
+        }
+        break;
     }
 
     gm_context_event_free(event);
@@ -3105,7 +3115,11 @@ viewer_init(Data *data)
         gm_error(data->log, "%s", open_err);
     }
 
-    data->ctx = gm_context_new(data->log, NULL);
+    /* Skeletal tracking can't start until the decision trees have loaded
+     * but we can already show the device stream and learn the background
+     * in the meantime...
+     */
+    data->ctx = gm_context_new_async(data->log, NULL);
 
     gm_context_set_event_callback(data->ctx, on_event_cb, data);
 
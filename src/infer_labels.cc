@@ -25,15 +25,31 @@
 
 #include <stdbool.h>
 #include <math.h>
-#include <thread>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 #include <system_error>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
 
 #include "infer_labels.h"
 #include "xalloc.h"
 #include "rdt_tree.h"
+#include "glimpse_cpu.h"
 
 
 typedef struct {
@@ -46,213 +62,3056 @@ typedef struct {
     int height;
     float* output;
     bool flip;
+    bool depth_u16_mm;
+    struct infer_labels_top_k* top_k_output; // (output is NULL if set)
+    const int* indices; // Only infer these pixels, if not NULL
+    int n_indices;
+    struct infer_labels_leaf_cache* leaf_cache; // (sparse inference only)
+    float probe_scale; // u,v offsets are scaled by this (e.g. 0.5 at half res)
+    std::atomic<int>* next_tile; // Shared between all threads
+    uint64_t* tile_ns; // Per-tile cost, if not NULL
+    const struct infer_crops* crops; // (infer_labels_batch() only)
+    float cascade_threshold; // Cascaded early exit if > 0
+    struct infer_labels_cascade_stats* cascade_stats; // Per-thread, if not NULL
 } InferThreadData;
 
+#define ARRAY_LEN(X) (sizeof(X)/sizeof(X[0]))
+
+#define INFER_CROP_CHUNK_SIZE 256
+
+struct infer_crops {
+    InferThreadData* crop_data; // per-crop state, shared by all threads
+    int n_crops;
+    const int* chunk_ends; // cumulative number of chunks up to each crop
+};
+
 typedef vector(int, 2) Int2D;
 
+struct infer_labels_worker {
+    struct infer_labels_pool* pool;
+    int idx;
+    std::thread thread;
+
+    uint64_t busy_ns;
+    uint64_t idle_ns;
+};
+
+struct infer_labels_pool {
+    struct gm_logger* log;
+
+    std::mutex lock;
+    std::condition_variable work_available_cond;
+    std::condition_variable work_complete_cond;
+
+    /* Bumped for each batch of work submitted so that workers can tell when
+     * there's something new to do...
+     */
+    uint64_t generation;
+    bool quit;
+
+    void (*work_cb)(void* userdata);
+    InferThreadData* work_data;
+
+    /* The completion barrier: counts down as workers finish their part of
+     * the current generation of work
+     */
+    int n_pending;
+
+    std::vector<infer_labels_worker> workers;
+
+    /* The time spent on each tile during the last (dense) run */
+    std::vector<uint64_t> tile_ns;
+
+    float cascade_threshold;
+    struct infer_labels_cascade_stats cascade_stats;
+};
+
+static uint64_t
+get_time_ns(void)
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
 static void
-infer_label_probs_cb(void* userdata)
+infer_labels_worker_run(struct infer_labels_worker* worker)
 {
-    InferThreadData* data = (InferThreadData*)userdata;
-    int n_threads = data->n_threads;
-    int thread_id = data->thread;
+    struct infer_labels_pool* pool = worker->pool;
+    uint64_t seen_generation = 0;
 
-    float* depth_image = (float*)data->depth_image;
-    int n_labels = data->forest[0]->header.n_labels;
+    std::unique_lock<std::mutex> scoped_lock(pool->lock);
 
-    float bg_depth = data->forest[0]->header.bg_depth;
-    int bg_label = data->forest[0]->header.bg_label;
+    while (true) {
+        uint64_t wait_start = get_time_ns();
+        pool->work_available_cond.wait(scoped_lock, [&]{
+            return pool->quit || pool->generation != seen_generation;
+        });
+        if (pool->quit)
+            break;
 
-    int width = data->width;
-    int height = data->height;
+        seen_generation = pool->generation;
+        void (*work_cb)(void* userdata) = pool->work_cb;
+        InferThreadData* data = &pool->work_data[worker->idx];
 
-    bool flip = data->flip;
+        scoped_lock.unlock();
 
-    uint8_t* flip_map = data->forest[0]->header.flip_map;
+        uint64_t work_start = get_time_ns();
+        work_cb(data);
+        uint64_t work_end = get_time_ns();
 
-    Node* tree_nodes[data->n_trees];
-    float* tree_pr_tables[data->n_trees];
-    for (int i = 0; i < data->n_trees; ++i)
+        scoped_lock.lock();
+
+        worker->idle_ns += work_start - wait_start;
+        worker->busy_ns += work_end - work_start;
+
+        if (--pool->n_pending == 0)
+            pool->work_complete_cond.notify_all();
+    }
+}
+
+/* Runs work_cb once per worker, with data[i] for worker i, and blocks until
+ * all workers have finished.
+ */
+static void
+infer_labels_pool_run(struct infer_labels_pool* pool,
+                      void (*work_cb)(void* userdata),
+                      InferThreadData* data)
+{
+    std::unique_lock<std::mutex> scoped_lock(pool->lock);
+
+    gm_assert(pool->log, pool->n_pending == 0,
+              "Spurious re-entrant use of label inference pool");
+
+    pool->work_cb = work_cb;
+    pool->work_data = data;
+    pool->n_pending = pool->workers.size();
+    pool->generation++;
+    pool->work_available_cond.notify_all();
+
+    pool->work_complete_cond.wait(scoped_lock, [&]{
+        return pool->n_pending == 0;
+    });
+
+    pool->work_cb = NULL;
+    pool->work_data = NULL;
+}
+
+struct infer_labels_pool*
+infer_labels_pool_new(struct gm_logger* log, int n_workers)
+{
+    struct infer_labels_pool* pool = new infer_labels_pool();
+
+    pool->log = log;
+    pool->generation = 0;
+    pool->quit = false;
+    pool->work_cb = NULL;
+    pool->work_data = NULL;
+    pool->n_pending = 0;
+    pool->cascade_threshold = 0;
+    pool->cascade_stats = {};
+
+    if (n_workers <= 0)
+        n_workers = std::max(1u, std::thread::hardware_concurrency());
+
+    /* NB: the workers refer to their entry in this vector so we mustn't
+     * resize it after starting any threads
+     */
+    pool->workers.resize(n_workers);
+    for (int i = 0; i < n_workers; i++) {
+        struct infer_labels_worker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->idx = i;
+        worker->busy_ns = 0;
+        worker->idle_ns = 0;
+    }
+
+    /* NB: work for a pool with a single worker is always run on the calling
+     * thread so we don't need to spawn a thread in that case
+     */
+    for (int i = 0; n_workers > 1 && i < n_workers; i++) {
+        struct infer_labels_worker* worker = &pool->workers[i];
+        try {
+            worker->thread = std::thread(infer_labels_worker_run, worker);
+        } catch (const std::system_error &e) {
+            gm_error(log,
+                     "Error creating label inference thread, limiting pool to %d workers: %s\n",
+                     i, e.what());
+            pool->workers.resize(i);
+            break;
+        }
+    }
+
+    if (pool->workers.size() == 0) {
+        delete pool;
+        return NULL;
+    }
+
+    return pool;
+}
+
+void
+infer_labels_pool_destroy(struct infer_labels_pool* pool)
+{
     {
-        RDTree* tree = data->forest[i];
-        tree_nodes[i] = tree->nodes;
-        tree_pr_tables[i] = tree->label_pr_tables;
+        std::lock_guard<std::mutex> scoped_lock(pool->lock);
+        pool->quit = true;
+        pool->work_available_cond.notify_all();
     }
 
-    for (int y = 0; y < height; y++) {
-        if (y % n_threads != thread_id)
+    for (auto &worker : pool->workers) {
+        if (!worker.thread.joinable())
             continue;
+        try {
+            worker.thread.join();
+        } catch (const std::system_error &e) {
+            gm_error(pool->log,
+                     "Error joining label inference thread (%s), trying to continue...\n",
+                     e.what());
+        }
+    }
+
+    delete pool;
+}
+
+int
+infer_labels_pool_get_n_workers(struct infer_labels_pool* pool)
+{
+    return pool->workers.size();
+}
 
-        for (int x = 0; x < width; x++) {
+void
+infer_labels_pool_get_worker_times(struct infer_labels_pool* pool,
+                                   int worker,
+                                   uint64_t* busy_ns,
+                                   uint64_t* idle_ns)
+{
+    std::lock_guard<std::mutex> scoped_lock(pool->lock);
 
-            int off = y * width + x;
+    gm_assert(pool->log, worker >= 0 && worker < (int)pool->workers.size(),
+              "Out of range label inference worker index %d", worker);
 
-            int out_pr_idx = off * n_labels;
-            float depth = depth_image[off];
+    *busy_ns = pool->workers[worker].busy_ns;
+    *idle_ns = pool->workers[worker].idle_ns;
+}
 
-            if (depth >= bg_depth) {
-                (data->output + out_pr_idx)[bg_label] += 1.f;
-                continue;
-            }
+void
+infer_labels_pool_reset_worker_times(struct infer_labels_pool* pool)
+{
+    std::lock_guard<std::mutex> scoped_lock(pool->lock);
 
-            Int2D pixel = { x, y };
-            for (int i = 0; i < data->n_trees; ++i)
-            {
-                Node *nodes = tree_nodes[i];
-                float* pr_tables = tree_pr_tables[i];
-                Node node = nodes[0];
-                int id = 0;
-
-                while (node.label_pr_idx == 0) {
-                    Int2D u, v;
-                    u = (Int2D){ (int)(pixel[0] + node.uv[0] / depth),
-                        (int)(pixel[1] + node.uv[1] / depth) };
-                    v = (Int2D){ (int)(pixel[0] + node.uv[2] / depth),
-                        (int)(pixel[1] + node.uv[3] / depth) };
-
-                    float upixel = (u[0] >= 0 && u[0] < (int)width &&
-                                    u[1] >= 0 && u[1] < (int)height) ?
-                        (float)depth_image[((u[1] * width) + u[0])] : bg_depth;
-                    float vpixel = (v[0] >= 0 && v[0] < (int)width &&
-                                    v[1] >= 0 && v[1] < (int)height) ?
-                        (float)depth_image[((v[1] * width) + v[0])] : bg_depth;
-
-                    float gradient = upixel - vpixel;
-
-                    /* NB: The nodes are arranged in breadth-first, left then
-                     * right child order with the root node at index zero.
-                     *
-                     * In this case if you have an index for any particular node
-                     * ('id' here) then 2 * id + 1 is the index for the left
-                     * child and 2 * id + 2 is the index for the right child...
-                     */
-                    id = (gradient < node.t) ? 2 * id + 1 : 2 * id + 2;
-
-                    node = nodes[id];
-                }
+    for (auto &worker : pool->workers) {
+        worker.busy_ns = 0;
+        worker.idle_ns = 0;
+    }
+}
 
-                /* NB: node->label_pr_idx is a base-one index since index zero
-                 * is reserved to indicate that the node is not a leaf node
-                 */
-                float* pr_table = &pr_tables[(node.label_pr_idx - 1) * n_labels];
-                float* out_pr_table = &data->output[out_pr_idx];
-                for (int n = 0; n < n_labels; ++n) {
-                    out_pr_table[n] += pr_table[n];
-                }
+bool
+infer_labels_pool_get_tile_stats(struct infer_labels_pool* pool,
+                                 struct infer_labels_tile_stats* stats)
+{
+    std::vector<uint64_t> sorted;
+    {
+        std::lock_guard<std::mutex> scoped_lock(pool->lock);
+        sorted = pool->tile_ns;
+    }
 
-                if (flip) {
-                    int id = 0;
-                    Node node = nodes[0];
-
-                    while (node.label_pr_idx == 0) {
-                        Int2D u, v;
-                        u = (Int2D){ (int)(pixel[0] - node.uv[0] / depth),
-                            (int)(pixel[1] + node.uv[1] / depth) };
-                        v = (Int2D){ (int)(pixel[0] - node.uv[2] / depth),
-                            (int)(pixel[1] + node.uv[3] / depth) };
-
-                        float upixel = (u[0] >= 0 && u[0] < (int)width &&
-                                        u[1] >= 0 && u[1] < (int)height) ?
-                            (float)depth_image[((u[1] * width) + u[0])] : bg_depth;
-                        float vpixel = (v[0] >= 0 && v[0] < (int)width &&
-                                        v[1] >= 0 && v[1] < (int)height) ?
-                            (float)depth_image[((v[1] * width) + v[0])] : bg_depth;
-
-                        float gradient = upixel - vpixel;
-
-                        /* NB: The nodes are arranged in breadth-first, left then
-                         * right child order with the root node at index zero.
-                         *
-                         * In this case if you have an index for any particular node
-                         * ('id' here) then 2 * id + 1 is the index for the left
-                         * child and 2 * id + 2 is the index for the right child...
-                         */
-                        id = (gradient < node.t) ? 2 * id + 1 : 2 * id + 2;
-
-                        node = nodes[id];
-                    }
+    int n_tiles = sorted.size();
+    if (!n_tiles)
+        return false;
 
-                    /* NB: node->label_pr_idx is a base-one index since index zero
-                     * is reserved to indicate that the node is not a leaf node
-                     */
-                    float* pr_table = &pr_tables[(node.label_pr_idx - 1) * n_labels];
-                    float* out_pr_table = &data->output[out_pr_idx];
-                    for (int n = 0; n < n_labels; ++n) {
-                        out_pr_table[flip_map[n]] += pr_table[n];
-                    }
-                }
-            }
+    std::sort(sorted.begin(), sorted.end());
+
+    uint64_t total_ns = 0;
+    for (uint64_t ns : sorted)
+        total_ns += ns;
+
+    stats->tile_size = INFER_TILE_SIZE;
+    stats->n_tiles = n_tiles;
+    stats->total_ns = total_ns;
+    stats->mean_ns = total_ns / n_tiles;
+    stats->median_ns = sorted[n_tiles / 2];
+    stats->p95_ns = sorted[std::min(n_tiles - 1, (n_tiles * 95) / 100)];
+    stats->max_ns = sorted[n_tiles - 1];
+
+    return true;
+}
+
+void
+infer_labels_pool_set_cascade_threshold(struct infer_labels_pool* pool,
+                                        float threshold)
+{
+    std::lock_guard<std::mutex> scoped_lock(pool->lock);
+    pool->cascade_threshold = threshold;
+}
+
+void
+infer_labels_pool_get_cascade_stats(struct infer_labels_pool* pool,
+                                    struct infer_labels_cascade_stats* stats)
+{
+    std::lock_guard<std::mutex> scoped_lock(pool->lock);
+    *stats = pool->cascade_stats;
+}
+
+void
+infer_labels_pool_reset_cascade_stats(struct infer_labels_pool* pool)
+{
+    std::lock_guard<std::mutex> scoped_lock(pool->lock);
+    pool->cascade_stats = {};
+}
+
+/* Adds the per-thread stats of a run to the pool's totals */
+static void
+infer_labels_pool_add_cascade_stats(struct infer_labels_pool* pool,
+                                    const struct infer_labels_cascade_stats* stats,
+                                    int n_threads)
+{
+    std::lock_guard<std::mutex> scoped_lock(pool->lock);
+    for (int i = 0; i < n_threads; i++) {
+        pool->cascade_stats.n_pixels += stats[i].n_pixels;
+        pool->cascade_stats.n_trees_evaluated += stats[i].n_trees_evaluated;
+        pool->cascade_stats.n_early_exits += stats[i].n_early_exits;
+    }
+}
+
+static float
+infer_labels_pool_get_cascade_threshold(struct infer_labels_pool* pool)
+{
+    if (!pool)
+        return 0;
+
+    std::lock_guard<std::mutex> scoped_lock(pool->lock);
+    return pool->cascade_threshold;
+}
+
+/* Label inference traverses each tree for a batch of (up to
+ * INFER_MAX_BATCH) foreground pixels at a time so that SIMD kernels can
+ * advance multiple pixels through the same tree level together.
+ *
+ * Every kernel must produce bit-identical results to the scalar kernel, which
+ * is the reference implementation. In particular the u,v sample coordinates
+ * must be calculated as (int)((float)x + uv / depth) with the same rounding
+ * and the same handling of out-of-bounds samples.
+ */
+#define INFER_MAX_BATCH 8
+
+struct infer_batch {
+    int n;
+    int x[INFER_MAX_BATCH];
+    int y[INFER_MAX_BATCH];
+    float depth[INFER_MAX_BATCH]; // divided by probe_scale (u,v divisor)
+};
+
+/* Writes the (1-based) label_pr_idx of the leaf reached by each pixel in
+ * the batch. If @flip is true then the x components of the u,v offsets are
+ * negated, equivalent to traversing the tree with a horizontally mirrored
+ * image.
+ */
+typedef void (*infer_traverse_batch_func)(const Node* nodes,
+                                          const float* depth_image,
+                                          int width,
+                                          int height,
+                                          float bg_depth,
+                                          const struct infer_batch* batch,
+                                          bool flip,
+                                          uint32_t* leaves_out);
+
+template<bool flip>
+static void
+traverse_batch_scalar_tmpl(const Node* nodes,
+                           const float* depth_image,
+                           int width,
+                           int height,
+                           float bg_depth,
+                           const struct infer_batch* batch,
+                           uint32_t* leaves_out)
+{
+    for (int i = 0; i < batch->n; i++) {
+        Int2D pixel = { batch->x[i], batch->y[i] };
+        float depth = batch->depth[i];
+        Node node = nodes[0];
+        int id = 0;
 
-            float divider = (float)
-                (flip ? data->n_trees * 2 : data->n_trees);
-            for (int n = 0; n < n_labels; ++n) {
-                (data->output + out_pr_idx)[n] /= divider;
+        while (node.label_pr_idx == 0) {
+            Int2D u, v;
+            if (flip) {
+                u = (Int2D){ (int)(pixel[0] - node.uv[0] / depth),
+                    (int)(pixel[1] + node.uv[1] / depth) };
+                v = (Int2D){ (int)(pixel[0] - node.uv[2] / depth),
+                    (int)(pixel[1] + node.uv[3] / depth) };
+            } else {
+                u = (Int2D){ (int)(pixel[0] + node.uv[0] / depth),
+                    (int)(pixel[1] + node.uv[1] / depth) };
+                v = (Int2D){ (int)(pixel[0] + node.uv[2] / depth),
+                    (int)(pixel[1] + node.uv[3] / depth) };
             }
+
+            float upixel = (u[0] >= 0 && u[0] < (int)width &&
+                            u[1] >= 0 && u[1] < (int)height) ?
+                (float)depth_image[((u[1] * width) + u[0])] : bg_depth;
+            float vpixel = (v[0] >= 0 && v[0] < (int)width &&
+                            v[1] >= 0 && v[1] < (int)height) ?
+                (float)depth_image[((v[1] * width) + v[0])] : bg_depth;
+
+            float gradient = upixel - vpixel;
+
+            /* NB: The nodes are arranged in depth-first pre-order with the
+             * root node at index zero, so the left child of any particular
+             * node ('id' here) is at id + 1 while the right child is at
+             * node.right_idx...
+             */
+            id = (gradient < node.t) ? id + 1 : node.right_idx;
+
+            node = nodes[id];
         }
+
+        leaves_out[i] = node.label_pr_idx;
     }
 }
 
-float*
-infer_labels(struct gm_logger* log,
-             RDTree** forest,
-             int n_trees,
-             float* depth_image,
-             int width, int height,
-             float* out_labels,
-             bool use_threads,
-             bool do_flip)
+static void
+traverse_batch_scalar(const Node* nodes,
+                      const float* depth_image,
+                      int width,
+                      int height,
+                      float bg_depth,
+                      const struct infer_batch* batch,
+                      bool flip,
+                      uint32_t* leaves_out)
 {
-    int n_labels = (int)forest[0]->header.n_labels;
-    size_t output_size = width * height * n_labels * sizeof(float);
-    float* output_pr = out_labels;
+    if (flip) {
+        traverse_batch_scalar_tmpl<true>(nodes, depth_image, width, height,
+                                         bg_depth, batch, leaves_out);
+    } else {
+        traverse_batch_scalar_tmpl<false>(nodes, depth_image, width, height,
+                                          bg_depth, batch, leaves_out);
+    }
+}
 
-    gm_assert(log, output_pr != NULL, "NULL output buffer for label probabilities");
+/* With flipping enabled each tree is also traversed with its mirrored nodes
+ * (see rdt_tree_prepare_mirrored()). Walking both trees for the same pixels
+ * together gives two independent chains of dependent loads that can be in
+ * flight at the same time.
+ *
+ * NB: the mirrored nodes are traversed without flipping.
+ */
+typedef void (*infer_traverse_batch_pair_func)(const Node* nodes,
+                                               const Node* mirrored_nodes,
+                                               const float* depth_image,
+                                               int width,
+                                               int height,
+                                               float bg_depth,
+                                               const struct infer_batch* batch,
+                                               uint32_t* leaves_out,
+                                               uint32_t* mirrored_leaves_out);
 
-    memset(output_pr, 0, output_size);
+static inline int
+traverse_node_scalar(const Node& node, int id,
+                     int x, int y, float depth,
+                     const float* depth_image,
+                     int width, int height, float bg_depth)
+{
+    Int2D u = { (int)(x + node.uv[0] / depth), (int)(y + node.uv[1] / depth) };
+    Int2D v = { (int)(x + node.uv[2] / depth), (int)(y + node.uv[3] / depth) };
 
-    void (*infer_labels_callback)(void* userdata);
-    infer_labels_callback = infer_label_probs_cb;
+    float upixel = (u[0] >= 0 && u[0] < width && u[1] >= 0 && u[1] < height) ?
+        depth_image[u[1] * width + u[0]] : bg_depth;
+    float vpixel = (v[0] >= 0 && v[0] < width && v[1] >= 0 && v[1] < height) ?
+        depth_image[v[1] * width + v[0]] : bg_depth;
 
-    int n_threads = std::thread::hardware_concurrency();
-    if (!use_threads || n_threads <= 1)
-    {
-        InferThreadData data = {
-            0, 1, forest, n_trees,
-            (void*)depth_image, width, height, output_pr, do_flip
-        };
-        infer_labels_callback((void*)(&data));
-    }
-    else
-    {
-        std::thread threads[n_threads];
-        InferThreadData data[n_threads];
+    float gradient = upixel - vpixel;
 
-        for (int i = 0; i < n_threads; ++i)
+    return (gradient < node.t) ? id + 1 : node.right_idx;
+}
+
+static void
+traverse_batch_pair_scalar(const Node* nodes,
+                           const Node* mirrored_nodes,
+                           const float* depth_image,
+                           int width,
+                           int height,
+                           float bg_depth,
+                           const struct infer_batch* batch,
+                           uint32_t* leaves_out,
+                           uint32_t* mirrored_leaves_out)
+{
+    for (int i = 0; i < batch->n; i++) {
+        int x = batch->x[i];
+        int y = batch->y[i];
+        float depth = batch->depth[i];
+        int id = 0;
+        int mirrored_id = 0;
+
+        while (nodes[id].label_pr_idx == 0 ||
+               mirrored_nodes[mirrored_id].label_pr_idx == 0)
         {
-            data[i] = { i, n_threads, forest, n_trees,
-                (void*)depth_image, width, height, output_pr, do_flip };
-            try {
-                threads[i] = std::thread(infer_labels_callback,
-                                         (void*)(&data[i]));
-            } catch (const std::system_error &e) {
-                gm_error(log,
-                         "Error creating thread, results will be incomplete: %s\n",
-                         e.what());
-                n_threads = i;
-                break;
+            if (nodes[id].label_pr_idx == 0) {
+                id = traverse_node_scalar(nodes[id], id, x, y, depth,
+                                          depth_image, width, height,
+                                          bg_depth);
+            }
+            if (mirrored_nodes[mirrored_id].label_pr_idx == 0) {
+                mirrored_id = traverse_node_scalar(mirrored_nodes[mirrored_id],
+                                                   mirrored_id, x, y, depth,
+                                                   depth_image, width, height,
+                                                   bg_depth);
             }
         }
 
-        for (int i = 0; i < n_threads; ++i)
-        {
-            try {
-                threads[i].join();
-            } catch (const std::system_error &e) {
-                gm_error(log, "Error joining thread (%s), trying to continue...\n",
-                         e.what());
+        leaves_out[i] = nodes[id].label_pr_idx;
+        mirrored_leaves_out[i] = mirrored_nodes[mirrored_id].label_pr_idx;
+    }
+}
+
+/* As above but for trees using the cache-blocked (v7) NodeCluster layout */
+typedef void (*infer_traverse_clusters_func)(const NodeCluster* clusters,
+                                             const float* depth_image,
+                                             int width,
+                                             int height,
+                                             float bg_depth,
+                                             const struct infer_batch* batch,
+                                             bool flip,
+                                             uint32_t* leaves_out);
+
+template<bool flip>
+static void
+traverse_clusters_scalar_tmpl(const NodeCluster* clusters,
+                              const float* depth_image,
+                              int width,
+                              int height,
+                              float bg_depth,
+                              const struct infer_batch* batch,
+                              uint32_t* leaves_out)
+{
+    for (int i = 0; i < batch->n; i++) {
+        Int2D pixel = { batch->x[i], batch->y[i] };
+        float depth = batch->depth[i];
+        const NodeCluster* cluster = &clusters[0];
+        const CompactNode* node = &cluster->nodes[0];
+        int slot = 0;
+
+        while (node->label_pr_idx == 0) {
+            float uv[4] = {
+                rdt_half_to_float(node->uv[0]),
+                rdt_half_to_float(node->uv[1]),
+                rdt_half_to_float(node->uv[2]),
+                rdt_half_to_float(node->uv[3]),
+            };
+            Int2D u, v;
+            if (flip) {
+                u = (Int2D){ (int)(pixel[0] - uv[0] / depth),
+                    (int)(pixel[1] + uv[1] / depth) };
+                v = (Int2D){ (int)(pixel[0] - uv[2] / depth),
+                    (int)(pixel[1] + uv[3] / depth) };
+            } else {
+                u = (Int2D){ (int)(pixel[0] + uv[0] / depth),
+                    (int)(pixel[1] + uv[1] / depth) };
+                v = (Int2D){ (int)(pixel[0] + uv[2] / depth),
+                    (int)(pixel[1] + uv[3] / depth) };
+            }
+
+            float upixel = (u[0] >= 0 && u[0] < (int)width &&
+                            u[1] >= 0 && u[1] < (int)height) ?
+                (float)depth_image[((u[1] * width) + u[0])] : bg_depth;
+            float vpixel = (v[0] >= 0 && v[0] < (int)width &&
+                            v[1] >= 0 && v[1] < (int)height) ?
+                (float)depth_image[((v[1] * width) + v[0])] : bg_depth;
+
+            float gradient = upixel - vpixel;
+            bool left = gradient < rdt_half_to_float(node->t);
+
+            /* The root of each cluster leads to one of its two children
+             * within the same cluster, and those children lead to the root
+             * of another cluster...
+             */
+            if (slot == 0) {
+                slot = left ? 1 : 2;
+            } else {
+                cluster = &clusters[cluster->children[(slot - 1) * 2 +
+                                                      (left ? 0 : 1)]];
+                slot = 0;
             }
+            node = &cluster->nodes[slot];
+        }
+
+        leaves_out[i] = node->label_pr_idx;
+    }
+}
+
+static void
+traverse_clusters_scalar(const NodeCluster* clusters,
+                         const float* depth_image,
+                         int width,
+                         int height,
+                         float bg_depth,
+                         const struct infer_batch* batch,
+                         bool flip,
+                         uint32_t* leaves_out)
+{
+    if (flip) {
+        traverse_clusters_scalar_tmpl<true>(clusters, depth_image,
+                                            width, height, bg_depth,
+                                            batch, leaves_out);
+    } else {
+        traverse_clusters_scalar_tmpl<false>(clusters, depth_image,
+                                             width, height, bg_depth,
+                                             batch, leaves_out);
+    }
+}
+
+/* The SIMD kernels below view each 32 byte Node as 8 x 32bit words so that
+ * individual members can be gathered based on a node index...
+ */
+#define NODE_WORDS       8
+#define NODE_WORD_U_X    0
+#define NODE_WORD_U_Y    1
+#define NODE_WORD_V_X    2
+#define NODE_WORD_V_Y    3
+#define NODE_WORD_T      4
+#define NODE_WORD_IDX    5
+#define NODE_WORD_RIGHT  6
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INFER_HAVE_X86_KERNELS 1
+#include <immintrin.h>
+
+struct avx2_batch_lanes {
+    __m256 pxf;
+    __m256 pyf;
+    __m256 depth;
+    __m256i valid;
+};
+
+__attribute__((target("avx2"))) static inline struct avx2_batch_lanes
+load_batch_avx2(const struct infer_batch* batch)
+{
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    struct avx2_batch_lanes lanes;
+
+    __m256i n_v = _mm256_set1_epi32(batch->n);
+    lanes.valid = _mm256_cmpgt_epi32(n_v, lane);
+
+    __m256i px = _mm256_maskload_epi32(batch->x, lanes.valid);
+    __m256i py = _mm256_maskload_epi32(batch->y, lanes.valid);
+    lanes.pxf = _mm256_cvtepi32_ps(px);
+    lanes.pyf = _mm256_cvtepi32_ps(py);
+    /* NB: give padding lanes a harmless non-zero depth */
+    lanes.depth = _mm256_blendv_ps(_mm256_set1_ps(1.f),
+                                   _mm256_maskload_ps(batch->depth, lanes.valid),
+                                   _mm256_castsi256_ps(lanes.valid));
+
+    return lanes;
+}
+
+/* Moves each active lane one level down the tree and deactivates lanes that
+ * reach a leaf
+ */
+__attribute__((target("avx2"))) static inline void
+traverse_level_avx2(const Node* nodes,
+                    const float* depth_image,
+                    int width,
+                    int height,
+                    float bg_depth,
+                    const struct avx2_batch_lanes& lanes,
+                    bool flip,
+                    __m256i* id_inout,
+                    __m256i* active_inout)
+{
+    const float* node_words = (const float*)nodes;
+    const int* node_iwords = (const int*)nodes;
+
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i width_v = _mm256_set1_epi32(width);
+    const __m256i height_v = _mm256_set1_epi32(height);
+    const __m256 bg_v = _mm256_set1_ps(bg_depth);
+
+    __m256 pxf = lanes.pxf;
+    __m256 pyf = lanes.pyf;
+    __m256 depth = lanes.depth;
+    __m256i id = *id_inout;
+    __m256i active = *active_inout;
+
+    __m256i word = _mm256_slli_epi32(id, 3); // * NODE_WORDS
+
+    __m256 ux = _mm256_i32gather_ps(node_words + NODE_WORD_U_X, word, 4);
+    __m256 uy = _mm256_i32gather_ps(node_words + NODE_WORD_U_Y, word, 4);
+    __m256 vx = _mm256_i32gather_ps(node_words + NODE_WORD_V_X, word, 4);
+    __m256 vy = _mm256_i32gather_ps(node_words + NODE_WORD_V_Y, word, 4);
+    __m256 t = _mm256_i32gather_ps(node_words + NODE_WORD_T, word, 4);
+    __m256i right = _mm256_i32gather_epi32(node_iwords + NODE_WORD_RIGHT, word, 4);
+
+    __m256 uxf, vxf;
+    if (flip) {
+        uxf = _mm256_sub_ps(pxf, _mm256_div_ps(ux, depth));
+        vxf = _mm256_sub_ps(pxf, _mm256_div_ps(vx, depth));
+    } else {
+        uxf = _mm256_add_ps(pxf, _mm256_div_ps(ux, depth));
+        vxf = _mm256_add_ps(pxf, _mm256_div_ps(vx, depth));
+    }
+    __m256i u0 = _mm256_cvttps_epi32(uxf);
+    __m256i u1 = _mm256_cvttps_epi32(_mm256_add_ps(pyf, _mm256_div_ps(uy, depth)));
+    __m256i v0 = _mm256_cvttps_epi32(vxf);
+    __m256i v1 = _mm256_cvttps_epi32(_mm256_add_ps(pyf, _mm256_div_ps(vy, depth)));
+
+    __m256i u_in = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpgt_epi32(u0, _mm256_set1_epi32(-1)),
+                         _mm256_cmpgt_epi32(width_v, u0)),
+        _mm256_and_si256(_mm256_cmpgt_epi32(u1, _mm256_set1_epi32(-1)),
+                         _mm256_cmpgt_epi32(height_v, u1)));
+    __m256i v_in = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpgt_epi32(v0, _mm256_set1_epi32(-1)),
+                         _mm256_cmpgt_epi32(width_v, v0)),
+        _mm256_and_si256(_mm256_cmpgt_epi32(v1, _mm256_set1_epi32(-1)),
+                         _mm256_cmpgt_epi32(height_v, v1)));
+    u_in = _mm256_and_si256(u_in, active);
+    v_in = _mm256_and_si256(v_in, active);
+
+    __m256i u_off = _mm256_add_epi32(_mm256_mullo_epi32(u1, width_v), u0);
+    __m256i v_off = _mm256_add_epi32(_mm256_mullo_epi32(v1, width_v), v0);
+
+    __m256 upixel = _mm256_mask_i32gather_ps(bg_v, depth_image, u_off,
+                                             _mm256_castsi256_ps(u_in), 4);
+    __m256 vpixel = _mm256_mask_i32gather_ps(bg_v, depth_image, v_off,
+                                             _mm256_castsi256_ps(v_in), 4);
+
+    __m256 gradient = _mm256_sub_ps(upixel, vpixel);
+    __m256i left = _mm256_castps_si256(_mm256_cmp_ps(gradient, t, _CMP_LT_OQ));
+
+    /* The left child is the next node, in pre-order */
+    __m256i child = _mm256_blendv_epi8(right, _mm256_add_epi32(id, one), left);
+    id = _mm256_blendv_epi8(id, child, active);
+
+    __m256i label_pr_idx =
+        _mm256_mask_i32gather_epi32(zero, node_iwords + NODE_WORD_IDX,
+                                    _mm256_slli_epi32(id, 3), active, 4);
+    active = _mm256_and_si256(active, _mm256_cmpeq_epi32(label_pr_idx, zero));
+
+    *id_inout = id;
+    *active_inout = active;
+}
+
+__attribute__((target("avx2"))) static void
+traverse_batch_avx2(const Node* nodes,
+                    const float* depth_image,
+                    int width,
+                    int height,
+                    float bg_depth,
+                    const struct infer_batch* batch,
+                    bool flip,
+                    uint32_t* leaves_out)
+{
+    struct avx2_batch_lanes lanes = load_batch_avx2(batch);
+
+    __m256i id = _mm256_setzero_si256();
+
+    /* NB: the root of a depth-1 tree is a leaf, in which case no lanes
+     * need to be traversed
+     */
+    __m256i active = nodes[0].label_pr_idx ? _mm256_setzero_si256() : lanes.valid;
+
+    while (!_mm256_testz_si256(active, active)) {
+        traverse_level_avx2(nodes, depth_image, width, height, bg_depth,
+                            lanes, flip, &id, &active);
+    }
+
+    uint32_t ids[8];
+    _mm256_storeu_si256((__m256i*)ids, id);
+    for (int i = 0; i < batch->n; i++)
+        leaves_out[i] = nodes[ids[i]].label_pr_idx;
+}
+
+__attribute__((target("avx2"))) static void
+traverse_batch_pair_avx2(const Node* nodes,
+                         const Node* mirrored_nodes,
+                         const float* depth_image,
+                         int width,
+                         int height,
+                         float bg_depth,
+                         const struct infer_batch* batch,
+                         uint32_t* leaves_out,
+                         uint32_t* mirrored_leaves_out)
+{
+    struct avx2_batch_lanes lanes = load_batch_avx2(batch);
+
+    __m256i id = _mm256_setzero_si256();
+    __m256i mirrored_id = _mm256_setzero_si256();
+    __m256i active = nodes[0].label_pr_idx ? _mm256_setzero_si256() : lanes.valid;
+    __m256i mirrored_active =
+        mirrored_nodes[0].label_pr_idx ? _mm256_setzero_si256() : lanes.valid;
+
+    while (!_mm256_testz_si256(_mm256_or_si256(active, mirrored_active),
+                               _mm256_or_si256(active, mirrored_active)))
+    {
+        traverse_level_avx2(nodes, depth_image, width, height, bg_depth,
+                            lanes, false, &id, &active);
+        traverse_level_avx2(mirrored_nodes, depth_image, width, height,
+                            bg_depth, lanes, false,
+                            &mirrored_id, &mirrored_active);
+    }
+
+    uint32_t ids[8];
+    uint32_t mirrored_ids[8];
+    _mm256_storeu_si256((__m256i*)ids, id);
+    _mm256_storeu_si256((__m256i*)mirrored_ids, mirrored_id);
+    for (int i = 0; i < batch->n; i++) {
+        leaves_out[i] = nodes[ids[i]].label_pr_idx;
+        mirrored_leaves_out[i] = mirrored_nodes[mirrored_ids[i]].label_pr_idx;
+    }
+}
+
+/* Each 64 byte NodeCluster is viewed as 16 x 32bit words, with 4 words per
+ * CompactNode followed by 4 words of child cluster indices...
+ */
+#define CLUSTER_WORDS           16
+#define CLUSTER_WORD_CHILDREN   12
+#define COMPACT_NODE_WORDS      4
+#define COMPACT_NODE_WORD_U     0
+#define COMPACT_NODE_WORD_V     1
+#define COMPACT_NODE_WORD_T     2
+#define COMPACT_NODE_WORD_IDX   3
+
+/* Equivalent to rdt_half_to_float() for the low 16 bits of each lane */
+__attribute__((target("avx2"))) static inline __m256
+half_to_float_avx2(__m256i h)
+{
+    __m256i mag = _mm256_slli_epi32(
+        _mm256_and_si256(h, _mm256_set1_epi32(0x7fff)), 13);
+    __m256i sign = _mm256_slli_epi32(
+        _mm256_and_si256(h, _mm256_set1_epi32(0x8000)), 16);
+    __m256 f = _mm256_mul_ps(_mm256_castsi256_ps(mag),
+                             _mm256_castsi256_ps(
+                                 _mm256_set1_epi32((127 + 112) << 23)));
+    return _mm256_or_ps(f, _mm256_castsi256_ps(sign));
+}
+
+__attribute__((target("avx2"))) static void
+traverse_clusters_avx2(const NodeCluster* clusters,
+                       const float* depth_image,
+                       int width,
+                       int height,
+                       float bg_depth,
+                       const struct infer_batch* batch,
+                       bool flip,
+                       uint32_t* leaves_out)
+{
+    if (clusters[0].nodes[0].label_pr_idx != 0) {
+        for (int i = 0; i < batch->n; i++)
+            leaves_out[i] = clusters[0].nodes[0].label_pr_idx;
+        return;
+    }
+
+    const int* words = (const int*)clusters;
+
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i width_v = _mm256_set1_epi32(width);
+    const __m256i height_v = _mm256_set1_epi32(height);
+    const __m256 bg_v = _mm256_set1_ps(bg_depth);
+    const __m256i lo16 = _mm256_set1_epi32(0xffff);
+
+    __m256i n_v = _mm256_set1_epi32(batch->n);
+    __m256i valid = _mm256_cmpgt_epi32(n_v, lane);
+
+    __m256i px = _mm256_maskload_epi32(batch->x, valid);
+    __m256i py = _mm256_maskload_epi32(batch->y, valid);
+    __m256 pxf = _mm256_cvtepi32_ps(px);
+    __m256 pyf = _mm256_cvtepi32_ps(py);
+    /* NB: give padding lanes a harmless non-zero depth */
+    __m256 depth = _mm256_blendv_ps(_mm256_set1_ps(1.f),
+                                    _mm256_maskload_ps(batch->depth, valid),
+                                    _mm256_castsi256_ps(valid));
+
+    /* Each lane tracks the word index of its current node, which implies
+     * both the cluster (word / CLUSTER_WORDS) and the node's slot within
+     * the cluster ((word % CLUSTER_WORDS) / COMPACT_NODE_WORDS)
+     */
+    __m256i node_word = zero;
+    __m256i active = valid;
+
+    while (!_mm256_testz_si256(active, active)) {
+        __m256i w_u = _mm256_i32gather_epi32(words + COMPACT_NODE_WORD_U,
+                                             node_word, 4);
+        __m256i w_v = _mm256_i32gather_epi32(words + COMPACT_NODE_WORD_V,
+                                             node_word, 4);
+        __m256i w_t = _mm256_i32gather_epi32(words + COMPACT_NODE_WORD_T,
+                                             node_word, 4);
+
+        __m256 ux = half_to_float_avx2(_mm256_and_si256(w_u, lo16));
+        __m256 uy = half_to_float_avx2(_mm256_srli_epi32(w_u, 16));
+        __m256 vx = half_to_float_avx2(_mm256_and_si256(w_v, lo16));
+        __m256 vy = half_to_float_avx2(_mm256_srli_epi32(w_v, 16));
+        __m256 t = half_to_float_avx2(_mm256_and_si256(w_t, lo16));
+
+        __m256 uxf, vxf;
+        if (flip) {
+            uxf = _mm256_sub_ps(pxf, _mm256_div_ps(ux, depth));
+            vxf = _mm256_sub_ps(pxf, _mm256_div_ps(vx, depth));
+        } else {
+            uxf = _mm256_add_ps(pxf, _mm256_div_ps(ux, depth));
+            vxf = _mm256_add_ps(pxf, _mm256_div_ps(vx, depth));
         }
+        __m256i u0 = _mm256_cvttps_epi32(uxf);
+        __m256i u1 = _mm256_cvttps_epi32(_mm256_add_ps(pyf, _mm256_div_ps(uy, depth)));
+        __m256i v0 = _mm256_cvttps_epi32(vxf);
+        __m256i v1 = _mm256_cvttps_epi32(_mm256_add_ps(pyf, _mm256_div_ps(vy, depth)));
+
+        __m256i u_in = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(u0, _mm256_set1_epi32(-1)),
+                             _mm256_cmpgt_epi32(width_v, u0)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(u1, _mm256_set1_epi32(-1)),
+                             _mm256_cmpgt_epi32(height_v, u1)));
+        __m256i v_in = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(v0, _mm256_set1_epi32(-1)),
+                             _mm256_cmpgt_epi32(width_v, v0)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(v1, _mm256_set1_epi32(-1)),
+                             _mm256_cmpgt_epi32(height_v, v1)));
+        u_in = _mm256_and_si256(u_in, active);
+        v_in = _mm256_and_si256(v_in, active);
+
+        __m256i u_off = _mm256_add_epi32(_mm256_mullo_epi32(u1, width_v), u0);
+        __m256i v_off = _mm256_add_epi32(_mm256_mullo_epi32(v1, width_v), v0);
+
+        __m256 upixel = _mm256_mask_i32gather_ps(bg_v, depth_image, u_off,
+                                                 _mm256_castsi256_ps(u_in), 4);
+        __m256 vpixel = _mm256_mask_i32gather_ps(bg_v, depth_image, v_off,
+                                                 _mm256_castsi256_ps(v_in), 4);
+
+        __m256 gradient = _mm256_sub_ps(upixel, vpixel);
+        /* All ones (-1) for true */
+        __m256i left = _mm256_castps_si256(_mm256_cmp_ps(gradient, t, _CMP_LT_OQ));
+
+        __m256i base = _mm256_andnot_si256(_mm256_set1_epi32(CLUSTER_WORDS - 1),
+                                           node_word);
+        __m256i slot = _mm256_srli_epi32(
+            _mm256_and_si256(node_word, _mm256_set1_epi32(CLUSTER_WORDS - 1)), 2);
+        __m256i at_root = _mm256_cmpeq_epi32(slot, zero);
+
+        /* From the root: nodes[1] (word 4) or nodes[2] (word 8) */
+        __m256i root_next = _mm256_add_epi32(
+            base, _mm256_add_epi32(_mm256_set1_epi32(2 * COMPACT_NODE_WORDS),
+                                   _mm256_slli_epi32(left, 2)));
+
+        /* From nodes[1] or nodes[2]: children[(slot - 1) * 2 + (left ? 0 : 1)] */
+        __m256i child_word = _mm256_add_epi32(
+            _mm256_add_epi32(base, _mm256_set1_epi32(CLUSTER_WORD_CHILDREN - 1)),
+            _mm256_add_epi32(_mm256_add_epi32(slot, slot), left));
+        __m256i child = _mm256_mask_i32gather_epi32(
+            zero, words, child_word, _mm256_andnot_si256(at_root, active), 4);
+        __m256i child_next = _mm256_slli_epi32(child, 4); // * CLUSTER_WORDS
+
+        __m256i next = _mm256_blendv_epi8(child_next, root_next, at_root);
+        node_word = _mm256_blendv_epi8(node_word, next, active);
+
+        __m256i label_pr_idx =
+            _mm256_mask_i32gather_epi32(zero, words + COMPACT_NODE_WORD_IDX,
+                                        node_word, active, 4);
+        active = _mm256_and_si256(active, _mm256_cmpeq_epi32(label_pr_idx, zero));
     }
 
-    return output_pr;
+    uint32_t node_words[8];
+    _mm256_storeu_si256((__m256i*)node_words, node_word);
+    for (int i = 0; i < batch->n; i++)
+        leaves_out[i] = (uint32_t)words[node_words[i] + COMPACT_NODE_WORD_IDX];
+}
+
+/* Without a gather instruction it's not worthwhile advancing multiple pixels
+ * together with SSE, so instead we process one pixel at a time and use SIMD
+ * to calculate all four components of the u,v sample coordinates at once.
+ */
+__attribute__((target("sse4.1"))) static void
+traverse_batch_sse41(const Node* nodes,
+                     const float* depth_image,
+                     int width,
+                     int height,
+                     float bg_depth,
+                     const struct infer_batch* batch,
+                     bool flip,
+                     uint32_t* leaves_out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bounds = _mm_setr_epi32(width, height, width, height);
+
+    for (int i = 0; i < batch->n; i++) {
+        __m128 pxy = _mm_cvtepi32_ps(_mm_setr_epi32(batch->x[i], batch->y[i],
+                                                    batch->x[i], batch->y[i]));
+        __m128 depth = _mm_set1_ps(batch->depth[i]);
+        int id = 0;
+        const Node* node = &nodes[0];
+
+        while (node->label_pr_idx == 0) {
+            __m128 offset = _mm_div_ps(_mm_load_ps((const float*)node), depth);
+
+            /* NB: _addsub_ps() subtracts the even (x) components and adds
+             * the odd (y) components which is just what we need for
+             * mirroring the x offsets
+             */
+            __m128 uv_f = flip ? _mm_addsub_ps(pxy, offset) :
+                                 _mm_add_ps(pxy, offset);
+            __m128i uv = _mm_cvttps_epi32(uv_f);
+
+            __m128i in_bounds = _mm_andnot_si128(_mm_cmplt_epi32(uv, zero),
+                                                 _mm_cmplt_epi32(uv, bounds));
+            int in_mask = _mm_movemask_ps(_mm_castsi128_ps(in_bounds));
+
+            alignas(16) int uvi[4];
+            _mm_store_si128((__m128i*)uvi, uv);
+
+            float upixel = ((in_mask & 0x3) == 0x3) ?
+                depth_image[uvi[1] * width + uvi[0]] : bg_depth;
+            float vpixel = ((in_mask & 0xc) == 0xc) ?
+                depth_image[uvi[3] * width + uvi[2]] : bg_depth;
+
+            float gradient = upixel - vpixel;
+
+            id = (gradient < node->t) ? id + 1 : node->right_idx;
+            node = &nodes[id];
+        }
+
+        leaves_out[i] = node->label_pr_idx;
+    }
+}
+#endif // x86
+
+/* NB: we depend on vdivq_f32() and vmaxvq_u32() which are only available
+ * for AArch64
+ */
+#if defined(__aarch64__)
+#define INFER_HAVE_NEON_KERNEL 1
+#include <arm_neon.h>
+
+static void
+traverse_batch_neon(const Node* nodes,
+                    const float* depth_image,
+                    int width,
+                    int height,
+                    float bg_depth,
+                    const struct infer_batch* batch,
+                    bool flip,
+                    uint32_t* leaves_out)
+{
+    const int32_t lane_init[4] = { 0, 1, 2, 3 };
+    const int32x4_t lane = vld1q_s32(lane_init);
+    const int32x4_t width_v = vdupq_n_s32(width);
+    const int32x4_t height_v = vdupq_n_s32(height);
+    const int32x4_t zero = vdupq_n_s32(0);
+
+    for (int base = 0; base < batch->n; base += 4) {
+        int n = std::min(4, batch->n - base);
+        uint32x4_t valid = vcltq_s32(lane, vdupq_n_s32(n));
+
+        int32_t xs[4] = { 0, 0, 0, 0 };
+        int32_t ys[4] = { 0, 0, 0, 0 };
+        float ds[4] = { 1.f, 1.f, 1.f, 1.f };
+        for (int i = 0; i < n; i++) {
+            xs[i] = batch->x[base + i];
+            ys[i] = batch->y[base + i];
+            ds[i] = batch->depth[base + i];
+        }
+        float32x4_t pxf = vcvtq_f32_s32(vld1q_s32(xs));
+        float32x4_t pyf = vcvtq_f32_s32(vld1q_s32(ys));
+        float32x4_t depth = vld1q_f32(ds);
+
+        int32_t id[4] = { 0, 0, 0, 0 };
+        uint32x4_t active = valid;
+
+        while (vmaxvq_u32(active)) {
+            /* NEON has no gather so we de-interleave the uv vectors of four
+             * nodes with a structure load from a small staging buffer...
+             */
+            float uvs[16];
+            float ts[4];
+            int32_t rights[4];
+            for (int i = 0; i < 4; i++) {
+                const Node* node = &nodes[id[i]];
+                vst1q_f32(uvs + 4 * i, vld1q_f32((const float*)node));
+                ts[i] = node->t;
+                rights[i] = node->right_idx;
+            }
+            float32x4x4_t uv = vld4q_f32(uvs);
+            float32x4_t t = vld1q_f32(ts);
+
+            float32x4_t uxf, vxf;
+            if (flip) {
+                uxf = vsubq_f32(pxf, vdivq_f32(uv.val[0], depth));
+                vxf = vsubq_f32(pxf, vdivq_f32(uv.val[2], depth));
+            } else {
+                uxf = vaddq_f32(pxf, vdivq_f32(uv.val[0], depth));
+                vxf = vaddq_f32(pxf, vdivq_f32(uv.val[2], depth));
+            }
+            int32x4_t u0 = vcvtq_s32_f32(uxf);
+            int32x4_t u1 = vcvtq_s32_f32(vaddq_f32(pyf, vdivq_f32(uv.val[1], depth)));
+            int32x4_t v0 = vcvtq_s32_f32(vxf);
+            int32x4_t v1 = vcvtq_s32_f32(vaddq_f32(pyf, vdivq_f32(uv.val[3], depth)));
+
+            uint32x4_t u_in = vandq_u32(
+                vandq_u32(vcgeq_s32(u0, zero), vcltq_s32(u0, width_v)),
+                vandq_u32(vcgeq_s32(u1, zero), vcltq_s32(u1, height_v)));
+            uint32x4_t v_in = vandq_u32(
+                vandq_u32(vcgeq_s32(v0, zero), vcltq_s32(v0, width_v)),
+                vandq_u32(vcgeq_s32(v1, zero), vcltq_s32(v1, height_v)));
+            u_in = vandq_u32(u_in, active);
+            v_in = vandq_u32(v_in, active);
+
+            int32_t u_off[4], v_off[4];
+            uint32_t u_ok[4], v_ok[4];
+            vst1q_s32(u_off, vmlaq_s32(u0, u1, width_v));
+            vst1q_s32(v_off, vmlaq_s32(v0, v1, width_v));
+            vst1q_u32(u_ok, u_in);
+            vst1q_u32(v_ok, v_in);
+
+            float upx[4], vpx[4];
+            for (int i = 0; i < 4; i++) {
+                upx[i] = u_ok[i] ? depth_image[u_off[i]] : bg_depth;
+                vpx[i] = v_ok[i] ? depth_image[v_off[i]] : bg_depth;
+            }
+
+            float32x4_t gradient = vsubq_f32(vld1q_f32(upx), vld1q_f32(vpx));
+            int32x4_t left = vreinterpretq_s32_u32(vcltq_f32(gradient, t));
+
+            int32x4_t id_v = vld1q_s32(id);
+            int32x4_t child = vbslq_s32(vreinterpretq_u32_s32(left),
+                                        vaddq_s32(id_v, vdupq_n_s32(1)),
+                                        vld1q_s32(rights));
+            id_v = vbslq_s32(active, child, id_v);
+            vst1q_s32(id, id_v);
+
+            uint32_t idx[4] = { nodes[id[0]].label_pr_idx,
+                                nodes[id[1]].label_pr_idx,
+                                nodes[id[2]].label_pr_idx,
+                                nodes[id[3]].label_pr_idx };
+            active = vandq_u32(active, vceqq_u32(vld1q_u32(idx), vdupq_n_u32(0)));
+        }
+
+        for (int i = 0; i < n; i++)
+            leaves_out[base + i] = nodes[id[i]].label_pr_idx;
+    }
+}
+#endif // NEON
+
+/* Inference on GM_FORMAT_Z_U16_MM depth images follows
+ * sample_uv_gradient_mm() in glimpse_rdt.cc so that we make exactly the same
+ * decisions as at training time: samples are integer millimetres, the
+ * gradient is an integer and the threshold (which the trainer chooses in
+ * whole millimetres) is compared as an integer, via the tree's
+ * thresholds_mm that are quantised once when the tree is loaded.
+ *
+ * NB: we still divide by the depth (pre-converted to metres per-pixel, as
+ * infer_batch::depth) instead of multiplying by a reciprocal since the
+ * truncated sample coordinates could otherwise differ from training.
+ *
+ * Zero (missing) samples are read as background, like samples outside the
+ * image, since training data has no holes and the float path sees
+ * bg_depth for them.
+ */
+static inline int
+sample_depth_mm(const uint16_t* depth_image, int width, int height,
+                int x, int y, int bg_depth_mm)
+{
+    if (x < 0 || x >= width || y < 0 || y >= height)
+        return bg_depth_mm;
+    int depth_mm = depth_image[y * width + x];
+    return depth_mm ? depth_mm : bg_depth_mm;
+}
+
+template<bool flip>
+static inline bool
+goes_left_mm(const float* uv, int t_mm,
+             int x, int y, float depth_m,
+             const uint16_t* depth_image,
+             int width, int height,
+             int bg_depth_mm)
+{
+    Int2D u, v;
+    if (flip) {
+        u = (Int2D){ (int)(x - uv[0] / depth_m), (int)(y + uv[1] / depth_m) };
+        v = (Int2D){ (int)(x - uv[2] / depth_m), (int)(y + uv[3] / depth_m) };
+    } else {
+        u = (Int2D){ (int)(x + uv[0] / depth_m), (int)(y + uv[1] / depth_m) };
+        v = (Int2D){ (int)(x + uv[2] / depth_m), (int)(y + uv[3] / depth_m) };
+    }
+
+    int upixel = sample_depth_mm(depth_image, width, height, u[0], u[1],
+                                 bg_depth_mm);
+    int vpixel = sample_depth_mm(depth_image, width, height, v[0], v[1],
+                                 bg_depth_mm);
+
+    return (upixel - vpixel) < t_mm;
+}
+
+template<bool flip>
+static void
+traverse_batch_mm_tmpl(const Node* nodes,
+                       const int16_t* thresholds_mm,
+                       const uint16_t* depth_image,
+                       int width,
+                       int height,
+                       int bg_depth_mm,
+                       const struct infer_batch* batch,
+                       uint32_t* leaves_out)
+{
+    for (int i = 0; i < batch->n; i++) {
+        int id = 0;
+
+        while (nodes[id].label_pr_idx == 0) {
+            const Node& node = nodes[id];
+            float uv[4] = { node.uv[0], node.uv[1], node.uv[2], node.uv[3] };
+            bool left = goes_left_mm<flip>(uv, thresholds_mm[id],
+                                           batch->x[i], batch->y[i],
+                                           batch->depth[i],
+                                           depth_image, width, height,
+                                           bg_depth_mm);
+            id = left ? id + 1 : node.right_idx;
+        }
+
+        leaves_out[i] = nodes[id].label_pr_idx;
+    }
+}
+
+template<bool flip>
+static void
+traverse_clusters_mm_tmpl(const NodeCluster* clusters,
+                          const int16_t* thresholds_mm,
+                          const uint16_t* depth_image,
+                          int width,
+                          int height,
+                          int bg_depth_mm,
+                          const struct infer_batch* batch,
+                          uint32_t* leaves_out)
+{
+    for (int i = 0; i < batch->n; i++) {
+        const NodeCluster* cluster = &clusters[0];
+        const CompactNode* node = &cluster->nodes[0];
+        int slot = 0;
+
+        while (node->label_pr_idx == 0) {
+            float uv[4] = {
+                rdt_half_to_float(node->uv[0]),
+                rdt_half_to_float(node->uv[1]),
+                rdt_half_to_float(node->uv[2]),
+                rdt_half_to_float(node->uv[3]),
+            };
+            int t_mm = thresholds_mm[(cluster - clusters) * 3 + slot];
+            bool left = goes_left_mm<flip>(uv, t_mm,
+                                           batch->x[i], batch->y[i],
+                                           batch->depth[i],
+                                           depth_image, width, height,
+                                           bg_depth_mm);
+            if (slot == 0) {
+                slot = left ? 1 : 2;
+            } else {
+                cluster = &clusters[cluster->children[(slot - 1) * 2 +
+                                                      (left ? 0 : 1)]];
+                slot = 0;
+            }
+            node = &cluster->nodes[slot];
+        }
+
+        leaves_out[i] = node->label_pr_idx;
+    }
+}
+
+typedef void (*infer_traverse_batch_mm_func)(const Node* nodes,
+                                             const int16_t* thresholds_mm,
+                                             const uint16_t* depth_image,
+                                             int width,
+                                             int height,
+                                             int bg_depth_mm,
+                                             const struct infer_batch* batch,
+                                             bool flip,
+                                             uint32_t* leaves_out);
+
+static void
+traverse_batch_mm_scalar(const Node* nodes,
+                         const int16_t* thresholds_mm,
+                         const uint16_t* depth_image,
+                         int width,
+                         int height,
+                         int bg_depth_mm,
+                         const struct infer_batch* batch,
+                         bool flip,
+                         uint32_t* leaves_out)
+{
+    if (flip) {
+        traverse_batch_mm_tmpl<true>(nodes, thresholds_mm, depth_image,
+                                     width, height, bg_depth_mm, batch,
+                                     leaves_out);
+    } else {
+        traverse_batch_mm_tmpl<false>(nodes, thresholds_mm, depth_image,
+                                      width, height, bg_depth_mm, batch,
+                                      leaves_out);
+    }
+}
+
+static void
+traverse_clusters_mm_scalar(const NodeCluster* clusters,
+                            const int16_t* thresholds_mm,
+                            const uint16_t* depth_image,
+                            int width,
+                            int height,
+                            int bg_depth_mm,
+                            const struct infer_batch* batch,
+                            bool flip,
+                            uint32_t* leaves_out)
+{
+    if (flip) {
+        traverse_clusters_mm_tmpl<true>(clusters, thresholds_mm, depth_image,
+                                        width, height, bg_depth_mm, batch,
+                                        leaves_out);
+    } else {
+        traverse_clusters_mm_tmpl<false>(clusters, thresholds_mm, depth_image,
+                                         width, height, bg_depth_mm, batch,
+                                         leaves_out);
+    }
+}
+
+#ifdef INFER_HAVE_X86_KERNELS
+/* Gathers 16bit depth samples for the lanes in @mask (other lanes, and zero
+ * samples, get @fallback). Since there's no 16bit gather we gather 32bit
+ * words, taking care to not read beyond the end of the image for the very
+ * last pixel.
+ */
+__attribute__((target("avx2"))) static inline __m256i
+gather_depth_u16_avx2(const uint16_t* depth_image, int n_pixels,
+                      __m256i off, __m256i mask, __m256i fallback)
+{
+    __m256i last = _mm256_cmpeq_epi32(off, _mm256_set1_epi32(n_pixels - 1));
+    __m256i byte_off = _mm256_add_epi32(_mm256_add_epi32(off, off),
+                                        _mm256_add_epi32(last, last));
+    __m256i word = _mm256_mask_i32gather_epi32(fallback, (const int*)depth_image,
+                                               byte_off, mask, 1);
+    __m256i shift = _mm256_and_si256(last, _mm256_set1_epi32(16));
+    __m256i sample = _mm256_and_si256(_mm256_srlv_epi32(word, shift),
+                                      _mm256_set1_epi32(0xffff));
+    __m256i hole = _mm256_cmpeq_epi32(sample, _mm256_setzero_si256());
+    return _mm256_blendv_epi8(fallback, sample, _mm256_andnot_si256(hole, mask));
+}
+
+__attribute__((target("avx2"))) static void
+traverse_batch_mm_avx2(const Node* nodes,
+                       const int16_t* thresholds_mm,
+                       const uint16_t* depth_image,
+                       int width,
+                       int height,
+                       int bg_depth_mm,
+                       const struct infer_batch* batch,
+                       bool flip,
+                       uint32_t* leaves_out)
+{
+    if (width * height < 2) {
+        traverse_batch_mm_scalar(nodes, thresholds_mm, depth_image,
+                                 width, height, bg_depth_mm, batch, flip,
+                                 leaves_out);
+        return;
+    }
+
+    const float* node_words = (const float*)nodes;
+    const int* node_iwords = (const int*)nodes;
+
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i width_v = _mm256_set1_epi32(width);
+    const __m256i height_v = _mm256_set1_epi32(height);
+    const __m256i bg_v = _mm256_set1_epi32(bg_depth_mm);
+    const int n_pixels = width * height;
+
+    __m256i n_v = _mm256_set1_epi32(batch->n);
+    __m256i valid = _mm256_cmpgt_epi32(n_v, lane);
+
+    __m256i px = _mm256_maskload_epi32(batch->x, valid);
+    __m256i py = _mm256_maskload_epi32(batch->y, valid);
+    __m256 pxf = _mm256_cvtepi32_ps(px);
+    __m256 pyf = _mm256_cvtepi32_ps(py);
+    /* NB: give padding lanes a harmless non-zero depth */
+    __m256 depth = _mm256_blendv_ps(_mm256_set1_ps(1.f),
+                                    _mm256_maskload_ps(batch->depth, valid),
+                                    _mm256_castsi256_ps(valid));
+
+    __m256i id = zero;
+
+    /* NB: the root of a depth-1 tree is a leaf, in which case no lanes
+     * need to be traversed
+     */
+    __m256i active = nodes[0].label_pr_idx ? zero : valid;
+
+    while (!_mm256_testz_si256(active, active)) {
+        __m256i word = _mm256_slli_epi32(id, 3); // * NODE_WORDS
+
+        __m256 ux = _mm256_i32gather_ps(node_words + NODE_WORD_U_X, word, 4);
+        __m256 uy = _mm256_i32gather_ps(node_words + NODE_WORD_U_Y, word, 4);
+        __m256 vx = _mm256_i32gather_ps(node_words + NODE_WORD_V_X, word, 4);
+        __m256 vy = _mm256_i32gather_ps(node_words + NODE_WORD_V_Y, word, 4);
+        __m256i right = _mm256_i32gather_epi32(node_iwords + NODE_WORD_RIGHT, word, 4);
+
+        __m256 uxf, vxf;
+        if (flip) {
+            uxf = _mm256_sub_ps(pxf, _mm256_div_ps(ux, depth));
+            vxf = _mm256_sub_ps(pxf, _mm256_div_ps(vx, depth));
+        } else {
+            uxf = _mm256_add_ps(pxf, _mm256_div_ps(ux, depth));
+            vxf = _mm256_add_ps(pxf, _mm256_div_ps(vx, depth));
+        }
+        __m256i u0 = _mm256_cvttps_epi32(uxf);
+        __m256i u1 = _mm256_cvttps_epi32(_mm256_add_ps(pyf, _mm256_div_ps(uy, depth)));
+        __m256i v0 = _mm256_cvttps_epi32(vxf);
+        __m256i v1 = _mm256_cvttps_epi32(_mm256_add_ps(pyf, _mm256_div_ps(vy, depth)));
+
+        __m256i u_in = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(u0, _mm256_set1_epi32(-1)),
+                             _mm256_cmpgt_epi32(width_v, u0)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(u1, _mm256_set1_epi32(-1)),
+                             _mm256_cmpgt_epi32(height_v, u1)));
+        __m256i v_in = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(v0, _mm256_set1_epi32(-1)),
+                             _mm256_cmpgt_epi32(width_v, v0)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(v1, _mm256_set1_epi32(-1)),
+                             _mm256_cmpgt_epi32(height_v, v1)));
+        u_in = _mm256_and_si256(u_in, active);
+        v_in = _mm256_and_si256(v_in, active);
+
+        __m256i u_off = _mm256_add_epi32(_mm256_mullo_epi32(u1, width_v), u0);
+        __m256i v_off = _mm256_add_epi32(_mm256_mullo_epi32(v1, width_v), v0);
+
+        __m256i upixel = gather_depth_u16_avx2(depth_image, n_pixels,
+                                               u_off, u_in, bg_v);
+        __m256i vpixel = gather_depth_u16_avx2(depth_image, n_pixels,
+                                               v_off, v_in, bg_v);
+
+        __m256i gradient = _mm256_sub_epi32(upixel, vpixel);
+        /* NB: thresholds_mm is padded so that a 32bit gather of the last
+         * entry is in bounds, and the entry is sign extended from the low
+         * 16 bits
+         */
+        __m256i t_word = _mm256_i32gather_epi32((const int*)thresholds_mm,
+                                                _mm256_add_epi32(id, id), 1);
+        __m256i t_mm = _mm256_srai_epi32(_mm256_slli_epi32(t_word, 16), 16);
+        __m256i left = _mm256_cmpgt_epi32(t_mm, gradient);
+
+        /* The left child is the next node, in pre-order */
+        __m256i child = _mm256_blendv_epi8(right, _mm256_add_epi32(id, one), left);
+        id = _mm256_blendv_epi8(id, child, active);
+
+        __m256i label_pr_idx =
+            _mm256_mask_i32gather_epi32(zero, node_iwords + NODE_WORD_IDX,
+                                        _mm256_slli_epi32(id, 3), active, 4);
+        active = _mm256_and_si256(active, _mm256_cmpeq_epi32(label_pr_idx, zero));
+    }
+
+    uint32_t ids[8];
+    _mm256_storeu_si256((__m256i*)ids, id);
+    for (int i = 0; i < batch->n; i++)
+        leaves_out[i] = nodes[ids[i]].label_pr_idx;
+}
+#endif // INFER_HAVE_X86_KERNELS
+
+/* Adds a u8 quantised probability table into 16bit accumulators */
+static inline void
+accumulate_u8_pr_table(uint16_t* acc, const uint8_t* pr_table, int n_labels)
+{
+    int n = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; n + 16 <= n_labels; n += 16) {
+        __m128i pr = _mm_loadu_si128((const __m128i*)(pr_table + n));
+        __m128i lo = _mm_loadu_si128((const __m128i*)(acc + n));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(acc + n + 8));
+        lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(pr, zero));
+        hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(pr, zero));
+        _mm_storeu_si128((__m128i*)(acc + n), lo);
+        _mm_storeu_si128((__m128i*)(acc + n + 8), hi);
+    }
+#elif defined(__ARM_NEON)
+    for (; n + 8 <= n_labels; n += 8)
+        vst1q_u16(acc + n, vaddw_u8(vld1q_u16(acc + n), vld1_u8(pr_table + n)));
+#endif
+    for (; n < n_labels; n++)
+        acc[n] += pr_table[n];
+}
+
+/* Adds a half-float probability table into float accumulators, equivalent
+ * to using rdt_half_to_float() for each entry
+ */
+static inline void
+accumulate_f16_pr_table(float* out, const uint16_t* pr_table, int n_labels)
+{
+    int n = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mag_mask = _mm_set1_epi32(0x7fff);
+    const __m128i sign_mask = _mm_set1_epi32(0x8000);
+    const __m128 scale = _mm_castsi128_ps(_mm_set1_epi32((127 + 112) << 23));
+    for (; n + 4 <= n_labels; n += 4) {
+        __m128i h = _mm_unpacklo_epi16(
+            _mm_loadl_epi64((const __m128i*)(pr_table + n)), zero);
+        __m128i mag = _mm_slli_epi32(_mm_and_si128(h, mag_mask), 13);
+        __m128i sign = _mm_slli_epi32(_mm_and_si128(h, sign_mask), 16);
+        __m128 pr = _mm_or_ps(_mm_mul_ps(_mm_castsi128_ps(mag), scale),
+                              _mm_castsi128_ps(sign));
+        _mm_storeu_ps(out + n, _mm_add_ps(_mm_loadu_ps(out + n), pr));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; n + 4 <= n_labels; n += 4) {
+        float32x4_t pr = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(pr_table + n)));
+        vst1q_f32(out + n, vaddq_f32(vld1q_f32(out + n), pr));
+    }
+#endif
+    for (; n < n_labels; n++)
+        out[n] += rdt_half_to_float(pr_table[n]);
+}
+
+static void
+select_top_k_labels(const float* pr_table,
+                    int n_labels,
+                    struct infer_labels_top_k* top_k)
+{
+    float top_pr[INFER_LABELS_TOP_K];
+    uint8_t top_labels[INFER_LABELS_TOP_K];
+
+    for (int k = 0; k < INFER_LABELS_TOP_K; k++) {
+        top_pr[k] = -1.f;
+        top_labels[k] = 0;
+    }
+
+    /* NB: ties favour the lower label */
+    for (int l = 0; l < n_labels; l++) {
+        float pr = pr_table[l];
+        if (pr <= top_pr[INFER_LABELS_TOP_K - 1])
+            continue;
+
+        int k = INFER_LABELS_TOP_K - 1;
+        for (; k > 0 && pr > top_pr[k - 1]; k--) {
+            top_pr[k] = top_pr[k - 1];
+            top_labels[k] = top_labels[k - 1];
+        }
+        top_pr[k] = pr;
+        top_labels[k] = l;
+    }
+
+    for (int k = 0; k < INFER_LABELS_TOP_K; k++) {
+        float q = roundf(top_pr[k] * 255.f);
+        top_k->labels[k] = top_labels[k];
+        top_k->probs[k] = (uint8_t)std::min(std::max(q, 0.f), 255.f);
+    }
+}
+
+#ifdef INFER_HAVE_X86_KERNELS
+__attribute__((target("avx2,f16c"))) static inline void
+accumulate_u8_pr_table_avx2(uint16_t* acc, const uint8_t* pr_table, int n_labels)
+{
+    int n = 0;
+    for (; n + 16 <= n_labels; n += 16) {
+        __m256i pr = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i*)(pr_table + n)));
+        __m256i sum = _mm256_add_epi16(
+            _mm256_loadu_si256((const __m256i*)(acc + n)), pr);
+        _mm256_storeu_si256((__m256i*)(acc + n), sum);
+    }
+    for (; n < n_labels; n++)
+        acc[n] += pr_table[n];
+}
+
+/* NB: the conversion from half to single precision is exact so the F16C
+ * instructions give the same results as rdt_half_to_float()
+ */
+__attribute__((target("avx2,f16c"))) static inline void
+accumulate_f16_pr_table_avx2(float* out, const uint16_t* pr_table, int n_labels)
+{
+    int n = 0;
+    for (; n + 8 <= n_labels; n += 8) {
+        __m256 pr = _mm256_cvtph_ps(
+            _mm_loadu_si128((const __m128i*)(pr_table + n)));
+        _mm256_storeu_ps(out + n, _mm256_add_ps(_mm256_loadu_ps(out + n), pr));
+    }
+    for (; n < n_labels; n++)
+        out[n] += rdt_half_to_float(pr_table[n]);
+}
+#endif // INFER_HAVE_X86_KERNELS
+
+/* The probability table accumulators for each accumulation kernel variant,
+ * where the generic variant only depends on our baseline SSE2/NEON support
+ */
+struct accumulate_generic {
+    static inline void u8(uint16_t* acc, const uint8_t* pr_table, int n_labels) {
+        accumulate_u8_pr_table(acc, pr_table, n_labels);
+    }
+    static inline void f16(float* out, const uint16_t* pr_table, int n_labels) {
+        accumulate_f16_pr_table(out, pr_table, n_labels);
+    }
+};
+
+#ifdef INFER_HAVE_X86_KERNELS
+struct accumulate_avx2 {
+    __attribute__((target("avx2,f16c")))
+    static inline void u8(uint16_t* acc, const uint8_t* pr_table, int n_labels) {
+        accumulate_u8_pr_table_avx2(acc, pr_table, n_labels);
+    }
+    __attribute__((target("avx2,f16c")))
+    static inline void f16(float* out, const uint16_t* pr_table, int n_labels) {
+        accumulate_f16_pr_table_avx2(out, pr_table, n_labels);
+    }
+};
+#endif
+
+/* NB: u8 quantised tables are summed as integers (so the order of
+ * accumulation doesn't matter) and only dequantised once per pixel, while
+ * half-float tables are dequantised as they are accumulated.
+ *
+ * The accumulation functions are always inlined into a wrapper for each
+ * kernel variant so that the compiler can also make use of the variant's
+ * instruction set for the remaining loops.
+ */
+template<typename Acc>
+static inline __attribute__((always_inline)) void
+infer_accumulate_tree(InferThreadData* data,
+                      RDTree* tree,
+                      uint32_t (*tree_leaves)[INFER_MAX_BATCH],
+                      int b,
+                      float* out_pr_table,
+                      uint16_t* u8_acc)
+{
+    int n_labels = tree->header.n_labels;
+    uint8_t* flip_map = data->forest[0]->header.flip_map;
+    int n_passes = data->flip ? 2 : 1;
+
+    for (int p = 0; p < n_passes; p++) {
+        /* NB: node->label_pr_idx is a base-one index since index zero
+         * is reserved to indicate that the node is not a leaf node
+         */
+        size_t table_off = (size_t)(tree_leaves[p][b] - 1) * n_labels;
+
+        /* Mirrored tables are already permuted by the flip_map */
+        void* tables = tree->label_pr_tables ?
+            (void*)tree->label_pr_tables : tree->quantised_pr_tables;
+        bool remap = p == 1;
+        if (remap && tree->mirrored_pr_tables) {
+            tables = tree->mirrored_pr_tables;
+            remap = false;
+        }
+
+        switch ((enum rdt_pr_format)tree->header.pr_format) {
+        case RDT_PR_FORMAT_F32: {
+            float* pr_table = &((float*)tables)[table_off];
+            if (!remap) {
+                for (int n = 0; n < n_labels; ++n)
+                    out_pr_table[n] += pr_table[n];
+            } else {
+                for (int n = 0; n < n_labels; ++n)
+                    out_pr_table[flip_map[n]] += pr_table[n];
+            }
+            break;
+        }
+        case RDT_PR_FORMAT_U8: {
+            uint8_t* pr_table = &((uint8_t*)tables)[table_off];
+            if (!remap) {
+                Acc::u8(u8_acc, pr_table, n_labels);
+            } else {
+                for (int n = 0; n < n_labels; ++n)
+                    u8_acc[flip_map[n]] += pr_table[n];
+            }
+            break;
+        }
+        case RDT_PR_FORMAT_F16: {
+            uint16_t* pr_table = &((uint16_t*)tables)[table_off];
+            if (!remap) {
+                Acc::f16(out_pr_table, pr_table, n_labels);
+            } else {
+                for (int n = 0; n < n_labels; ++n) {
+                    out_pr_table[flip_map[n]] +=
+                        rdt_half_to_float(pr_table[n]);
+                }
+            }
+            break;
+        }
+        }
+    }
+}
+
+/* Normalizes the probabilities accumulated from @n_trees trees (@u8_acc may
+ * be NULL if no tree has u8 tables) and writes any top-k output
+ */
+static inline __attribute__((always_inline)) void
+infer_finish_pr_table(InferThreadData* data,
+                      int off,
+                      float* out_pr_table,
+                      const uint16_t* u8_acc,
+                      int n_trees)
+{
+    int n_labels = data->forest[0]->header.n_labels;
+    float divider = (float)(data->flip ? n_trees * 2 : n_trees);
+
+    if (u8_acc) {
+        for (int n = 0; n < n_labels; ++n)
+            out_pr_table[n] += u8_acc[n] * (1.f / 255.f);
+    }
+
+    for (int n = 0; n < n_labels; ++n) {
+        out_pr_table[n] /= divider;
+    }
+
+    if (data->top_k_output)
+        select_top_k_labels(out_pr_table, n_labels, &data->top_k_output[off]);
+}
+
+static bool
+infer_forest_has_u8_tables(InferThreadData* data)
+{
+    for (int i = 0; i < data->n_trees; ++i) {
+        if (data->forest[i]->header.pr_format == RDT_PR_FORMAT_U8)
+            return true;
+    }
+    return false;
+}
+
+/* With cascaded inference a pixel may exit before evaluating all trees, in
+ * which case the leaves of the remaining trees are zero and the
+ * probabilities are averaged over the trees that were evaluated.
+ */
+template<typename Acc>
+static inline __attribute__((always_inline)) void
+infer_accumulate_batch(InferThreadData* data,
+                       const struct infer_batch* batch,
+                       uint32_t (*leaves)[2][INFER_MAX_BATCH])
+{
+    int n_labels = data->forest[0]->header.n_labels;
+    int width = data->width;
+
+    bool have_u8 = infer_forest_has_u8_tables(data);
+    uint16_t u8_acc[n_labels];
+
+    /* For top-k output we accumulate into a temporary table per pixel */
+    bool top_k = data->top_k_output != NULL;
+    float top_k_pr_table[top_k ? n_labels : 1];
+
+    for (int b = 0; b < batch->n; b++) {
+        int off = batch->y[b] * width + batch->x[b];
+        float* out_pr_table;
+
+        if (top_k) {
+            out_pr_table = top_k_pr_table;
+            memset(out_pr_table, 0, sizeof(float) * n_labels);
+        } else {
+            out_pr_table = &data->output[off * n_labels];
+        }
+
+        if (have_u8)
+            memset(u8_acc, 0, sizeof(u8_acc));
+
+        int n_evaluated = 0;
+        for (int i = 0; i < data->n_trees; ++i) {
+            if (leaves[i][0][b] == 0)
+                break;
+            infer_accumulate_tree<Acc>(data, data->forest[i], leaves[i], b,
+                                       out_pr_table, u8_acc);
+            n_evaluated++;
+        }
+
+        infer_finish_pr_table(data, off, out_pr_table,
+                              have_u8 ? u8_acc : NULL, n_evaluated);
+    }
+}
+
+/* Accumulates the probability tables for the leaves of all trees, for a
+ * batch of pixels, and writes the final output
+ */
+typedef void (*infer_accumulate_batch_func)(InferThreadData* data,
+                                            const struct infer_batch* batch,
+                                            uint32_t (*leaves)[2][INFER_MAX_BATCH]);
+
+/* Accumulates the probability tables for a single tree and pixel (used
+ * for cascaded inference)
+ */
+typedef void (*infer_accumulate_tree_func)(InferThreadData* data,
+                                           RDTree* tree,
+                                           uint32_t (*tree_leaves)[INFER_MAX_BATCH],
+                                           int b,
+                                           float* out_pr_table,
+                                           uint16_t* u8_acc);
+
+static void
+accumulate_batch_generic(InferThreadData* data,
+                         const struct infer_batch* batch,
+                         uint32_t (*leaves)[2][INFER_MAX_BATCH])
+{
+    infer_accumulate_batch<accumulate_generic>(data, batch, leaves);
+}
+
+static void
+accumulate_tree_generic(InferThreadData* data,
+                        RDTree* tree,
+                        uint32_t (*tree_leaves)[INFER_MAX_BATCH],
+                        int b,
+                        float* out_pr_table,
+                        uint16_t* u8_acc)
+{
+    infer_accumulate_tree<accumulate_generic>(data, tree, tree_leaves, b,
+                                              out_pr_table, u8_acc);
+}
+
+#ifdef INFER_HAVE_X86_KERNELS
+__attribute__((target("avx2,f16c"))) static void
+accumulate_batch_avx2(InferThreadData* data,
+                      const struct infer_batch* batch,
+                      uint32_t (*leaves)[2][INFER_MAX_BATCH])
+{
+    infer_accumulate_batch<accumulate_avx2>(data, batch, leaves);
+}
+
+__attribute__((target("avx2,f16c"))) static void
+accumulate_tree_avx2(InferThreadData* data,
+                     RDTree* tree,
+                     uint32_t (*tree_leaves)[INFER_MAX_BATCH],
+                     int b,
+                     float* out_pr_table,
+                     uint16_t* u8_acc)
+{
+    infer_accumulate_tree<accumulate_avx2>(data, tree, tree_leaves, b,
+                                           out_pr_table, u8_acc);
+}
+#endif
+
+struct infer_kernel {
+    const char* name;
+    infer_traverse_batch_func traverse_batch;
+    infer_traverse_clusters_func traverse_clusters;
+    infer_traverse_batch_mm_func traverse_batch_mm;
+    infer_traverse_batch_pair_func traverse_batch_pair; // NULL to run separately
+
+    /* Selected independently of the traversal functions */
+    infer_accumulate_batch_func accumulate_batch;
+    infer_accumulate_tree_func accumulate_tree;
+};
+
+static struct infer_kernel
+select_infer_kernel(void)
+{
+    static const struct gm_cpu_variant traverse_variants[] = {
+#ifdef INFER_HAVE_X86_KERNELS
+        { "avx2", GM_CPU_FEATURE_AVX2 },
+        { "sse4.1", GM_CPU_FEATURE_SSE4_1 },
+#endif
+#ifdef INFER_HAVE_NEON_KERNEL
+        { "neon", GM_CPU_FEATURE_NEON },
+#endif
+        { "scalar", 0 },
+    };
+    /* NB: the accumulate functions are filled in below */
+    static const struct infer_kernel traverse_kernels[] = {
+#ifdef INFER_HAVE_X86_KERNELS
+        { "avx2", traverse_batch_avx2, traverse_clusters_avx2,
+          traverse_batch_mm_avx2, traverse_batch_pair_avx2, NULL, NULL },
+        { "sse4.1", traverse_batch_sse41, traverse_clusters_scalar,
+          traverse_batch_mm_scalar, NULL, NULL, NULL },
+#endif
+#ifdef INFER_HAVE_NEON_KERNEL
+        { "neon", traverse_batch_neon, traverse_clusters_scalar,
+          traverse_batch_mm_scalar, NULL, NULL, NULL },
+#endif
+        { "scalar", traverse_batch_scalar, traverse_clusters_scalar,
+          traverse_batch_mm_scalar, traverse_batch_pair_scalar, NULL, NULL },
+    };
+
+    static const struct gm_cpu_variant accumulate_variants[] = {
+#ifdef INFER_HAVE_X86_KERNELS
+        { "avx2", GM_CPU_FEATURE_AVX2 | GM_CPU_FEATURE_F16C },
+#endif
+        { "generic", 0 },
+    };
+    static const struct {
+        infer_accumulate_batch_func accumulate_batch;
+        infer_accumulate_tree_func accumulate_tree;
+    } accumulate_kernels[] = {
+#ifdef INFER_HAVE_X86_KERNELS
+        { accumulate_batch_avx2, accumulate_tree_avx2 },
+#endif
+        { accumulate_batch_generic, accumulate_tree_generic },
+    };
+
+    int traverse = gm_cpu_select_variant("label traversal",
+                                         traverse_variants,
+                                         ARRAY_LEN(traverse_variants));
+    int accumulate = gm_cpu_select_variant("label accumulation",
+                                           accumulate_variants,
+                                           ARRAY_LEN(accumulate_variants));
+
+    struct infer_kernel kernel = traverse_kernels[traverse];
+    kernel.accumulate_batch = accumulate_kernels[accumulate].accumulate_batch;
+    kernel.accumulate_tree = accumulate_kernels[accumulate].accumulate_tree;
+
+    return kernel;
+}
+
+static const struct infer_kernel&
+get_infer_kernel(void)
+{
+    /* NB: C++11 guarantees thread-safe initialization */
+    static const struct infer_kernel kernel = select_infer_kernel();
+    return kernel;
+}
+
+const char*
+infer_labels_get_kernel_name(void)
+{
+    return get_infer_kernel().name;
+}
+
+static inline int
+bg_depth_to_mm(float bg_depth)
+{
+    return (int)roundf(bg_depth * 1000.f);
+}
+
+/* Writes the leaves reached by each pixel of the batch for tree @i */
+static void
+infer_traverse_tree(InferThreadData* data,
+                    const struct infer_kernel& kernel,
+                    int i,
+                    const struct infer_batch* batch,
+                    uint32_t (*tree_leaves)[INFER_MAX_BATCH])
+{
+    RDTHeader* header = &data->forest[0]->header;
+    int bg_depth_mm = bg_depth_to_mm(header->bg_depth);
+    RDTree* tree = data->forest[i];
+    int n_passes = data->flip ? 2 : 1;
+
+    if (data->flip && !data->depth_u16_mm && !tree->compiled_traverse &&
+        tree->mirrored_nodes && kernel.traverse_batch_pair)
+    {
+        kernel.traverse_batch_pair(tree->nodes, tree->mirrored_nodes,
+                                   (float*)data->depth_image,
+                                   data->width, data->height,
+                                   header->bg_depth, batch,
+                                   tree_leaves[0], tree_leaves[1]);
+        return;
+    }
+
+    for (int p = 0; p < n_passes; p++) {
+        /* The flipped pass can use mirrored nodes without flipping */
+        const Node* nodes = tree->nodes;
+        const NodeCluster* clusters = tree->clusters;
+        bool flip = p == 1;
+        if (flip && (tree->mirrored_nodes || tree->mirrored_clusters)) {
+            nodes = tree->mirrored_nodes;
+            clusters = tree->mirrored_clusters;
+            flip = false;
+        }
+
+        if (data->depth_u16_mm && tree->clusters) {
+            traverse_clusters_mm_scalar(clusters,
+                                        tree->thresholds_mm,
+                                        (uint16_t*)data->depth_image,
+                                        data->width, data->height,
+                                        bg_depth_mm, batch, flip,
+                                        tree_leaves[p]);
+        } else if (data->depth_u16_mm) {
+            kernel.traverse_batch_mm(nodes,
+                                     tree->thresholds_mm,
+                                     (uint16_t*)data->depth_image,
+                                     data->width, data->height,
+                                     bg_depth_mm, batch, flip,
+                                     tree_leaves[p]);
+        } else if (tree->compiled_traverse) {
+            tree->compiled_traverse(tree->nodes, (float*)data->depth_image,
+                                    data->width, data->height,
+                                    header->bg_depth,
+                                    batch->n, batch->x, batch->y,
+                                    batch->depth,
+                                    p == 1, tree_leaves[p]);
+        } else if (tree->clusters) {
+            kernel.traverse_clusters(clusters,
+                                     (float*)data->depth_image,
+                                     data->width, data->height,
+                                     header->bg_depth,
+                                     batch, flip, tree_leaves[p]);
+        } else {
+            kernel.traverse_batch(nodes, (float*)data->depth_image,
+                                  data->width, data->height,
+                                  header->bg_depth,
+                                  batch, flip, tree_leaves[p]);
+        }
+    }
+}
+
+static void
+infer_cache_leaves(InferThreadData* data,
+                   const struct infer_batch* batch,
+                   uint32_t (*leaves)[2][INFER_MAX_BATCH])
+{
+    uint32_t* cached_leaves = data->leaf_cache->leaves;
+    int n_trees = data->n_trees;
+    int n_passes = data->flip ? 2 : 1;
+
+    for (int b = 0; b < batch->n; b++) {
+        int off = batch->y[b] * data->width + batch->x[b];
+        for (int i = 0; i < n_trees; i++) {
+            for (int p = 0; p < n_passes; p++) {
+                cached_leaves[INFER_LABELS_LEAF_CACHE_IDX(off, n_trees, i, p)] =
+                    leaves[i][p][b];
+            }
+        }
+    }
+}
+
+/* Cascaded inference evaluates the trees one at a time, accumulating the
+ * probabilities of each pixel as it goes, and a pixel stops early once the
+ * most probable label of its (normalized) running total reaches
+ * cascade_threshold. Most pixels away from body part boundaries are
+ * classified confidently by the first tree or two.
+ *
+ * The remaining pixels are compacted into a smaller batch for the next tree
+ * so that SIMD kernels still advance them together.
+ */
+static void
+infer_process_batch_cascade(InferThreadData* data,
+                            const struct infer_kernel& kernel,
+                            const struct infer_batch* batch)
+{
+    int n_labels = data->forest[0]->header.n_labels;
+    int n_trees = data->n_trees;
+    int n_passes = data->flip ? 2 : 1;
+    int width = data->width;
+    float threshold = data->cascade_threshold;
+
+    bool have_u8 = infer_forest_has_u8_tables(data);
+
+    uint32_t leaves[n_trees][2][INFER_MAX_BATCH];
+    memset(leaves, 0, sizeof(leaves));
+
+    float pr_tables[INFER_MAX_BATCH][n_labels];
+    memset(pr_tables, 0, sizeof(pr_tables));
+    uint16_t u8_accs[INFER_MAX_BATCH][n_labels];
+    memset(u8_accs, 0, sizeof(u8_accs));
+
+    int n_evaluated[INFER_MAX_BATCH];
+
+    struct infer_batch active = *batch;
+    int active_idx[INFER_MAX_BATCH];
+    for (int b = 0; b < batch->n; b++)
+        active_idx[b] = b;
+
+    uint32_t tree_leaves[2][INFER_MAX_BATCH];
+    int n_trees_evaluated = 0;
+    int n_early_exits = 0;
+
+    for (int i = 0; i < n_trees && active.n; i++) {
+        infer_traverse_tree(data, kernel, i, &active, tree_leaves);
+        n_trees_evaluated += active.n;
+
+        int n_active = 0;
+        for (int a = 0; a < active.n; a++) {
+            int b = active_idx[a];
+
+            for (int p = 0; p < n_passes; p++)
+                leaves[i][p][b] = tree_leaves[p][a];
+            kernel.accumulate_tree(data, data->forest[i], leaves[i], b,
+                                   pr_tables[b], u8_accs[b]);
+            n_evaluated[b] = i + 1;
+
+            if (i < n_trees - 1) {
+                float max_pr = 0;
+                for (int n = 0; n < n_labels; n++) {
+                    max_pr = std::max(max_pr,
+                                      pr_tables[b][n] + u8_accs[b][n] * (1.f / 255.f));
+                }
+                if (max_pr >= threshold * (n_evaluated[b] * n_passes)) {
+                    n_early_exits++;
+                    continue;
+                }
+            }
+
+            active.x[n_active] = active.x[a];
+            active.y[n_active] = active.y[a];
+            active.depth[n_active] = active.depth[a];
+            active_idx[n_active] = b;
+            n_active++;
+        }
+        active.n = n_active;
+    }
+
+    if (data->leaf_cache)
+        infer_cache_leaves(data, batch, leaves);
+
+    for (int b = 0; b < batch->n; b++) {
+        int off = batch->y[b] * width + batch->x[b];
+        float* out_pr_table = pr_tables[b];
+
+        /* NB: the dense output is zero-initialized, so copying is
+         * equivalent to accumulating into it directly
+         */
+        if (!data->top_k_output) {
+            out_pr_table = &data->output[off * n_labels];
+            memcpy(out_pr_table, pr_tables[b], sizeof(float) * n_labels);
+        }
+
+        infer_finish_pr_table(data, off, out_pr_table,
+                              have_u8 ? u8_accs[b] : NULL, n_evaluated[b]);
+    }
+
+    if (data->cascade_stats) {
+        data->cascade_stats->n_pixels += batch->n;
+        data->cascade_stats->n_trees_evaluated += n_trees_evaluated;
+        data->cascade_stats->n_early_exits += n_early_exits;
+    }
+}
+
+static void
+infer_process_batch(InferThreadData* data,
+                    const struct infer_kernel& kernel,
+                    const struct infer_batch* batch)
+{
+    if (data->cascade_threshold > 0 && data->n_trees > 1) {
+        infer_process_batch_cascade(data, kernel, batch);
+        return;
+    }
+
+    uint32_t leaves[data->n_trees][2][INFER_MAX_BATCH];
+
+    for (int i = 0; i < data->n_trees; ++i)
+        infer_traverse_tree(data, kernel, i, batch, leaves[i]);
+
+    if (data->leaf_cache)
+        infer_cache_leaves(data, batch, leaves);
+
+    kernel.accumulate_batch(data, batch, leaves);
+
+    if (data->cascade_stats) {
+        data->cascade_stats->n_pixels += batch->n;
+        data->cascade_stats->n_trees_evaluated += batch->n * data->n_trees;
+    }
+}
+
+/* Accumulates the probabilities for a batch of pixels whose leaves were
+ * all cached by a previous run
+ */
+static void
+infer_reuse_batch(InferThreadData* data, const struct infer_batch* batch)
+{
+    uint32_t leaves[data->n_trees][2][INFER_MAX_BATCH];
+    uint32_t* cached_leaves = data->leaf_cache->leaves;
+    int n_trees = data->n_trees;
+    int n_passes = data->flip ? 2 : 1;
+
+    for (int b = 0; b < batch->n; b++) {
+        int off = batch->y[b] * data->width + batch->x[b];
+        for (int i = 0; i < n_trees; i++) {
+            for (int p = 0; p < n_passes; p++) {
+                leaves[i][p][b] =
+                    cached_leaves[INFER_LABELS_LEAF_CACHE_IDX(off, n_trees, i, p)];
+            }
+        }
+    }
+
+    get_infer_kernel().accumulate_batch(data, batch, leaves);
+}
+
+/* Returns true if the pixel is background */
+static inline bool
+infer_read_depth(InferThreadData* data,
+                 int off,
+                 float bg_depth,
+                 int bg_depth_mm,
+                 float* depth_out)
+{
+    /* NB: zero is treated as an invalid/missing depth value for
+     * millimetre depth images
+     */
+    if (data->depth_u16_mm) {
+        int depth_mm = ((uint16_t*)data->depth_image)[off];
+        *depth_out = depth_mm / 1000.f;
+        return depth_mm == 0 || depth_mm >= bg_depth_mm;
+    } else {
+        float depth = ((float*)data->depth_image)[off];
+        *depth_out = depth;
+        return depth >= bg_depth;
+    }
+}
+
+static inline void
+infer_write_bg(InferThreadData* data, int off, int bg_label)
+{
+    if (data->top_k_output) {
+        struct infer_labels_top_k* top_k = &data->top_k_output[off];
+        memset(top_k, 0, sizeof(*top_k));
+        top_k->labels[0] = bg_label;
+        top_k->probs[0] = 255;
+    } else {
+        int n_labels = data->forest[0]->header.n_labels;
+        data->output[off * n_labels + bg_label] = 1.f;
+    }
+}
+
+/* The image is divided into INFER_TILE_SIZE x INFER_TILE_SIZE tiles which
+ * threads claim one at a time via a shared counter until there are none left.
+ * Compared to statically assigning rows to threads this balances the load
+ * when some parts of the image (e.g. through the body) are much more costly
+ * than others (background) and keeps the depth samples of each thread local.
+ */
+static void
+infer_label_probs_cb(void* userdata)
+{
+    InferThreadData* data = (InferThreadData*)userdata;
+
+    float bg_depth = data->forest[0]->header.bg_depth;
+    int bg_depth_mm = bg_depth_to_mm(bg_depth);
+    int bg_label = data->forest[0]->header.bg_label;
+
+    int width = data->width;
+    int height = data->height;
+
+    int tiles_x = (width + INFER_TILE_SIZE - 1) / INFER_TILE_SIZE;
+    int tiles_y = (height + INFER_TILE_SIZE - 1) / INFER_TILE_SIZE;
+    int n_tiles = tiles_x * tiles_y;
+
+    const struct infer_kernel& kernel = get_infer_kernel();
+
+    struct infer_batch batch;
+
+    while (true) {
+        int tile = data->next_tile->fetch_add(1, std::memory_order_relaxed);
+        if (tile >= n_tiles)
+            break;
+
+        uint64_t tile_start = data->tile_ns ? get_time_ns() : 0;
+
+        int x0 = (tile % tiles_x) * INFER_TILE_SIZE;
+        int y0 = (tile / tiles_x) * INFER_TILE_SIZE;
+        int x1 = std::min(x0 + INFER_TILE_SIZE, width);
+        int y1 = std::min(y0 + INFER_TILE_SIZE, height);
+
+        batch.n = 0;
+
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                int off = y * width + x;
+
+                float depth;
+                if (infer_read_depth(data, off, bg_depth, bg_depth_mm, &depth)) {
+                    infer_write_bg(data, off, bg_label);
+                    continue;
+                }
+
+                batch.x[batch.n] = x;
+                batch.y[batch.n] = y;
+                batch.depth[batch.n] = depth / data->probe_scale;
+                batch.n++;
+
+                if (batch.n == INFER_MAX_BATCH) {
+                    infer_process_batch(data, kernel, &batch);
+                    batch.n = 0;
+                }
+            }
+        }
+
+        if (batch.n) {
+            infer_process_batch(data, kernel, &batch);
+        }
+
+        if (data->tile_ns)
+            data->tile_ns[tile] = get_time_ns() - tile_start;
+    }
+}
+
+/* Whereas infer_label_probs_cb() divides the image into tiles, here we
+ * only have a list of foreground pixels to consider which are divided into
+ * even, contiguous ranges for each thread.
+ *
+ * NB: all pixels have already been initialized as background
+ */
+static void
+infer_label_probs_sparse_range(InferThreadData* data, int begin, int end)
+{
+    int n_labels = data->forest[0]->header.n_labels;
+
+    float bg_depth = data->forest[0]->header.bg_depth;
+    int bg_depth_mm = bg_depth_to_mm(bg_depth);
+    int bg_label = data->forest[0]->header.bg_label;
+
+    int width = data->width;
+
+    const struct infer_kernel& kernel = get_infer_kernel();
+
+    const uint8_t* reuse = data->leaf_cache ? data->leaf_cache->reuse : NULL;
+
+    struct infer_batch batch;
+    batch.n = 0;
+
+    struct infer_batch reuse_batch;
+    reuse_batch.n = 0;
+
+    for (int i = begin; i < end; i++) {
+        int off = data->indices ? data->indices[i] : i;
+
+        float depth;
+        if (infer_read_depth(data, off, bg_depth, bg_depth_mm, &depth))
+            continue;
+
+        if (data->output)
+            data->output[off * n_labels + bg_label] = 0.f;
+
+        if (reuse && reuse[off]) {
+            reuse_batch.x[reuse_batch.n] = off % width;
+            reuse_batch.y[reuse_batch.n] = off / width;
+            reuse_batch.depth[reuse_batch.n] = depth / data->probe_scale;
+            reuse_batch.n++;
+
+            if (reuse_batch.n == INFER_MAX_BATCH) {
+                infer_reuse_batch(data, &reuse_batch);
+                reuse_batch.n = 0;
+            }
+            continue;
+        }
+
+        batch.x[batch.n] = off % width;
+        batch.y[batch.n] = off / width;
+        batch.depth[batch.n] = depth / data->probe_scale;
+        batch.n++;
+
+        if (batch.n == INFER_MAX_BATCH) {
+            infer_process_batch(data, kernel, &batch);
+            batch.n = 0;
+        }
+    }
+
+    if (batch.n) {
+        infer_process_batch(data, kernel, &batch);
+    }
+    if (reuse_batch.n) {
+        infer_reuse_batch(data, &reuse_batch);
+    }
+}
+
+static void
+infer_label_probs_sparse_cb(void* userdata)
+{
+    InferThreadData* data = (InferThreadData*)userdata;
+    int n_threads = data->n_threads;
+    int thread_id = data->thread;
+
+    int begin = (int)((int64_t)data->n_indices * thread_id / n_threads);
+    int end = (int)((int64_t)data->n_indices * (thread_id + 1) / n_threads);
+
+    infer_label_probs_sparse_range(data, begin, end);
+}
+
+/* For infer_labels_batch() the pixels of every crop are divided into chunks
+ * of INFER_CROP_CHUNK_SIZE pixels, which threads claim one at a time via a
+ * shared counter across all crops.
+ *
+ * NB: all pixels have already been initialized as background
+ */
+static void
+infer_label_probs_crops_cb(void* userdata)
+{
+    InferThreadData* data = (InferThreadData*)userdata;
+    const struct infer_crops* crops = data->crops;
+    int n_chunks = crops->chunk_ends[crops->n_crops - 1];
+    int crop = 0;
+
+    while (true) {
+        int chunk = data->next_tile->fetch_add(1, std::memory_order_relaxed);
+        if (chunk >= n_chunks)
+            break;
+
+        /* NB: each thread claims chunks in increasing order */
+        while (chunk >= crops->chunk_ends[crop])
+            crop++;
+
+        /* NB: the crop state is shared but stats are per-thread */
+        InferThreadData crop_data = crops->crop_data[crop];
+        crop_data.cascade_stats = data->cascade_stats;
+
+        int first_chunk = crop ? crops->chunk_ends[crop - 1] : 0;
+        int begin = (chunk - first_chunk) * INFER_CROP_CHUNK_SIZE;
+        int end = std::min(begin + INFER_CROP_CHUNK_SIZE, crop_data.n_indices);
+
+        infer_label_probs_sparse_range(&crop_data, begin, end);
+    }
+}
+
+static void
+infer_labels_run(struct gm_logger* log,
+                 RDTree** forest,
+                 int n_trees,
+                 void* depth_image,
+                 bool depth_u16_mm,
+                 int width, int height,
+                 float probe_scale,
+                 const int* indices,
+                 int n_indices,
+                 struct infer_labels_leaf_cache* leaf_cache,
+                 float* out_labels,
+                 struct infer_labels_top_k* out_top_k,
+                 struct infer_labels_pool* pool,
+                 bool do_flip)
+{
+    int n_labels = (int)forest[0]->header.n_labels;
+
+    gm_assert(log, out_labels != NULL || out_top_k != NULL,
+              "NULL output buffer for label probabilities");
+    gm_assert(log, leaf_cache == NULL || indices != NULL,
+              "Leaf caching is only supported for sparse inference");
+
+    /* NB: every pixel of a top-k output is written */
+    if (out_labels)
+        memset(out_labels, 0, width * height * n_labels * sizeof(float));
+
+    std::atomic<int> next_tile(0);
+
+    /* NB: tile costs are written to a per-run buffer and only published to
+     * the pool (under its lock) once the run has completed, so readers of
+     * the stats never see a buffer that's being resized or written to
+     */
+    std::vector<uint64_t> tile_ns;
+
+    void (*infer_labels_callback)(void* userdata);
+    if (indices) {
+        /* Pixels not in the given list of indices are background */
+        InferThreadData bg_data = {
+            0, 1, forest, n_trees,
+            depth_image, width, height, out_labels, do_flip, depth_u16_mm,
+            out_top_k, indices, n_indices, leaf_cache, probe_scale, NULL, NULL, NULL,
+            0, NULL
+        };
+        int bg_label = forest[0]->header.bg_label;
+        for (int off = 0; off < width * height; off++)
+            infer_write_bg(&bg_data, off, bg_label);
+
+        infer_labels_callback = infer_label_probs_sparse_cb;
+    } else {
+        infer_labels_callback = infer_label_probs_cb;
+
+        if (pool) {
+            int tiles_x = (width + INFER_TILE_SIZE - 1) / INFER_TILE_SIZE;
+            int tiles_y = (height + INFER_TILE_SIZE - 1) / INFER_TILE_SIZE;
+            tile_ns.resize(tiles_x * tiles_y);
+        }
+    }
+
+    float cascade_threshold = infer_labels_pool_get_cascade_threshold(pool);
+
+    int n_threads = pool ? infer_labels_pool_get_n_workers(pool) : 1;
+    struct infer_labels_cascade_stats cascade_stats[n_threads];
+    memset(cascade_stats, 0, sizeof(cascade_stats));
+
+    if (n_threads <= 1)
+    {
+        InferThreadData data = {
+            0, 1, forest, n_trees,
+            depth_image, width, height, out_labels, do_flip, depth_u16_mm,
+            out_top_k, indices, n_indices, leaf_cache, probe_scale,
+            &next_tile, tile_ns.empty() ? NULL : tile_ns.data(), NULL,
+            cascade_threshold, &cascade_stats[0]
+        };
+        infer_labels_callback((void*)(&data));
+    }
+    else
+    {
+        InferThreadData data[n_threads];
+
+        for (int i = 0; i < n_threads; ++i)
+        {
+            data[i] = { i, n_threads, forest, n_trees,
+                depth_image, width, height, out_labels, do_flip, depth_u16_mm,
+                out_top_k, indices, n_indices, leaf_cache, probe_scale,
+                &next_tile, tile_ns.empty() ? NULL : tile_ns.data(), NULL,
+                cascade_threshold, &cascade_stats[i] };
+        }
+
+        infer_labels_pool_run(pool, infer_labels_callback, data);
+    }
+
+    if (pool) {
+        infer_labels_pool_add_cascade_stats(pool, cascade_stats, n_threads);
+
+        if (!tile_ns.empty()) {
+            std::lock_guard<std::mutex> scoped_lock(pool->lock);
+            pool->tile_ns.swap(tile_ns);
+        }
+    }
+}
+
+static void
+infer_labels_batch_run(struct gm_logger* log,
+                       RDTree** forest,
+                       int n_trees,
+                       bool depth_u16_mm,
+                       struct infer_labels_crop* crops,
+                       int n_crops,
+                       struct infer_labels_pool* pool,
+                       bool do_flip)
+{
+    if (n_crops <= 0)
+        return;
+
+    int n_labels = (int)forest[0]->header.n_labels;
+    int bg_label = forest[0]->header.bg_label;
+
+    float cascade_threshold = infer_labels_pool_get_cascade_threshold(pool);
+
+    std::vector<InferThreadData> crop_data(n_crops);
+    std::vector<int> chunk_ends(n_crops);
+    int n_chunks = 0;
+
+    for (int i = 0; i < n_crops; i++) {
+        struct infer_labels_crop* crop = &crops[i];
+        int n_pixels = crop->width * crop->height;
+
+        gm_assert(log, crop->out_labels != NULL || crop->out_top_k != NULL,
+                  "NULL output buffer for label probabilities");
+        gm_assert(log, crop->leaf_cache == NULL || crop->indices != NULL,
+                  "Leaf caching is only supported for sparse inference");
+
+        /* NB: without any indices all pixels are considered */
+        int n_indices = crop->indices ? crop->n_indices : n_pixels;
+
+        crop_data[i] = { 0, 1, forest, n_trees,
+            crop->depth_image, crop->width, crop->height, crop->out_labels,
+            do_flip, depth_u16_mm,
+            crop->out_top_k, crop->indices, n_indices, crop->leaf_cache, 1.f,
+            NULL, NULL, NULL, cascade_threshold, NULL };
+
+        if (crop->out_labels)
+            memset(crop->out_labels, 0, n_pixels * n_labels * sizeof(float));
+        for (int off = 0; off < n_pixels; off++)
+            infer_write_bg(&crop_data[i], off, bg_label);
+
+        n_chunks += (n_indices + INFER_CROP_CHUNK_SIZE - 1) / INFER_CROP_CHUNK_SIZE;
+        chunk_ends[i] = n_chunks;
+    }
+
+    struct infer_crops infer_crops = { crop_data.data(), n_crops, chunk_ends.data() };
+    std::atomic<int> next_chunk(0);
+
+    int n_threads = pool ? infer_labels_pool_get_n_workers(pool) : 1;
+    struct infer_labels_cascade_stats cascade_stats[n_threads];
+    memset(cascade_stats, 0, sizeof(cascade_stats));
+
+    if (n_threads <= 1)
+    {
+        InferThreadData data = {
+            0, 1, forest, n_trees,
+            NULL, 0, 0, NULL, do_flip, depth_u16_mm,
+            NULL, NULL, 0, NULL, 1.f,
+            &next_chunk, NULL, &infer_crops, cascade_threshold, &cascade_stats[0]
+        };
+        infer_label_probs_crops_cb((void*)(&data));
+    }
+    else
+    {
+        InferThreadData data[n_threads];
+
+        for (int i = 0; i < n_threads; ++i)
+        {
+            data[i] = { i, n_threads, forest, n_trees,
+                NULL, 0, 0, NULL, do_flip, depth_u16_mm,
+                NULL, NULL, 0, NULL, 1.f,
+                &next_chunk, NULL, &infer_crops,
+                cascade_threshold, &cascade_stats[i] };
+        }
+
+        infer_labels_pool_run(pool, infer_label_probs_crops_cb, data);
+    }
+
+    if (pool)
+        infer_labels_pool_add_cascade_stats(pool, cascade_stats, n_threads);
+}
+
+void
+infer_labels_batch(struct gm_logger* log,
+                   RDTree** forest,
+                   int n_trees,
+                   struct infer_labels_crop* crops,
+                   int n_crops,
+                   struct infer_labels_pool* pool,
+                   bool do_flip)
+{
+    infer_labels_batch_run(log, forest, n_trees,
+                           false, // float metres
+                           crops, n_crops, pool, do_flip);
+}
+
+void
+infer_labels_batch_u16_mm(struct gm_logger* log,
+                          RDTree** forest,
+                          int n_trees,
+                          struct infer_labels_crop* crops,
+                          int n_crops,
+                          struct infer_labels_pool* pool,
+                          bool do_flip)
+{
+    infer_labels_batch_run(log, forest, n_trees,
+                           true, // u16 millimetres
+                           crops, n_crops, pool, do_flip);
+}
+
+float*
+infer_labels(struct gm_logger* log,
+             RDTree** forest,
+             int n_trees,
+             float* depth_image,
+             int width, int height,
+             float* out_labels,
+             struct infer_labels_pool* pool,
+             bool do_flip)
+{
+    infer_labels_run(log, forest, n_trees,
+                     (void*)depth_image, false, // float metres
+                     width, height, 1.f, NULL, 0, NULL,
+                     out_labels, NULL, pool, do_flip);
+    return out_labels;
+}
+
+float*
+infer_labels_u16_mm(struct gm_logger* log,
+                    RDTree** forest,
+                    int n_trees,
+                    uint16_t* depth_image,
+                    int width, int height,
+                    float* out_labels,
+                    struct infer_labels_pool* pool,
+                    bool do_flip)
+{
+    infer_labels_run(log, forest, n_trees,
+                     (void*)depth_image, true, // u16 millimetres
+                     width, height, 1.f, NULL, 0, NULL,
+                     out_labels, NULL, pool, do_flip);
+    return out_labels;
+}
+
+struct infer_labels_top_k*
+infer_labels_top_k(struct gm_logger* log,
+                   RDTree** forest,
+                   int n_trees,
+                   float* depth_image,
+                   int width, int height,
+                   struct infer_labels_top_k* out_top_k,
+                   struct infer_labels_pool* pool,
+                   bool do_flip)
+{
+    infer_labels_run(log, forest, n_trees,
+                     (void*)depth_image, false, // float metres
+                     width, height, 1.f, NULL, 0, NULL,
+                     NULL, out_top_k, pool, do_flip);
+    return out_top_k;
+}
+
+struct infer_labels_top_k*
+infer_labels_top_k_u16_mm(struct gm_logger* log,
+                          RDTree** forest,
+                          int n_trees,
+                          uint16_t* depth_image,
+                          int width, int height,
+                          struct infer_labels_top_k* out_top_k,
+                          struct infer_labels_pool* pool,
+                          bool do_flip)
+{
+    infer_labels_run(log, forest, n_trees,
+                     (void*)depth_image, true, // u16 millimetres
+                     width, height, 1.f, NULL, 0, NULL,
+                     NULL, out_top_k, pool, do_flip);
+    return out_top_k;
+}
+
+float*
+infer_labels_sparse(struct gm_logger* log,
+                    RDTree** forest,
+                    int n_trees,
+                    float* depth_image,
+                    int width, int height,
+                    const int* indices,
+                    int n_indices,
+                    struct infer_labels_leaf_cache* leaf_cache,
+                    float* out_labels,
+                    struct infer_labels_pool* pool,
+                    bool do_flip)
+{
+    infer_labels_run(log, forest, n_trees,
+                     (void*)depth_image, false, // float metres
+                     width, height, 1.f, indices, n_indices, leaf_cache,
+                     out_labels, NULL, pool, do_flip);
+    return out_labels;
+}
+
+float*
+infer_labels_sparse_u16_mm(struct gm_logger* log,
+                           RDTree** forest,
+                           int n_trees,
+                           uint16_t* depth_image,
+                           int width, int height,
+                           const int* indices,
+                           int n_indices,
+                           struct infer_labels_leaf_cache* leaf_cache,
+                           float* out_labels,
+                           struct infer_labels_pool* pool,
+                           bool do_flip)
+{
+    infer_labels_run(log, forest, n_trees,
+                     (void*)depth_image, true, // u16 millimetres
+                     width, height, 1.f, indices, n_indices, leaf_cache,
+                     out_labels, NULL, pool, do_flip);
+    return out_labels;
+}
+
+struct infer_labels_top_k*
+infer_labels_top_k_sparse(struct gm_logger* log,
+                          RDTree** forest,
+                          int n_trees,
+                          float* depth_image,
+                          int width, int height,
+                          const int* indices,
+                          int n_indices,
+                          struct infer_labels_leaf_cache* leaf_cache,
+                          struct infer_labels_top_k* out_top_k,
+                          struct infer_labels_pool* pool,
+                          bool do_flip)
+{
+    infer_labels_run(log, forest, n_trees,
+                     (void*)depth_image, false, // float metres
+                     width, height, 1.f, indices, n_indices, leaf_cache,
+                     NULL, out_top_k, pool, do_flip);
+    return out_top_k;
+}
+
+struct infer_labels_top_k*
+infer_labels_top_k_sparse_u16_mm(struct gm_logger* log,
+                                 RDTree** forest,
+                                 int n_trees,
+                                 uint16_t* depth_image,
+                                 int width, int height,
+                                 const int* indices,
+                                 int n_indices,
+                                 struct infer_labels_leaf_cache* leaf_cache,
+                                 struct infer_labels_top_k* out_top_k,
+                                 struct infer_labels_pool* pool,
+                                 bool do_flip)
+{
+    infer_labels_run(log, forest, n_trees,
+                     (void*)depth_image, true, // u16 millimetres
+                     width, height, 1.f, indices, n_indices, leaf_cache,
+                     NULL, out_top_k, pool, do_flip);
+    return out_top_k;
+}
+
+/* The coarse pass classifies a half resolution image, taking the nearest
+ * depth of each 2x2 block, and halves the u,v offsets to match.
+ *
+ * Pixels whose coarse 3x3 neighbourhood doesn't all share the same most
+ * probable label (including any background or out-of-bounds neighbours)
+ * are then re-classified at full resolution while the remaining pixels
+ * bilinearly interpolate the coarse probabilities.
+ */
+static void
+infer_labels_coarse_to_fine_run(struct gm_logger* log,
+                                RDTree** forest,
+                                int n_trees,
+                                float* depth_image,
+                                int width, int height,
+                                const int* indices,
+                                int n_indices,
+                                float* out_labels,
+                                struct infer_labels_top_k* out_top_k,
+                                struct infer_labels_pool* pool,
+                                bool do_flip,
+                                struct infer_labels_coarse_stats* stats)
+{
+    RDTHeader* header = &forest[0]->header;
+    int n_labels = header->n_labels;
+    float bg_depth = header->bg_depth;
+    int bg_label = header->bg_label;
+
+    int coarse_width = (width + 1) / 2;
+    int coarse_height = (height + 1) / 2;
+    int n_coarse_pixels = coarse_width * coarse_height;
+
+    std::vector<float> coarse_depth(n_coarse_pixels, bg_depth);
+    std::vector<int> fg_indices;
+    fg_indices.reserve(n_indices);
+
+    for (int i = 0; i < n_indices; i++) {
+        int off = indices[i];
+        float depth = depth_image[off];
+        if (depth >= bg_depth)
+            continue;
+
+        fg_indices.push_back(off);
+
+        int x = off % width;
+        int y = off / width;
+        int coff = (y / 2) * coarse_width + (x / 2);
+        coarse_depth[coff] = std::min(coarse_depth[coff], depth);
+    }
+
+    std::vector<int> coarse_indices;
+    for (int off = 0; off < n_coarse_pixels; off++) {
+        if (coarse_depth[off] < bg_depth)
+            coarse_indices.push_back(off);
+    }
+
+    std::vector<float> coarse_probs((size_t)n_coarse_pixels * n_labels);
+    infer_labels_run(log, forest, n_trees,
+                     (void*)coarse_depth.data(), false, // float metres
+                     coarse_width, coarse_height, 0.5f,
+                     coarse_indices.data(), coarse_indices.size(), NULL,
+                     coarse_probs.data(), NULL, pool, do_flip);
+
+    std::vector<uint8_t> coarse_labels(n_coarse_pixels, bg_label);
+    for (int off : coarse_indices) {
+        float* pr_table = &coarse_probs[(size_t)off * n_labels];
+        int best = 0;
+        for (int n = 1; n < n_labels; n++) {
+            if (pr_table[n] > pr_table[best])
+                best = n;
+        }
+        coarse_labels[off] = best;
+    }
+
+    std::vector<int> refine_indices;
+    std::vector<int> upsample_indices;
+    for (int off : fg_indices) {
+        int cx = (off % width) / 2;
+        int cy = (off / width) / 2;
+        int label = coarse_labels[cy * coarse_width + cx];
+        bool boundary = (label == bg_label);
+
+        for (int dy = -1; dy <= 1 && !boundary; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int nx = cx + dx;
+                int ny = cy + dy;
+                if (nx < 0 || nx >= coarse_width ||
+                    ny < 0 || ny >= coarse_height ||
+                    coarse_labels[ny * coarse_width + nx] != label)
+                {
+                    boundary = true;
+                    break;
+                }
+            }
+        }
+
+        if (boundary)
+            refine_indices.push_back(off);
+        else
+            upsample_indices.push_back(off);
+    }
+
+    /* NB: this also initializes every other pixel as background */
+    infer_labels_run(log, forest, n_trees,
+                     (void*)depth_image, false, // float metres
+                     width, height, 1.f,
+                     refine_indices.data(), refine_indices.size(), NULL,
+                     out_labels, out_top_k, pool, do_flip);
+
+    float pr_table[n_labels];
+    for (int off : upsample_indices) {
+        int x = off % width;
+        int y = off / width;
+
+        /* Coarse pixel centres are at (x * 2 + 0.5, y * 2 + 0.5) in the
+         * full resolution image, and since this pixel's whole coarse
+         * neighbourhood is in-bounds then so are all four samples.
+         */
+        float fx = x * 0.5f - 0.25f;
+        float fy = y * 0.5f - 0.25f;
+        int x0 = (int)floorf(fx);
+        int y0 = (int)floorf(fy);
+        float wx = fx - x0;
+        float wy = fy - y0;
+
+        const float* pr00 = &coarse_probs[((size_t)y0 * coarse_width + x0) * n_labels];
+        const float* pr01 = pr00 + n_labels;
+        const float* pr10 = pr00 + (size_t)coarse_width * n_labels;
+        const float* pr11 = pr10 + n_labels;
+
+        float* out_pr_table = out_top_k ? pr_table : &out_labels[(size_t)off * n_labels];
+        for (int n = 0; n < n_labels; n++) {
+            float top = pr00[n] + (pr01[n] - pr00[n]) * wx;
+            float bottom = pr10[n] + (pr11[n] - pr10[n]) * wx;
+            out_pr_table[n] = top + (bottom - top) * wy;
+        }
+
+        if (out_top_k)
+            select_top_k_labels(pr_table, n_labels, &out_top_k[off]);
+    }
+
+    if (stats) {
+        stats->n_pixels = fg_indices.size();
+        stats->n_coarse = coarse_indices.size();
+        stats->n_refined = refine_indices.size();
+    }
+}
+
+float*
+infer_labels_coarse_to_fine(struct gm_logger* log,
+                            RDTree** forest,
+                            int n_trees,
+                            float* depth_image,
+                            int width, int height,
+                            const int* indices,
+                            int n_indices,
+                            float* out_labels,
+                            struct infer_labels_pool* pool,
+                            bool do_flip,
+                            struct infer_labels_coarse_stats* stats)
+{
+    infer_labels_coarse_to_fine_run(log, forest, n_trees, depth_image,
+                                    width, height, indices, n_indices,
+                                    out_labels, NULL, pool, do_flip, stats);
+    return out_labels;
+}
+
+struct infer_labels_top_k*
+infer_labels_top_k_coarse_to_fine(struct gm_logger* log,
+                                  RDTree** forest,
+                                  int n_trees,
+                                  float* depth_image,
+                                  int width, int height,
+                                  const int* indices,
+                                  int n_indices,
+                                  struct infer_labels_top_k* out_top_k,
+                                  struct infer_labels_pool* pool,
+                                  bool do_flip,
+                                  struct infer_labels_coarse_stats* stats)
+{
+    infer_labels_coarse_to_fine_run(log, forest, n_trees, depth_image,
+                                    width, height, indices, n_indices,
+                                    NULL, out_top_k, pool, do_flip, stats);
+    return out_top_k;
+}
+
+struct infer_labels_compiled {
+    void* handle;
+    RDTree** forest;
+    int n_trees;
+};
+
+struct infer_labels_compiled*
+infer_labels_compiled_open(struct gm_logger* log,
+                           const char* filename,
+                           RDTree** forest,
+                           int n_trees,
+                           char** err)
+{
+#ifdef _WIN32
+    gm_throw(log, err, "Loading compiled trees not supported on Windows");
+    return NULL;
+#else
+    void* handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        gm_throw(log, err, "Failed to open compiled forest %s: %s",
+                 filename, dlerror());
+        return NULL;
+    }
+
+    const struct rdt_compiled_forest* compiled =
+        (const struct rdt_compiled_forest*)dlsym(handle,
+                                                 RDT_COMPILED_FOREST_SYMBOL);
+    if (!compiled) {
+        gm_throw(log, err, "Missing %s symbol in %s",
+                 RDT_COMPILED_FOREST_SYMBOL, filename);
+        dlclose(handle);
+        return NULL;
+    }
+
+    if (compiled->abi_version != RDT_COMPILED_ABI_VERSION) {
+        gm_throw(log, err, "Compiled forest %s has ABI version %d, expected %d",
+                 filename, compiled->abi_version, RDT_COMPILED_ABI_VERSION);
+        dlclose(handle);
+        return NULL;
+    }
+
+    if (compiled->n_trees != n_trees) {
+        gm_throw(log, err, "Compiled forest %s has %d trees, expected %d",
+                 filename, compiled->n_trees, n_trees);
+        dlclose(handle);
+        return NULL;
+    }
+
+    for (int i = 0; i < n_trees; i++) {
+        if (!forest[i]->nodes) {
+            gm_throw(log, err, "Compiled trees can only be used with v%d trees",
+                     RDT_VERSION);
+            dlclose(handle);
+            return NULL;
+        }
+        if (forest[i]->compiled_traverse) {
+            gm_throw(log, err, "Tree %d already has compiled code loaded", i);
+            dlclose(handle);
+            return NULL;
+        }
+        if (compiled->tree_hashes[i] != rdt_tree_get_hash(forest[i])) {
+            gm_throw(log, err, "Compiled tree %d in %s doesn't match the loaded tree",
+                     i, filename);
+            dlclose(handle);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < n_trees; i++)
+        forest[i]->compiled_traverse = compiled->traverse[i];
+
+    struct infer_labels_compiled* ret =
+        (struct infer_labels_compiled*)xcalloc(1, sizeof(*ret));
+    ret->handle = handle;
+    ret->forest = forest;
+    ret->n_trees = n_trees;
+
+    return ret;
+#endif
+}
+
+void
+infer_labels_compiled_close(struct infer_labels_compiled* compiled)
+{
+#ifndef _WIN32
+    for (int i = 0; i < compiled->n_trees; i++)
+        compiled->forest[i]->compiled_traverse = NULL;
+    dlclose(compiled->handle);
+#endif
+    xfree(compiled);
+}
+
+float
+infer_labels_get_max_probe_offset(RDTree** forest, int n_trees)
+{
+    float max_offset = 0;
+
+    for (int i = 0; i < n_trees; i++) {
+        RDTree* tree = forest[i];
+
+        if (tree->nodes) {
+            for (uint32_t n = 0; n < tree->n_nodes; n++) {
+                Node* node = &tree->nodes[n];
+                if (node->label_pr_idx != 0)
+                    continue;
+                for (int c = 0; c < 4; c++)
+                    max_offset = std::max(max_offset, fabsf(node->uv[c]));
+            }
+        } else {
+            for (uint32_t n = 0; n < tree->n_clusters; n++) {
+                NodeCluster* cluster = &tree->clusters[n];
+                for (int j = 0; j < 3; j++) {
+                    CompactNode* node = &cluster->nodes[j];
+                    if (node->label_pr_idx != 0)
+                        continue;
+                    for (int c = 0; c < 4; c++) {
+                        max_offset = std::max(max_offset,
+                                              fabsf(rdt_half_to_float(node->uv[c])));
+                    }
+                }
+            }
+        }
+    }
+
+    return max_offset;
+}
+
+void
+infer_labels_top_k_to_pr_table(const struct infer_labels_top_k* top_k,
+                               int n_labels,
+                               float* pr_table)
+{
+    memset(pr_table, 0, sizeof(float) * n_labels);
+    for (int k = 0; k < INFER_LABELS_TOP_K; k++) {
+        if (top_k->probs[k] && top_k->labels[k] < n_labels)
+            pr_table[top_k->labels[k]] += top_k->probs[k] * (1.f / 255.f);
+    }
 }
@@ -31,10 +31,137 @@
 
 #define HUGE_DEPTH 1000.f
 
+#define INFER_LABELS_TOP_K 4
+#define INFER_TILE_SIZE 16
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* A compact alternative to a dense table of n_labels probabilities per-pixel
+ * that only keeps the INFER_LABELS_TOP_K most probable labels, in descending
+ * order of probability. Probabilities are quantised as (probability * 255)
+ * and unused entries have a probability of zero.
+ */
+struct infer_labels_top_k {
+    uint8_t labels[INFER_LABELS_TOP_K];
+    uint8_t probs[INFER_LABELS_TOP_K];
+};
+
+/* A long-lived set of worker threads for label inference so that we don't
+ * pay for creating and joining threads each time we run inference (which may
+ * be several times per frame when there are multiple candidate clusters)
+ */
+struct infer_labels_pool;
+
+/* Pass n_workers <= 0 to create one worker per hardware thread.
+ *
+ * A pool with a single worker doesn't create any threads and inference is
+ * run synchronously on the calling thread, the same as with a NULL pool.
+ */
+struct infer_labels_pool*
+infer_labels_pool_new(struct gm_logger* log, int n_workers);
+
+void
+infer_labels_pool_destroy(struct infer_labels_pool* pool);
+
+int
+infer_labels_pool_get_n_workers(struct infer_labels_pool* pool);
+
+/* Reports the cumulative time (in nanoseconds) that a worker has spent
+ * running inference work vs waiting for work since the pool was created or
+ * since the last _reset_worker_times()
+ */
+void
+infer_labels_pool_get_worker_times(struct infer_labels_pool* pool,
+                                   int worker,
+                                   uint64_t* busy_ns,
+                                   uint64_t* idle_ns);
+
+void
+infer_labels_pool_reset_worker_times(struct infer_labels_pool* pool);
+
+/* Dense inference divides the image into INFER_TILE_SIZE x INFER_TILE_SIZE
+ * tiles that are claimed dynamically by the workers of a pool.
+ */
+struct infer_labels_tile_stats {
+    int tile_size;
+    int n_tiles;
+    uint64_t total_ns;
+    uint64_t mean_ns;
+    uint64_t median_ns;
+    uint64_t p95_ns;
+    uint64_t max_ns;
+};
+
+/* Summarises the time spent on each tile during the most recent dense
+ * inference run via this pool. Returns false if there hasn't been one.
+ */
+bool
+infer_labels_pool_get_tile_stats(struct infer_labels_pool* pool,
+                                 struct infer_labels_tile_stats* stats);
+
+/* Cascaded inference lets a pixel stop evaluating the forest early, after
+ * any tree where the most probable label of the probabilities accumulated so
+ * far (normalized by the number of trees evaluated) is >= @threshold. The
+ * output probabilities of such pixels are then only averaged over the trees
+ * that were evaluated.
+ *
+ * This applies to all inference run via the given pool (which may have a
+ * single worker for synchronous inference). A threshold <= 0 (the default)
+ * disables the cascade so the whole forest is always evaluated.
+ */
+void
+infer_labels_pool_set_cascade_threshold(struct infer_labels_pool* pool,
+                                        float threshold);
+
+struct infer_labels_cascade_stats {
+    uint64_t n_pixels; // traversed pixels (not counting reused leaves)
+    uint64_t n_trees_evaluated; // summed over all traversed pixels
+    uint64_t n_early_exits; // pixels that didn't evaluate all trees
+};
+
+/* Reports the cumulative stats for all inference run via this pool since it
+ * was created or since the last _reset_cascade_stats() (whether or not the
+ * cascade is enabled)
+ */
+void
+infer_labels_pool_get_cascade_stats(struct infer_labels_pool* pool,
+                                    struct infer_labels_cascade_stats* stats);
+
+void
+infer_labels_pool_reset_cascade_stats(struct infer_labels_pool* pool);
+
+/* Trees can be compiled ahead of time to native code via rdt-compile and
+ * built into a plugin that can then be loaded here to replace the
+ * interpreted traversal of the given forest (which must be the same v8
+ * trees that were compiled). Compiled code is only used for inference with
+ * float depth images.
+ *
+ * The forest must not be destroyed while the plugin is open.
+ */
+struct infer_labels_compiled;
+
+struct infer_labels_compiled*
+infer_labels_compiled_open(struct gm_logger* log,
+                           const char* filename,
+                           RDTree** forest,
+                           int n_trees,
+                           char** err);
+
+void
+infer_labels_compiled_close(struct infer_labels_compiled* compiled);
+
+/* Returns the name of the label traversal kernel that was selected at runtime
+ * based on the CPU features available (such as "avx2" or "neon"), see
+ * glimpse_cpu.h
+ */
+const char*
+infer_labels_get_kernel_name(void);
+
+/* If @pool is NULL then inference will be run synchronously on the calling
+ * thread.
+ */
 float* infer_labels(struct gm_logger* log,
                     RDTree** forest,
                     int n_trees,
@@ -42,9 +169,236 @@ float* infer_labels(struct gm_logger* log,
                     int width,
                     int height,
                     float* out_labels,
-                    bool use_threads,
+                    struct infer_labels_pool* pool,
+                    bool flip_label_mapping);
+
+/* Equivalent to infer_labels() but for a GM_FORMAT_Z_U16_MM depth image, using
+ * the same fixed-point sampling as the decision tree training, so results
+ * match the decisions made at training time exactly.
+ *
+ * Zero depth values are considered invalid and treated as background.
+ */
+float* infer_labels_u16_mm(struct gm_logger* log,
+                           RDTree** forest,
+                           int n_trees,
+                           uint16_t* depth_image,
+                           int width,
+                           int height,
+                           float* out_labels,
+                           struct infer_labels_pool* pool,
+                           bool flip_label_mapping);
+
+/* Equivalent to infer_labels() and infer_labels_u16_mm() but writing
+ * width * height top-k entries instead of dense probability tables
+ */
+struct infer_labels_top_k*
+infer_labels_top_k(struct gm_logger* log,
+                   RDTree** forest,
+                   int n_trees,
+                   float* depth_image,
+                   int width,
+                   int height,
+                   struct infer_labels_top_k* out_top_k,
+                   struct infer_labels_pool* pool,
+                   bool flip_label_mapping);
+
+struct infer_labels_top_k*
+infer_labels_top_k_u16_mm(struct gm_logger* log,
+                          RDTree** forest,
+                          int n_trees,
+                          uint16_t* depth_image,
+                          int width,
+                          int height,
+                          struct infer_labels_top_k* out_top_k,
+                          struct infer_labels_pool* pool,
+                          bool flip_label_mapping);
+
+/* For the sparse inference functions below, the leaves reached by each
+ * pixel can be cached (e.g. to reuse for static pixels in the next frame).
+ *
+ * @leaves holds width * height * n_trees * 2 leaf indices (see
+ * INFER_LABELS_LEAF_CACHE_IDX) where the second pass is only used with
+ * flipped inference. The leaves of traversed pixels are written here.
+ *
+ * If @reuse is not NULL then pixels with a non-zero reuse entry aren't
+ * traversed and their current entries in @leaves are used instead.
+ */
+struct infer_labels_leaf_cache {
+    uint32_t* leaves;
+    const uint8_t* reuse;
+};
+
+#define INFER_LABELS_LEAF_CACHE_IDX(OFF, N_TREES, TREE, PASS) \
+    ((((OFF) * (N_TREES)) + (TREE)) * 2 + (PASS))
+
+/* Sparse variants of the above that only run inference for the given list
+ * of pixel offsets (y * width + x) within the depth image, considered to be
+ * the foreground. All other pixels are output as background.
+ *
+ * The full depth image is still needed for sampling neighbouring pixels.
+ * The indices are divided evenly between the workers of the given pool.
+ *
+ * @leaf_cache may be NULL.
+ */
+float*
+infer_labels_sparse(struct gm_logger* log,
+                    RDTree** forest,
+                    int n_trees,
+                    float* depth_image,
+                    int width,
+                    int height,
+                    const int* indices,
+                    int n_indices,
+                    struct infer_labels_leaf_cache* leaf_cache,
+                    float* out_labels,
+                    struct infer_labels_pool* pool,
                     bool flip_label_mapping);
 
+float*
+infer_labels_sparse_u16_mm(struct gm_logger* log,
+                           RDTree** forest,
+                           int n_trees,
+                           uint16_t* depth_image,
+                           int width,
+                           int height,
+                           const int* indices,
+                           int n_indices,
+                           struct infer_labels_leaf_cache* leaf_cache,
+                           float* out_labels,
+                           struct infer_labels_pool* pool,
+                           bool flip_label_mapping);
+
+struct infer_labels_top_k*
+infer_labels_top_k_sparse(struct gm_logger* log,
+                          RDTree** forest,
+                          int n_trees,
+                          float* depth_image,
+                          int width,
+                          int height,
+                          const int* indices,
+                          int n_indices,
+                          struct infer_labels_leaf_cache* leaf_cache,
+                          struct infer_labels_top_k* out_top_k,
+                          struct infer_labels_pool* pool,
+                          bool flip_label_mapping);
+
+struct infer_labels_top_k*
+infer_labels_top_k_sparse_u16_mm(struct gm_logger* log,
+                                 RDTree** forest,
+                                 int n_trees,
+                                 uint16_t* depth_image,
+                                 int width,
+                                 int height,
+                                 const int* indices,
+                                 int n_indices,
+                                 struct infer_labels_leaf_cache* leaf_cache,
+                                 struct infer_labels_top_k* out_top_k,
+                                 struct infer_labels_pool* pool,
+                                 bool flip_label_mapping);
+
+/* A cropped depth image for infer_labels_batch() */
+struct infer_labels_crop {
+    void* depth_image; // float metres or u16 millimetres (see below)
+    int width;
+    int height;
+    const int* indices; // Foreground pixels, or NULL to consider all pixels
+    int n_indices;
+    struct infer_labels_leaf_cache* leaf_cache; // May be NULL
+    float* out_labels; // Either dense label probabilities...
+    struct infer_labels_top_k* out_top_k; // or top-k output (other is NULL)
+};
+
+/* Runs inference for multiple crops (e.g. one per person) with a single
+ * dispatch to the pool so that all workers are kept busy across all crops,
+ * instead of synchronizing after each (possibly small) crop.
+ *
+ * Each crop is otherwise handled like the corresponding sparse (or dense
+ * with NULL indices) function above.
+ */
+void
+infer_labels_batch(struct gm_logger* log,
+                   RDTree** forest,
+                   int n_trees,
+                   struct infer_labels_crop* crops,
+                   int n_crops,
+                   struct infer_labels_pool* pool,
+                   bool flip_label_mapping);
+
+void
+infer_labels_batch_u16_mm(struct gm_logger* log,
+                          RDTree** forest,
+                          int n_trees,
+                          struct infer_labels_crop* crops,
+                          int n_crops,
+                          struct infer_labels_pool* pool,
+                          bool flip_label_mapping);
+
+struct infer_labels_coarse_stats {
+    int n_pixels; // foreground pixels
+    int n_coarse; // pixels classified at half resolution
+    int n_refined; // foreground pixels re-classified at full resolution
+};
+
+/* Coarse-to-fine variants of the sparse inference functions that first
+ * classify a half resolution image (with u,v offsets scaled to match) and
+ * then only traverse the trees at full resolution for pixels near a change
+ * of label (body part boundaries and silhouette edges). Probabilities for
+ * the remaining pixels are bilinearly upsampled.
+ *
+ * The results are an approximation of full resolution inference, which
+ * @stats (may be NULL) can help quantify.
+ */
+float*
+infer_labels_coarse_to_fine(struct gm_logger* log,
+                            RDTree** forest,
+                            int n_trees,
+                            float* depth_image,
+                            int width,
+                            int height,
+                            const int* indices,
+                            int n_indices,
+                            float* out_labels,
+                            struct infer_labels_pool* pool,
+                            bool flip_label_mapping,
+                            struct infer_labels_coarse_stats* stats);
+
+struct infer_labels_top_k*
+infer_labels_top_k_coarse_to_fine(struct gm_logger* log,
+                                  RDTree** forest,
+                                  int n_trees,
+                                  float* depth_image,
+                                  int width,
+                                  int height,
+                                  const int* indices,
+                                  int n_indices,
+                                  struct infer_labels_top_k* out_top_k,
+                                  struct infer_labels_pool* pool,
+                                  bool flip_label_mapping,
+                                  struct infer_labels_coarse_stats* stats);
+
+/* The maximum magnitude of any u,v offset component in the forest, which
+ * divided by the depth of a pixel bounds how far away (in pixels) that pixel
+ * may be sampled while traversing.
+ */
+float
+infer_labels_get_max_probe_offset(RDTree** forest, int n_trees);
+
+/* Expands a top-k entry into a dense table of n_labels probabilities */
+void
+infer_labels_top_k_to_pr_table(const struct infer_labels_top_k* top_k,
+                               int n_labels,
+                               float* pr_table);
+
+static inline float
+infer_labels_top_k_get_pr(const struct infer_labels_top_k* top_k, int label)
+{
+    for (int k = 0; k < INFER_LABELS_TOP_K; k++) {
+        if (top_k->labels[k] == label)
+            return top_k->probs[k] * (1.f / 255.f);
+    }
+    return 0.f;
+}
+
 #ifdef __cplusplus
 }
 #endif
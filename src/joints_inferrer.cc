@@ -74,14 +74,35 @@ struct joints_inferrer
     std::vector<std::vector<Joint>> results;
 };
 
+/* The functions below are templated over how per-pixel label probabilities
+ * are looked up so they can consume either dense tables of n_labels floats
+ * per pixel or compact top-k label entries.
+ */
+struct dense_label_probs {
+    const float* probs;
+    int n_labels;
 
-float*
-joints_inferrer_calc_pixel_weights(struct joints_inferrer *inferrer,
-                                   float* depth_image,
-                                   float* pr_table,
-                                   int width, int height,
-                                   int n_labels,
-                                   float* weights)
+    float get(int pixel_idx, int label) const {
+        return probs[pixel_idx * n_labels + label];
+    }
+};
+
+struct top_k_label_probs {
+    const struct infer_labels_top_k* top_k;
+
+    float get(int pixel_idx, int label) const {
+        return infer_labels_top_k_get_pr(&top_k[pixel_idx], label);
+    }
+};
+
+
+template<typename LabelProbs>
+static float*
+calc_pixel_weights(struct joints_inferrer *inferrer,
+                   float* depth_image,
+                   const LabelProbs &label_probs,
+                   int width, int height,
+                   float* weights)
 {
     int n_joints = inferrer->n_joints;
     std::vector<joint_labels_entry> &map = inferrer->map;
@@ -110,7 +131,7 @@ joints_inferrer_calc_pixel_weights(struct joints_inferrer *inferrer,
                 for (int n = 0; n < map[j].n_labels; n++)
                 {
                     int label = (int)map[j].labels[n];
-                    pr += pr_table[(pixel_idx * n_labels) + label];
+                    pr += label_probs.get(pixel_idx, label);
                 }
                 weights[weight_idx] = pr * depth_2;
             }
@@ -120,6 +141,31 @@ joints_inferrer_calc_pixel_weights(struct joints_inferrer *inferrer,
     return weights;
 }
 
+float*
+joints_inferrer_calc_pixel_weights(struct joints_inferrer *inferrer,
+                                   float* depth_image,
+                                   float* pr_table,
+                                   int width, int height,
+                                   int n_labels,
+                                   float* weights)
+{
+    dense_label_probs label_probs = { pr_table, n_labels };
+    return calc_pixel_weights(inferrer, depth_image, label_probs,
+                              width, height, weights);
+}
+
+float*
+joints_inferrer_calc_pixel_weights_top_k(struct joints_inferrer *inferrer,
+                                         float* depth_image,
+                                         struct infer_labels_top_k* top_k,
+                                         int width, int height,
+                                         float* weights)
+{
+    top_k_label_probs label_probs = { top_k };
+    return calc_pixel_weights(inferrer, depth_image, label_probs,
+                              width, height, weights);
+}
+
 // Clusters are first described as a sparse collection of per-line spans before
 // we iterate through spans to associate them with cluster IDs. If spans are
 // found to be vertically-adjacent to other spans then they should be mapped to
@@ -152,18 +198,18 @@ find_id_root(std::vector<unsigned> &runs, unsigned index)
     return idx;
 }
 
-InferredJoints*
-joints_inferrer_infer_fast(struct joints_inferrer *inferrer,
-                           struct gm_intrinsics *intrinsics,
-                           int cluster_width,
-                           int cluster_height,
-                           int cluster_x0,
-                           int cluster_y0,
-                           float* cluster_depth_image,
-                           float* cluster_label_probs,
-                           float* cluster_weights,
-                           int n_labels,
-                           JIParam* params)
+template<typename LabelProbs>
+static InferredJoints*
+infer_fast(struct joints_inferrer *inferrer,
+           struct gm_intrinsics *intrinsics,
+           int cluster_width,
+           int cluster_height,
+           int cluster_x0,
+           int cluster_y0,
+           float* cluster_depth_image,
+           const LabelProbs &cluster_label_probs,
+           float* cluster_weights,
+           JIParam* params)
 {
     int n_joints = inferrer->n_joints;
     std::vector<joint_labels_entry> &map = inferrer->map;
@@ -221,7 +267,7 @@ joints_inferrer_infer_fast(struct joints_inferrer *inferrer,
                 for (int n = 0; n < map[j].n_labels; ++n)
                 {
                     int label = (int)map[j].labels[n];
-                    float label_pr = cluster_label_probs[(y * cluster_width + x) * n_labels + label];
+                    float label_pr = cluster_label_probs.get(y * cluster_width + x, label);
                     if (label_pr >= params[j].threshold)
                     {
                         threshold_passed = true;
@@ -411,6 +457,47 @@ joints_inferrer_infer_fast(struct joints_inferrer *inferrer,
     return ret;
 }
 
+InferredJoints*
+joints_inferrer_infer_fast(struct joints_inferrer *inferrer,
+                           struct gm_intrinsics *intrinsics,
+                           int cluster_width,
+                           int cluster_height,
+                           int cluster_x0,
+                           int cluster_y0,
+                           float* cluster_depth_image,
+                           float* cluster_label_probs,
+                           float* cluster_weights,
+                           int n_labels,
+                           JIParam* params)
+{
+    dense_label_probs label_probs = { cluster_label_probs, n_labels };
+    return infer_fast(inferrer, intrinsics,
+                      cluster_width, cluster_height,
+                      cluster_x0, cluster_y0,
+                      cluster_depth_image, label_probs, cluster_weights,
+                      params);
+}
+
+InferredJoints*
+joints_inferrer_infer_fast_top_k(struct joints_inferrer *inferrer,
+                                 struct gm_intrinsics *intrinsics,
+                                 int cluster_width,
+                                 int cluster_height,
+                                 int cluster_x0,
+                                 int cluster_y0,
+                                 float* cluster_depth_image,
+                                 struct infer_labels_top_k* cluster_top_k,
+                                 float* cluster_weights,
+                                 JIParam* params)
+{
+    top_k_label_probs label_probs = { cluster_top_k };
+    return infer_fast(inferrer, intrinsics,
+                      cluster_width, cluster_height,
+                      cluster_x0, cluster_y0,
+                      cluster_depth_image, label_probs, cluster_weights,
+                      params);
+}
+
 static int
 compare_joints(LList* a, LList* b, void* userdata)
 {
@@ -419,19 +506,19 @@ compare_joints(LList* a, LList* b, void* userdata)
     return ja->confidence - jb->confidence;
 }
 
-InferredJoints*
-joints_inferrer_infer(struct joints_inferrer* inferrer,
-                      struct gm_intrinsics *intrinsics,
-                      int cluster_width,
-                      int cluster_height,
-                      int cluster_x0,
-                      int cluster_y0,
-                      float* cluster_depth_image,
-                      float* cluster_label_probs,
-                      float* cluster_weights,
-                      float bg_depth,
-                      int n_labels,
-                      JIParam* params)
+template<typename LabelProbs>
+static InferredJoints*
+infer_mean_shift(struct joints_inferrer* inferrer,
+                 struct gm_intrinsics *intrinsics,
+                 int cluster_width,
+                 int cluster_height,
+                 int cluster_x0,
+                 int cluster_y0,
+                 float* cluster_depth_image,
+                 const LabelProbs &cluster_label_probs,
+                 float* cluster_weights,
+                 float bg_depth,
+                 JIParam* params)
 {
     int n_joints = inferrer->n_joints;
     std::vector<joint_labels_entry> &map = inferrer->map;
@@ -474,7 +561,7 @@ joints_inferrer_infer(struct joints_inferrer* inferrer,
                 for (int n = 0; n < map[j].n_labels; n++)
                 {
                     int label = (int)map[j].labels[n];
-                    float label_pr = cluster_label_probs[(idx * n_labels) + label];
+                    float label_pr = cluster_label_probs.get(idx, label);
                     if (label_pr >= threshold)
                     {
                         // Reproject point
@@ -606,6 +693,49 @@ joints_inferrer_infer(struct joints_inferrer* inferrer,
     return result;
 }
 
+InferredJoints*
+joints_inferrer_infer(struct joints_inferrer* inferrer,
+                      struct gm_intrinsics *intrinsics,
+                      int cluster_width,
+                      int cluster_height,
+                      int cluster_x0,
+                      int cluster_y0,
+                      float* cluster_depth_image,
+                      float* cluster_label_probs,
+                      float* cluster_weights,
+                      float bg_depth,
+                      int n_labels,
+                      JIParam* params)
+{
+    dense_label_probs label_probs = { cluster_label_probs, n_labels };
+    return infer_mean_shift(inferrer, intrinsics,
+                            cluster_width, cluster_height,
+                            cluster_x0, cluster_y0,
+                            cluster_depth_image, label_probs, cluster_weights,
+                            bg_depth, params);
+}
+
+InferredJoints*
+joints_inferrer_infer_top_k(struct joints_inferrer* inferrer,
+                            struct gm_intrinsics *intrinsics,
+                            int cluster_width,
+                            int cluster_height,
+                            int cluster_x0,
+                            int cluster_y0,
+                            float* cluster_depth_image,
+                            struct infer_labels_top_k* cluster_top_k,
+                            float* cluster_weights,
+                            float bg_depth,
+                            JIParam* params)
+{
+    top_k_label_probs label_probs = { cluster_top_k };
+    return infer_mean_shift(inferrer, intrinsics,
+                            cluster_width, cluster_height,
+                            cluster_x0, cluster_y0,
+                            cluster_depth_image, label_probs, cluster_weights,
+                            bg_depth, params);
+}
+
 void
 joints_inferrer_free_joints(struct joints_inferrer* inferrer,
                             InferredJoints* joints)
@@ -32,6 +32,7 @@
 #include "parson.h"
 
 #include "glimpse_context.h"
+#include "infer_labels.h"
 
 typedef struct {
     float x;
@@ -96,6 +97,42 @@ joints_inferrer_infer(struct joints_inferrer* inferrer,
                       int n_labels,
                       JIParam* params);
 
+/* Variants of the above that consume the compact top-k label output of
+ * infer_labels_top_k() instead of dense per-pixel probability tables
+ */
+float*
+joints_inferrer_calc_pixel_weights_top_k(struct joints_inferrer* inferrer,
+                                         float* depth_image,
+                                         struct infer_labels_top_k* top_k,
+                                         int width,
+                                         int height,
+                                         float* out_weights);
+
+InferredJoints*
+joints_inferrer_infer_fast_top_k(struct joints_inferrer *inferrer,
+                                 struct gm_intrinsics *intrinsics,
+                                 int cluster_width,
+                                 int cluster_height,
+                                 int cluster_x0,
+                                 int cluster_y0,
+                                 float* cluster_depth_image,
+                                 struct infer_labels_top_k* cluster_top_k,
+                                 float* cluster_weights,
+                                 JIParam* params);
+
+InferredJoints*
+joints_inferrer_infer_top_k(struct joints_inferrer* inferrer,
+                            struct gm_intrinsics *intrinsics,
+                            int cluster_width,
+                            int cluster_height,
+                            int cluster_x0,
+                            int cluster_y0,
+                            float* cluster_depth_image,
+                            struct infer_labels_top_k* cluster_top_k,
+                            float* cluster_weights,
+                            float bg_depth,
+                            JIParam* params);
+
 void
 joints_inferrer_free_joints(struct joints_inferrer* inferrer,
                             InferredJoints* joints);
@@ -33,13 +33,27 @@
 #include <glimpse_log.h>
 
 #include "rdt_tree.h"
+#include "xalloc.h"
 
 static void
 usage(void)
 {
     printf(
 "Usage json-to-rdt [options] <in.json> <out.rdt>\n"
+"      json-to-rdt [options] --forest <tree0.json> [<tree1.json> ...] <out.rdt>\n"
 "\n"
+"    -c,--clustered             Write a cache-blocked (v%d) tree with\n"
+"                               half-float node parameters for faster\n"
+"                               inference\n"
+"    -q,--pr-format=FORMAT      Leaf probability table format: f32 (default),\n"
+"                               u8 or f16\n"
+"    -m,--mappable              Write a page aligned container that can be\n"
+"                               memory mapped and used in place, including\n"
+"                               the mirrored tree for flipped inference\n"
+"    -f,--forest                Write all of the given trees to a single\n"
+"                               (mappable) forest container in which the\n"
+"                               trees share identical leaf probability\n"
+"                               tables\n"
 "    -h,--help                  Display this help\n\n"
 "\n"
 "This tool converts the JSON representation of the randomised decision trees\n"
@@ -47,6 +61,14 @@ usage(void)
 "convenient for fast loading of trees and more compact representation when\n"
 "compressed.\n"
 "\n"
+"Unless --clustered is given the tree is written as a v%d tree which only\n"
+"stores the nodes that were trained, so the size of a tree with many early\n"
+"leaf nodes doesn't grow exponentially with its depth.\n"
+"\n"
+"Note: Many leaves have near-identical (often one-hot) distributions, so\n"
+"      a --forest with --pr-format=u8 tables can be much smaller than the\n"
+"      separate trees.\n"
+"\n"
 "Note: A packed RDT file only needs to contain the minimum information for\n"
 "      efficient runtime inference so the conversion is lossy.\n"
 "\n"
@@ -78,8 +100,8 @@ usage(void)
 "        \"p\": [0, 0, 0, 0.2, 0, 0.2, 0, 0.6, 0, 0 ... ],\n"
 "      }\n"
 "    }\n"
-"  }\n"
-    );
+"  }\n",
+    RDT_CLUSTERED_VERSION, RDT_VERSION);
 }
 
 int
@@ -87,9 +109,17 @@ main(int argc, char **argv)
 {
     struct gm_logger *log = gm_logger_new(NULL, NULL);
     int opt;
-    const char *short_options="+hp";
+    bool clustered = false;
+    bool mappable = false;
+    bool forest = false;
+    enum rdt_pr_format pr_format = RDT_PR_FORMAT_F32;
+    const char *short_options="+hcq:pmf";
     const struct option long_options[] = {
         {"help",            no_argument,        0, 'h'},
+        {"clustered",       no_argument,        0, 'c'},
+        {"pr-format",       required_argument,  0, 'q'},
+        {"mappable",        no_argument,        0, 'm'},
+        {"forest",          no_argument,        0, 'f'},
         {0, 0, 0, 0}
     };
 
@@ -100,23 +130,58 @@ main(int argc, char **argv)
             case 'h':
                 usage();
                 return 0;
+            case 'c':
+                clustered = true;
+                break;
+            case 'q':
+                if (!rdt_pr_format_from_name(optarg, &pr_format)) {
+                    fprintf(stderr, "Unknown probability table format '%s'\n",
+                            optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                mappable = true;
+                break;
+            case 'f':
+                forest = true;
+                break;
             default:
                 usage();
                 return 1;
         }
     }
 
-    if (argc - optind != 2) {
+    if (forest ? argc - optind < 2 : argc - optind != 2) {
         usage();
         return 1;
     }
 
-    RDTree *tree = rdt_tree_load_from_json_file(log,
-                                                argv[optind],
-                                                false, // don't load incomplete trees
-                                                NULL);
-    if (!tree)
-        return 1;
+    int n_trees = argc - optind - 1;
+    const char *out_filename = argv[argc - 1];
+    RDTree **trees = xcalloc(n_trees, sizeof(RDTree *));
+
+    for (int i = 0; i < n_trees; i++) {
+        RDTree *tree = rdt_tree_load_from_json_file(log,
+                                                    argv[optind + i],
+                                                    false, // don't load incomplete trees
+                                                    NULL);
+        if (!tree)
+            return 1;
+
+        if (clustered && !rdt_tree_convert_to_clusters(log, tree, NULL))
+            return 1;
+
+        if (!rdt_tree_quantise_pr_tables(log, tree, pr_format, NULL))
+            return 1;
+
+        trees[i] = tree;
+    }
 
-    return rdt_tree_save(tree, argv[optind+1]) ? 0 : 1;
+    if (forest)
+        return rdt_forest_save(log, trees, n_trees, out_filename, NULL) ? 0 : 1;
+    else if (mappable)
+        return rdt_tree_save_mappable(trees[0], out_filename) ? 0 : 1;
+    else
+        return rdt_tree_save(trees[0], out_filename) ? 0 : 1;
 }
@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2018 Glimp IP Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <getopt-compat.h>
+
+#include <glimpse_log.h>
+
+#include "rdt_tree.h"
+
+#define DEFAULT_N_LEVELS 10
+
+static void
+usage(void)
+{
+    printf(
+"Usage rdt-compile [options] <out.cc> <tree0.rdt> [tree1.rdt ...]\n"
+"      rdt-compile [options] <out.cc> <forest.rdt>\n"
+"\n"
+"    -l,--levels=N              Number of levels of each tree to compile\n"
+"                               (default %d)\n"
+"    -h,--help                  Display this help\n\n"
+"\n"
+"This tool generates C++ code for traversing the given (v%d) forest\n"
+"with the node parameters of the first N levels of each tree baked into\n"
+"the code as constants, so those levels don't need to load any nodes.\n"
+"Deeper levels are still interpreted.\n"
+"\n"
+"A single forest container (see json-to-rdt --forest) may be given instead\n"
+"of separate tree files.\n"
+"\n"
+"The generated code should be built as a plugin that can be loaded via\n"
+"infer_labels_compiled_open() to replace the interpreted traversal of the\n"
+"same trees. test_rdt --compiled=PLUGIN can check the results are identical\n"
+"to the interpreted traversal.\n",
+    DEFAULT_N_LEVELS, RDT_VERSION);
+}
+
+/* NB: printed with enough precision to exactly round trip a float */
+static void
+print_float(FILE* fp, float val)
+{
+    fprintf(fp, "%.9ef", val);
+}
+
+static void
+print_indent(FILE* fp, int indent)
+{
+    fprintf(fp, "%*s", indent * 4, "");
+}
+
+static void
+emit_node(FILE* fp, RDTree* tree, int id, int level, int n_levels,
+          int indent)
+{
+    Node* node = &tree->nodes[id];
+
+    if (node->label_pr_idx != 0) {
+        print_indent(fp, indent);
+        fprintf(fp, "return %" PRIu32 ";\n", node->label_pr_idx);
+        return;
+    }
+
+    if (level == n_levels) {
+        print_indent(fp, indent);
+        fprintf(fp, "return interpret<flip>(nodes, %d, depth_image, width, height, bg_depth, x, y, depth);\n", id);
+        return;
+    }
+
+    print_indent(fp, indent);
+    fprintf(fp, "if (sample_gradient<flip>(depth_image, width, height, bg_depth, x, y, depth, ");
+    print_float(fp, node->uv[0]);
+    fprintf(fp, ", ");
+    print_float(fp, node->uv[1]);
+    fprintf(fp, ", ");
+    print_float(fp, node->uv[2]);
+    fprintf(fp, ", ");
+    print_float(fp, node->uv[3]);
+    fprintf(fp, ") < ");
+    print_float(fp, node->t);
+    fprintf(fp, ") {\n");
+
+    emit_node(fp, tree, id + 1, level + 1, n_levels, indent + 1);
+
+    print_indent(fp, indent);
+    fprintf(fp, "} else {\n");
+
+    emit_node(fp, tree, node->right_idx, level + 1, n_levels, indent + 1);
+
+    print_indent(fp, indent);
+    fprintf(fp, "}\n");
+}
+
+/* NB: the sampling here must exactly match the interpreted traversal in
+ * infer_labels.cc
+ */
+static const char* prologue =
+"/* Generated by rdt-compile - DO NOT EDIT */\n"
+"\n"
+"#include <stdint.h>\n"
+"#include <stdbool.h>\n"
+"\n"
+"#include \"rdt_tree.h\"\n"
+"\n"
+"template<bool flip>\n"
+"static inline float\n"
+"sample_gradient(const float* depth_image, int width, int height,\n"
+"                float bg_depth, int x, int y, float depth,\n"
+"                float u0, float u1, float v0, float v1)\n"
+"{\n"
+"    int ux, uy, vx, vy;\n"
+"    if (flip) {\n"
+"        ux = (int)(x - u0 / depth);\n"
+"        vx = (int)(x - v0 / depth);\n"
+"    } else {\n"
+"        ux = (int)(x + u0 / depth);\n"
+"        vx = (int)(x + v0 / depth);\n"
+"    }\n"
+"    uy = (int)(y + u1 / depth);\n"
+"    vy = (int)(y + v1 / depth);\n"
+"\n"
+"    float upixel = (ux >= 0 && ux < width && uy >= 0 && uy < height) ?\n"
+"        depth_image[uy * width + ux] : bg_depth;\n"
+"    float vpixel = (vx >= 0 && vx < width && vy >= 0 && vy < height) ?\n"
+"        depth_image[vy * width + vx] : bg_depth;\n"
+"\n"
+"    return upixel - vpixel;\n"
+"}\n"
+"\n"
+"template<bool flip>\n"
+"static uint32_t\n"
+"interpret(const Node* nodes, int id, const float* depth_image,\n"
+"          int width, int height, float bg_depth,\n"
+"          int x, int y, float depth)\n"
+"{\n"
+"    while (nodes[id].label_pr_idx == 0) {\n"
+"        const Node* node = &nodes[id];\n"
+"        float gradient = sample_gradient<flip>(depth_image, width, height,\n"
+"                                               bg_depth, x, y, depth,\n"
+"                                               node->uv[0], node->uv[1],\n"
+"                                               node->uv[2], node->uv[3]);\n"
+"        id = (gradient < node->t) ? id + 1 : (int)node->right_idx;\n"
+"    }\n"
+"    return nodes[id].label_pr_idx;\n"
+"}\n";
+
+static void
+emit_tree(FILE* fp, RDTree* tree, int index, int n_levels)
+{
+    fprintf(fp,
+"\n"
+"template<bool flip>\n"
+"static uint32_t\n"
+"tree%d_pixel(const Node* nodes, const float* depth_image,\n"
+"            int width, int height, float bg_depth,\n"
+"            int x, int y, float depth)\n"
+"{\n", index);
+
+    emit_node(fp, tree, 0, 0, n_levels, 1);
+
+    fprintf(fp,
+"}\n"
+"\n"
+"static void\n"
+"tree%d_traverse(const Node* nodes, const float* depth_image,\n"
+"               int width, int height, float bg_depth,\n"
+"               int n, const int* x, const int* y, const float* depth,\n"
+"               bool flip, uint32_t* leaves_out)\n"
+"{\n"
+"    if (flip) {\n"
+"        for (int i = 0; i < n; i++) {\n"
+"            leaves_out[i] = tree%d_pixel<true>(nodes, depth_image, width, height,\n"
+"                                              bg_depth, x[i], y[i], depth[i]);\n"
+"        }\n"
+"    } else {\n"
+"        for (int i = 0; i < n; i++) {\n"
+"            leaves_out[i] = tree%d_pixel<false>(nodes, depth_image, width, height,\n"
+"                                               bg_depth, x[i], y[i], depth[i]);\n"
+"        }\n"
+"    }\n"
+"}\n", index, index, index);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct gm_logger *log = gm_logger_new(NULL, NULL);
+    int opt;
+    int n_levels = DEFAULT_N_LEVELS;
+    const char *short_options="+hl:";
+    const struct option long_options[] = {
+        {"help",            no_argument,        0, 'h'},
+        {"levels",          required_argument,  0, 'l'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL))
+           != -1)
+    {
+        switch (opt) {
+            case 'h':
+                usage();
+                return 0;
+            case 'l':
+                n_levels = atoi(optarg);
+                if (n_levels < 0) {
+                    fprintf(stderr, "Spurious negative number of levels\n");
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage();
+        return 1;
+    }
+
+    const char *out_filename = argv[optind];
+    int n_files = argc - optind - 1;
+    int n_trees = n_files;
+
+    RDTree **forest;
+    if (n_files == 1) {
+        forest = rdt_forest_load_from_file(log, argv[optind + 1], &n_trees,
+                                           NULL);
+    } else {
+        forest = rdt_forest_load_from_files(log,
+                                            (const char **)&argv[optind + 1],
+                                            n_files,
+                                            NULL);
+    }
+    if (!forest)
+        return 1;
+
+    for (int i = 0; i < n_trees; i++) {
+        if (!forest[i]->nodes) {
+            fprintf(stderr, "%s: Only v%d trees can be compiled\n",
+                    argv[optind + 1 + (n_files == 1 ? 0 : i)], RDT_VERSION);
+            return 1;
+        }
+    }
+
+    FILE *fp = fopen(out_filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing\n", out_filename);
+        return 1;
+    }
+
+    fputs(prologue, fp);
+
+    for (int i = 0; i < n_trees; i++)
+        emit_tree(fp, forest[i], i, n_levels);
+
+    fprintf(fp, "\nstatic const uint64_t tree_hashes[] = {\n");
+    for (int i = 0; i < n_trees; i++) {
+        fprintf(fp, "    0x%016" PRIx64 "ULL,\n", rdt_tree_get_hash(forest[i]));
+    }
+    fprintf(fp, "};\n");
+
+    fprintf(fp, "\nstatic const rdt_compiled_traverse_func traverse[] = {\n");
+    for (int i = 0; i < n_trees; i++) {
+        fprintf(fp, "    tree%d_traverse,\n", i);
+    }
+    fprintf(fp, "};\n");
+
+    fprintf(fp,
+"\n"
+"extern \"C\" {\n"
+"__attribute__((visibility(\"default\")))\n"
+"extern const struct rdt_compiled_forest %s;\n"
+"\n"
+"const struct rdt_compiled_forest %s = {\n"
+"    %d, // abi_version\n"
+"    %d, // n_trees\n"
+"    tree_hashes,\n"
+"    traverse,\n"
+"};\n"
+"}\n",
+            RDT_COMPILED_FOREST_SYMBOL, RDT_COMPILED_FOREST_SYMBOL,
+            RDT_COMPILED_ABI_VERSION, n_trees);
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write %s\n", out_filename);
+        return 1;
+    }
+
+    rdt_forest_destroy(forest, n_trees);
+
+    return 0;
+}
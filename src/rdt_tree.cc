@@ -26,24 +26,43 @@
 #include <sys/stat.h>
 
 #include <limits.h>
+#include <inttypes.h>
 #include <string.h>
 #include <math.h>
 #include <stddef.h>
 
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #ifdef _WIN32
 #define fileno(X) _fileno(X)
+#else
+#include <sys/mman.h>
 #endif
 
 #include "rdt_tree.h"
 #include "glimpse_data.h"
 #include "parson.h"
 #include "xalloc.h"
+#include "half.hpp"
+
+using half_float::half;
 
 static void
 assert_rdt_abi()
 {
     static_assert(sizeof(RDTHeader) == 272, "RDT ABI Breakage");
     static_assert(sizeof(Node) == 32,       "RDT ABI Breakage");
+    static_assert(sizeof(CompactNode) == 16, "RDT ABI Breakage");
+    static_assert(sizeof(NodeCluster) == 64, "RDT ABI Breakage");
+    static_assert(sizeof(RDTClusterHeader) == 16, "RDT ABI Breakage");
+    static_assert(sizeof(RDTNodeHeader) == 16, "RDT ABI Breakage");
+    static_assert(sizeof(RDTMappableHeader) == 368, "RDT ABI Breakage");
+    static_assert(sizeof(RDTForestTree) == 16, "RDT ABI Breakage");
+    static_assert(sizeof(RDTForestHeader) == 368, "RDT ABI Breakage");
 
     // The MSVC 2017 headers define offsetof using reinterpret_cast which
     // isn't allowed in const expressions. A future version will apparently
@@ -53,6 +72,7 @@ assert_rdt_abi()
     //          static-assert-cannot-compile-constexprs-method-tha.html
 #ifndef _MSC_VER
     static_assert(offsetof(Node, t) == 16,  "RDT ABI Breakage");
+    static_assert(offsetof(Node, right_idx) == 24,  "RDT ABI Breakage");
 #endif
 }
 
@@ -69,18 +89,20 @@ count_pr_tables(JSON_Object* node)
         count_pr_tables(json_object_get_object(node, "r"));
 }
 
+/* Appends the nodes of the subtree rooted at @jnode to @nodes in depth-first
+ * pre-order
+ */
 static bool
 unpack_json_tree(struct gm_logger* log,
                  JSON_Object* jnode,
-                 Node* nodes,
-                 int node_index,
+                 std::vector<Node>& nodes,
                  float* pr_tables,
                  int* table_index,
                  int n_labels,
                  bool allow_incomplete_leaves,
                  char** err)
 {
-    Node* node = &nodes[node_index];
+    int node_index = nodes.size();
     JSON_Array* p = NULL;
 
     if (!jnode) {
@@ -88,6 +110,11 @@ unpack_json_tree(struct gm_logger* log,
         return false;
     }
 
+    /* NB: zero the padding too so that saved trees are reproducible */
+    Node node;
+    memset(&node, 0, sizeof(node));
+    nodes.push_back(node);
+
     JSON_Array* u = json_object_get_array(jnode, "u");
 
     if (u) {
@@ -110,17 +137,16 @@ unpack_json_tree(struct gm_logger* log,
         }
 
 
-        node->uv[0] = json_array_get_number(u, 0);
-        node->uv[1] = json_array_get_number(u, 1);
-        node->uv[2] = json_array_get_number(v, 0);
-        node->uv[3] = json_array_get_number(v, 1);
-        node->t = json_object_get_number(jnode, "t");
-        node->label_pr_idx = 0;
+        node.uv[0] = json_array_get_number(u, 0);
+        node.uv[1] = json_array_get_number(u, 1);
+        node.uv[2] = json_array_get_number(v, 0);
+        node.uv[3] = json_array_get_number(v, 1);
+        node.t = json_object_get_number(jnode, "t");
+        node.label_pr_idx = 0;
 
         if (!unpack_json_tree(log,
                               json_object_get_object(jnode, "l"),
                               nodes,
-                              node_index * 2 + 1,
                               pr_tables,
                               table_index,
                               n_labels,
@@ -130,10 +156,11 @@ unpack_json_tree(struct gm_logger* log,
             return false;
         }
 
+        node.right_idx = nodes.size();
+
         if (!unpack_json_tree(log,
                               json_object_get_object(jnode, "r"),
                               nodes,
-                              node_index * 2 + 2,
                               pr_tables,
                               table_index,
                               n_labels,
@@ -155,29 +182,239 @@ unpack_json_tree(struct gm_logger* log,
         for (int i = 0; i < n_labels; i++)
             pr_table[i] = (float)json_array_get_number(p, i);
 
-        node->label_pr_idx = ++(*table_index);
+        node.label_pr_idx = ++(*table_index);
 
     } else if (allow_incomplete_leaves) {
-        node->label_pr_idx = INT_MAX;
+        node.label_pr_idx = INT_MAX;
     } else {
         gm_throw(log, err, "Incomplete node %d found while loading", node_index);
         return false;
     }
 
+    /* NB: don't hold a reference to nodes[node_index] across recursion since
+     * the vector may be reallocated
+     */
+    nodes[node_index] = node;
+
+    return true;
+}
+
+/* Appends the subtree rooted at @id of a dense (v6) array of nodes to @nodes
+ * in depth-first pre-order
+ */
+static bool
+pack_dense_nodes(struct gm_logger* log,
+                 const Node* dense,
+                 int n_dense,
+                 int id,
+                 std::vector<Node>& nodes,
+                 char** err)
+{
+    int node_index = nodes.size();
+
+    Node node;
+    memset(&node, 0, sizeof(node));
+    node.uv = dense[id].uv;
+    node.t = dense[id].t;
+    node.label_pr_idx = dense[id].label_pr_idx;
+    nodes.push_back(node);
+
+    if (node.label_pr_idx != 0)
+        return true;
+
+    if (id * 2 + 2 >= n_dense) {
+        gm_throw(log, err, "Spurious non-leaf node %d at max tree depth", id);
+        return false;
+    }
+
+    if (!pack_dense_nodes(log, dense, n_dense, id * 2 + 1, nodes, err))
+        return false;
+    nodes[node_index].right_idx = nodes.size();
+    return pack_dense_nodes(log, dense, n_dense, id * 2 + 2, nodes, err);
+}
+
+/* Since every child index is greater than the index of its parent any
+ * traversal that starts at the root is bounded by n_nodes
+ */
+static bool
+check_nodes(struct gm_logger* log,
+            const Node* nodes,
+            uint32_t n_nodes,
+            char** err)
+{
+    if (n_nodes < 1) {
+        gm_throw(log, err, "Tree has no nodes\n");
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_nodes; i++) {
+        if (nodes[i].label_pr_idx == 0 &&
+            (i + 1 >= n_nodes ||
+             nodes[i].right_idx <= i + 1 ||
+             nodes[i].right_idx >= n_nodes))
+        {
+            gm_throw(log, err, "Out of bounds child node index\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+check_clusters(struct gm_logger* log,
+               const NodeCluster* clusters,
+               uint32_t n_clusters,
+               char** err)
+{
+    for (uint32_t i = 0; i < n_clusters; i++) {
+        for (int c = 0; c < 4; c++) {
+            if (clusters[i].children[c] >= n_clusters) {
+                gm_throw(log, err, "Out of bounds child cluster index\n");
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Replaces the dense (v6) nodes of a tree with the equivalent v8 nodes */
+static bool
+convert_dense_nodes(struct gm_logger* log,
+                    RDTree* tree,
+                    const Node* dense,
+                    char** err)
+{
+    int n_dense = (1<<tree->header.depth) - 1;
+    if (n_dense < 1) {
+        gm_throw(log, err, "Tree has no nodes\n");
+        return false;
+    }
+
+    std::vector<Node> nodes;
+    if (!pack_dense_nodes(log, dense, n_dense, 0, nodes, err))
+        return false;
+
+    tree->n_nodes = nodes.size();
+    tree->nodes = (Node*)xmalloc(nodes.size() * sizeof(Node));
+    memcpy(tree->nodes, nodes.data(), nodes.size() * sizeof(Node));
+    tree->header.version = RDT_VERSION;
+
     return true;
 }
 
+/* The tables of a forest container are the deduplicated union of the
+ * tables of all its trees, so when copied they're only copied once and
+ * shared by all the trees of the forest.
+ */
+struct rdt_shared_pr_tables {
+    std::atomic<int> ref;
+    void* tables;
+    void* mirrored_tables;
+};
+
+static void
+unref_shared_pr_tables(struct rdt_shared_pr_tables* shared)
+{
+    if (--shared->ref == 0) {
+        xfree(shared->tables);
+        if (shared->mirrored_tables)
+            xfree(shared->mirrored_tables);
+        delete shared;
+    }
+}
+
+/* Drops a tree's reference to any shared tables, leaving it without any
+ * label probability tables
+ */
+static void
+release_shared_pr_tables(RDTree* tree)
+{
+    if (!tree->shared_pr_tables)
+        return;
+
+    unref_shared_pr_tables(tree->shared_pr_tables);
+    tree->shared_pr_tables = NULL;
+    tree->label_pr_tables = NULL;
+    tree->quantised_pr_tables = NULL;
+    tree->mirrored_pr_tables = NULL;
+}
+
+static void
+free_mirrored(RDTree* tree)
+{
+    if (tree->mirrored_nodes) {
+        xfree(tree->mirrored_nodes);
+        tree->mirrored_nodes = NULL;
+    }
+    if (tree->mirrored_clusters) {
+        xaligned_free(tree->mirrored_clusters);
+        tree->mirrored_clusters = NULL;
+    }
+    if (tree->mirrored_pr_tables && !tree->shared_pr_tables) {
+        xfree(tree->mirrored_pr_tables);
+        tree->mirrored_pr_tables = NULL;
+    }
+}
+
+/* NB: thresholds are derived from the nodes so they're owned by the tree
+ * even if it's loaded in-place
+ */
+static void
+prepare_thresholds_mm(RDTree* tree)
+{
+    if (tree->thresholds_mm)
+        xfree(tree->thresholds_mm);
+
+    size_t n = tree->clusters ? (size_t)tree->n_clusters * 3 : tree->n_nodes;
+
+    /* The padding lets the last entry be read with a 32bit gather */
+    int16_t* thresholds_mm = (int16_t*)xcalloc(n + 1, sizeof(int16_t));
+    for (size_t i = 0; i < n; i++) {
+        float t = tree->clusters ?
+            rdt_half_to_float(tree->clusters[i / 3].nodes[i % 3].t) :
+            tree->nodes[i].t;
+        float t_mm = roundf(t * 1000.f);
+        thresholds_mm[i] = (int16_t)std::min(std::max(t_mm, (float)INT16_MIN),
+                                             (float)INT16_MAX);
+    }
+    tree->thresholds_mm = thresholds_mm;
+}
+
 void
 rdt_tree_destroy(RDTree* tree)
 {
+    if (tree->thresholds_mm)
+        xfree(tree->thresholds_mm);
+
+    if (tree->in_place) {
+#ifndef _WIN32
+        if (tree->mapping)
+            munmap(tree->mapping, tree->mapping_len);
+#endif
+        xfree(tree);
+        return;
+    }
+
     if (tree->nodes)
     {
         xfree(tree->nodes);
     }
+    if (tree->clusters)
+    {
+        xaligned_free(tree->clusters);
+    }
+    release_shared_pr_tables(tree);
     if (tree->label_pr_tables)
     {
         xfree(tree->label_pr_tables);
     }
+    if (tree->quantised_pr_tables)
+    {
+        xfree(tree->quantised_pr_tables);
+    }
+    free_mirrored(tree);
     xfree(tree);
 }
 
@@ -229,6 +466,45 @@ rdt_util_load_flip_map_from_label_map(struct gm_logger* log,
     return true;
 }
 
+/* Initializes an RDTHeader from the top-level properties of a JSON tree */
+static bool
+init_header_from_json(struct gm_logger* log,
+                      RDTHeader* header,
+                      JSON_Object* json_tree,
+                      char** err)
+{
+    header->tag[0] = 'R';
+    header->tag[1] = 'D';
+    header->tag[2] = 'T';
+    header->version = RDT_VERSION;
+
+    header->depth = (uint8_t)json_object_get_number(json_tree, "depth");
+    header->n_labels = (uint8_t)json_object_get_number(json_tree, "n_labels");
+    header->bg_label = (uint8_t)json_object_get_number(json_tree, "bg_label");
+    header->fov = (float)json_object_get_number(json_tree, "vertical_fov");
+
+    JSON_Value* label_map = json_object_get_value(json_tree, "labels");
+    if (!label_map) {
+        gm_warn(log, "RDT tree with no label map, flipping will be disabled");
+        for (int i = 0; i < header->n_labels; ++i) {
+            header->flip_map[i] = i;
+        }
+    } else if (!rdt_util_load_flip_map_from_label_map(log, label_map,
+                                                      header->flip_map,
+                                                      err))
+    {
+        gm_throw(log, err, "RDT tree with invalid label map");
+        return false;
+    }
+
+    if (json_object_has_value(json_tree, "bg_depth"))
+        header->bg_depth = json_object_get_number(json_tree, "bg_depth");
+    else
+        header->bg_depth = 1000.0;
+
+    return true;
+}
+
 RDTree*
 rdt_tree_load_from_json(struct gm_logger* log,
                         JSON_Value* json_tree_value,
@@ -252,244 +528,1562 @@ rdt_tree_load_from_json(struct gm_logger* log,
     }
 
     RDTree* tree = (RDTree*)xcalloc(1, sizeof(RDTree));
-    tree->header.tag[0] = 'R';
-    tree->header.tag[1] = 'D';
-    tree->header.tag[2] = 'T';
-    tree->header.version = RDT_VERSION;
-
-    tree->header.depth = (uint8_t)json_object_get_number(json_tree, "depth");
-    tree->header.n_labels = (uint8_t)json_object_get_number(json_tree, "n_labels");
-    tree->header.bg_label = (uint8_t)json_object_get_number(json_tree, "bg_label");
-    tree->header.fov = (float)json_object_get_number(json_tree, "vertical_fov");
-
-    JSON_Value* label_map = json_object_get_value(json_tree, "labels");
-    if (!label_map) {
-        gm_warn(log, "RDT tree with no label map, flipping will be disabled");
-        for (int i = 0; i < tree->header.n_labels; ++i) {
-            tree->header.flip_map[i] = i;
-        }
-    } else if (!rdt_util_load_flip_map_from_label_map(log, label_map,
-                                                      tree->header.flip_map,
-                                                      err))
-    {
-        gm_throw(log, err, "RDT tree with invalid label map");
+    if (!init_header_from_json(log, &tree->header, json_tree, err)) {
         xfree(tree);
         return NULL;
     }
 
-    if (json_object_has_value(json_tree, "bg_depth"))
-        tree->header.bg_depth = json_object_get_number(json_tree, "bg_depth");
-    else
-        tree->header.bg_depth = 1000.0;
-
     // Count probability arrays
     int n_pr_tables = root ? count_pr_tables(root) : 0;
     tree->n_pr_tables = n_pr_tables;
 
-    // Allocate tree structure
-    int n_nodes = (1<<tree->header.depth) - 1;
-    tree->nodes = (Node*)xmalloc(n_nodes * sizeof(Node));
-
-    /* In case we don't have a complete tree we need to initialize label_pr_idx
-     * to imply that the node has not been trained yet
-     */
-    for (int i = 0; i < n_nodes; i++)
-        tree->nodes[i].label_pr_idx = INT_MAX;
-
     tree->label_pr_tables = (float*)
         xmalloc(n_pr_tables * tree->header.n_labels * sizeof(float));
 
-    // Copy over nodes and probability tables
+    /* Copy over nodes and probability tables. Untrained nodes of an
+     * incomplete tree have a label_pr_idx of INT_MAX and no children.
+     */
+    std::vector<Node> nodes;
     int table_index = 0;
     if (!unpack_json_tree(log,
-                            root,
-                            tree->nodes,
-                            0,
-                            tree->label_pr_tables,
-                            &table_index,
-                            tree->header.n_labels,
-                            allow_incomplete_leaves,
-                            err))
+                          root,
+                          nodes,
+                          tree->label_pr_tables,
+                          &table_index,
+                          tree->header.n_labels,
+                          allow_incomplete_leaves,
+                          err))
     {
-        xfree(tree);
         xfree(tree->label_pr_tables);
+        xfree(tree);
         return NULL;
-    } else {
-        return tree;
     }
+
+    tree->n_nodes = nodes.size();
+    tree->nodes = (Node*)xmalloc(nodes.size() * sizeof(Node));
+    memcpy(tree->nodes, nodes.data(), nodes.size() * sizeof(Node));
+
+    rdt_tree_prepare_mirrored(tree);
+    prepare_thresholds_mm(tree);
+    return tree;
 }
 
-RDTree*
-rdt_tree_load_from_json_file(struct gm_logger* log,
-                             const char* filename,
-                             bool allow_incomplete_leaves,
-                             char** err)
+/* A minimal pull parser for reading the nodes of a JSON tree as a stream,
+ * without building a DOM, which can take many gigabytes for a deep tree.
+ *
+ * Nodes are appended to @nodes in depth-first pre-order as they are read and
+ * leaf probabilities are appended to @pr_tables.
+ */
+struct json_tree_stream {
+    struct gm_logger* log;
+    FILE* fp;
+    std::vector<char> buf;
+    size_t pos;
+    size_t len;
+    uint64_t offset;    // stream offset of buf[0], for error messages
+
+    bool allow_incomplete_leaves;
+    std::vector<Node> nodes;
+    std::vector<float> pr_tables;
+    int pr_table_len;   // -1 until the first leaf is read
+    uint32_t n_pr_tables;
+    std::vector<float> values;
+};
+
+static int
+stream_peek(struct json_tree_stream* s)
 {
-    JSON_Value *js = json_parse_file(filename);
-    if (!js) {
-        gm_throw(log, err, "Failed to parse %s", filename);
-        return NULL;
+    if (s->pos == s->len) {
+        s->offset += s->len;
+        s->pos = 0;
+        s->len = fread(s->buf.data(), 1, s->buf.size(), s->fp);
+        if (!s->len)
+            return EOF;
     }
+    return (unsigned char)s->buf[s->pos];
+}
 
-    RDTree *tree = rdt_tree_load_from_json(log, js, allow_incomplete_leaves, err);
-    json_value_free(js);
+/* Consumes the next character, also appending it to @capture, if given */
+static int
+stream_next(struct json_tree_stream* s, std::string* capture)
+{
+    int c = stream_peek(s);
+    if (c != EOF) {
+        s->pos++;
+        if (capture)
+            capture->push_back(c);
+    }
+    return c;
+}
 
-    return tree;
+static int
+stream_skip_space(struct json_tree_stream* s)
+{
+    int c;
+    while ((c = stream_peek(s)) == ' ' || c == '\n' || c == '\r' || c == '\t')
+        s->pos++;
+    return c;
 }
 
-RDTree*
-rdt_tree_load_from_buf(struct gm_logger* log,
-                       uint8_t* tree_buf,
-                       int len,
-                       char** err)
+static bool
+stream_expect(struct json_tree_stream* s,
+              char expected,
+              std::string* capture,
+              char** err)
 {
-    assert_rdt_abi();
+    if (stream_skip_space(s) != expected) {
+        gm_throw(s->log, err, "Expected '%c' at offset %" PRIu64 " of JSON tree",
+                 expected, s->offset + s->pos);
+        return false;
+    }
+    stream_next(s, capture);
+    return true;
+}
 
-    RDTree* tree = (RDTree*)xcalloc(1, sizeof(RDTree));
+/* NB: escape sequences are kept as-is in @str, which is fine for comparing
+ * with our own property names
+ */
+static bool
+stream_read_string(struct json_tree_stream* s,
+                   std::string* str,
+                   std::string* capture,
+                   char** err)
+{
+    if (!stream_expect(s, '"', capture, err))
+        return false;
+    if (str)
+        str->clear();
 
-    if ((size_t)len < sizeof(RDTHeader))
-    {
-        gm_throw(log, err, "Buffer too small to contain tree\n");
-        rdt_tree_destroy(tree);
-        return NULL;
+    for (;;) {
+        int c = stream_next(s, capture);
+        if (c == EOF) {
+            gm_throw(s->log, err, "Unterminated string in JSON tree");
+            return false;
+        }
+        if (c == '"')
+            return true;
+        if (str)
+            str->push_back(c);
+        if (c == '\\') {
+            c = stream_next(s, capture);
+            if (c == EOF) {
+                gm_throw(s->log, err, "Unterminated string in JSON tree");
+                return false;
+            }
+            if (str)
+                str->push_back(c);
+        }
     }
-    memcpy(&tree->header, tree_buf, sizeof(RDTHeader));
-    tree_buf += sizeof(RDTHeader);
-    len -= sizeof(RDTHeader);
+}
 
-    if (strncmp(tree->header.tag, "RDT", 3) != 0)
+static bool
+stream_read_number(struct json_tree_stream* s,
+                   double* val,
+                   std::string* capture,
+                   char** err)
+{
+    char num[64];
+    int len = 0;
+
+    stream_skip_space(s);
+    for (int c = stream_peek(s);
+         (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+         c == 'e' || c == 'E';
+         c = stream_peek(s))
     {
-        gm_throw(log, err, "File is not an RDT file\n");
-        rdt_tree_destroy(tree);
-        return NULL;
+        if (len == sizeof(num) - 1) {
+            gm_throw(s->log, err, "Spurious long number at offset %" PRIu64 " of JSON tree",
+                     s->offset + s->pos);
+            return false;
+        }
+        num[len++] = stream_next(s, capture);
     }
+    num[len] = '\0';
 
-    if (tree->header.version != RDT_VERSION)
-    {
-        gm_throw(log, err, "Incompatible RDT version, expected %u, found %u\n",
-                 RDT_VERSION, (unsigned)tree->header.version);
-        rdt_tree_destroy(tree);
-        return NULL;
+    char* end = NULL;
+    *val = strtod(num, &end);
+    if (!len || *end != '\0') {
+        gm_throw(s->log, err, "Expected a number at offset %" PRIu64 " of JSON tree",
+                 s->offset + s->pos);
+        return false;
     }
 
-    // Read in the decision tree nodes
-    int n_nodes = (1<<tree->header.depth) - 1;
-    tree->nodes = (Node*)xmalloc(n_nodes * sizeof(Node));
-    if ((size_t)len < (sizeof(Node) * n_nodes))
-    {
-        gm_throw(log, err, "Error parsing tree nodes\n");
-        rdt_tree_destroy(tree);
-        return NULL;
-    }
-    memcpy(tree->nodes, tree_buf, sizeof(Node) * n_nodes);
-    tree_buf += sizeof(Node) * n_nodes;
-    len -= sizeof(Node) * n_nodes;
+    return true;
+}
 
-    // Read in the label probabilities
-    int label_bytes = len;
-    if (label_bytes % sizeof(float) != 0)
-    {
-        gm_throw(log, err, "Unexpected size of label probability tables\n");
-        rdt_tree_destroy(tree);
-        return NULL;
-    }
-    int n_prs = label_bytes / sizeof(float);
-    if (n_prs % tree->header.n_labels != 0)
-    {
-        gm_throw(log, err, "Unexpected number of label probabilities\n");
-        rdt_tree_destroy(tree);
-        return NULL;
+/* Appends the numbers of an array to @values */
+static bool
+stream_read_numbers(struct json_tree_stream* s,
+                    std::vector<float>& values,
+                    char** err)
+{
+    if (!stream_expect(s, '[', NULL, err))
+        return false;
+    if (stream_skip_space(s) == ']') {
+        s->pos++;
+        return true;
     }
-    int n_tables = n_prs / tree->header.n_labels;
-
-    tree->n_pr_tables = n_tables;
-    tree->label_pr_tables = (float*)xmalloc(label_bytes);
-    memcpy(tree->label_pr_tables, tree_buf,
-           sizeof(float) * tree->header.n_labels * n_tables);
 
-    return tree;
+    for (;;) {
+        double val;
+        if (!stream_read_number(s, &val, NULL, err))
+            return false;
+        values.push_back(val);
+
+        int c = stream_skip_space(s);
+        stream_next(s, NULL);
+        if (c == ']')
+            return true;
+        if (c != ',') {
+            gm_throw(s->log, err, "Expected ',' or ']' at offset %" PRIu64 " of JSON tree",
+                     s->offset + s->pos);
+            return false;
+        }
+    }
 }
 
-RDTree*
-rdt_tree_load_from_file(struct gm_logger* log,
-                        const char* filename,
-                        char** err)
+/* Skips over any JSON value, appending it to @capture (without whitespace),
+ * if given
+ */
+static bool
+stream_skip_value(struct json_tree_stream* s,
+                  std::string* capture,
+                  int depth,
+                  char** err)
 {
-    FILE* tree_fp;
-    if (!(tree_fp = fopen(filename, "r")))
-    {
-        gm_throw(log, err, "Failed to open decision tree: %s\n", filename);
-        return NULL;
+    if (depth > 1000) {
+        gm_throw(s->log, err, "JSON tree values are nested too deeply");
+        return false;
     }
 
-    struct stat sb;
-    if (fstat(fileno(tree_fp), &sb) < 0)
-    {
-        gm_throw(log, err, "Failed to stat decision tree: %s\n", filename);
-        fclose(tree_fp);
-        return NULL;
+    int c = stream_skip_space(s);
+    if (c == '"')
+        return stream_read_string(s, NULL, capture, err);
+
+    if (c == '{' || c == '[') {
+        char close = c == '{' ? '}' : ']';
+        stream_next(s, capture);
+        if (stream_skip_space(s) == close) {
+            stream_next(s, capture);
+            return true;
+        }
+        for (;;) {
+            if (c == '{') {
+                if (!stream_read_string(s, NULL, capture, err) ||
+                    !stream_expect(s, ':', capture, err))
+                {
+                    return false;
+                }
+            }
+            if (!stream_skip_value(s, capture, depth + 1, err))
+                return false;
+
+            int next = stream_skip_space(s);
+            stream_next(s, capture);
+            if (next == close)
+                return true;
+            if (next != ',') {
+                gm_throw(s->log, err, "Expected ',' or '%c' at offset %" PRIu64 " of JSON tree",
+                         close, s->offset + s->pos);
+                return false;
+            }
+        }
     }
 
-    uint8_t* tree_buf = (uint8_t*)xcalloc(1, sb.st_size);
-    if (fread(tree_buf, sb.st_size, 1, tree_fp) != 1)
-    {
-        gm_throw(log, err, "Failed to read decision tree: %s\n", filename);
-        xfree(tree_buf);
-        fclose(tree_fp);
-        return NULL;
+    if (c == 't' || c == 'f' || c == 'n') {
+        while ((c = stream_peek(s)) >= 'a' && c <= 'z')
+            stream_next(s, capture);
+        return true;
     }
 
-    RDTree* tree = rdt_tree_load_from_buf(log, tree_buf, sb.st_size, err);
-    xfree(tree_buf);
+    double val;
+    return stream_read_number(s, &val, capture, err);
+}
+
+/* Since a node is appended before its children, a right subtree that's read
+ * before the left subtree has to be moved after it, adjusting the right
+ * child indices of the moved nodes
+ */
+static void
+stream_swap_subtrees(struct json_tree_stream* s,
+                     uint32_t r_start,
+                     uint32_t l_start,
+                     uint32_t l_end)
+{
+    uint32_t n_right = l_start - r_start;
+    uint32_t n_left = l_end - l_start;
+    std::vector<Node>& nodes = s->nodes;
+
+    std::rotate(nodes.begin() + r_start,
+                nodes.begin() + l_start,
+                nodes.begin() + l_end);
+
+    for (uint32_t i = r_start; i < l_end; i++) {
+        if (nodes[i].label_pr_idx != 0)
+            continue;
+        if (i < r_start + n_left)
+            nodes[i].right_idx -= n_right;
+        else
+            nodes[i].right_idx += n_left;
+    }
+}
+
+static bool
+stream_read_node(struct json_tree_stream* s, int depth, char** err)
+{
+    if (depth > 255) {
+        gm_throw(s->log, err, "JSON tree nodes are nested too deeply");
+        return false;
+    }
+
+    uint32_t node_index = s->nodes.size();
+
+    /* NB: zero the padding too so that saved trees are reproducible */
+    Node node;
+    memset(&node, 0, sizeof(node));
+    s->nodes.push_back(node);
+
+    bool has_u = false, has_v = false, has_t = false, has_p = false;
+    int64_t l_start = -1, l_end = -1, r_start = -1;
+    std::string key;
+
+    if (!stream_expect(s, '{', NULL, err))
+        return false;
+    if (stream_skip_space(s) == '}') {
+        s->pos++;
+    } else {
+        for (;;) {
+            if (!stream_read_string(s, &key, NULL, err) ||
+                !stream_expect(s, ':', NULL, err))
+            {
+                return false;
+            }
+
+            if (key == "t") {
+                double t;
+                if (!stream_read_number(s, &t, NULL, err))
+                    return false;
+                node.t = t;
+                has_t = true;
+            } else if (key == "u" || key == "v") {
+                s->values.clear();
+                if (!stream_read_numbers(s, s->values, err))
+                    return false;
+                s->values.resize(std::max(s->values.size(), (size_t)2), 0.f);
+                int base = key == "u" ? 0 : 2;
+                node.uv[base] = s->values[0];
+                node.uv[base + 1] = s->values[1];
+                if (key == "u")
+                    has_u = true;
+                else
+                    has_v = true;
+            } else if (key == "p") {
+                if (has_p) {
+                    gm_throw(s->log, err, "Spurious leaf node %u with multiple 'p' tables",
+                             node_index);
+                    return false;
+                }
+                size_t start = s->pr_tables.size();
+                if (!stream_read_numbers(s, s->pr_tables, err))
+                    return false;
+                int len = s->pr_tables.size() - start;
+                if (s->pr_table_len < 0)
+                    s->pr_table_len = len;
+                if (len != s->pr_table_len) {
+                    gm_throw(s->log, err, "Leaf node %u has %d label probabilities, expected %d",
+                             node_index, len, s->pr_table_len);
+                    return false;
+                }
+                has_p = true;
+            } else if (key == "l" || key == "r") {
+                if ((key == "l" ? l_start : r_start) >= 0) {
+                    gm_throw(s->log, err, "Spurious tree node %u with multiple '%s' children",
+                             node_index, key.c_str());
+                    return false;
+                }
+                int64_t start = s->nodes.size();
+                if (!stream_read_node(s, depth + 1, err))
+                    return false;
+                if (key == "l") {
+                    l_start = start;
+                    l_end = s->nodes.size();
+                } else {
+                    r_start = start;
+                }
+            } else if (!stream_skip_value(s, NULL, 0, err)) {
+                return false;
+            }
+
+            int c = stream_skip_space(s);
+            stream_next(s, NULL);
+            if (c == '}')
+                break;
+            if (c != ',') {
+                gm_throw(s->log, err, "Expected ',' or '}' at offset %" PRIu64 " of JSON tree",
+                         s->offset + s->pos);
+                return false;
+            }
+        }
+    }
+
+    if (has_u) {
+        if (!has_v) {
+            gm_throw(s->log, err, "Spurious tree node %u with 'u' but no 'v'",
+                     node_index);
+            return false;
+        }
+        if (!has_t) {
+            gm_throw(s->log, err, "Spurious non-leaf tree node %u with no threshold",
+                     node_index);
+            return false;
+        }
+        if (has_p) {
+            gm_throw(s->log, err, "Spurious non-leaf tree node %u with probabilities table",
+                     node_index);
+            return false;
+        }
+        if (l_start < 0 || r_start < 0) {
+            gm_throw(s->log, err, "Spurious missing child of tree node %u",
+                     node_index);
+            return false;
+        }
+
+        if (r_start < l_start)
+            stream_swap_subtrees(s, r_start, l_start, l_end);
+
+        node.label_pr_idx = 0;
+        node.right_idx = node_index + 1 + (l_end - l_start);
+    } else if (has_p) {
+        if (has_v || has_t || l_start >= 0 || r_start >= 0) {
+            gm_throw(s->log, err, "Spurious leaf node %u with 'v', 't', 'l' or 'r' property",
+                     node_index);
+            return false;
+        }
+        node.label_pr_idx = ++s->n_pr_tables;
+    } else if (l_start >= 0 || r_start >= 0) {
+        gm_throw(s->log, err, "Spurious tree node %u with children but no 'u'",
+                 node_index);
+        return false;
+    } else if (s->allow_incomplete_leaves) {
+        node.label_pr_idx = INT_MAX;
+    } else {
+        gm_throw(s->log, err, "Incomplete node %u found while loading", node_index);
+        return false;
+    }
+
+    s->nodes[node_index] = node;
+
+    return true;
+}
+
+RDTree*
+rdt_tree_load_from_json_stream(struct gm_logger* log,
+                               FILE* fp,
+                               bool allow_incomplete_leaves,
+                               JSON_Value** properties,
+                               char** err)
+{
+    assert_rdt_abi();
+
+    struct json_tree_stream s;
+    s.log = log;
+    s.fp = fp;
+    s.buf.resize(256 * 1024);
+    s.pos = 0;
+    s.len = 0;
+    s.offset = 0;
+    s.allow_incomplete_leaves = allow_incomplete_leaves;
+    s.pr_table_len = -1;
+    s.n_pr_tables = 0;
+
+    /* All the top-level properties besides the root are small enough to be
+     * captured and parsed as a DOM
+     */
+    std::string props = "{";
+    bool found_root = false;
+    std::string key;
+
+    if (!stream_expect(&s, '{', NULL, err))
+        return NULL;
+    if (stream_skip_space(&s) == '}') {
+        s.pos++;
+    } else {
+        for (;;) {
+            if (!stream_read_string(&s, &key, NULL, err) ||
+                !stream_expect(&s, ':', NULL, err))
+            {
+                return NULL;
+            }
+
+            if (key == "root") {
+                if (found_root) {
+                    gm_throw(log, err, "Spurious tree with multiple root nodes");
+                    return NULL;
+                }
+                if (!stream_read_node(&s, 0, err))
+                    return NULL;
+                found_root = true;
+            } else {
+                if (props.size() > 1)
+                    props += ',';
+                props += '"' + key + "\":";
+                if (!stream_skip_value(&s, &props, 0, err))
+                    return NULL;
+            }
+
+            int c = stream_skip_space(&s);
+            stream_next(&s, NULL);
+            if (c == '}')
+                break;
+            if (c != ',') {
+                gm_throw(log, err, "Expected ',' or '}' at offset %" PRIu64 " of JSON tree",
+                         s.offset + s.pos);
+                return NULL;
+            }
+        }
+    }
+    if (stream_skip_space(&s) != EOF) {
+        gm_throw(log, err, "Spurious data following JSON tree");
+        return NULL;
+    }
+    props += '}';
+
+    if (!found_root) {
+        gm_throw(log, err, "Failed to find tree root node\n");
+        return NULL;
+    }
+
+    JSON_Value* js = json_parse_string(props.c_str());
+    if (!js) {
+        gm_throw(log, err, "Failed to parse top-level tree properties");
+        return NULL;
+    }
+
+    RDTree* tree = (RDTree*)xcalloc(1, sizeof(RDTree));
+    if (!init_header_from_json(log, &tree->header, json_object(js), err)) {
+        json_value_free(js);
+        xfree(tree);
+        return NULL;
+    }
+
+    int n_labels = tree->header.n_labels;
+    if (s.n_pr_tables && s.pr_table_len != n_labels) {
+        gm_throw(log, err, "Leaf nodes have %d label probabilities, expected %d",
+                 s.pr_table_len, n_labels);
+        json_value_free(js);
+        xfree(tree);
+        return NULL;
+    }
+
+    tree->n_pr_tables = s.n_pr_tables;
+    tree->label_pr_tables = (float*)
+        xmalloc((size_t)s.n_pr_tables * n_labels * sizeof(float));
+    memcpy(tree->label_pr_tables, s.pr_tables.data(),
+           (size_t)s.n_pr_tables * n_labels * sizeof(float));
+
+    tree->n_nodes = s.nodes.size();
+    tree->nodes = (Node*)xmalloc(s.nodes.size() * sizeof(Node));
+    memcpy(tree->nodes, s.nodes.data(), s.nodes.size() * sizeof(Node));
+
+    if (properties)
+        *properties = js;
+    else
+        json_value_free(js);
+
+    rdt_tree_prepare_mirrored(tree);
+    prepare_thresholds_mm(tree);
+    return tree;
+}
+
+RDTree*
+rdt_tree_load_from_json_file(struct gm_logger* log,
+                             const char* filename,
+                             bool allow_incomplete_leaves,
+                             char** err)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        gm_throw(log, err, "Failed to open %s", filename);
+        return NULL;
+    }
+
+    RDTree *tree = rdt_tree_load_from_json_stream(log, fp,
+                                                  allow_incomplete_leaves,
+                                                  NULL, // properties
+                                                  err);
+    fclose(fp);
+
+    return tree;
+}
+
+bool
+rdt_tree_is_mappable(const uint8_t* buf, size_t len)
+{
+    return len >= sizeof(RDTMappableHeader) && memcmp(buf, "RDTM", 4) == 0;
+}
+
+static bool
+check_mappable_section(const RDTSection* section, size_t len)
+{
+    return !section->size || (section->offset % 64 == 0 &&
+                              section->offset <= len &&
+                              section->size <= len - section->offset);
+}
+
+/* Returns a pointer to @size bytes at @offset within the given section of a
+ * mappable container, either in place or as a copy, or NULL if the section
+ * is empty
+ */
+static void*
+get_mappable_range(const uint8_t* buf,
+                   const RDTSection* section,
+                   uint64_t offset,
+                   uint64_t size,
+                   bool in_place,
+                   bool clusters)
+{
+    if (!section->size)
+        return NULL;
+
+    const uint8_t* data = buf + section->offset + offset;
+    if (in_place)
+        return (void*)data;
+
+    /* Align clusters to a cache line so each cluster only spans a single
+     * line (NB: they must then be freed with xaligned_free())
+     */
+    void* copy = clusters ? xaligned_alloc(64, size) : xmalloc(size);
+    memcpy(copy, data, size);
+    return copy;
+}
+
+static void*
+get_mappable_section(const uint8_t* buf,
+                     const RDTSection* section,
+                     bool in_place,
+                     bool clusters)
+{
+    return get_mappable_range(buf, section, 0, section->size, in_place,
+                              clusters);
+}
+
+static RDTree*
+load_mappable(struct gm_logger* log,
+              const uint8_t* buf,
+              size_t len,
+              bool in_place,
+              char** err)
+{
+    assert_rdt_abi();
+
+    if (!rdt_tree_is_mappable(buf, len))
+    {
+        gm_throw(log, err, "Buffer doesn't contain a mappable RDT container\n");
+        return NULL;
+    }
+
+    RDTMappableHeader mappable_header;
+    memcpy(&mappable_header, buf, sizeof(mappable_header));
+
+    if (mappable_header.version != RDT_MAPPABLE_VERSION)
+    {
+        gm_throw(log, err, "Incompatible mappable RDT version, expected %u, found %u\n",
+                 RDT_MAPPABLE_VERSION, (unsigned)mappable_header.version);
+        return NULL;
+    }
+
+    if (in_place && ((uintptr_t)buf % 64) != 0)
+    {
+        gm_throw(log, err, "Mappable RDT buffer isn't suitably aligned\n");
+        return NULL;
+    }
+
+    RDTHeader* header = &mappable_header.header;
+    if (strncmp(header->tag, "RDT", 3) != 0)
+    {
+        gm_throw(log, err, "Mappable container doesn't contain an RDT tree\n");
+        return NULL;
+    }
+
+    int pr_size = rdt_pr_format_get_size((enum rdt_pr_format)header->pr_format);
+    if (!pr_size || !header->n_labels)
+    {
+        gm_throw(log, err, "Unknown label probability table format %u\n",
+                 (unsigned)header->pr_format);
+        return NULL;
+    }
+
+    for (int i = 0; i < RDT_N_SECTIONS; i++) {
+        if (!check_mappable_section(&mappable_header.sections[i], len)) {
+            gm_throw(log, err, "Out of bounds or misaligned RDT section %d\n", i);
+            return NULL;
+        }
+    }
+
+    const RDTSection* sections = mappable_header.sections;
+    uint64_t nodes_size = sections[RDT_SECTION_NODES].size;
+    uint64_t n_clusters = mappable_header.cluster_header.n_clusters;
+
+    if (header->version == RDT_CLUSTERED_VERSION) {
+        if (n_clusters < 1 || nodes_size != sizeof(NodeCluster) * n_clusters)
+        {
+            gm_throw(log, err, "Error parsing tree node clusters\n");
+            return NULL;
+        }
+
+        const NodeCluster* clusters = (const NodeCluster*)
+            (buf + sections[RDT_SECTION_NODES].offset);
+        if (!check_clusters(log, clusters, n_clusters, err))
+            return NULL;
+    } else if (header->version == RDT_VERSION) {
+        if (nodes_size % sizeof(Node) != 0 ||
+            nodes_size / sizeof(Node) > UINT32_MAX)
+        {
+            gm_throw(log, err, "Error parsing tree nodes\n");
+            return NULL;
+        }
+
+        const Node* nodes = (const Node*)
+            (buf + sections[RDT_SECTION_NODES].offset);
+        if (!check_nodes(log, nodes, nodes_size / sizeof(Node), err))
+            return NULL;
+    } else {
+        /* NB: dense (v6) trees can't be used in place since they are
+         * converted while loading
+         */
+        gm_throw(log, err, "Incompatible mappable RDT version, expected %u or %u, found %u\n",
+                 RDT_VERSION, RDT_CLUSTERED_VERSION,
+                 (unsigned)header->version);
+        return NULL;
+    }
+
+    uint64_t table_size = (uint64_t)pr_size * header->n_labels;
+    uint64_t pr_tables_size = sections[RDT_SECTION_PR_TABLES].size;
+    if (pr_tables_size % table_size != 0 || pr_tables_size / table_size > UINT32_MAX)
+    {
+        gm_throw(log, err, "Unexpected size of label probability tables\n");
+        return NULL;
+    }
+
+    uint64_t mirrored_nodes_size = sections[RDT_SECTION_MIRRORED_NODES].size;
+    uint64_t mirrored_pr_tables_size = sections[RDT_SECTION_MIRRORED_PR_TABLES].size;
+    if ((mirrored_nodes_size && mirrored_nodes_size != nodes_size) ||
+        (mirrored_pr_tables_size && mirrored_pr_tables_size != pr_tables_size))
+    {
+        gm_throw(log, err, "Inconsistent size of mirrored tree arrays\n");
+        return NULL;
+    }
+
+    RDTree* tree = (RDTree*)xcalloc(1, sizeof(RDTree));
+    tree->header = *header;
+    tree->in_place = in_place;
+    tree->n_pr_tables = pr_tables_size / table_size;
+
+    bool clustered = header->version == RDT_CLUSTERED_VERSION;
+    void* nodes = get_mappable_section(buf, &sections[RDT_SECTION_NODES],
+                                       in_place, clustered);
+    void* mirrored_nodes =
+        get_mappable_section(buf, &sections[RDT_SECTION_MIRRORED_NODES],
+                             in_place, clustered);
+    if (clustered) {
+        tree->n_clusters = n_clusters;
+        tree->clusters = (NodeCluster*)nodes;
+        tree->mirrored_clusters = (NodeCluster*)mirrored_nodes;
+    } else {
+        tree->n_nodes = nodes_size / sizeof(Node);
+        tree->nodes = (Node*)nodes;
+        tree->mirrored_nodes = (Node*)mirrored_nodes;
+    }
+
+    void* tables = get_mappable_section(buf, &sections[RDT_SECTION_PR_TABLES],
+                                        in_place, false);
+    if (header->pr_format == RDT_PR_FORMAT_F32)
+        tree->label_pr_tables = (float*)tables;
+    else
+        tree->quantised_pr_tables = tables;
+    tree->mirrored_pr_tables =
+        get_mappable_section(buf, &sections[RDT_SECTION_MIRRORED_PR_TABLES],
+                             in_place, false);
+
+    /* Containers written without mirrored arrays can only be given them if
+     * the tree owns its arrays
+     */
+    if (!in_place && !tree->mirrored_nodes && !tree->mirrored_clusters)
+        rdt_tree_prepare_mirrored(tree);
+
+    prepare_thresholds_mm(tree);
+
+    return tree;
+}
+
+RDTree*
+rdt_tree_load_in_place(struct gm_logger* log,
+                       const uint8_t* buf,
+                       size_t len,
+                       char** err)
+{
+    return load_mappable(log, buf, len, true, err);
+}
+
+RDTree*
+rdt_tree_load_from_buf(struct gm_logger* log,
+                       uint8_t* tree_buf,
+                       int len,
+                       char** err)
+{
+    assert_rdt_abi();
+
+    if (len > 0 && rdt_tree_is_mappable(tree_buf, len))
+        return load_mappable(log, tree_buf, len, false, err);
+
+    RDTree* tree = (RDTree*)xcalloc(1, sizeof(RDTree));
+
+    if ((size_t)len < sizeof(RDTHeader))
+    {
+        gm_throw(log, err, "Buffer too small to contain tree\n");
+        rdt_tree_destroy(tree);
+        return NULL;
+    }
+    memcpy(&tree->header, tree_buf, sizeof(RDTHeader));
+    tree_buf += sizeof(RDTHeader);
+    len -= sizeof(RDTHeader);
+
+    if (strncmp(tree->header.tag, "RDT", 3) != 0)
+    {
+        gm_throw(log, err, "File is not an RDT file\n");
+        rdt_tree_destroy(tree);
+        return NULL;
+    }
+
+    if (tree->header.version == RDT_CLUSTERED_VERSION)
+    {
+        RDTClusterHeader cluster_header;
+        if ((size_t)len < sizeof(RDTClusterHeader))
+        {
+            gm_throw(log, err, "Buffer too small to contain cluster header\n");
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+        memcpy(&cluster_header, tree_buf, sizeof(RDTClusterHeader));
+        tree_buf += sizeof(RDTClusterHeader);
+        len -= sizeof(RDTClusterHeader);
+
+        int n_clusters = cluster_header.n_clusters;
+        if (n_clusters < 1 ||
+            (size_t)len < (sizeof(NodeCluster) * n_clusters))
+        {
+            gm_throw(log, err, "Error parsing tree node clusters\n");
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+
+        /* Align to a cache line so each cluster only spans a single line */
+        tree->n_clusters = n_clusters;
+        tree->clusters = (NodeCluster*)
+            xaligned_alloc(64, sizeof(NodeCluster) * n_clusters);
+        memcpy(tree->clusters, tree_buf, sizeof(NodeCluster) * n_clusters);
+        tree_buf += sizeof(NodeCluster) * n_clusters;
+        len -= sizeof(NodeCluster) * n_clusters;
+
+        if (!check_clusters(log, tree->clusters, n_clusters, err)) {
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+    }
+    else if (tree->header.version == RDT_VERSION)
+    {
+        RDTNodeHeader node_header;
+        if ((size_t)len < sizeof(RDTNodeHeader))
+        {
+            gm_throw(log, err, "Buffer too small to contain node header\n");
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+        memcpy(&node_header, tree_buf, sizeof(RDTNodeHeader));
+        tree_buf += sizeof(RDTNodeHeader);
+        len -= sizeof(RDTNodeHeader);
+
+        // Read in the decision tree nodes
+        int n_nodes = node_header.n_nodes;
+        if (n_nodes < 1 ||
+            (size_t)len < (sizeof(Node) * n_nodes))
+        {
+            gm_throw(log, err, "Error parsing tree nodes\n");
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+        tree->n_nodes = n_nodes;
+        tree->nodes = (Node*)xmalloc(n_nodes * sizeof(Node));
+        memcpy(tree->nodes, tree_buf, sizeof(Node) * n_nodes);
+        tree_buf += sizeof(Node) * n_nodes;
+        len -= sizeof(Node) * n_nodes;
+
+        if (!check_nodes(log, tree->nodes, n_nodes, err)) {
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+    }
+    else if (tree->header.version == RDT_DENSE_VERSION)
+    {
+        // Read in the decision tree nodes
+        int n_nodes = (1<<tree->header.depth) - 1;
+        if ((size_t)len < (sizeof(Node) * n_nodes))
+        {
+            gm_throw(log, err, "Error parsing tree nodes\n");
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+        Node* dense = (Node*)xmalloc(n_nodes * sizeof(Node));
+        memcpy(dense, tree_buf, sizeof(Node) * n_nodes);
+        bool converted = convert_dense_nodes(log, tree, dense, err);
+        xfree(dense);
+        if (!converted) {
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+        tree_buf += sizeof(Node) * n_nodes;
+        len -= sizeof(Node) * n_nodes;
+    }
+    else
+    {
+        gm_throw(log, err, "Incompatible RDT version, expected %u, %u or %u, found %u\n",
+                 RDT_VERSION, RDT_CLUSTERED_VERSION, RDT_DENSE_VERSION,
+                 (unsigned)tree->header.version);
+        rdt_tree_destroy(tree);
+        return NULL;
+    }
+
+    int pr_size = rdt_pr_format_get_size((enum rdt_pr_format)tree->header.pr_format);
+    if (!pr_size)
+    {
+        gm_throw(log, err, "Unknown label probability table format %u\n",
+                 (unsigned)tree->header.pr_format);
+        rdt_tree_destroy(tree);
+        return NULL;
+    }
+
+    // Read in the label probabilities
+    int label_bytes = len;
+    if (label_bytes % pr_size != 0)
+    {
+        gm_throw(log, err, "Unexpected size of label probability tables\n");
+        rdt_tree_destroy(tree);
+        return NULL;
+    }
+    int n_prs = label_bytes / pr_size;
+    if (n_prs % tree->header.n_labels != 0)
+    {
+        gm_throw(log, err, "Unexpected number of label probabilities\n");
+        rdt_tree_destroy(tree);
+        return NULL;
+    }
+    int n_tables = n_prs / tree->header.n_labels;
+
+    tree->n_pr_tables = n_tables;
+    void* tables = xmalloc(label_bytes);
+    memcpy(tables, tree_buf, (size_t)pr_size * tree->header.n_labels * n_tables);
+    if (tree->header.pr_format == RDT_PR_FORMAT_F32)
+        tree->label_pr_tables = (float*)tables;
+    else
+        tree->quantised_pr_tables = tables;
+
+    rdt_tree_prepare_mirrored(tree);
+    prepare_thresholds_mm(tree);
+
+    return tree;
+}
+
+RDTree*
+rdt_tree_load_from_file(struct gm_logger* log,
+                        const char* filename,
+                        char** err)
+{
+    FILE* tree_fp;
+    if (!(tree_fp = fopen(filename, "r")))
+    {
+        gm_throw(log, err, "Failed to open decision tree: %s\n", filename);
+        return NULL;
+    }
+
+    struct stat sb;
+    if (fstat(fileno(tree_fp), &sb) < 0)
+    {
+        gm_throw(log, err, "Failed to stat decision tree: %s\n", filename);
+        fclose(tree_fp);
+        return NULL;
+    }
+
+#ifndef _WIN32
+    /* NB: a mappable container is used in-place, keeping the mapping, while
+     * other trees are only copied once, from the mapping.
+     */
+    void* mapping = sb.st_size ?
+        mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fileno(tree_fp), 0) :
+        MAP_FAILED;
+    if (mapping != MAP_FAILED) {
+        fclose(tree_fp);
+
+        const uint8_t* buf = (const uint8_t*)mapping;
+        RDTree* tree;
+        if (rdt_tree_is_mappable(buf, sb.st_size)) {
+            tree = rdt_tree_load_in_place(log, buf, sb.st_size, err);
+            if (tree) {
+                tree->mapping = mapping;
+                tree->mapping_len = sb.st_size;
+                return tree;
+            }
+        } else {
+            tree = rdt_tree_load_from_buf(log, (uint8_t*)buf, sb.st_size, err);
+        }
+
+        munmap(mapping, sb.st_size);
+        return tree;
+    }
+#endif
+
+    uint8_t* tree_buf = (uint8_t*)xcalloc(1, sb.st_size);
+    if (fread(tree_buf, sb.st_size, 1, tree_fp) != 1)
+    {
+        gm_throw(log, err, "Failed to read decision tree: %s\n", filename);
+        xfree(tree_buf);
+        fclose(tree_fp);
+        return NULL;
+    }
+
+    RDTree* tree = rdt_tree_load_from_buf(log, tree_buf, sb.st_size, err);
+    xfree(tree_buf);
     fclose(tree_fp);
 
-    return tree;
+    return tree;
+}
+
+bool
+rdt_tree_save(RDTree* tree, const char* filename)
+{
+    bool success;
+    FILE* output;
+
+    if (!(output = fopen(filename, "wb")))
+    {
+        fprintf(stderr, "Failed to open output file '%s'\n", filename);
+        return false;
+    }
+
+    success = false;
+    if (fwrite(&tree->header, sizeof(RDTHeader), 1, output) != 1)
+    {
+        fprintf(stderr, "Error writing header\n");
+        goto save_tree_close;
+    }
+
+    if (tree->clusters) {
+        RDTClusterHeader cluster_header = {};
+        cluster_header.n_clusters = tree->n_clusters;
+        cluster_header.n_pr_tables = tree->n_pr_tables;
+
+        if (fwrite(&cluster_header, sizeof(cluster_header), 1, output) != 1)
+        {
+            fprintf(stderr, "Error writing cluster header\n");
+            goto save_tree_close;
+        }
+
+        if (fwrite(tree->clusters, sizeof(NodeCluster), tree->n_clusters,
+                   output) != (size_t)tree->n_clusters)
+        {
+            fprintf(stderr, "Error writing tree node clusters\n");
+            goto save_tree_close;
+        }
+    } else {
+        RDTNodeHeader node_header = {};
+        node_header.n_nodes = tree->n_nodes;
+        node_header.n_pr_tables = tree->n_pr_tables;
+
+        if (fwrite(&node_header, sizeof(node_header), 1, output) != 1)
+        {
+            fprintf(stderr, "Error writing node header\n");
+            goto save_tree_close;
+        }
+
+        if (fwrite(tree->nodes, sizeof(Node), tree->n_nodes,
+                   output) != (size_t)tree->n_nodes)
+        {
+            fprintf(stderr, "Error writing tree nodes\n");
+            goto save_tree_close;
+        }
+    }
+
+    if (fwrite(tree->label_pr_tables ? tree->label_pr_tables :
+               tree->quantised_pr_tables,
+               rdt_pr_format_get_size((enum rdt_pr_format)tree->header.pr_format) *
+               tree->header.n_labels,
+               tree->n_pr_tables, output) != (size_t)tree->n_pr_tables)
+    {
+        fprintf(stderr, "Error writing tree probability tables\n");
+        goto save_tree_close;
+    }
+
+    success = true;
+
+save_tree_close:
+    if (fclose(output) != 0)
+    {
+        fprintf(stderr, "Error closing output file\n");
+        return false;
+    }
+
+    return success;
+}
+
+/* Lays out the given sections of a mappable container at
+ * RDT_MAPPABLE_ALIGNMENT aligned offsets following the header (which
+ * contains the sections) and writes the container. Sections without any
+ * data are left empty.
+ */
+static bool
+write_mappable(const char* filename,
+               const void* header,
+               size_t header_size,
+               RDTSection** sections,
+               const void** data,
+               int n_sections)
+{
+    uint64_t offset = header_size;
+    for (int i = 0; i < n_sections; i++) {
+        RDTSection* section = sections[i];
+        if (!data[i]) {
+            section->offset = 0;
+            section->size = 0;
+            continue;
+        }
+
+        offset = (offset + RDT_MAPPABLE_ALIGNMENT - 1) &
+            ~(uint64_t)(RDT_MAPPABLE_ALIGNMENT - 1);
+        section->offset = offset;
+        offset += section->size;
+    }
+
+    FILE* output;
+    if (!(output = fopen(filename, "wb")))
+    {
+        fprintf(stderr, "Failed to open output file '%s'\n", filename);
+        return false;
+    }
+
+    bool success = false;
+    uint64_t pos = 0;
+    static const uint8_t zeros[RDT_MAPPABLE_ALIGNMENT] = { 0 };
+
+    if (fwrite(header, header_size, 1, output) != 1)
+    {
+        fprintf(stderr, "Error writing header\n");
+        goto write_mappable_close;
+    }
+    pos = header_size;
+
+    for (int i = 0; i < n_sections; i++) {
+        RDTSection* section = sections[i];
+        if (!data[i])
+            continue;
+
+        size_t padding = section->offset - pos;
+        if (padding && fwrite(zeros, padding, 1, output) != 1)
+        {
+            fprintf(stderr, "Error writing section padding\n");
+            goto write_mappable_close;
+        }
+        if (section->size &&
+            fwrite(data[i], section->size, 1, output) != 1)
+        {
+            fprintf(stderr, "Error writing tree section %d\n", i);
+            goto write_mappable_close;
+        }
+        pos = section->offset + section->size;
+    }
+
+    success = true;
+
+write_mappable_close:
+    if (fclose(output) != 0)
+    {
+        fprintf(stderr, "Error closing output file\n");
+        return false;
+    }
+
+    return success;
+}
+
+bool
+rdt_tree_save_mappable(RDTree* tree, const char* filename)
+{
+    RDTMappableHeader mappable_header = {};
+    memcpy(mappable_header.tag, "RDTM", 4);
+    mappable_header.version = RDT_MAPPABLE_VERSION;
+    mappable_header.alignment = RDT_MAPPABLE_ALIGNMENT;
+    mappable_header.header = tree->header;
+
+    const void* data[RDT_N_SECTIONS];
+    RDTSection* sections[RDT_N_SECTIONS];
+    size_t pr_tables_size =
+        (size_t)rdt_pr_format_get_size((enum rdt_pr_format)tree->header.pr_format) *
+        tree->header.n_labels * tree->n_pr_tables;
+    size_t nodes_size;
+
+    if (tree->clusters) {
+        mappable_header.cluster_header.n_clusters = tree->n_clusters;
+        mappable_header.cluster_header.n_pr_tables = tree->n_pr_tables;
+        nodes_size = sizeof(NodeCluster) * tree->n_clusters;
+        data[RDT_SECTION_NODES] = tree->clusters;
+        data[RDT_SECTION_MIRRORED_NODES] = tree->mirrored_clusters;
+    } else {
+        nodes_size = sizeof(Node) * tree->n_nodes;
+        data[RDT_SECTION_NODES] = tree->nodes;
+        data[RDT_SECTION_MIRRORED_NODES] = tree->mirrored_nodes;
+    }
+    data[RDT_SECTION_PR_TABLES] = tree->label_pr_tables ?
+        (const void*)tree->label_pr_tables : tree->quantised_pr_tables;
+    data[RDT_SECTION_MIRRORED_PR_TABLES] = tree->mirrored_pr_tables;
+
+    for (int i = 0; i < RDT_N_SECTIONS; i++) {
+        sections[i] = &mappable_header.sections[i];
+        sections[i]->size = (i == RDT_SECTION_NODES ||
+                             i == RDT_SECTION_MIRRORED_NODES) ?
+            nodes_size : pr_tables_size;
+    }
+
+    return write_mappable(filename, &mappable_header, sizeof(mappable_header),
+                          sections, data, RDT_N_SECTIONS);
+}
+
+static uint16_t
+float_to_half_bits(float val)
+{
+    half h = half_float::half_cast<half, std::round_to_nearest>(val);
+    uint16_t bits;
+    memcpy(&bits, &h, sizeof(bits));
+    return bits;
+}
+
+static void
+pack_compact_node(const Node* node, CompactNode* compact)
+{
+    memset(compact, 0, sizeof(*compact));
+    compact->label_pr_idx = node->label_pr_idx;
+
+    /* NB: the u,v and threshold values of leaf nodes are undefined */
+    if (node->label_pr_idx != 0)
+        return;
+
+    for (int i = 0; i < 4; i++)
+        compact->uv[i] = float_to_half_bits(node->uv[i]);
+    compact->t = float_to_half_bits(node->t);
+}
+
+/* Recursively packs the two-level subtree rooted at node @id into a
+ * new cluster, followed (depth-first) by the clusters for its descendants.
+ * Returns the index of the new cluster.
+ */
+static uint32_t
+pack_node_clusters(const Node* nodes,
+                   int id,
+                   std::vector<NodeCluster>& clusters)
+{
+    uint32_t idx = clusters.size();
+    clusters.emplace_back();
+    memset(&clusters[idx], 0, sizeof(NodeCluster));
+
+    pack_compact_node(&nodes[id], &clusters[idx].nodes[0]);
+    if (nodes[id].label_pr_idx != 0)
+        return idx;
+
+    for (int c = 0; c < 2; c++) {
+        int child_id = c ? nodes[id].right_idx : id + 1;
+
+        pack_compact_node(&nodes[child_id], &clusters[idx].nodes[1 + c]);
+        if (nodes[child_id].label_pr_idx != 0)
+            continue;
+
+        /* NB: don't hold a reference to clusters[idx] across recursion since
+         * the vector may be reallocated
+         */
+        for (int g = 0; g < 2; g++) {
+            int grandchild_id = g ? nodes[child_id].right_idx : child_id + 1;
+            uint32_t grandchild = pack_node_clusters(nodes, grandchild_id,
+                                                     clusters);
+            clusters[idx].children[c * 2 + g] = grandchild;
+        }
+    }
+
+    return idx;
+}
+
+bool
+rdt_tree_convert_to_clusters(struct gm_logger* log,
+                             RDTree* tree,
+                             char** err)
+{
+    assert_rdt_abi();
+
+    if (tree->clusters)
+        return true;
+
+    if (!tree->nodes) {
+        gm_throw(log, err, "Can't convert tree without any nodes");
+        return false;
+    }
+
+    if (tree->in_place) {
+        gm_throw(log, err, "Can't convert a tree that's loaded in-place");
+        return false;
+    }
+
+    std::vector<NodeCluster> clusters;
+    pack_node_clusters(tree->nodes, 0, clusters);
+
+    tree->n_clusters = clusters.size();
+    tree->clusters = (NodeCluster*)
+        xaligned_alloc(64, sizeof(NodeCluster) * clusters.size());
+    memcpy(tree->clusters, clusters.data(),
+           sizeof(NodeCluster) * clusters.size());
+
+    xfree(tree->nodes);
+    tree->nodes = NULL;
+    tree->n_nodes = 0;
+    tree->header.version = RDT_CLUSTERED_VERSION;
+
+    if (tree->mirrored_nodes)
+        rdt_tree_prepare_mirrored(tree);
+    prepare_thresholds_mm(tree);
+
+    return true;
+}
+
+/* Returns a copy of the given tables permuted by header->flip_map, or NULL
+ * if there are no tables or flip_map isn't a permutation
+ */
+static void*
+make_mirrored_pr_tables(const RDTHeader* header,
+                        uint32_t n_pr_tables,
+                        const void* tables)
+{
+    /* Accumulating table[n] into flip_map[n] can only be replaced by a
+     * permuted table if no two labels map to the same label
+     */
+    int n_labels = header->n_labels;
+    bool seen[256] = { false };
+    for (int n = 0; n < n_labels; n++) {
+        int flipped = header->flip_map[n];
+        if (flipped >= n_labels || seen[flipped])
+            return NULL;
+        seen[flipped] = true;
+    }
+
+    if (!tables)
+        return NULL;
+
+    int pr_size = rdt_pr_format_get_size((enum rdt_pr_format)header->pr_format);
+    const uint8_t* src = (const uint8_t*)tables;
+    uint8_t* dst = (uint8_t*)xmalloc((size_t)n_pr_tables * n_labels * pr_size);
+    for (uint32_t t = 0; t < n_pr_tables; t++) {
+        size_t table_off = (size_t)t * n_labels;
+        for (int n = 0; n < n_labels; n++) {
+            memcpy(dst + (table_off + header->flip_map[n]) * pr_size,
+                   src + (table_off + n) * pr_size,
+                   pr_size);
+        }
+    }
+    return dst;
+}
+
+/* NB: negating the x offsets is exactly equivalent to subtracting them
+ * while traversing, as done for flipped inference with the original nodes.
+ */
+void
+rdt_tree_prepare_mirrored(RDTree* tree)
+{
+    /* Any mirrored arrays of a tree loaded in-place come from its container */
+    if (tree->in_place)
+        return;
+
+    free_mirrored(tree);
+
+    if (tree->nodes) {
+        int n_nodes = tree->n_nodes;
+        tree->mirrored_nodes = (Node*)xmalloc(n_nodes * sizeof(Node));
+        memcpy(tree->mirrored_nodes, tree->nodes, n_nodes * sizeof(Node));
+        for (int i = 0; i < n_nodes; i++) {
+            tree->mirrored_nodes[i].uv[0] = -tree->nodes[i].uv[0];
+            tree->mirrored_nodes[i].uv[2] = -tree->nodes[i].uv[2];
+        }
+    }
+
+    if (tree->clusters) {
+        size_t size = sizeof(NodeCluster) * tree->n_clusters;
+        tree->mirrored_clusters = (NodeCluster*)xaligned_alloc(64, size);
+        memcpy(tree->mirrored_clusters, tree->clusters, size);
+        for (uint32_t i = 0; i < tree->n_clusters; i++) {
+            for (int n = 0; n < 3; n++) {
+                CompactNode* node = &tree->mirrored_clusters[i].nodes[n];
+                node->uv[0] ^= 0x8000; // flip half-float sign bit
+                node->uv[2] ^= 0x8000;
+            }
+        }
+    }
+
+    /* NB: shared tables are only mirrored once, when the forest is loaded */
+    if (!tree->shared_pr_tables) {
+        const void* tables = tree->label_pr_tables ?
+            (const void*)tree->label_pr_tables :
+            (const void*)tree->quantised_pr_tables;
+        tree->mirrored_pr_tables =
+            make_mirrored_pr_tables(&tree->header, tree->n_pr_tables, tables);
+    }
+}
+
+static inline uint64_t
+fnv1a_64(uint64_t hash, const void* data, size_t len)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
 }
 
-bool
-rdt_tree_save(RDTree* tree, const char* filename)
+uint64_t
+rdt_tree_get_hash(RDTree* tree)
 {
-    int n_nodes;
-    bool success;
-    FILE* output;
+    if (!tree->nodes)
+        return 0;
 
-    if (!(output = fopen(filename, "wb")))
-    {
-        fprintf(stderr, "Failed to open output file '%s'\n", filename);
-        return false;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a_64(hash, &tree->header.depth, sizeof(tree->header.depth));
+    hash = fnv1a_64(hash, &tree->n_nodes, sizeof(tree->n_nodes));
+
+    /* NB: we avoid hashing the Node structs directly since the padding
+     * bytes may be uninitialized
+     */
+    for (uint32_t i = 0; i < tree->n_nodes; i++) {
+        Node* node = &tree->nodes[i];
+        float uvt[5] = { node->uv[0], node->uv[1], node->uv[2], node->uv[3],
+                         node->t };
+        hash = fnv1a_64(hash, uvt, sizeof(uvt));
+        hash = fnv1a_64(hash, &node->label_pr_idx, sizeof(node->label_pr_idx));
+        hash = fnv1a_64(hash, &node->right_idx, sizeof(node->right_idx));
     }
 
-    success = false;
-    if (fwrite(&tree->header, sizeof(RDTHeader), 1, output) != 1)
-    {
-        fprintf(stderr, "Error writing header\n");
-        goto save_tree_close;
+    return hash;
+}
+
+int
+rdt_pr_format_get_size(enum rdt_pr_format format)
+{
+    switch (format) {
+    case RDT_PR_FORMAT_F32:
+        return sizeof(float);
+    case RDT_PR_FORMAT_U8:
+        return sizeof(uint8_t);
+    case RDT_PR_FORMAT_F16:
+        return sizeof(uint16_t);
     }
 
-    n_nodes = (1<<tree->header.depth) - 1;
-    if (fwrite(tree->nodes, sizeof(Node), n_nodes, output) != (size_t)n_nodes)
-    {
-        fprintf(stderr, "Error writing tree nodes\n");
-        goto save_tree_close;
+    return 0;
+}
+
+const char*
+rdt_pr_format_get_name(enum rdt_pr_format format)
+{
+    switch (format) {
+    case RDT_PR_FORMAT_F32:
+        return "f32";
+    case RDT_PR_FORMAT_U8:
+        return "u8";
+    case RDT_PR_FORMAT_F16:
+        return "f16";
     }
 
-    if (fwrite(tree->label_pr_tables, sizeof(float) * tree->header.n_labels,
-               tree->n_pr_tables, output) != (size_t)tree->n_pr_tables)
-    {
-        fprintf(stderr, "Error writing tree probability tables\n");
-        goto save_tree_close;
+    return "unknown";
+}
+
+bool
+rdt_pr_format_from_name(const char* name, enum rdt_pr_format* format)
+{
+    enum rdt_pr_format formats[] = {
+        RDT_PR_FORMAT_F32,
+        RDT_PR_FORMAT_U8,
+        RDT_PR_FORMAT_F16,
+    };
+
+    for (int i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++) {
+        if (strcmp(name, rdt_pr_format_get_name(formats[i])) == 0) {
+            *format = formats[i];
+            return true;
+        }
     }
 
-    success = true;
+    return false;
+}
 
-save_tree_close:
-    if (fclose(output) != 0)
-    {
-        fprintf(stderr, "Error closing output file\n");
+bool
+rdt_tree_quantise_pr_tables(struct gm_logger* log,
+                            RDTree* tree,
+                            enum rdt_pr_format format,
+                            char** err)
+{
+    if (format == tree->header.pr_format)
+        return true;
+
+    if (!tree->label_pr_tables) {
+        gm_throw(log, err, "Can't re-quantise %s label probability tables",
+                 rdt_pr_format_get_name((enum rdt_pr_format)tree->header.pr_format));
         return false;
     }
 
-    return success;
+    if (tree->in_place) {
+        gm_throw(log, err, "Can't quantise a tree that's loaded in-place");
+        return false;
+    }
+
+    int n_prs = tree->n_pr_tables * tree->header.n_labels;
+    float* src = tree->label_pr_tables;
+    void* quantised = NULL;
+
+    switch (format) {
+    case RDT_PR_FORMAT_F32:
+        return true;
+    case RDT_PR_FORMAT_U8: {
+        uint8_t* dst = (uint8_t*)xmalloc(n_prs);
+        for (int i = 0; i < n_prs; i++) {
+            float q = roundf(src[i] * 255.f);
+            dst[i] = (uint8_t)std::min(std::max(q, 0.f), 255.f);
+        }
+        quantised = dst;
+        break;
+    }
+    case RDT_PR_FORMAT_F16: {
+        uint16_t* dst = (uint16_t*)xmalloc(n_prs * sizeof(uint16_t));
+        for (int i = 0; i < n_prs; i++)
+            dst[i] = float_to_half_bits(src[i]);
+        quantised = dst;
+        break;
+    }
+    }
+
+    /* NB: the quantised tables (and their mirrored copy) are private to this
+     * tree, even if the float tables were shared with the rest of a forest
+     */
+    if (tree->shared_pr_tables)
+        release_shared_pr_tables(tree);
+    else
+        xfree(tree->label_pr_tables);
+    tree->label_pr_tables = NULL;
+    tree->quantised_pr_tables = quantised;
+    tree->header.pr_format = format;
+
+    if (tree->mirrored_nodes || tree->mirrored_clusters)
+        rdt_tree_prepare_mirrored(tree);
+
+    return true;
 }
 
 static bool
@@ -538,6 +2132,575 @@ rdt_forest_load_from_files(struct gm_logger* log,
     return trees;
 }
 
+bool
+rdt_forest_is_container(const uint8_t* buf, size_t len)
+{
+    return len >= sizeof(RDTForestHeader) && memcmp(buf, "RDTF", 4) == 0;
+}
+
+static bool
+check_leaf_indices(struct gm_logger* log, RDTree* tree, char** err)
+{
+    for (uint32_t i = 0; i < tree->n_nodes; i++) {
+        if (tree->nodes[i].label_pr_idx > tree->n_pr_tables) {
+            gm_throw(log, err, "Out of bounds label probability table index\n");
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < tree->n_clusters; i++) {
+        for (int n = 0; n < 3; n++) {
+            if (tree->clusters[i].nodes[n].label_pr_idx > tree->n_pr_tables) {
+                gm_throw(log, err, "Out of bounds label probability table index\n");
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static RDTree**
+load_forest(struct gm_logger* log,
+            const uint8_t* buf,
+            size_t len,
+            bool in_place,
+            int* n_trees_out,
+            char** err)
+{
+    assert_rdt_abi();
+
+    if (!rdt_forest_is_container(buf, len))
+    {
+        gm_throw(log, err, "Buffer doesn't contain an RDT forest container\n");
+        return NULL;
+    }
+
+    RDTForestHeader forest_header;
+    memcpy(&forest_header, buf, sizeof(forest_header));
+
+    if (forest_header.version != RDT_FOREST_VERSION)
+    {
+        gm_throw(log, err, "Incompatible RDT forest version, expected %u, found %u\n",
+                 RDT_FOREST_VERSION, (unsigned)forest_header.version);
+        return NULL;
+    }
+
+    if (in_place && ((uintptr_t)buf % 64) != 0)
+    {
+        gm_throw(log, err, "RDT forest buffer isn't suitably aligned\n");
+        return NULL;
+    }
+
+    RDTHeader* header = &forest_header.header;
+    if (strncmp(header->tag, "RDT", 3) != 0)
+    {
+        gm_throw(log, err, "Forest container doesn't contain RDT trees\n");
+        return NULL;
+    }
+
+    int pr_size = rdt_pr_format_get_size((enum rdt_pr_format)header->pr_format);
+    if (!pr_size || !header->n_labels)
+    {
+        gm_throw(log, err, "Unknown label probability table format %u\n",
+                 (unsigned)header->pr_format);
+        return NULL;
+    }
+
+    size_t node_size;
+    if (header->version == RDT_VERSION) {
+        node_size = sizeof(Node);
+    } else if (header->version == RDT_CLUSTERED_VERSION) {
+        node_size = sizeof(NodeCluster);
+    } else {
+        gm_throw(log, err, "Incompatible RDT forest tree version, expected %u or %u, found %u\n",
+                 RDT_VERSION, RDT_CLUSTERED_VERSION,
+                 (unsigned)header->version);
+        return NULL;
+    }
+
+    if (!check_mappable_section(&forest_header.trees, len)) {
+        gm_throw(log, err, "Out of bounds or misaligned RDT forest tree table\n");
+        return NULL;
+    }
+    for (int i = 0; i < RDT_N_SECTIONS; i++) {
+        if (!check_mappable_section(&forest_header.sections[i], len)) {
+            gm_throw(log, err, "Out of bounds or misaligned RDT section %d\n", i);
+            return NULL;
+        }
+    }
+
+    int n_trees = forest_header.n_trees;
+    if (n_trees < 1 || forest_header.n_trees > INT_MAX ||
+        forest_header.trees.size != sizeof(RDTForestTree) * n_trees)
+    {
+        gm_throw(log, err, "Error parsing RDT forest tree table\n");
+        return NULL;
+    }
+
+    const RDTSection* sections = forest_header.sections;
+    uint64_t nodes_size = sections[RDT_SECTION_NODES].size;
+    if (nodes_size % node_size != 0)
+    {
+        gm_throw(log, err, "Error parsing forest nodes\n");
+        return NULL;
+    }
+    uint64_t n_forest_nodes = nodes_size / node_size;
+
+    uint64_t table_size = (uint64_t)pr_size * header->n_labels;
+    uint64_t pr_tables_size = sections[RDT_SECTION_PR_TABLES].size;
+    if (pr_tables_size % table_size != 0 || pr_tables_size / table_size > UINT32_MAX)
+    {
+        gm_throw(log, err, "Unexpected size of label probability tables\n");
+        return NULL;
+    }
+
+    uint64_t mirrored_nodes_size = sections[RDT_SECTION_MIRRORED_NODES].size;
+    uint64_t mirrored_pr_tables_size = sections[RDT_SECTION_MIRRORED_PR_TABLES].size;
+    if ((mirrored_nodes_size && mirrored_nodes_size != nodes_size) ||
+        (mirrored_pr_tables_size && mirrored_pr_tables_size != pr_tables_size))
+    {
+        gm_throw(log, err, "Inconsistent size of mirrored forest arrays\n");
+        return NULL;
+    }
+
+    /* The label probability tables are shared by all trees so they're only
+     * copied (and mirrored) once, with a reference held by each tree as
+     * well as one held while loading
+     */
+    uint32_t n_pr_tables = pr_tables_size / table_size;
+    struct rdt_shared_pr_tables* shared = NULL;
+    if (!in_place) {
+        shared = new rdt_shared_pr_tables();
+        shared->ref = 1;
+        shared->tables = get_mappable_section(buf, &sections[RDT_SECTION_PR_TABLES],
+                                              false, false);
+        shared->mirrored_tables =
+            get_mappable_section(buf, &sections[RDT_SECTION_MIRRORED_PR_TABLES],
+                                 false, false);
+        if (!shared->mirrored_tables && !mirrored_nodes_size) {
+            shared->mirrored_tables =
+                make_mirrored_pr_tables(header, n_pr_tables, shared->tables);
+        }
+    }
+
+    RDTree** forest = (RDTree**)xcalloc(n_trees, sizeof(RDTree*));
+    bool loaded = true;
+
+    for (int i = 0; i < n_trees; i++) {
+        RDTForestTree entry;
+        memcpy(&entry,
+               buf + forest_header.trees.offset + sizeof(RDTForestTree) * i,
+               sizeof(entry));
+
+        if (entry.n_nodes < 1 ||
+            entry.first_node > n_forest_nodes ||
+            entry.n_nodes > n_forest_nodes - entry.first_node)
+        {
+            gm_throw(log, err, "Out of bounds nodes for forest tree %d\n", i);
+            loaded = false;
+            break;
+        }
+
+        uint64_t offset = entry.first_node * node_size;
+        uint64_t size = (uint64_t)entry.n_nodes * node_size;
+
+        /* NB: the nodes are validated before the tree is created so a tree
+         * can't be left with a partially copied set of arrays
+         */
+        const uint8_t* tree_nodes = buf + sections[RDT_SECTION_NODES].offset + offset;
+        if (header->version == RDT_VERSION) {
+            if (!check_nodes(log, (const Node*)tree_nodes, entry.n_nodes, err)) {
+                loaded = false;
+                break;
+            }
+        } else {
+            if (!check_clusters(log, (const NodeCluster*)tree_nodes,
+                                entry.n_nodes, err))
+            {
+                loaded = false;
+                break;
+            }
+        }
+
+        RDTree* tree = (RDTree*)xcalloc(1, sizeof(RDTree));
+        forest[i] = tree;
+        tree->header = *header;
+        tree->header.depth = entry.depth;
+        tree->in_place = in_place;
+        tree->n_pr_tables = n_pr_tables;
+
+        bool clustered = header->version == RDT_CLUSTERED_VERSION;
+        void* nodes = get_mappable_range(buf, &sections[RDT_SECTION_NODES],
+                                         offset, size, in_place, clustered);
+        void* mirrored_nodes =
+            get_mappable_range(buf, &sections[RDT_SECTION_MIRRORED_NODES],
+                               offset, size, in_place, clustered);
+        if (clustered) {
+            tree->n_clusters = entry.n_nodes;
+            tree->clusters = (NodeCluster*)nodes;
+            tree->mirrored_clusters = (NodeCluster*)mirrored_nodes;
+        } else {
+            tree->n_nodes = entry.n_nodes;
+            tree->nodes = (Node*)nodes;
+            tree->mirrored_nodes = (Node*)mirrored_nodes;
+        }
+
+        void* tables;
+        if (shared) {
+            shared->ref++;
+            tree->shared_pr_tables = shared;
+            tables = shared->tables;
+            tree->mirrored_pr_tables = shared->mirrored_tables;
+        } else {
+            tables = get_mappable_section(buf, &sections[RDT_SECTION_PR_TABLES],
+                                          in_place, false);
+            tree->mirrored_pr_tables =
+                get_mappable_section(buf, &sections[RDT_SECTION_MIRRORED_PR_TABLES],
+                                     in_place, false);
+        }
+        if (header->pr_format == RDT_PR_FORMAT_F32)
+            tree->label_pr_tables = (float*)tables;
+        else
+            tree->quantised_pr_tables = tables;
+
+        if (!check_leaf_indices(log, tree, err)) {
+            loaded = false;
+            break;
+        }
+
+        if (!in_place && !tree->mirrored_nodes && !tree->mirrored_clusters)
+            rdt_tree_prepare_mirrored(tree);
+
+        prepare_thresholds_mm(tree);
+    }
+
+    if (shared)
+        unref_shared_pr_tables(shared);
+
+    if (!loaded) {
+        rdt_forest_destroy(forest, n_trees);
+        return NULL;
+    }
+
+    *n_trees_out = n_trees;
+
+    return forest;
+}
+
+RDTree**
+rdt_forest_load_in_place(struct gm_logger* log,
+                         const uint8_t* buf,
+                         size_t len,
+                         int* n_trees,
+                         char** err)
+{
+    return load_forest(log, buf, len, true, n_trees, err);
+}
+
+RDTree**
+rdt_forest_load_from_buf(struct gm_logger* log,
+                         const uint8_t* buf,
+                         size_t len,
+                         int* n_trees,
+                         char** err)
+{
+    return load_forest(log, buf, len, false, n_trees, err);
+}
+
+RDTree**
+rdt_forest_load_from_file(struct gm_logger* log,
+                          const char* filename,
+                          int* n_trees,
+                          char** err)
+{
+    FILE* forest_fp;
+    if (!(forest_fp = fopen(filename, "r")))
+    {
+        gm_throw(log, err, "Failed to open decision forest: %s\n", filename);
+        return NULL;
+    }
+
+    RDTForestHeader forest_header;
+    bool is_forest =
+        fread(&forest_header, sizeof(forest_header), 1, forest_fp) == 1 &&
+        rdt_forest_is_container((const uint8_t*)&forest_header,
+                                sizeof(forest_header));
+    if (!is_forest) {
+        fclose(forest_fp);
+
+        RDTree* tree = rdt_tree_load_from_file(log, filename, err);
+        if (!tree)
+            return NULL;
+
+        RDTree** forest = (RDTree**)xcalloc(1, sizeof(RDTree*));
+        forest[0] = tree;
+        *n_trees = 1;
+        return forest;
+    }
+
+    struct stat sb;
+    if (fstat(fileno(forest_fp), &sb) < 0)
+    {
+        gm_throw(log, err, "Failed to stat decision forest: %s\n", filename);
+        fclose(forest_fp);
+        return NULL;
+    }
+
+#ifndef _WIN32
+    void* mapping = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED,
+                         fileno(forest_fp), 0);
+    if (mapping != MAP_FAILED) {
+        fclose(forest_fp);
+
+        RDTree** forest = rdt_forest_load_in_place(log,
+                                                   (const uint8_t*)mapping,
+                                                   sb.st_size,
+                                                   n_trees,
+                                                   err);
+        if (!forest) {
+            munmap(mapping, sb.st_size);
+            return NULL;
+        }
+
+        forest[0]->mapping = mapping;
+        forest[0]->mapping_len = sb.st_size;
+        return forest;
+    }
+#endif
+
+    uint8_t* forest_buf = (uint8_t*)xmalloc(sb.st_size);
+    if (fseek(forest_fp, 0, SEEK_SET) != 0 ||
+        fread(forest_buf, sb.st_size, 1, forest_fp) != 1)
+    {
+        gm_throw(log, err, "Failed to read decision forest: %s\n", filename);
+        xfree(forest_buf);
+        fclose(forest_fp);
+        return NULL;
+    }
+
+    RDTree** forest = rdt_forest_load_from_buf(log, forest_buf, sb.st_size,
+                                               n_trees, err);
+    xfree(forest_buf);
+    fclose(forest_fp);
+
+    return forest;
+}
+
+/* Appends the label probability table @idx (1-based) of @tree to the shared
+ * tables of a forest, unless an identical table has already been added, and
+ * returns the (1-based) index of the shared table
+ */
+static uint32_t
+add_forest_pr_table(RDTree* tree,
+                    uint32_t idx,
+                    size_t table_size,
+                    std::unordered_map<std::string, uint32_t>& table_index,
+                    std::vector<uint8_t>& tables,
+                    std::vector<uint8_t>& mirrored_tables)
+{
+    const uint8_t* src = tree->label_pr_tables ?
+        (const uint8_t*)tree->label_pr_tables :
+        (const uint8_t*)tree->quantised_pr_tables;
+    const uint8_t* table = src + (idx - 1) * table_size;
+
+    std::string key((const char*)table, table_size);
+    auto it = table_index.find(key);
+    if (it != table_index.end())
+        return it->second;
+
+    uint32_t shared_idx = table_index.size() + 1;
+    table_index[key] = shared_idx;
+    tables.insert(tables.end(), table, table + table_size);
+    if (tree->mirrored_pr_tables) {
+        const uint8_t* mirrored = (const uint8_t*)tree->mirrored_pr_tables +
+            (idx - 1) * table_size;
+        mirrored_tables.insert(mirrored_tables.end(),
+                               mirrored, mirrored + table_size);
+    }
+
+    return shared_idx;
+}
+
+bool
+rdt_forest_save(struct gm_logger* log,
+                RDTree** forest,
+                int n_trees,
+                const char* filename,
+                char** err)
+{
+    assert_rdt_abi();
+
+    if (n_trees < 1) {
+        gm_throw(log, err, "Can't save a forest without any trees");
+        return false;
+    }
+
+    RDTForestHeader forest_header = {};
+    memcpy(forest_header.tag, "RDTF", 4);
+    forest_header.version = RDT_FOREST_VERSION;
+    forest_header.alignment = RDT_MAPPABLE_ALIGNMENT;
+    forest_header.n_trees = n_trees;
+    forest_header.header = forest[0]->header;
+
+    RDTHeader* header = &forest_header.header;
+    bool clustered = forest[0]->clusters != NULL;
+    bool mirrored_nodes = true;
+    bool mirrored_tables = true;
+
+    for (int i = 0; i < n_trees; i++) {
+        RDTree* tree = forest[i];
+
+        if (tree->header.version != header->version ||
+            (clustered ? !tree->clusters : !tree->nodes))
+        {
+            gm_throw(log, err, "Can't save v%d and v%d trees in the same forest",
+                     header->version, tree->header.version);
+            return false;
+        }
+        if (tree->header.n_labels != header->n_labels) {
+            gm_throw(log, err, "Tree %d has %d labels, expected %d",
+                     i, tree->header.n_labels, header->n_labels);
+            return false;
+        }
+        if (tree->header.pr_format != header->pr_format) {
+            gm_throw(log, err, "Tree %d has %s probability tables, expected %s",
+                     i,
+                     rdt_pr_format_get_name((enum rdt_pr_format)tree->header.pr_format),
+                     rdt_pr_format_get_name((enum rdt_pr_format)header->pr_format));
+            return false;
+        }
+        if (tree->header.bg_label != header->bg_label ||
+            tree->header.fov != header->fov ||
+            tree->header.bg_depth != header->bg_depth ||
+            memcmp(tree->header.flip_map, header->flip_map,
+                   sizeof(header->flip_map)) != 0)
+        {
+            gm_throw(log, err, "Tree %d has a different background, field of view or flip map to tree 0",
+                     i);
+            return false;
+        }
+
+        header->depth = std::max(header->depth, tree->header.depth);
+        if (!tree->mirrored_nodes && !tree->mirrored_clusters)
+            mirrored_nodes = false;
+        if (!tree->mirrored_pr_tables)
+            mirrored_tables = false;
+    }
+
+    size_t table_size =
+        (size_t)rdt_pr_format_get_size((enum rdt_pr_format)header->pr_format) *
+        header->n_labels;
+    std::unordered_map<std::string, uint32_t> table_index;
+    std::vector<uint8_t> tables;
+    std::vector<uint8_t> mirrored_pr_tables;
+    std::vector<Node> nodes;
+    std::vector<Node> mirrored;
+    std::vector<NodeCluster> clusters;
+    std::vector<NodeCluster> mirrored_clusters;
+    std::vector<RDTForestTree> trees(n_trees);
+    uint64_t n_tables_in = 0;
+
+    for (int i = 0; i < n_trees; i++) {
+        RDTree* tree = forest[i];
+
+        /* Maps the tree's tables to shared tables, in the order they're
+         * first referenced so that any unused tables are dropped
+         */
+        std::vector<uint32_t> remap(tree->n_pr_tables + 1, 0);
+        n_tables_in += tree->n_pr_tables;
+
+        RDTForestTree& entry = trees[i];
+        entry.depth = tree->header.depth;
+        entry.n_nodes = clustered ? tree->n_clusters : tree->n_nodes;
+        entry.first_node = clustered ? clusters.size() : nodes.size();
+
+        for (uint32_t n = 0; n < entry.n_nodes; n++) {
+            uint32_t* indices[6];
+            int n_indices = 0;
+
+            if (clustered) {
+                clusters.push_back(tree->clusters[n]);
+                for (int c = 0; c < 3; c++)
+                    indices[n_indices++] = &clusters.back().nodes[c].label_pr_idx;
+                if (mirrored_nodes) {
+                    mirrored_clusters.push_back(tree->mirrored_clusters[n]);
+                    for (int c = 0; c < 3; c++)
+                        indices[n_indices++] = &mirrored_clusters.back().nodes[c].label_pr_idx;
+                }
+            } else {
+                nodes.push_back(tree->nodes[n]);
+                indices[n_indices++] = &nodes.back().label_pr_idx;
+                if (mirrored_nodes) {
+                    mirrored.push_back(tree->mirrored_nodes[n]);
+                    indices[n_indices++] = &mirrored.back().label_pr_idx;
+                }
+            }
+
+            for (int j = 0; j < n_indices; j++) {
+                uint32_t idx = *indices[j];
+                if (!idx)
+                    continue;
+                if (idx > tree->n_pr_tables) {
+                    gm_throw(log, err, "Out of bounds label probability table index in tree %d",
+                             i);
+                    return false;
+                }
+                if (!remap[idx]) {
+                    remap[idx] = add_forest_pr_table(tree, idx, table_size,
+                                                     table_index, tables,
+                                                     mirrored_pr_tables);
+                }
+                *indices[j] = remap[idx];
+            }
+        }
+    }
+
+    gm_info(log, "Packed %d trees with %u unique label probability tables (of %" PRIu64 ")",
+            n_trees, (unsigned)table_index.size(), n_tables_in);
+
+    RDTSection* sections[RDT_N_SECTIONS + 1];
+    const void* data[RDT_N_SECTIONS + 1];
+
+    sections[0] = &forest_header.trees;
+    sections[0]->size = sizeof(RDTForestTree) * n_trees;
+    data[0] = trees.data();
+
+    RDTSection* nodes_section = &forest_header.sections[RDT_SECTION_NODES];
+    RDTSection* mirrored_nodes_section =
+        &forest_header.sections[RDT_SECTION_MIRRORED_NODES];
+    if (clustered) {
+        nodes_section->size = sizeof(NodeCluster) * clusters.size();
+        data[1 + RDT_SECTION_NODES] = clusters.data();
+        data[1 + RDT_SECTION_MIRRORED_NODES] =
+            mirrored_nodes ? mirrored_clusters.data() : NULL;
+    } else {
+        nodes_section->size = sizeof(Node) * nodes.size();
+        data[1 + RDT_SECTION_NODES] = nodes.data();
+        data[1 + RDT_SECTION_MIRRORED_NODES] =
+            mirrored_nodes ? mirrored.data() : NULL;
+    }
+    mirrored_nodes_section->size = nodes_section->size;
+
+    forest_header.sections[RDT_SECTION_PR_TABLES].size = tables.size();
+    data[1 + RDT_SECTION_PR_TABLES] = tables.data();
+    forest_header.sections[RDT_SECTION_MIRRORED_PR_TABLES].size =
+        mirrored_pr_tables.size();
+    data[1 + RDT_SECTION_MIRRORED_PR_TABLES] =
+        mirrored_tables ? mirrored_pr_tables.data() : NULL;
+
+    for (int i = 0; i < RDT_N_SECTIONS; i++)
+        sections[1 + i] = &forest_header.sections[i];
+
+    if (!write_mappable(filename, &forest_header, sizeof(forest_header),
+                        sections, data, RDT_N_SECTIONS + 1))
+    {
+        gm_throw(log, err, "Failed to write forest to %s", filename);
+        return false;
+    }
+
+    return true;
+}
+
 void
 rdt_forest_destroy(RDTree** forest, int n_trees)
 {
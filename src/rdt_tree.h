@@ -35,7 +35,21 @@
 
 #define vector(type,size) type __attribute__ ((vector_size(sizeof(type)*(size))))
 
-#define RDT_VERSION 6
+/* v8 trees only store the nodes that were trained, in depth-first pre-order
+ * with the root node at index zero. The left child of a non-leaf node is the
+ * next node in the array and its right child is at Node::right_idx.
+ */
+#define RDT_VERSION 8
+
+/* v6 trees store a complete tree of (2^depth - 1) nodes arranged breadth-first
+ * so the children of node N are at 2N+1 and 2N+2, regardless of how many
+ * nodes were actually trained. These are converted to the v8 layout when
+ * loaded.
+ */
+#define RDT_DENSE_VERSION 6
+
+/* v7 trees use a compact, cache-blocked node layout (see NodeCluster) */
+#define RDT_CLUSTERED_VERSION 7
 
 typedef struct {
     /* XXX: Note that (at least with gcc) then uv will have a 16 byte
@@ -45,27 +59,240 @@ typedef struct {
     vector(float,4) uv;     // U in [0:2] and V in [2:4]
     float t;                // Threshold
     uint32_t label_pr_idx;  // Index into label probability table (1-based)
+    uint32_t right_idx;     // Index of the right child (zero for leaf nodes)
 } Node;
 
+/* Compact 16 byte node used by v7 trees with half-float u,v and threshold
+ * values. These are only used as part of a NodeCluster.
+ */
+typedef struct {
+    uint16_t uv[4];         // Half-float U in [0:2] and V in [2:4]
+    uint16_t t;             // Half-float threshold
+    uint16_t pad;
+    uint32_t label_pr_idx;  // Index into label probability table (1-based)
+} CompactNode;
+
+/* v7 trees group nodes into 64 byte (cache line sized) clusters that each
+ * contain a two-level subtree, so a traversal touches one cache line for
+ * every two levels of the tree instead of one line per level.
+ *
+ * nodes[0] is the root of the subtree and nodes[1] and nodes[2] are its
+ * left and right children (unused if nodes[0] is a leaf).
+ *
+ * children[] holds the cluster indices for the left and right children of
+ * nodes[1] followed by the left and right children of nodes[2] (zero where
+ * the corresponding node is a leaf).
+ *
+ * Clusters are stored in depth-first order with the root cluster at index
+ * zero.
+ */
+typedef struct {
+    CompactNode nodes[3];
+    uint32_t children[4];
+} NodeCluster;
+
+/* Storage format for leaf label probability tables. Quantised tables are
+ * dequantised while accumulating probabilities during inference.
+ */
+enum rdt_pr_format {
+    RDT_PR_FORMAT_F32,
+    RDT_PR_FORMAT_U8,   // probability * 255, rounded
+    RDT_PR_FORMAT_F16,  // half-float
+};
+
 typedef struct {
     char    tag[3];
     uint8_t version;
     uint8_t depth;
     uint8_t n_labels;
     uint8_t bg_label;
-    // 1 byte padding
+    uint8_t pr_format; // enum rdt_pr_format (previously padding, always zero)
     float   fov;
     float   bg_depth; // v5+
     uint8_t flip_map[256]; // v6+
 } RDTHeader;
 
+/* v7 files have this header immediately following the RDTHeader */
+typedef struct {
+    uint32_t n_clusters;
+    uint32_t n_pr_tables;
+    uint32_t pad[2];
+} RDTClusterHeader;
+
+/* v8 files have this header immediately following the RDTHeader */
+typedef struct {
+    uint32_t n_nodes;
+    uint32_t n_pr_tables;
+    uint32_t pad[2];
+} RDTNodeHeader;
+
+/* A page aligned container for a tree that can be memory mapped read-only
+ * and used in place, without copying (see rdt_tree_load_in_place()), so that
+ * multiple processes can share one physical copy of a forest.
+ *
+ * The file starts with an RDTMappableHeader which embeds the RDTHeader (and
+ * RDTClusterHeader for v7 trees) of the tree, followed by each array of the
+ * tree at a RDT_MAPPABLE_ALIGNMENT aligned offset. The mirrored arrays (see
+ * rdt_tree_prepare_mirrored()) are optional and have a size of zero if not
+ * included.
+ */
+#define RDT_MAPPABLE_VERSION 1
+#define RDT_MAPPABLE_ALIGNMENT 4096
+
+enum rdt_section {
+    RDT_SECTION_NODES,              // Node or NodeCluster array (per version)
+    RDT_SECTION_PR_TABLES,          // in header.pr_format
+    RDT_SECTION_MIRRORED_NODES,
+    RDT_SECTION_MIRRORED_PR_TABLES,
+    RDT_N_SECTIONS
+};
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} RDTSection;
+
+typedef struct {
+    char        tag[4]; // "RDTM"
+    uint32_t    version;
+    uint32_t    alignment;
+    uint32_t    pad;
+    RDTSection  sections[RDT_N_SECTIONS];
+    RDTHeader   header;
+    RDTClusterHeader cluster_header; // zero for v8 trees
+} RDTMappableHeader;
+
+/* A page aligned container for a whole forest, that can be memory mapped
+ * and used in place like an RDTMappableHeader container (see
+ * rdt_forest_load_in_place()).
+ *
+ * The RDTHeader is only stored once since it has to be the same for every
+ * tree, except for the depth which is stored per tree (header.depth is the
+ * maximum depth of the forest).
+ *
+ * The nodes (or node clusters) of all the trees are stored contiguously in
+ * one section, located per tree by an RDTForestTree entry, and the trees
+ * share one array of label probability tables in which identical tables are
+ * only stored once. Node indices remain relative to the first node of each
+ * tree.
+ */
+#define RDT_FOREST_VERSION 1
+
+typedef struct {
+    uint64_t first_node;    // Index of the tree's first Node or NodeCluster
+    uint32_t n_nodes;       // Number of Nodes or NodeClusters
+    uint8_t  depth;
+    uint8_t  pad[3];
+} RDTForestTree;
+
+typedef struct {
+    char        tag[4]; // "RDTF"
+    uint32_t    version;
+    uint32_t    alignment;
+    uint32_t    n_trees;
+    RDTSection  trees;  // n_trees RDTForestTree entries
+    RDTSection  sections[RDT_N_SECTIONS];
+    RDTHeader   header;
+} RDTForestHeader;
+
+/* Native code generated for a specific (v8) tree by rdt-compile that
+ * writes the (1-based) label_pr_idx of the leaf reached by each of the n
+ * given pixels, equivalent to interpreting the tree's nodes.
+ *
+ * The nodes of the tree are still passed so that the generated code can fall
+ * back to interpreting the levels of the tree that weren't compiled.
+ */
+typedef void (*rdt_compiled_traverse_func)(const Node* nodes,
+                                           const float* depth_image,
+                                           int width,
+                                           int height,
+                                           float bg_depth,
+                                           int n,
+                                           const int* x,
+                                           const int* y,
+                                           const float* depth,
+                                           bool flip,
+                                           uint32_t* leaves_out);
+
+/* Bump if the rdt_compiled_forest struct, traverse signature or node layout
+ * changes
+ */
+#define RDT_COMPILED_ABI_VERSION 2
+
+/* Name of the struct rdt_compiled_forest symbol exported by plugins built
+ * from rdt-compile output
+ */
+#define RDT_COMPILED_FOREST_SYMBOL "rdt_compiled_forest"
+
+struct rdt_compiled_forest {
+    int abi_version;
+    int n_trees;
+    const uint64_t* tree_hashes; // rdt_tree_get_hash() of each tree compiled
+    const rdt_compiled_traverse_func* traverse;
+};
+
 typedef struct {
     RDTHeader header;
-    Node* nodes;
+    uint32_t n_nodes;
+    Node* nodes;                // NULL for clustered (v7) trees
+    uint32_t n_clusters;
+    NodeCluster* clusters;      // NULL for v8 trees
     uint32_t n_pr_tables;
-    float* label_pr_tables;
+    float* label_pr_tables;     // NULL for quantised tables
+    void* quantised_pr_tables;  // u8 or half-float tables, per header.pr_format
+
+    /* Horizontally mirrored copies of the tree (with negated u,v x offsets)
+     * and of the label probability tables (permuted by header.flip_map, in
+     * header.pr_format) for inferring labels of a flipped image. See
+     * rdt_tree_prepare_mirrored().
+     */
+    Node* mirrored_nodes;
+    NodeCluster* mirrored_clusters;
+    void* mirrored_pr_tables;   // NULL if flip_map isn't a permutation
+
+    /* Set if the label probability tables above (including the mirrored
+     * tables) are shared by all the trees of a forest copied by
+     * rdt_forest_load_from_buf(), in which case they're freed along with
+     * the last tree that references them.
+     */
+    struct rdt_shared_pr_tables* shared_pr_tables;
+
+    /* The node thresholds (t) in whole millimetres, as chosen by the
+     * trainer, for inference on GM_FORMAT_Z_U16_MM depth images. Indexed
+     * like the nodes, or by (cluster * 3 + slot) for clustered trees, with
+     * one entry of padding at the end.
+     */
+    int16_t* thresholds_mm;
+
+    /* Set if the arrays above point into a read-only buffer that's not owned
+     * by the tree (see rdt_tree_load_in_place()), in which case the tree
+     * can't be modified. If mapping is not NULL it's unmapped when the tree
+     * is destroyed.
+     */
+    bool in_place;
+    void* mapping;
+    size_t mapping_len;
+
+    /* Set while compiled code for this tree is loaded, see
+     * infer_labels_compiled_open()
+     */
+    rdt_compiled_traverse_func compiled_traverse;
 } RDTree;
 
+/* NB: no handling of inf/nan since they never occur within trees. Scaling by
+ * 2^112 re-biases the exponent (and also correctly handles denormals)
+ */
+static inline float
+rdt_half_to_float(uint16_t h)
+{
+    union { uint32_t u; float f; } val, scale;
+    scale.u = (127 + 112) << 23;
+    val.u = (uint32_t)(h & 0x7fff) << 13;
+    val.f *= scale.f;
+    val.u |= (uint32_t)(h & 0x8000) << 16;
+    return val.f;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -75,6 +302,23 @@ rdt_tree_load_from_json(struct gm_logger* log,
                         JSON_Value* json_tree_value,
                         bool allow_incomplete_leaves,
                         char** err);
+
+/* Reads a JSON tree (as written by train_rdt) from @fp as a stream, so
+ * unlike rdt_tree_load_from_json() no DOM is built for the nodes and memory
+ * use is proportional to the size of the resulting tree.
+ *
+ * If @properties is not NULL it's set to an object with all the top-level
+ * properties besides the "root" node (such as "history" and "labels") which
+ * should be freed with json_value_free().
+ */
+RDTree*
+rdt_tree_load_from_json_stream(struct gm_logger* log,
+                               FILE* fp,
+                               bool allow_incomplete_leaves,
+                               JSON_Value** properties,
+                               char** err);
+
+/* Streams the tree from a file via rdt_tree_load_from_json_stream() */
 RDTree*
 rdt_tree_load_from_json_file(struct gm_logger* log,
                              const char* filename,
@@ -86,23 +330,146 @@ rdt_tree_load_from_buf(struct gm_logger* log,
                        uint8_t* tree,
                        int len,
                        char** err);
+
+/* Maps the file read-only (where supported) and for a mappable container
+ * the tree is used in place, otherwise the tree is loaded from the mapping
+ * and the mapping is released.
+ */
 RDTree*
 rdt_tree_load_from_file(struct gm_logger* log,
                         const char* filename,
                         char** err);
 
+/* Returns true if @buf starts with an RDTMappableHeader. */
+bool
+rdt_tree_is_mappable(const uint8_t* buf, size_t len);
+
+/* Loads a mappable container without copying any of the tree's arrays, so
+ * @buf (which must be at least 64 byte aligned, such as a memory mapping)
+ * must outlive the tree. rdt_tree_load_from_buf() can also load a mappable
+ * container, but copies the arrays.
+ */
+RDTree*
+rdt_tree_load_in_place(struct gm_logger* log,
+                       const uint8_t* buf,
+                       size_t len,
+                       char** err);
+
 void
 rdt_tree_destroy(RDTree* tree);
 
 bool
 rdt_tree_save(RDTree* tree, const char* filename);
 
+/* Saves a mappable container (see RDTMappableHeader), including any mirrored
+ * arrays of the tree
+ */
+bool
+rdt_tree_save_mappable(RDTree* tree, const char* filename);
+
+/* Converts a v8 tree into the cache-blocked (v7) layout used for
+ * faster inference, freeing tree->nodes. Note that u,v and threshold values
+ * are rounded to half-float precision.
+ */
+bool
+rdt_tree_convert_to_clusters(struct gm_logger* log,
+                             RDTree* tree,
+                             char** err);
+
+/* Re-encodes the label probability tables of a tree in the given format.
+ * Only tables currently stored as floats can be quantised.
+ */
+bool
+rdt_tree_quantise_pr_tables(struct gm_logger* log,
+                            RDTree* tree,
+                            enum rdt_pr_format format,
+                            char** err);
+
+/* (Re)creates the mirrored nodes/clusters and probability tables of a tree.
+ *
+ * This is done by all the loaders and is kept up to date by
+ * rdt_tree_convert_to_clusters() and rdt_tree_quantise_pr_tables() for trees
+ * that have been prepared.
+ */
+void
+rdt_tree_prepare_mirrored(RDTree* tree);
+
+/* A hash of the structure and node values of a v8 tree, used to
+ * check that compiled code matches the tree it's used with. Returns zero for
+ * clustered (v7) trees.
+ */
+uint64_t
+rdt_tree_get_hash(RDTree* tree);
+
+/* Size in bytes of a single label probability table entry */
+int
+rdt_pr_format_get_size(enum rdt_pr_format format);
+
+const char*
+rdt_pr_format_get_name(enum rdt_pr_format format);
+
+bool
+rdt_pr_format_from_name(const char* name, enum rdt_pr_format* format);
+
 RDTree**
 rdt_forest_load_from_files(struct gm_logger* log,
                            const char** files,
                            int n_files,
                            char **err);
 
+/* Returns true if @buf starts with an RDTForestHeader. */
+bool
+rdt_forest_is_container(const uint8_t* buf, size_t len);
+
+/* Loads the trees of a forest container without copying any of their arrays,
+ * so @buf (which must be at least 64 byte aligned, such as a memory mapping)
+ * must outlive the trees.
+ */
+RDTree**
+rdt_forest_load_in_place(struct gm_logger* log,
+                         const uint8_t* buf,
+                         size_t len,
+                         int* n_trees,
+                         char** err);
+
+/* Loads the trees of a forest container as independent trees that each own
+ * a copy of their arrays (including all of the shared probability tables)
+ */
+RDTree**
+rdt_forest_load_from_buf(struct gm_logger* log,
+                         const uint8_t* buf,
+                         size_t len,
+                         int* n_trees,
+                         char** err);
+
+/* Loads a forest container (in place from a read-only mapping, where
+ * supported) or else a single tree file as a forest of one tree.
+ *
+ * NB: The trees of a forest container loaded in place all refer to a
+ * mapping that's owned by the first tree, so they must be destroyed
+ * together with rdt_forest_destroy().
+ */
+RDTree**
+rdt_forest_load_from_file(struct gm_logger* log,
+                          const char* filename,
+                          int* n_trees,
+                          char** err);
+
+/* Saves the trees (which must all be v8 or all be v7 trees with the same
+ * header, besides their depth) as a single forest container (see
+ * RDTForestHeader), including any mirrored arrays of the trees.
+ *
+ * Note: only tables that are exactly equal are merged, so quantising the
+ * tables first (see rdt_tree_quantise_pr_tables()) can find many more
+ * duplicates between near-identical tables.
+ */
+bool
+rdt_forest_save(struct gm_logger* log,
+                RDTree** forest,
+                int n_trees,
+                const char* filename,
+                char** err);
+
 void
 rdt_forest_destroy(RDTree** forest, int n_trees);
 
@@ -798,6 +798,9 @@ handle_context_event(Data *data, struct gm_event *event)
          */
         data->tracking_ready = true;
         break;
+    case GM_EVENT_ASSETS_READY:
+        gm_debug(data->log, "Received context _ASSETS_READY event");
+        break;
     }
 
     gm_context_event_free(event);
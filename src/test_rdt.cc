@@ -70,6 +70,7 @@
 
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <getopt.h>
 
 #include <vector>
@@ -102,6 +103,11 @@ struct data_loader
 };
 
 static bool threaded_opt = false;
+static bool clustered_opt = false;
+static enum rdt_pr_format pr_format_opt = RDT_PR_FORMAT_F32;
+static const char *compiled_opt = NULL;
+static float cascade_opt = 0;
+static bool fixed_point_opt = false;
 static bool verbose_opt = false;
 
 static int rows_per_label_opt = 2;
@@ -398,14 +404,12 @@ infer_pixel_label_probs(struct gm_logger *log,
 
             float gradient = upixel - vpixel;
 
-            /* NB: The nodes are arranged in breadth-first, left then
-             * right child order with the root node at index zero.
-             *
-             * In this case if you have an index for any particular node
-             * ('id' here) then 2 * id + 1 is the index for the left
-             * child and 2 * id + 2 is the index for the right child...
+            /* NB: The nodes are arranged in depth-first pre-order with the
+             * root node at index zero, so the left child of any particular
+             * node ('id' here) is at id + 1 while the right child is at
+             * node.right_idx...
              */
-            id = (gradient < node.t) ? 2 * id + 1 : 2 * id + 2;
+            id = (gradient < node.t) ? id + 1 : node.right_idx;
 
             node = tree->nodes[id];
         }
@@ -458,6 +462,25 @@ usage(void)
 "\n"
 "  -f, --flip              Enable horizontal mirroring for enhanced inference\n"
 "  -t, --threaded          Use multi-threaded inference.\n"
+"  -c, --clustered         Convert trees to the cache-blocked (v7) layout,\n"
+"                          with half-float node parameters, for inference\n"
+"  --pr-format=FORMAT      Quantise leaf probability tables (u8 or f16) for\n"
+"                          inference and report the accuracy impact compared\n"
+"                          to float tables\n"
+"  --compiled=PLUGIN       Use a compiled forest plugin (see rdt-compile) for\n"
+"                          inference and check the results are identical to\n"
+"                          interpreting the trees (exits with an error\n"
+"                          status if not)\n"
+"  --cascade=THRESHOLD     Let pixels stop evaluating the forest early once the\n"
+"                          most probable label reaches THRESHOLD and report the\n"
+"                          speed up and accuracy impact compared to evaluating\n"
+"                          all trees. Range = (0,1]\n"
+"  --fixed-point           Also run inference on millimetre (u16) depth\n"
+"                          images where background pixels are holes (zero)\n"
+"                          and check the labels match float inference\n"
+"                          (exits with an error status if more than 1%%\n"
+"                          of pixels differ, since gradients that exactly\n"
+"                          equal a threshold may be decided differently)\n"
 "\n"
 "  -v, --verbose           Verbose output.\n"
 "  -h, --help              Display this message.\n"
@@ -477,8 +500,12 @@ main(int argc, char **argv)
 #define TEST_TO_OUT_MAP_OPT                 (CHAR_MAX + 2)
 #define INDEX_OUTPUT_OPT                    (CHAR_MAX + 3)
 #define INDEX_LOW_ACC_OPT                   (CHAR_MAX + 4)
+#define PR_FORMAT_OPT                       (CHAR_MAX + 5)
+#define COMPILED_OPT                        (CHAR_MAX + 6)
+#define CASCADE_OPT                         (CHAR_MAX + 7)
+#define FIXED_POINT_OPT                     (CHAR_MAX + 8)
 
-    const char *short_options = "oprftvh";
+    const char *short_options = "oprftcvh";
     const struct option long_options[] = {
         {"rdt-to-test-map",  required_argument,  0, RDT_TO_TEST_MAP_OPT},
         {"test-to-out-map",  required_argument,  0, TEST_TO_OUT_MAP_OPT},
@@ -489,6 +516,11 @@ main(int argc, char **argv)
         {"row-height",       required_argument,  0, 'r'},
         {"flip",             no_argument,        0, 'f'},
         {"threaded",         no_argument,        0, 't'},
+        {"clustered",        no_argument,        0, 'c'},
+        {"pr-format",        required_argument,  0, PR_FORMAT_OPT},
+        {"compiled",         required_argument,  0, COMPILED_OPT},
+        {"cascade",          required_argument,  0, CASCADE_OPT},
+        {"fixed-point",      no_argument,        0, FIXED_POINT_OPT},
         {"verbose",          no_argument,        0, 'v'},
         {"help",             no_argument,        0, 'h'},
         {0, 0, 0, 0}
@@ -554,6 +586,29 @@ main(int argc, char **argv)
         case 't':
             threaded_opt = true;
             break;
+        case 'c':
+            clustered_opt = true;
+            break;
+        case PR_FORMAT_OPT:
+            gm_assert(log, rdt_pr_format_from_name(optarg, &pr_format_opt),
+                      "Unknown probability table format '%s'", optarg);
+            break;
+        case COMPILED_OPT:
+            compiled_opt = optarg;
+            break;
+        case CASCADE_OPT:
+            {
+                char *end = NULL;
+                cascade_opt = strtod(optarg, &end);
+                gm_assert(log, end && *end == '\0',
+                          "Failed to parse cascade threshold");
+                gm_assert(log, cascade_opt > 0 && cascade_opt <= 1.0,
+                          "Cascade threshold should be between 0 and 1");
+            }
+            break;
+        case FIXED_POINT_OPT:
+            fixed_point_opt = true;
+            break;
         case 'v':
             verbose_opt = true;
             break;
@@ -569,6 +624,13 @@ main(int argc, char **argv)
     if (argc - optind < 3)
         usage();
 
+    gm_assert(log, !compiled_opt || (!clustered_opt &&
+                                     pr_format_opt == RDT_PR_FORMAT_F32),
+              "--compiled can't be combined with --clustered or --pr-format");
+    gm_assert(log, !cascade_opt || (!compiled_opt &&
+                                    pr_format_opt == RDT_PR_FORMAT_F32),
+              "--cascade can't be combined with --compiled or --pr-format");
+
     const char *data_dir = argv[optind];
     const char *index_name = argv[optind + 1];
 
@@ -617,6 +679,15 @@ main(int argc, char **argv)
     RDTree *forest[n_trees];
     JSON_Value *forest_js[n_trees];
 
+    /* When quantising probability tables we keep an unquantised forest too
+     * for reporting the impact on accuracy, and similarly when using a
+     * compiled forest we keep a forest that's only interpreted to compare
+     * with.
+     */
+    bool quantised = pr_format_opt != RDT_PR_FORMAT_F32;
+    bool need_ref_forest = quantised || compiled_opt;
+    RDTree *ref_forest[n_trees];
+
     start = get_time();
     for (int i = 0; i < n_trees; i++) {
         char *tree_path = argv[optind + 2 + i];
@@ -627,6 +698,25 @@ main(int argc, char **argv)
         forest[i] = rdt_tree_load_from_json(log, forest_js[i],
                                             false, // don't load incomplete trees
                                             NULL); // abort on error
+        if (clustered_opt)
+            rdt_tree_convert_to_clusters(log, forest[i], NULL); // abort on error
+
+        if (need_ref_forest) {
+            ref_forest[i] = rdt_tree_load_from_json(log, forest_js[i], false, NULL);
+            if (clustered_opt)
+                rdt_tree_convert_to_clusters(log, ref_forest[i], NULL);
+        }
+        if (quantised) {
+            rdt_tree_quantise_pr_tables(log, forest[i], pr_format_opt,
+                                        NULL); // abort on error
+        }
+    }
+
+    struct infer_labels_compiled *compiled = NULL;
+    if (compiled_opt) {
+        compiled = infer_labels_compiled_open(log, compiled_opt,
+                                              forest, n_trees,
+                                              NULL); // abort on error
     }
     end = get_time();
     uint64_t load_forest_duration = end - start;
@@ -783,6 +873,61 @@ main(int argc, char **argv)
 
     float *rdt_probs = (float*)xmalloc(width * height *
                                        sizeof(float) * n_rdt_labels);
+    float *ref_probs = NULL;
+    if (need_ref_forest) {
+        ref_probs = (float*)xmalloc(width * height *
+                                    sizeof(float) * n_rdt_labels);
+    }
+
+    int64_t n_quant_pixels = 0;
+    int64_t n_quant_best_label_matches = 0;
+    double quant_error_sum = 0;
+    float quant_error_max = 0;
+
+    int64_t n_compiled_mismatches = 0;
+
+    /* For --fixed-point we compare with float inference on the same
+     * millimetre quantised depth values
+     */
+    std::vector<float> fixed_float_depth;
+    std::vector<uint16_t> fixed_depth_mm;
+    std::vector<float> fixed_float_probs;
+    std::vector<float> fixed_probs;
+    if (fixed_point_opt) {
+        fixed_float_depth.resize(width * height);
+        fixed_depth_mm.resize(width * height);
+        fixed_float_probs.resize(width * height * n_rdt_labels);
+        fixed_probs.resize(width * height * n_rdt_labels);
+    }
+    int64_t n_fixed_point_pixels = 0;
+    int64_t n_fixed_point_mismatches = 0;
+
+    /* For cascaded inference we also evaluate all trees to compare with */
+    float *full_probs = NULL;
+    if (cascade_opt) {
+        full_probs = (float*)xmalloc(width * height *
+                                     sizeof(float) * n_rdt_labels);
+    }
+    struct infer_labels_cascade_stats cascade_stats = {};
+    int64_t n_cascade_pixels = 0;
+    int64_t n_cascade_best_label_matches = 0;
+    uint64_t full_infer_duration = 0;
+
+    /* Per-tile costs of the last image's (pooled) inference */
+    struct infer_labels_tile_stats tile_stats;
+    bool have_tile_stats = false;
+
+    /* NB: the cascade is configured via a pool, but with a single worker
+     * inference still runs synchronously
+     */
+    struct infer_labels_pool *infer_pool = NULL;
+    if (threaded_opt || cascade_opt) {
+        infer_pool = infer_labels_pool_new(log, threaded_opt ? 0 : 1);
+        gm_assert(log, infer_pool != NULL,
+                  "Failed to create label inference thread pool");
+    }
+
+    uint64_t infer_duration = 0;
 
     for (int i = 0; i < n_images; i++) {
 
@@ -796,6 +941,12 @@ main(int argc, char **argv)
         int image_best_label_matches[n_out_labels];
         memset(image_best_label_matches, 0, sizeof(image_best_label_matches));
 
+        if (cascade_opt) {
+            infer_labels_pool_set_cascade_threshold(infer_pool, cascade_opt);
+            infer_labels_pool_reset_cascade_stats(infer_pool);
+        }
+
+        uint64_t infer_start = get_time();
         infer_labels(log,
                      forest,
                      n_trees,
@@ -803,8 +954,165 @@ main(int argc, char **argv)
                      width,
                      height,
                      rdt_probs,
-                     threaded_opt,
+                     infer_pool,
                      flip);
+        infer_duration += get_time() - infer_start;
+
+        if (infer_pool)
+            have_tile_stats = infer_labels_pool_get_tile_stats(infer_pool,
+                                                               &tile_stats);
+
+        if (cascade_opt) {
+            struct infer_labels_cascade_stats image_stats;
+            infer_labels_pool_get_cascade_stats(infer_pool, &image_stats);
+            cascade_stats.n_pixels += image_stats.n_pixels;
+            cascade_stats.n_trees_evaluated += image_stats.n_trees_evaluated;
+            cascade_stats.n_early_exits += image_stats.n_early_exits;
+
+            infer_labels_pool_set_cascade_threshold(infer_pool, 0);
+
+            uint64_t full_start = get_time();
+            infer_labels(log,
+                         forest,
+                         n_trees,
+                         depth_image,
+                         width,
+                         height,
+                         full_probs,
+                         infer_pool,
+                         flip);
+            full_infer_duration += get_time() - full_start;
+
+            for (int off = 0; off < width * height; off++) {
+                // Ignore background pixels
+                if (labels[off] == 0)
+                    continue;
+
+                float *pr_table = &rdt_probs[off * n_rdt_labels];
+                float *full_pr_table = &full_probs[off * n_rdt_labels];
+                int best = 0, full_best = 0;
+                for (int l = 0; l < n_rdt_labels; l++) {
+                    if (pr_table[l] > pr_table[best])
+                        best = l;
+                    if (full_pr_table[l] > full_pr_table[full_best])
+                        full_best = l;
+                }
+                if (best == full_best)
+                    n_cascade_best_label_matches++;
+                n_cascade_pixels++;
+            }
+        }
+
+        if (quantised) {
+            infer_labels(log,
+                         ref_forest,
+                         n_trees,
+                         depth_image,
+                         width,
+                         height,
+                         ref_probs,
+                         infer_pool,
+                         flip);
+
+            for (int off = 0; off < width * height; off++) {
+                // Ignore background pixels
+                if (labels[off] == 0)
+                    continue;
+
+                float *pr_table = &rdt_probs[off * n_rdt_labels];
+                float *ref_pr_table = &ref_probs[off * n_rdt_labels];
+                int best = 0, ref_best = 0;
+                for (int l = 0; l < n_rdt_labels; l++) {
+                    float err = fabsf(pr_table[l] - ref_pr_table[l]);
+                    quant_error_sum += err;
+                    quant_error_max = std::max(quant_error_max, err);
+                    if (pr_table[l] > pr_table[best])
+                        best = l;
+                    if (ref_pr_table[l] > ref_pr_table[ref_best])
+                        ref_best = l;
+                }
+                if (best == ref_best)
+                    n_quant_best_label_matches++;
+                n_quant_pixels++;
+            }
+        }
+
+        if (compiled) {
+            infer_labels(log,
+                         ref_forest,
+                         n_trees,
+                         depth_image,
+                         width,
+                         height,
+                         ref_probs,
+                         infer_pool,
+                         flip);
+
+            for (int off = 0; off < width * height; off++) {
+                if (memcmp(&rdt_probs[off * n_rdt_labels],
+                           &ref_probs[off * n_rdt_labels],
+                           sizeof(float) * n_rdt_labels) != 0)
+                {
+                    n_compiled_mismatches++;
+                }
+            }
+        }
+
+        if (fixed_point_opt) {
+            /* Like a cropped person cluster, background pixels are holes
+             * without any depth in the millimetre image
+             */
+            float bg_depth = forest[0]->header.bg_depth;
+            for (int off = 0; off < width * height; off++) {
+                if (depth_image[off] >= bg_depth) {
+                    fixed_depth_mm[off] = 0;
+                    fixed_float_depth[off] = bg_depth;
+                } else {
+                    float depth_mm = roundf(depth_image[off] * 1000.f);
+                    fixed_depth_mm[off] = (uint16_t)std::min(std::max(depth_mm, 1.f),
+                                                             65535.f);
+                    fixed_float_depth[off] = fixed_depth_mm[off] / 1000.f;
+                }
+            }
+
+            infer_labels(log,
+                         forest,
+                         n_trees,
+                         fixed_float_depth.data(),
+                         width,
+                         height,
+                         fixed_float_probs.data(),
+                         infer_pool,
+                         flip);
+            infer_labels_u16_mm(log,
+                                forest,
+                                n_trees,
+                                fixed_depth_mm.data(),
+                                width,
+                                height,
+                                fixed_probs.data(),
+                                infer_pool,
+                                flip);
+
+            for (int off = 0; off < width * height; off++) {
+                // Ignore background pixels
+                if (labels[off] == 0)
+                    continue;
+
+                float *pr_table = &fixed_probs[off * n_rdt_labels];
+                float *float_pr_table = &fixed_float_probs[off * n_rdt_labels];
+                int best = 0, float_best = 0;
+                for (int l = 0; l < n_rdt_labels; l++) {
+                    if (pr_table[l] > pr_table[best])
+                        best = l;
+                    if (float_pr_table[l] > float_pr_table[float_best])
+                        float_best = l;
+                }
+                if (best != float_best)
+                    n_fixed_point_mismatches++;
+                n_fixed_point_pixels++;
+            }
+        }
 
         for (int y = 0; y < height; y++) {
             for (int x = 0; x < width; x++) {
@@ -955,6 +1263,87 @@ main(int argc, char **argv)
            get_format_duration(load_data_duration),
            get_format_duration_suffix(load_data_duration));
 
+    printf("Inferred labels for %d images in %.2f%s\n",
+           n_images,
+           get_format_duration(infer_duration),
+           get_format_duration_suffix(infer_duration));
+
+    if (infer_pool) {
+        int n_workers = infer_labels_pool_get_n_workers(infer_pool);
+        for (int i = 0; i < n_workers; i++) {
+            uint64_t busy_ns, idle_ns;
+            infer_labels_pool_get_worker_times(infer_pool, i,
+                                               &busy_ns, &idle_ns);
+            printf("  • Worker %-2d: busy %.2f%s, idle %.2f%s\n",
+                   i,
+                   get_format_duration(busy_ns),
+                   get_format_duration_suffix(busy_ns),
+                   get_format_duration(idle_ns),
+                   get_format_duration_suffix(idle_ns));
+        }
+        if (have_tile_stats) {
+            printf("  • %d %dx%d tiles (last image): mean %.2f%s, median %.2f%s, "
+                   "p95 %.2f%s, max %.2f%s\n",
+                   tile_stats.n_tiles, tile_stats.tile_size, tile_stats.tile_size,
+                   get_format_duration(tile_stats.mean_ns),
+                   get_format_duration_suffix(tile_stats.mean_ns),
+                   get_format_duration(tile_stats.median_ns),
+                   get_format_duration_suffix(tile_stats.median_ns),
+                   get_format_duration(tile_stats.p95_ns),
+                   get_format_duration_suffix(tile_stats.p95_ns),
+                   get_format_duration(tile_stats.max_ns),
+                   get_format_duration_suffix(tile_stats.max_ns));
+        }
+        infer_labels_pool_destroy(infer_pool);
+        infer_pool = NULL;
+    }
+
+    if (quantised) {
+        size_t pr_size = rdt_pr_format_get_size(pr_format_opt);
+        size_t n_prs = 0;
+        for (int i = 0; i < n_trees; i++)
+            n_prs += (size_t)forest[i]->n_pr_tables * n_rdt_labels;
+
+        printf("Quantised (%s) leaf probability tables: %.2fMB (vs %.2fMB for f32)\n",
+               rdt_pr_format_get_name(pr_format_opt),
+               (n_prs * pr_size) / (1024.0 * 1024.0),
+               (n_prs * sizeof(float)) / (1024.0 * 1024.0));
+        printf("  • Best label agreement with f32 tables: %.3f%%\n",
+               100.0 * n_quant_best_label_matches / std::max(n_quant_pixels, (int64_t)1));
+        printf("  • Mean absolute probability error: %g (max %g)\n",
+               quant_error_sum / std::max(n_quant_pixels * n_rdt_labels, (int64_t)1),
+               quant_error_max);
+    }
+
+    if (compiled) {
+        printf("Compiled forest: %" PRId64 " pixels differ from interpreted inference\n",
+               n_compiled_mismatches);
+    }
+
+    if (fixed_point_opt) {
+        printf("Fixed point (u16 mm) inference: %" PRId64 " of %" PRId64 " pixels have a different best label to float inference\n",
+               n_fixed_point_mismatches, n_fixed_point_pixels);
+    }
+
+    if (cascade_opt) {
+        printf("Cascaded inference (threshold %.3f):\n", cascade_opt);
+        printf("  • Average trees evaluated per pixel: %.2f of %d\n",
+               (double)cascade_stats.n_trees_evaluated /
+               std::max(cascade_stats.n_pixels, (uint64_t)1),
+               n_trees);
+        printf("  • Pixels exiting early: %.2f%%\n",
+               100.0 * cascade_stats.n_early_exits /
+               std::max(cascade_stats.n_pixels, (uint64_t)1));
+        printf("  • Inference time: %.2f%s (vs %.2f%s evaluating all trees)\n",
+               get_format_duration(infer_duration),
+               get_format_duration_suffix(infer_duration),
+               get_format_duration(full_infer_duration),
+               get_format_duration_suffix(full_infer_duration));
+        printf("  • Best label agreement with all trees: %.3f%%\n",
+               100.0 * n_cascade_best_label_matches /
+               std::max(n_cascade_pixels, (int64_t)1));
+    }
+
     printf("Accuracy across all images:\n");
     printf("  • Average: %.2f\n", average_accuracy);
     printf("  • Median:  %.2f\n", all_accuracies[all_accuracies.size() / 2]);
@@ -1110,6 +1499,33 @@ main(int argc, char **argv)
         json_object_set_value(json_object(json_output_root), "accuracy",
                               json_accuracy);
 
+        /* NB: running with a range of thresholds gives an accuracy vs
+         * speed curve for cascaded inference
+         */
+        if (cascade_opt) {
+            JSON_Value *json_cascade = json_value_init_object();
+            json_object_set_number(json_object(json_cascade),
+                                   "threshold", cascade_opt);
+            json_object_set_number(json_object(json_cascade),
+                                   "average_trees",
+                                   (double)cascade_stats.n_trees_evaluated /
+                                   std::max(cascade_stats.n_pixels, (uint64_t)1));
+            json_object_set_number(json_object(json_cascade),
+                                   "early_exit_ratio",
+                                   (double)cascade_stats.n_early_exits /
+                                   std::max(cascade_stats.n_pixels, (uint64_t)1));
+            json_object_set_number(json_object(json_cascade),
+                                   "best_label_agreement",
+                                   (double)n_cascade_best_label_matches /
+                                   std::max(n_cascade_pixels, (int64_t)1));
+            json_object_set_number(json_object(json_cascade),
+                                   "infer_ns", infer_duration);
+            json_object_set_number(json_object(json_cascade),
+                                   "full_infer_ns", full_infer_duration);
+            json_object_set_value(json_object(json_output_root), "cascade",
+                                  json_cascade);
+        }
+
         JSON_Value *results = json_value_init_object();
         json_object_set_number(json_object(results), "n_labels", n_out_labels);
 
@@ -1145,12 +1561,23 @@ main(int argc, char **argv)
     }
 
     // Clean up and quit
+    if (compiled)
+        infer_labels_compiled_close(compiled);
     for (int i = 0; i < n_trees; i++) {
         rdt_tree_destroy(forest[i]);
+        if (need_ref_forest)
+            rdt_tree_destroy(ref_forest[i]);
     }
+    if (ref_probs)
+        xfree(ref_probs);
+    if (full_probs)
+        xfree(full_probs);
 
     gm_data_index_destroy(data_index);
     data_index = NULL;
 
-    return 0;
+    bool fixed_point_failed =
+        n_fixed_point_mismatches * 100 > n_fixed_point_pixels;
+
+    return (n_compiled_mismatches || fixed_point_failed) ? 1 : 0;
 }
@@ -228,7 +228,7 @@ thread_body(void* userdata)
                      depth_image,
                      ctx->width, ctx->height,
                      pr_table.data(),
-                     false, // don't use multi-threaded inference
+                     NULL, // don't use multi-threaded inference
                      false); // don't combine horizontal flipped results
 
         joints_inferrer_calc_pixel_weights(ctx->joints_inferrer,
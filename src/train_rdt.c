@@ -237,7 +237,22 @@ usage(struct gm_ui_properties *ctx_props, FILE *fp)
 "\n"
 "      --verbose              Verbose output.\n"
 "      --profile              Profiling output.\n"
-"  -h, --help                 Display this message.\n");
+"  -h, --help                 Display this message.\n"
+"\n"
+"Distributed training:\n"
+"\n"
+"  A data set can be split between several worker processes (possibly on\n"
+"  different machines) that each only load a share of the images, e.g.:\n"
+"\n"
+"    train_rdt -p listen -v :7000 -p n_workers -v 2 <index_name> <results.json>\n"
+"    train_rdt -q '[{ \"coordinator\": \"host:7000\" }]' <index_name>  # workers\n"
+"\n"
+"  All the processes need the same data set. Hyperparameters that affect\n"
+"  training are decided by the coordinator which writes the results.\n"
+"\n"
+"  If a worker is lost, or the coordinator is interrupted, the partially\n"
+"  trained tree is still written and training can be resumed (by a single\n"
+"  process) with the 'reload' property.\n");
 
     exit(fp == stderr);
 }
@@ -62,6 +62,19 @@ xaligned_alloc(size_t alignment, size_t size)
   return_if_valid(mem);
 }
 
+/* Memory from xaligned_alloc() must be freed with this instead of xfree()
+ * since on Windows it can't be passed to free()
+ */
+void
+xaligned_free(void *ptr)
+{
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
 void
 xfree(void *ptr)
 {
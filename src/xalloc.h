@@ -34,6 +34,7 @@ extern "C" {
 
 void* xmalloc(size_t size);
 void* xaligned_alloc(size_t alignment, size_t size);
+void xaligned_free(void *ptr);
 void xfree(void *ptr);
 void* xcalloc(size_t nmemb, size_t size);
 void* xrealloc(void *ptr, size_t size);
@@ -91,3 +91,33 @@ EOF
 )
 
 train_rdt --log-stderr -q "$JOBS" -d rendered-training-data/pre-processed/test-render full full-tree.json
+
+# Check that distributed training, with a coordinator and two workers
+# connected over loopback, trains the same tree as a single process
+DIST_DATA=rendered-training-data/pre-processed/test-render
+DIST_PARAMS="-p max_depth -v 3 -p n_pixels -v 500 -p n_thresholds -v 25 -p n_uvs -v 500"
+
+train_rdt --log-stderr -d $DIST_DATA $DIST_PARAMS full full-single-d3.json
+train_rdt --log-stderr -d $DIST_DATA $DIST_PARAMS \
+    -p listen -v 127.0.0.1:7000 -p n_workers -v 2 full full-dist-d3.json &
+COORDINATOR_PID=$!
+WORKER_PIDS=
+for i in 0 1
+do
+    train_rdt --log-stderr -d $DIST_DATA \
+        -q '[{ "coordinator": "127.0.0.1:7000" }]' full &
+    WORKER_PIDS="$WORKER_PIDS $!"
+done
+for pid in $COORDINATOR_PID $WORKER_PIDS
+do
+    wait $pid
+done
+
+python3 - full-single-d3.json full-dist-d3.json <<'PY'
+import json, sys
+trees = [json.load(open(filename)) for filename in sys.argv[1:]]
+for tree in trees:
+    tree.pop('history', None)
+if trees[0] != trees[1]:
+    sys.exit("Distributed training gave a different tree to a single process")
+PY